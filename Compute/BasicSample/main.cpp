@@ -3,9 +3,17 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#include "spirv_builder.h"
+#include "workgroup_tuner.h"
+
+const char* const kWorkgroupCachePath = "workgroup_size.cache";
+
 uint32_t getBestComputeQueue(const vk::PhysicalDevice& physicalDevice) {
   const std::vector<vk::QueueFamilyProperties> queueFamilyProperties = physicalDevice.getQueueFamilyProperties();
 
@@ -48,8 +56,20 @@ uint32_t getMemoryTypeIndex(const vk::PhysicalDeviceMemoryProperties& properties
 }
 
 int main(int argc, const char * const argv[]) {
-  (void)argc;
-  (void)argv;
+  bool autotune = false;
+  uint32_t vectorWidth = 1;
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--autotune") == 0) {
+      autotune = true;
+    } else if (strcmp(argv[arg], "--vector-width") == 0 && arg + 1 < argc) {
+      vectorWidth = static_cast<uint32_t>(atoi(argv[++arg]));
+    }
+  }
+
+  if (vectorWidth != 1 && vectorWidth != 2 && vectorWidth != 4) {
+    std::cout << "Format to call: " << argv[0] << " [--autotune] [--vector-width 1|2|4]\n";
+    return EXIT_FAILURE;
+  }
 
   const vk::ApplicationInfo applicationInfo("VKComputeSample", 0, "", 0, VK_MAKE_VERSION(1, 0, 9));
 
@@ -80,6 +100,9 @@ int main(int argc, const char * const argv[]) {
 
     const uint32_t bufferSize = sizeof(int32_t) * bufferLength;
 
+    // number of vectors each invocation copies
+    const uint32_t elementCount = bufferLength / vectorWidth;
+
     // we are going to need two buffers from this one memory
     const vk::DeviceSize memorySize = bufferSize * 2; 
 
@@ -106,163 +129,23 @@ int main(int argc, const char * const argv[]) {
     const vk::Buffer out_buffer = device.createBuffer(bufferCreateInfo);
     device.bindBufferMemory(out_buffer, memory, bufferSize);
 
-    enum {
-      RESERVED_ID = 0,
-      FUNC_ID,
-      IN_ID,
-      OUT_ID,
-      GLOBAL_INVOCATION_ID,
-      VOID_TYPE_ID,
-      FUNC_TYPE_ID,
-      INT_TYPE_ID,
-      INT_ARRAY_TYPE_ID,
-      STRUCT_ID,
-      POINTER_TYPE_ID,
-      ELEMENT_POINTER_TYPE_ID,
-      INT_VECTOR_TYPE_ID,
-      INT_VECTOR_POINTER_TYPE_ID,
-      INT_POINTER_TYPE_ID,
-      CONSTANT_ZERO_ID,
-      CONSTANT_ARRAY_LENGTH_ID,
-      LABEL_ID,
-      IN_ELEMENT_ID,
-      OUT_ELEMENT_ID,
-      GLOBAL_INVOCATION_X_ID,
-      GLOBAL_INVOCATION_X_PTR_ID,
-      TEMP_LOADED_ID,
-      BOUND
-    };
-
-    enum {
-      INPUT = 1,
-      UNIFORM = 2,
-      BUFFER_BLOCK = 3,
-      ARRAY_STRIDE = 6,
-      BUILTIN = 11,
-      BINDING = 33,
-      OFFSET = 35,
-      DESCRIPTOR_SET = 34,
-      GLOBAL_INVOCATION = 28,
-      OP_TYPE_VOID = 19,
-      OP_TYPE_FUNCTION = 33,
-      OP_TYPE_INT = 21,
-      OP_TYPE_VECTOR = 23,
-      OP_TYPE_ARRAY = 28,
-      OP_TYPE_STRUCT = 30,
-      OP_TYPE_POINTER = 32,
-      OP_VARIABLE = 59,
-      OP_DECORATE = 71,
-      OP_MEMBER_DECORATE = 72,
-      OP_FUNCTION = 54,
-      OP_LABEL = 248,
-      OP_ACCESS_CHAIN = 65,
-      OP_CONSTANT = 43,
-      OP_LOAD = 61,
-      OP_STORE = 62,
-      OP_RETURN = 253,
-      OP_FUNCTION_END = 56,
-      OP_CAPABILITY = 17,
-      OP_MEMORY_MODEL = 14,
-      OP_ENTRY_POINT = 15,
-      OP_EXECUTION_MODE = 16,
-      OP_COMPOSITE_EXTRACT = 81,
-    };
-
-    const uint32_t shader[] = {
-      // first is the SPIR-V header
-      0x07230203, // magic header ID
-      0x00010000, // version 1.0.0
-      0,          // generator (optional)
-      BOUND,      // bound
-      0,          // schema
-
-      // OpCapability Shader
-      (2 << 16) | OP_CAPABILITY, 1, 
-
-      // OpMemoryModel Logical Simple
-      (3 << 16) | OP_MEMORY_MODEL, 0, 0, 
-
-      // OpEntryPoint GLCompute %FUNC_ID "f" %IN_ID %OUT_ID
-      // was: (4 << 16) | OP_ENTRY_POINT, 5, FUNC_ID, 0x00000066,
-      (5 << 16) | OP_ENTRY_POINT, 5, FUNC_ID, 0x66, GLOBAL_INVOCATION_ID,
-
-      // OpExecutionMode %FUNC_ID LocalSize 1 1 1
-      (6 << 16) | OP_EXECUTION_MODE, FUNC_ID, 17, 1, 1, 1,
-
-      // next declare decorations
-
-      (3 << 16) | OP_DECORATE, STRUCT_ID, BUFFER_BLOCK, 
-
-      (4 << 16) | OP_DECORATE, GLOBAL_INVOCATION_ID, BUILTIN, GLOBAL_INVOCATION,
-
-      (4 << 16) | OP_DECORATE, IN_ID, DESCRIPTOR_SET, 0,
-
-      (4 << 16) | OP_DECORATE, IN_ID, BINDING, 0,
-
-      (4 << 16) | OP_DECORATE, OUT_ID, DESCRIPTOR_SET, 0,
-
-      (4 << 16) | OP_DECORATE, OUT_ID, BINDING, 1,
-
-      (4 << 16) | OP_DECORATE, INT_ARRAY_TYPE_ID, ARRAY_STRIDE, 4,
-
-      (5 << 16) | OP_MEMBER_DECORATE, STRUCT_ID, 0, OFFSET, 0,
-
-      // next declare types
-      (2 << 16) | OP_TYPE_VOID, VOID_TYPE_ID,
-
-      (3 << 16) | OP_TYPE_FUNCTION, FUNC_TYPE_ID, VOID_TYPE_ID,
-
-      (4 << 16) | OP_TYPE_INT, INT_TYPE_ID, 32, 1,
-
-      (4 << 16) | OP_CONSTANT, INT_TYPE_ID, CONSTANT_ARRAY_LENGTH_ID, bufferLength,
-
-      (4 << 16) | OP_TYPE_ARRAY, INT_ARRAY_TYPE_ID, INT_TYPE_ID, CONSTANT_ARRAY_LENGTH_ID,
-
-      (3 << 16) | OP_TYPE_STRUCT, STRUCT_ID, INT_ARRAY_TYPE_ID,
-
-      (4 << 16) | OP_TYPE_POINTER, POINTER_TYPE_ID, UNIFORM, STRUCT_ID,
-
-      (4 << 16) | OP_TYPE_POINTER, ELEMENT_POINTER_TYPE_ID, UNIFORM, INT_TYPE_ID,
+    // Specialize the copy kernel for this job: element type, array length and
+    // vector width are baked in, the local size stays a specialization constant
+    spirv::CopyKernelDesc kernelDesc;
+    kernelDesc.elementType = spirv::ElementType::Int32;
+    kernelDesc.vectorWidth = vectorWidth;
+    kernelDesc.arrayLength = elementCount;
+    kernelDesc.localSizeX = 1;
 
-      (4 << 16) | OP_TYPE_VECTOR, INT_VECTOR_TYPE_ID, INT_TYPE_ID, 3,
+    const auto generationStart = std::chrono::steady_clock::now();
+    const std::vector<uint32_t> shader = spirv::makeCopyKernel(kernelDesc);
+    const auto generationEnd = std::chrono::steady_clock::now();
 
-      (4 << 16) | OP_TYPE_POINTER, INT_VECTOR_POINTER_TYPE_ID, INPUT, INT_VECTOR_TYPE_ID,
+    std::cout << "kernel generated in "
+              << std::chrono::duration<double, std::micro>(generationEnd - generationStart).count() << " us ("
+              << shader.size() << " words)\n";
 
-      (4 << 16) | OP_TYPE_POINTER, INT_POINTER_TYPE_ID, INPUT, INT_TYPE_ID,
-
-      // then declare constants
-      (4 << 16) | OP_CONSTANT, INT_TYPE_ID, CONSTANT_ZERO_ID, 0,
-
-      // then declare variables
-      (4 << 16) | OP_VARIABLE, POINTER_TYPE_ID, IN_ID, UNIFORM,
-
-      (4 << 16) | OP_VARIABLE, POINTER_TYPE_ID, OUT_ID, UNIFORM,
-
-      (4 << 16) | OP_VARIABLE, INT_VECTOR_POINTER_TYPE_ID, GLOBAL_INVOCATION_ID, INPUT,
-
-      // then declare function
-      (5 << 16) | OP_FUNCTION, VOID_TYPE_ID, FUNC_ID, 0, FUNC_TYPE_ID,
-
-      (2 << 16) | OP_LABEL, LABEL_ID,
-
-      (5 << 16) | OP_ACCESS_CHAIN, INT_POINTER_TYPE_ID, GLOBAL_INVOCATION_X_PTR_ID, GLOBAL_INVOCATION_ID, CONSTANT_ZERO_ID,
-
-      (4 << 16) | OP_LOAD, INT_TYPE_ID, GLOBAL_INVOCATION_X_ID, GLOBAL_INVOCATION_X_PTR_ID,
-
-      (6 << 16) | OP_ACCESS_CHAIN, ELEMENT_POINTER_TYPE_ID, IN_ELEMENT_ID, IN_ID, CONSTANT_ZERO_ID, GLOBAL_INVOCATION_X_ID,
-
-      (4 << 16) | OP_LOAD, INT_TYPE_ID, TEMP_LOADED_ID, IN_ELEMENT_ID,
-
-      (6 << 16) | OP_ACCESS_CHAIN, ELEMENT_POINTER_TYPE_ID, OUT_ELEMENT_ID, OUT_ID, CONSTANT_ZERO_ID, GLOBAL_INVOCATION_X_ID,
-
-      (3 << 16) | OP_STORE, OUT_ELEMENT_ID, TEMP_LOADED_ID,
-
-      (1 << 16) | OP_RETURN,
-
-      (1 << 16) | OP_FUNCTION_END,
-    };
-
-    const vk::ShaderModuleCreateInfo shaderModuleCreateInfo({}, sizeof(shader), shader);
+    const vk::ShaderModuleCreateInfo shaderModuleCreateInfo({}, shader.size() * sizeof(uint32_t), shader.data());
 
     const vk::ShaderModule shader_module = device.createShaderModule(shaderModuleCreateInfo);
 
@@ -289,12 +172,6 @@ int main(int argc, const char * const argv[]) {
 
     const vk::PipelineLayout pipelineLayout = device.createPipelineLayout(pipelineLayoutCreateInfo);
 
-    const vk::PipelineShaderStageCreateInfo pipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eCompute, shader_module, "f");
-  
-    const vk::ComputePipelineCreateInfo computePipelineCreateInfo({}, pipelineShaderStageCreateInfo, pipelineLayout);
-
-    const vk::Pipeline pipeline = device.createComputePipeline({}, computePipelineCreateInfo);
-
     const vk::CommandPoolCreateInfo commandPoolCreateInfo({}, queueFamilyIndex);
 
     const vk::DescriptorPoolSize descriptorPoolSize(vk::DescriptorType::eStorageBuffer, 2);
@@ -335,6 +212,46 @@ int main(int argc, const char * const argv[]) {
 
     device.updateDescriptorSets(2, writeDescriptorSet, 0, nullptr);
 
+    const vk::Queue queue = device.getQueue(queueFamilyIndex, 0);
+
+    const auto recordCopy = [&](VkCommandBuffer rawCommandBuffer, VkPipeline rawPipeline,
+                                const WorkgroupSize& size) {
+      const vk::CommandBuffer commandBuffer(rawCommandBuffer);
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, vk::Pipeline(rawPipeline));
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipelineLayout, 0, descriptorSets, {});
+      commandBuffer.dispatch((elementCount + size.x - 1) / size.x, 1, 1);
+    };
+
+    // Every vector width is a different kernel over a different element count
+    const std::string workgroupCacheKey = getWorkgroupCacheKey(props, "BasicSample.copy.vec" + std::to_string(vectorWidth));
+
+    WorkgroupSize workgroupSize = getDefaultWorkgroupSize(props.limits, 1);
+    WorkgroupSize cachedSize{};
+    if (autotune) {
+      if (autotuneWorkgroupSize(static_cast<VkPhysicalDevice>(physicalDevice), static_cast<VkDevice>(device),
+                                static_cast<VkQueue>(queue), queueFamilyIndex,
+                                static_cast<VkPipelineLayout>(pipelineLayout),
+                                static_cast<VkShaderModule>(shader_module), "main",
+                                getWorkgroupSizeCandidates(props.limits, 1), recordCopy,
+                                &workgroupSize) != VK_SUCCESS) {
+        throw std::runtime_error("Workgroup size autotuning failed");
+      }
+      storeTunedWorkgroupSize(kWorkgroupCachePath, workgroupCacheKey, workgroupSize);
+    } else if (loadTunedWorkgroupSize(kWorkgroupCachePath, workgroupCacheKey, &cachedSize) &&
+               fitsWorkgroupLimits(props.limits, cachedSize)) {
+      workgroupSize = cachedSize;
+    }
+
+    std::cout << "workgroup size: " << workgroupSize.x << '\n';
+
+    VkPipeline rawPipeline = VK_NULL_HANDLE;
+    if (createComputePipelineWithWorkgroupSize(static_cast<VkDevice>(device),
+                                               static_cast<VkPipelineLayout>(pipelineLayout),
+                                               static_cast<VkShaderModule>(shader_module), "main", workgroupSize,
+                                               &rawPipeline) != VK_SUCCESS) {
+      throw std::runtime_error("Failed to create compute pipeline");
+    }
+
     const vk::CommandPool commandPool = device.createCommandPool(commandPoolCreateInfo);
 
     const vk::CommandBufferAllocateInfo commandBufferAllocateInfo(commandPool, vk::CommandBufferLevel::ePrimary, 1);
@@ -345,14 +262,10 @@ int main(int argc, const char * const argv[]) {
 
     commandBuffers[0].begin(commandBufferBeginInfo);
 
-    commandBuffers[0].bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
-    commandBuffers[0].bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipelineLayout, 0, descriptorSets, {0});
-    commandBuffers[0].dispatch(bufferSize / sizeof(int32_t), 1, 1);
+    recordCopy(static_cast<VkCommandBuffer>(commandBuffers[0]), rawPipeline, workgroupSize);
 
     commandBuffers[0].end();
 
-    const vk::Queue queue = device.getQueue(queueFamilyIndex, 0);
-
     const vk::SubmitInfo submitInfo(0, nullptr, nullptr, 1, commandBuffers.data());
 
     queue.submit({submitInfo}, vk::Fence{});
@@ -0,0 +1,524 @@
+// Minimal SPIR-V module builder, enough to emit small compute kernels at
+// runtime without a GLSL compiler. Instructions are appended to the logical
+// layout sections of the module and concatenated by build(). Types and
+// constants are deduplicated, so asking twice for the same type returns the
+// same id.
+
+#ifndef SPIRV_BUILDER_H
+#define SPIRV_BUILDER_H
+
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace spirv {
+
+constexpr uint32_t kMagicNumber = 0x07230203;
+constexpr uint32_t kVersion1_0 = 0x00010000;
+
+enum Op : uint16_t {
+  OpName = 5,
+  OpMemoryModel = 14,
+  OpEntryPoint = 15,
+  OpExecutionMode = 16,
+  OpCapability = 17,
+  OpTypeVoid = 19,
+  OpTypeBool = 20,
+  OpTypeInt = 21,
+  OpTypeFloat = 22,
+  OpTypeVector = 23,
+  OpTypeArray = 28,
+  OpTypeRuntimeArray = 29,
+  OpTypeStruct = 30,
+  OpTypePointer = 32,
+  OpTypeFunction = 33,
+  OpConstant = 43,
+  OpSpecConstant = 50,
+  OpSpecConstantComposite = 51,
+  OpFunction = 54,
+  OpFunctionEnd = 56,
+  OpVariable = 59,
+  OpLoad = 61,
+  OpStore = 62,
+  OpAccessChain = 65,
+  OpArrayLength = 68,
+  OpDecorate = 71,
+  OpMemberDecorate = 72,
+  OpULessThan = 176,
+  OpSelectionMerge = 247,
+  OpLabel = 248,
+  OpBranch = 249,
+  OpBranchConditional = 250,
+  OpReturn = 253,
+};
+
+enum Capability : uint32_t { CapabilityShader = 1 };
+
+enum AddressingModel : uint32_t { AddressingModelLogical = 0 };
+
+enum MemoryModel : uint32_t { MemoryModelGLSL450 = 1 };
+
+enum ExecutionModel : uint32_t { ExecutionModelGLCompute = 5 };
+
+enum ExecutionMode : uint32_t { ExecutionModeLocalSize = 17 };
+
+enum StorageClass : uint32_t {
+  StorageClassInput = 1,
+  StorageClassUniform = 2,
+  StorageClassFunction = 7,
+};
+
+enum Decoration : uint32_t {
+  DecorationSpecId = 1,
+  DecorationBlock = 2,
+  DecorationBufferBlock = 3,
+  DecorationArrayStride = 6,
+  DecorationBuiltIn = 11,
+  DecorationBinding = 33,
+  DecorationDescriptorSet = 34,
+  DecorationOffset = 35,
+};
+
+enum BuiltIn : uint32_t {
+  BuiltInWorkgroupSize = 25,
+  BuiltInGlobalInvocationId = 28,
+};
+
+// First word of every instruction: word count in the high half, opcode in
+// the low half.
+constexpr uint32_t instructionHeader(Op op, uint32_t wordCount) {
+  return (wordCount << 16) | op;
+}
+
+static_assert(instructionHeader(OpReturn, 1) == 0x000100fd,
+              "unexpected instruction encoding");
+
+// Number of words a nul-terminated literal string occupies.
+constexpr uint32_t stringWordCount(const char* str) {
+  uint32_t length = 0;
+  while (str[length] != '\0') {
+    length++;
+  }
+  return length / 4 + 1;
+}
+
+static_assert(stringWordCount("main") == 2, "unexpected string encoding");
+
+class ModuleBuilder {
+ public:
+  uint32_t allocateId() { return nextId_++; }
+
+  void capability(Capability cap) { emit(capabilities_, OpCapability, {cap}); }
+
+  void memoryModel(AddressingModel addressing, MemoryModel memory) {
+    emit(memoryModel_, OpMemoryModel, {addressing, memory});
+  }
+
+  void entryPoint(ExecutionModel model, uint32_t function, const char* name,
+                  std::initializer_list<uint32_t> interface) {
+    std::vector<uint32_t> operands = {model, function};
+    appendString(&operands, name);
+    operands.insert(operands.end(), interface);
+    emit(entryPoints_, OpEntryPoint, operands);
+  }
+
+  void executionMode(uint32_t function, ExecutionMode mode,
+                     std::initializer_list<uint32_t> literals) {
+    std::vector<uint32_t> operands = {function, mode};
+    operands.insert(operands.end(), literals);
+    emit(executionModes_, OpExecutionMode, operands);
+  }
+
+  void name(uint32_t id, const char* str) {
+    std::vector<uint32_t> operands = {id};
+    appendString(&operands, str);
+    emit(debugNames_, OpName, operands);
+  }
+
+  void decorate(uint32_t id, Decoration decoration,
+                std::initializer_list<uint32_t> literals = {}) {
+    std::vector<uint32_t> operands = {id, decoration};
+    operands.insert(operands.end(), literals);
+    emit(annotations_, OpDecorate, operands);
+  }
+
+  void memberDecorate(uint32_t structType, uint32_t member,
+                      Decoration decoration,
+                      std::initializer_list<uint32_t> literals = {}) {
+    std::vector<uint32_t> operands = {structType, member, decoration};
+    operands.insert(operands.end(), literals);
+    emit(annotations_, OpMemberDecorate, operands);
+  }
+
+  // Types
+
+  uint32_t typeVoid() { return declare(OpTypeVoid, {}); }
+
+  uint32_t typeBool() { return declare(OpTypeBool, {}); }
+
+  uint32_t typeInt(uint32_t width, bool isSigned) {
+    return declare(OpTypeInt, {width, isSigned ? 1u : 0u});
+  }
+
+  uint32_t typeFloat(uint32_t width) { return declare(OpTypeFloat, {width}); }
+
+  uint32_t typeVector(uint32_t componentType, uint32_t count) {
+    return declare(OpTypeVector, {componentType, count});
+  }
+
+  // Array types are not deduplicated: each one usually carries its own
+  // ArrayStride decoration.
+  uint32_t typeArray(uint32_t elementType, uint32_t lengthConstant) {
+    return declareUnique(OpTypeArray, {elementType, lengthConstant});
+  }
+
+  uint32_t typeRuntimeArray(uint32_t elementType) {
+    return declareUnique(OpTypeRuntimeArray, {elementType});
+  }
+
+  // Struct types are never deduplicated, their decorations differ per use.
+  uint32_t typeStruct(std::initializer_list<uint32_t> members) {
+    return declareUnique(OpTypeStruct, members);
+  }
+
+  uint32_t typePointer(StorageClass storageClass, uint32_t type) {
+    return declare(OpTypePointer, {storageClass, type});
+  }
+
+  uint32_t typeFunction(uint32_t returnType,
+                        std::initializer_list<uint32_t> parameters = {}) {
+    std::vector<uint32_t> operands = {returnType};
+    operands.insert(operands.end(), parameters);
+    return declare(OpTypeFunction, operands);
+  }
+
+  // Constants
+
+  uint32_t constant(uint32_t type, uint32_t value) {
+    return declare(OpConstant, {type, value}, /*hasResultType=*/true);
+  }
+
+  uint32_t specConstant(uint32_t type, uint32_t defaultValue, uint32_t specId) {
+    const uint32_t id = allocateId();
+    emit(typesAndGlobals_, OpSpecConstant, {type, id, defaultValue});
+    decorate(id, DecorationSpecId, {specId});
+    return id;
+  }
+
+  uint32_t specConstantComposite(uint32_t type,
+                                 std::initializer_list<uint32_t> constituents) {
+    const uint32_t id = allocateId();
+    std::vector<uint32_t> operands = {type, id};
+    operands.insert(operands.end(), constituents);
+    emit(typesAndGlobals_, OpSpecConstantComposite, operands);
+    return id;
+  }
+
+  // Global variables
+
+  uint32_t variable(uint32_t pointerType, StorageClass storageClass) {
+    const uint32_t id = allocateId();
+    emit(typesAndGlobals_, OpVariable, {pointerType, id, storageClass});
+    return id;
+  }
+
+  // Function bodies. Instructions between beginFunction() and endFunction()
+  // go to the function section in the order they are issued.
+
+  uint32_t beginFunction(uint32_t returnType, uint32_t functionType) {
+    const uint32_t id = allocateId();
+    emit(functions_, OpFunction, {returnType, id, 0, functionType});
+    return id;
+  }
+
+  void endFunction() { emit(functions_, OpFunctionEnd, {}); }
+
+  void label(uint32_t id) { emit(functions_, OpLabel, {id}); }
+
+  uint32_t label() {
+    const uint32_t id = allocateId();
+    label(id);
+    return id;
+  }
+
+  uint32_t accessChain(uint32_t pointerType, uint32_t base,
+                       std::initializer_list<uint32_t> indices) {
+    std::vector<uint32_t> operands = {base};
+    operands.insert(operands.end(), indices);
+    return instruction(OpAccessChain, pointerType, operands);
+  }
+
+  uint32_t load(uint32_t type, uint32_t pointer) {
+    return instruction(OpLoad, type, {pointer});
+  }
+
+  void store(uint32_t pointer, uint32_t value) {
+    emit(functions_, OpStore, {pointer, value});
+  }
+
+  uint32_t arrayLength(uint32_t type, uint32_t structPointer,
+                       uint32_t member) {
+    return instruction(OpArrayLength, type, {structPointer, member});
+  }
+
+  // Generic instruction with a result type and a freshly allocated result id.
+  uint32_t instruction(Op op, uint32_t resultType,
+                       const std::vector<uint32_t>& operands) {
+    const uint32_t id = allocateId();
+    std::vector<uint32_t> words = {resultType, id};
+    words.insert(words.end(), operands.begin(), operands.end());
+    emit(functions_, op, words);
+    return id;
+  }
+
+  void selectionMerge(uint32_t mergeBlock) {
+    emit(functions_, OpSelectionMerge, {mergeBlock, 0});
+  }
+
+  void branch(uint32_t target) { emit(functions_, OpBranch, {target}); }
+
+  void branchConditional(uint32_t condition, uint32_t trueLabel,
+                         uint32_t falseLabel) {
+    emit(functions_, OpBranchConditional, {condition, trueLabel, falseLabel});
+  }
+
+  void returnVoid() { emit(functions_, OpReturn, {}); }
+
+  std::vector<uint32_t> build() const {
+    std::vector<uint32_t> module = {kMagicNumber, kVersion1_0, 0, nextId_, 0};
+
+    for (const auto* section :
+         {&capabilities_, &memoryModel_, &entryPoints_, &executionModes_,
+          &debugNames_, &annotations_, &typesAndGlobals_, &functions_}) {
+      module.insert(module.end(), section->begin(), section->end());
+    }
+
+    return module;
+  }
+
+ private:
+  static void emit(std::vector<uint32_t>& section, Op op,
+                   const std::vector<uint32_t>& operands) {
+    const size_t wordCount = operands.size() + 1;
+    if (wordCount > 0xffff) {
+      throw std::length_error("SPIR-V instruction too long");
+    }
+    section.push_back(instructionHeader(op, static_cast<uint32_t>(wordCount)));
+    section.insert(section.end(), operands.begin(), operands.end());
+  }
+
+  static void appendString(std::vector<uint32_t>* words, const char* str) {
+    const std::string value(str);
+    std::vector<uint32_t> packed(stringWordCount(str), 0);
+    for (size_t i = 0; i < value.size(); i++) {
+      packed[i / 4] |= static_cast<uint32_t>(static_cast<uint8_t>(value[i]))
+                       << (8 * (i % 4));
+    }
+    words->insert(words->end(), packed.begin(), packed.end());
+  }
+
+  // Emits a type or constant once per distinct set of operands. For
+  // constants the result type comes first and the result id second, for
+  // types the result id comes first.
+  uint32_t declare(Op op, const std::vector<uint32_t>& operands,
+                   bool hasResultType = false) {
+    std::vector<uint32_t> key = {op};
+    key.insert(key.end(), operands.begin(), operands.end());
+
+    const auto it = declarations_.find(key);
+    if (it != declarations_.end()) {
+      return it->second;
+    }
+
+    const uint32_t id = hasResultType ? declareWithResultType(op, operands)
+                                      : declareUnique(op, operands);
+    declarations_.emplace(std::move(key), id);
+    return id;
+  }
+
+  uint32_t declareUnique(Op op, const std::vector<uint32_t>& operands) {
+    const uint32_t id = allocateId();
+    std::vector<uint32_t> words = {id};
+    words.insert(words.end(), operands.begin(), operands.end());
+    emit(typesAndGlobals_, op, words);
+    return id;
+  }
+
+  uint32_t declareWithResultType(Op op, const std::vector<uint32_t>& operands) {
+    const uint32_t id = allocateId();
+    std::vector<uint32_t> words = {operands[0], id};
+    words.insert(words.end(), operands.begin() + 1, operands.end());
+    emit(typesAndGlobals_, op, words);
+    return id;
+  }
+
+  uint32_t nextId_ = 1;
+
+  std::vector<uint32_t> capabilities_;
+  std::vector<uint32_t> memoryModel_;
+  std::vector<uint32_t> entryPoints_;
+  std::vector<uint32_t> executionModes_;
+  std::vector<uint32_t> debugNames_;
+  std::vector<uint32_t> annotations_;
+  std::vector<uint32_t> typesAndGlobals_;
+  std::vector<uint32_t> functions_;
+
+  std::map<std::vector<uint32_t>, uint32_t> declarations_;
+};
+
+enum class ElementType { Int32, UInt32, Float32 };
+
+struct CopyKernelDesc {
+  ElementType elementType = ElementType::Int32;
+  // Number of elements (vectors when vectorWidth > 1) in each buffer, or 0
+  // for a runtime sized array whose length is queried in the shader.
+  uint32_t arrayLength = 0;
+  // 1, 2 or 4 components per element
+  uint32_t vectorWidth = 1;
+  // Local size baked into the module. Specialization constants 0, 1 and 2
+  // override it at pipeline creation when specializableLocalSize is set.
+  uint32_t localSizeX = 1;
+  bool specializableLocalSize = true;
+  const char* entryPoint = "main";
+};
+
+// Builds the equivalent of
+//
+//   layout(local_size_x_id = 0, local_size_y_id = 1, local_size_z_id = 2) in;
+//   layout(binding = 0) buffer In { T inputData[N]; };
+//   layout(binding = 1) buffer Out { T outputData[N]; };
+//   void main() {
+//     uint i = gl_GlobalInvocationID.x;
+//     if (i < N) outputData[i] = inputData[i];
+//   }
+//
+// so any group count covering the array may be dispatched.
+inline std::vector<uint32_t> makeCopyKernel(const CopyKernelDesc& desc) {
+  if (desc.vectorWidth != 1 && desc.vectorWidth != 2 &&
+      desc.vectorWidth != 4) {
+    throw std::invalid_argument("vector width must be 1, 2 or 4");
+  }
+
+  ModuleBuilder builder;
+
+  builder.capability(CapabilityShader);
+  builder.memoryModel(AddressingModelLogical, MemoryModelGLSL450);
+
+  const uint32_t voidType = builder.typeVoid();
+  const uint32_t boolType = builder.typeBool();
+  const uint32_t uintType = builder.typeInt(32, false);
+  const uint32_t uvec3Type = builder.typeVector(uintType, 3);
+
+  uint32_t scalarType = uintType;
+  switch (desc.elementType) {
+    case ElementType::Int32:
+      scalarType = builder.typeInt(32, true);
+      break;
+    case ElementType::UInt32:
+      scalarType = uintType;
+      break;
+    case ElementType::Float32:
+      scalarType = builder.typeFloat(32);
+      break;
+  }
+
+  const uint32_t elementType =
+      desc.vectorWidth > 1 ? builder.typeVector(scalarType, desc.vectorWidth)
+                           : scalarType;
+
+  const uint32_t zero = builder.constant(uintType, 0);
+
+  uint32_t arrayType = 0;
+  if (desc.arrayLength > 0) {
+    arrayType = builder.typeArray(elementType,
+                                  builder.constant(uintType, desc.arrayLength));
+  } else {
+    arrayType = builder.typeRuntimeArray(elementType);
+  }
+  builder.decorate(arrayType, DecorationArrayStride, {4 * desc.vectorWidth});
+
+  // SPIR-V 1.0 storage buffers: Uniform storage class with BufferBlock
+  const uint32_t bufferType = builder.typeStruct({arrayType});
+  builder.decorate(bufferType, DecorationBufferBlock);
+  builder.memberDecorate(bufferType, 0, DecorationOffset, {0});
+
+  const uint32_t bufferPointerType =
+      builder.typePointer(StorageClassUniform, bufferType);
+  const uint32_t elementPointerType =
+      builder.typePointer(StorageClassUniform, elementType);
+  const uint32_t uvec3PointerType =
+      builder.typePointer(StorageClassInput, uvec3Type);
+  const uint32_t uintInputPointerType =
+      builder.typePointer(StorageClassInput, uintType);
+
+  if (desc.specializableLocalSize) {
+    const uint32_t x = builder.specConstant(uintType, desc.localSizeX, 0);
+    const uint32_t y = builder.specConstant(uintType, 1, 1);
+    const uint32_t z = builder.specConstant(uintType, 1, 2);
+    const uint32_t workgroupSize =
+        builder.specConstantComposite(uvec3Type, {x, y, z});
+    builder.decorate(workgroupSize, DecorationBuiltIn, {BuiltInWorkgroupSize});
+  }
+
+  const uint32_t inputBuffer =
+      builder.variable(bufferPointerType, StorageClassUniform);
+  builder.decorate(inputBuffer, DecorationDescriptorSet, {0});
+  builder.decorate(inputBuffer, DecorationBinding, {0});
+
+  const uint32_t outputBuffer =
+      builder.variable(bufferPointerType, StorageClassUniform);
+  builder.decorate(outputBuffer, DecorationDescriptorSet, {0});
+  builder.decorate(outputBuffer, DecorationBinding, {1});
+
+  const uint32_t globalInvocationId =
+      builder.variable(uvec3PointerType, StorageClassInput);
+  builder.decorate(globalInvocationId, DecorationBuiltIn,
+                   {BuiltInGlobalInvocationId});
+
+  const uint32_t function =
+      builder.beginFunction(voidType, builder.typeFunction(voidType));
+  builder.entryPoint(ExecutionModelGLCompute, function, desc.entryPoint,
+                     {globalInvocationId});
+  builder.executionMode(function, ExecutionModeLocalSize,
+                        {desc.localSizeX, 1, 1});
+
+  builder.label();
+
+  const uint32_t indexPointer =
+      builder.accessChain(uintInputPointerType, globalInvocationId, {zero});
+  const uint32_t index = builder.load(uintType, indexPointer);
+
+  const uint32_t length =
+      desc.arrayLength > 0 ? builder.constant(uintType, desc.arrayLength)
+                           : builder.arrayLength(uintType, outputBuffer, 0);
+
+  const uint32_t inBounds =
+      builder.instruction(OpULessThan, boolType, {index, length});
+
+  const uint32_t bodyLabel = builder.allocateId();
+  const uint32_t mergeLabel = builder.allocateId();
+  builder.selectionMerge(mergeLabel);
+  builder.branchConditional(inBounds, bodyLabel, mergeLabel);
+
+  builder.label(bodyLabel);
+  const uint32_t inputElement =
+      builder.accessChain(elementPointerType, inputBuffer, {zero, index});
+  const uint32_t value = builder.load(elementType, inputElement);
+  const uint32_t outputElement =
+      builder.accessChain(elementPointerType, outputBuffer, {zero, index});
+  builder.store(outputElement, value);
+  builder.branch(mergeLabel);
+
+  builder.label(mergeLabel);
+  builder.returnVoid();
+  builder.endFunction();
+
+  return builder.build();
+}
+
+}  // namespace spirv
+
+#endif  // SPIRV_BUILDER_H
@@ -0,0 +1,327 @@
+// Workgroup size autotuning for compute kernels whose local size comes from
+// specialization constants 0, 1 and 2 (local_size_x_id / _y_id / _z_id).
+// Candidates are timed with GPU timestamps and the winner is cached per
+// device and kernel, so later runs can start with the tuned size.
+
+#ifndef WORKGROUP_TUNER_H
+#define WORKGROUP_TUNER_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct WorkgroupSize {
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+};
+
+// Records one dispatch of the kernel being tuned: bind the pipeline,
+// descriptor sets and push constants, then vkCmdDispatch with a group count
+// matching the given workgroup size.
+using RecordDispatchFn = std::function<void(
+    VkCommandBuffer, VkPipeline, const WorkgroupSize&)>;
+
+inline bool fitsWorkgroupLimits(const VkPhysicalDeviceLimits& limits,
+                                const WorkgroupSize& size) {
+  return size.x <= limits.maxComputeWorkGroupSize[0] &&
+         size.y <= limits.maxComputeWorkGroupSize[1] &&
+         size.z <= limits.maxComputeWorkGroupSize[2] &&
+         size.x * size.y * size.z <= limits.maxComputeWorkGroupInvocations;
+}
+
+// Power of two sizes from 32 invocations up to the device limit. For 2D
+// kernels only shapes at least as wide as they are tall are tried, since
+// rows are contiguous in memory. The legacy 1x1x1 size is always included
+// as the baseline.
+inline std::vector<WorkgroupSize> getWorkgroupSizeCandidates(
+    const VkPhysicalDeviceLimits& limits, uint32_t dimensions) {
+  std::vector<WorkgroupSize> candidates = {{1, 1, 1}};
+
+  const uint32_t minInvocations =
+      std::min<uint32_t>(32, limits.maxComputeWorkGroupInvocations);
+
+  for (uint32_t x = 1; x <= limits.maxComputeWorkGroupSize[0]; x *= 2) {
+    const uint32_t maxY = dimensions > 1 ? x : 1;
+    for (uint32_t y = 1; y <= maxY; y *= 2) {
+      const WorkgroupSize size{x, y, 1};
+      if (x * y >= minInvocations && fitsWorkgroupLimits(limits, size)) {
+        candidates.push_back(size);
+      }
+    }
+  }
+
+  return candidates;
+}
+
+// Used when there is neither a tuned nor a requested size: 256 invocations
+// (16x16 or 256x1) or the largest power of two the device allows.
+inline WorkgroupSize getDefaultWorkgroupSize(
+    const VkPhysicalDeviceLimits& limits, uint32_t dimensions) {
+  WorkgroupSize size = dimensions > 1 ? WorkgroupSize{16, 16, 1}
+                                      : WorkgroupSize{256, 1, 1};
+  while (!fitsWorkgroupLimits(limits, size) && size.x * size.y > 1) {
+    if (size.y >= size.x && size.y > 1) {
+      size.y /= 2;
+    } else {
+      size.x /= 2;
+    }
+  }
+  return size;
+}
+
+inline std::string getWorkgroupCacheKey(const VkPhysicalDeviceProperties& props,
+                                        const char* kernelName) {
+  std::ostringstream key;
+  key << std::hex << props.vendorID << ':' << props.deviceID << ':'
+      << props.driverVersion << ':' << kernelName;
+  return key.str();
+}
+
+inline bool loadTunedWorkgroupSize(const char* cachePath,
+                                   const std::string& key,
+                                   WorkgroupSize* size) {
+  std::ifstream file(cachePath);
+  std::string entryKey;
+  WorkgroupSize entry{};
+  while (file >> entryKey >> entry.x >> entry.y >> entry.z) {
+    if (entryKey == key) {
+      *size = entry;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void storeTunedWorkgroupSize(const char* cachePath,
+                                    const std::string& key,
+                                    const WorkgroupSize& size) {
+  std::vector<std::string> lines;
+  {
+    std::ifstream file(cachePath);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.empty() && line.compare(0, key.size() + 1, key + ' ') != 0) {
+        lines.push_back(line);
+      }
+    }
+  }
+
+  std::ofstream file(cachePath, std::ios::trunc);
+  for (const auto& line : lines) {
+    file << line << '\n';
+  }
+  file << key << ' ' << size.x << ' ' << size.y << ' ' << size.z << '\n';
+}
+
+inline VkResult createComputePipelineWithWorkgroupSize(
+    VkDevice device, VkPipelineLayout pipelineLayout,
+    VkShaderModule shaderModule, const char* entryPoint,
+    const WorkgroupSize& size, VkPipeline* pipeline) {
+  const VkSpecializationMapEntry mapEntries[3] = {
+      {0, offsetof(WorkgroupSize, x), sizeof(uint32_t)},
+      {1, offsetof(WorkgroupSize, y), sizeof(uint32_t)},
+      {2, offsetof(WorkgroupSize, z), sizeof(uint32_t)}};
+
+  const VkSpecializationInfo specializationInfo = {3, mapEntries,
+                                                   sizeof(WorkgroupSize), &size};
+
+  const VkComputePipelineCreateInfo computePipelineCreateInfo = {
+      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      nullptr,
+      0,
+      {VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr, 0,
+       VK_SHADER_STAGE_COMPUTE_BIT, shaderModule, entryPoint,
+       &specializationInfo},
+      pipelineLayout,
+      VK_NULL_HANDLE,
+      0};
+
+  return vkCreateComputePipelines(device, VK_NULL_HANDLE, 1,
+                                  &computePipelineCreateInfo, nullptr, pipeline);
+}
+
+// Builds the kernel once per candidate, runs it `repeats` times after one
+// warm-up dispatch and keeps the fastest run. Falls back to host timing when
+// the queue family has no timestamp support.
+inline VkResult autotuneWorkgroupSize(
+    VkPhysicalDevice physicalDevice, VkDevice device, VkQueue queue,
+    uint32_t queueFamilyIndex, VkPipelineLayout pipelineLayout,
+    VkShaderModule shaderModule, const char* entryPoint,
+    const std::vector<WorkgroupSize>& candidates,
+    const RecordDispatchFn& recordDispatch, WorkgroupSize* best,
+    uint32_t repeats = 5) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+  uint32_t queueFamilyPropertiesCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice,
+                                           &queueFamilyPropertiesCount, nullptr);
+  std::vector<VkQueueFamilyProperties> queueFamilyProperties(
+      queueFamilyPropertiesCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+      physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
+
+  const uint32_t timestampValidBits =
+      queueFamilyProperties[queueFamilyIndex].timestampValidBits;
+  const bool useTimestamps = timestampValidBits != 0;
+  const uint64_t timestampMask =
+      timestampValidBits >= 64 ? std::numeric_limits<uint64_t>::max()
+                               : (uint64_t{1} << timestampValidBits) - 1;
+
+  VkResult result = VK_SUCCESS;
+
+  VkQueryPool queryPool = VK_NULL_HANDLE;
+  if (useTimestamps) {
+    const VkQueryPoolCreateInfo queryPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr, 0,
+        VK_QUERY_TYPE_TIMESTAMP, 2, 0};
+    result = vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool);
+  }
+
+  const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+      VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr,
+      VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamilyIndex};
+
+  // Each step only runs when the ones before it succeeded, and everything
+  // created is destroyed at the end whatever failed
+  VkCommandPool commandPool = VK_NULL_HANDLE;
+  if (result == VK_SUCCESS) {
+    result = vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr,
+                                 &commandPool);
+  }
+
+  const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, commandPool,
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1};
+
+  VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+  if (result == VK_SUCCESS) {
+    result = vkAllocateCommandBuffers(device, &commandBufferAllocateInfo,
+                                      &commandBuffer);
+  }
+
+  const VkFenceCreateInfo fenceCreateInfo = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                                             nullptr, 0};
+  VkFence fence = VK_NULL_HANDLE;
+  if (result == VK_SUCCESS) {
+    result = vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+  }
+
+  double bestTime = std::numeric_limits<double>::max();
+
+  for (const auto& candidate : candidates) {
+    if (result != VK_SUCCESS) break;
+    if (!fitsWorkgroupLimits(props.limits, candidate)) {
+      continue;
+    }
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    result = createComputePipelineWithWorkgroupSize(
+        device, pipelineLayout, shaderModule, entryPoint, candidate, &pipeline);
+    if (result != VK_SUCCESS) break;
+
+    double candidateTime = std::numeric_limits<double>::max();
+
+    // The first iteration is a warm-up and is not measured
+    for (uint32_t run = 0; run <= repeats && result == VK_SUCCESS; run++) {
+      const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+          VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+          VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+      result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+      if (result != VK_SUCCESS) break;
+
+      if (useTimestamps) {
+        vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            queryPool, 0);
+      }
+
+      recordDispatch(commandBuffer, pipeline, candidate);
+
+      if (useTimestamps) {
+        vkCmdWriteTimestamp(commandBuffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+      }
+
+      result = vkEndCommandBuffer(commandBuffer);
+      if (result != VK_SUCCESS) break;
+
+      const VkSubmitInfo submitInfo = {
+          VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr, 0, nullptr, nullptr, 1,
+          &commandBuffer, 0, nullptr};
+
+      const auto hostStart = std::chrono::steady_clock::now();
+
+      result = vkQueueSubmit(queue, 1, &submitInfo, fence);
+      if (result != VK_SUCCESS) break;
+      result = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+      if (result != VK_SUCCESS) break;
+
+      const auto hostEnd = std::chrono::steady_clock::now();
+
+      vkResetFences(device, 1, &fence);
+
+      double elapsedNs = 0.0;
+      if (useTimestamps) {
+        uint64_t timestamps[2] = {};
+        result = vkGetQueryPoolResults(
+            device, queryPool, 0, 2, sizeof(timestamps), timestamps,
+            sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        if (result != VK_SUCCESS) break;
+
+        elapsedNs = static_cast<double>((timestamps[1] - timestamps[0]) &
+                                        timestampMask) *
+                    props.limits.timestampPeriod;
+      } else {
+        elapsedNs = std::chrono::duration<double, std::nano>(hostEnd - hostStart)
+                        .count();
+      }
+
+      if (run > 0) {
+        candidateTime = std::min(candidateTime, elapsedNs);
+      }
+    }
+
+    vkDestroyPipeline(device, pipeline, nullptr);
+    if (result != VK_SUCCESS) break;
+
+    printf("workgroup %ux%ux%u: %.3f ms\n", candidate.x, candidate.y,
+           candidate.z, candidateTime * 1e-6);
+
+    if (candidateTime < bestTime) {
+      bestTime = candidateTime;
+      *best = candidate;
+    }
+  }
+
+  if (fence != VK_NULL_HANDLE) {
+    vkDestroyFence(device, fence, nullptr);
+  }
+  if (commandPool != VK_NULL_HANDLE) {
+    vkDestroyCommandPool(device, commandPool, nullptr);
+  }
+  if (queryPool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(device, queryPool, nullptr);
+  }
+
+  if (result == VK_SUCCESS && bestTime == std::numeric_limits<double>::max()) {
+    result = VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  return result;
+}
+
+#endif  // WORKGROUP_TUNER_H
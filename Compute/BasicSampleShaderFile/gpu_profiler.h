@@ -0,0 +1,307 @@
+// GPU profiling for dispatches and render passes. Every scope is bracketed
+// with a pair of vkCmdWriteTimestamp and, optionally, a pipeline statistics
+// query. Queries live in per-frame slots so that command buffers recorded
+// once and submitted many times (one per swapchain image) can be profiled
+// too. collect() never waits: results that are not available yet are picked
+// up by a later call, results already seen are skipped.
+
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+struct GpuScopeStats {
+  std::string name;
+  uint64_t passes = 0;
+  double totalMs = 0.0;
+  double minMs = std::numeric_limits<double>::max();
+  double maxMs = 0.0;
+  double totalBytes = 0.0;
+  // Sums over all passes, one entry per bit set in the profiler statistics
+  // flags, lowest bit first
+  std::vector<uint64_t> statistics;
+};
+
+inline const char* getPipelineStatisticName(uint32_t bit) {
+  static const char* const names[] = {
+      "ia vertices",    "ia primitives",   "vs invocations",
+      "gs invocations", "gs primitives",   "clip invocations",
+      "clip primitives", "fs invocations", "tcs patches",
+      "tes invocations", "cs invocations"};
+  return bit < sizeof(names) / sizeof(names[0]) ? names[bit] : "statistic";
+}
+
+class GpuProfiler {
+ public:
+  // frameCount is the number of query slots, usually one per command buffer
+  // that is recorded once and resubmitted. statistics needs the
+  // pipelineStatisticsQuery device feature, pass 0 when it is not enabled.
+  // On queue families without timestamp support the profiler stays disabled
+  // and every call is a no-op.
+  VkResult init(VkPhysicalDevice physicalDevice, VkDevice device,
+                uint32_t queueFamilyIndex, uint32_t frameCount,
+                uint32_t scopesPerFrame,
+                VkQueryPipelineStatisticFlags statistics = 0) {
+    device_ = device;
+    scopesPerFrame_ = scopesPerFrame;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    timestampPeriod_ = properties.limits.timestampPeriod;
+
+    uint32_t queueFamilyPropertiesCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        physicalDevice, &queueFamilyPropertiesCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilyProperties(
+        queueFamilyPropertiesCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice,
+                                             &queueFamilyPropertiesCount,
+                                             queueFamilyProperties.data());
+
+    const uint32_t timestampValidBits =
+        queueFamilyIndex < queueFamilyPropertiesCount
+            ? queueFamilyProperties[queueFamilyIndex].timestampValidBits
+            : 0;
+    if (timestampValidBits == 0) {
+      return VK_SUCCESS;
+    }
+
+    timestampMask_ = timestampValidBits >= 64
+                         ? std::numeric_limits<uint64_t>::max()
+                         : (uint64_t{1} << timestampValidBits) - 1;
+
+    const uint32_t slotCount = frameCount * scopesPerFrame;
+
+    const VkQueryPoolCreateInfo timestampPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        VK_QUERY_TYPE_TIMESTAMP,
+        2 * slotCount,
+        0};
+
+    VkResult result = vkCreateQueryPool(device, &timestampPoolCreateInfo,
+                                        nullptr, &timestampPool_);
+    if (result != VK_SUCCESS) return result;
+
+    statistics_ = statistics;
+    for (VkQueryPipelineStatisticFlags bits = statistics; bits != 0;
+         bits &= bits - 1) {
+      statisticCount_++;
+    }
+
+    if (statistics_ != 0) {
+      const VkQueryPoolCreateInfo statisticsPoolCreateInfo = {
+          VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+          nullptr,
+          0,
+          VK_QUERY_TYPE_PIPELINE_STATISTICS,
+          slotCount,
+          statistics};
+
+      result = vkCreateQueryPool(device, &statisticsPoolCreateInfo, nullptr,
+                                 &statisticsPool_);
+      if (result != VK_SUCCESS) {
+        // Also releases the timestamp pool
+        destroy();
+        return result;
+      }
+    }
+
+    scopes_.resize(scopesPerFrame);
+    for (auto& scope : scopes_) {
+      scope.statistics.assign(statisticCount_, 0);
+    }
+    slots_.resize(slotCount);
+
+    enabled_ = true;
+    return VK_SUCCESS;
+  }
+
+  void destroy() {
+    if (device_ != VK_NULL_HANDLE) {
+      vkDestroyQueryPool(device_, timestampPool_, nullptr);
+      vkDestroyQueryPool(device_, statisticsPool_, nullptr);
+    }
+    *this = GpuProfiler{};
+  }
+
+  bool enabled() const { return enabled_; }
+
+  // Resets the queries of one frame slot. Record it at the start of the
+  // command buffer, outside of any render pass.
+  void beginFrame(VkCommandBuffer commandBuffer, uint32_t frame) {
+    if (!enabled_) {
+      return;
+    }
+
+    const uint32_t firstSlot = frame * scopesPerFrame_;
+    vkCmdResetQueryPool(commandBuffer, timestampPool_, 2 * firstSlot,
+                        2 * scopesPerFrame_);
+    if (statisticsPool_ != VK_NULL_HANDLE) {
+      vkCmdResetQueryPool(commandBuffer, statisticsPool_, firstSlot,
+                          scopesPerFrame_);
+    }
+
+    for (uint32_t scope = 0; scope < scopesPerFrame_; scope++) {
+      slots_[firstSlot + scope].recorded = false;
+    }
+  }
+
+  // bytes is the memory traffic of the scope (reads plus writes) and is
+  // only used to report achieved bandwidth.
+  void beginScope(VkCommandBuffer commandBuffer, uint32_t frame,
+                  uint32_t scope, const char* name, double bytes = 0.0) {
+    if (!enabled_) {
+      return;
+    }
+
+    const uint32_t index = frame * scopesPerFrame_ + scope;
+    scopes_[scope].name = name;
+    slots_[index].recorded = true;
+    slots_[index].bytes = bytes;
+
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        timestampPool_, 2 * index);
+    if (statisticsPool_ != VK_NULL_HANDLE) {
+      vkCmdBeginQuery(commandBuffer, statisticsPool_, index, 0);
+    }
+  }
+
+  void endScope(VkCommandBuffer commandBuffer, uint32_t frame,
+                uint32_t scope) {
+    if (!enabled_) {
+      return;
+    }
+
+    const uint32_t index = frame * scopesPerFrame_ + scope;
+    if (statisticsPool_ != VK_NULL_HANDLE) {
+      vkCmdEndQuery(commandBuffer, statisticsPool_, index);
+    }
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        timestampPool_, 2 * index + 1);
+  }
+
+  // Folds every available result that has not been seen yet into the
+  // per-scope statistics. Does not wait for the GPU.
+  void collect() {
+    if (!enabled_) {
+      return;
+    }
+
+    const VkQueryResultFlags flags =
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT;
+    std::vector<uint64_t> statistics(statisticCount_ + 1);
+
+    for (uint32_t index = 0; index < slots_.size(); index++) {
+      Slot& slot = slots_[index];
+      if (!slot.recorded) {
+        continue;
+      }
+
+      // value and availability for the begin and end timestamps
+      uint64_t timestamps[4] = {};
+      const VkResult result = vkGetQueryPoolResults(
+          device_, timestampPool_, 2 * index, 2, sizeof(timestamps),
+          timestamps, 2 * sizeof(uint64_t), flags);
+      if ((result != VK_SUCCESS && result != VK_NOT_READY) ||
+          timestamps[1] == 0 || timestamps[3] == 0 ||
+          timestamps[0] == slot.lastBegin) {
+        continue;
+      }
+
+      if (statisticsPool_ != VK_NULL_HANDLE) {
+        const VkResult statisticsResult = vkGetQueryPoolResults(
+            device_, statisticsPool_, index, 1,
+            statistics.size() * sizeof(uint64_t), statistics.data(),
+            statistics.size() * sizeof(uint64_t), flags);
+        if ((statisticsResult != VK_SUCCESS &&
+             statisticsResult != VK_NOT_READY) ||
+            statistics[statisticCount_] == 0) {
+          continue;
+        }
+      }
+
+      slot.lastBegin = timestamps[0];
+
+      const double ms =
+          static_cast<double>((timestamps[2] - timestamps[0]) &
+                              timestampMask_) *
+          timestampPeriod_ * 1e-6;
+
+      GpuScopeStats& scope = scopes_[index % scopesPerFrame_];
+      scope.passes++;
+      scope.totalMs += ms;
+      scope.minMs = std::min(scope.minMs, ms);
+      scope.maxMs = std::max(scope.maxMs, ms);
+      scope.totalBytes += slot.bytes;
+      for (uint32_t k = 0; k < statisticCount_; k++) {
+        scope.statistics[k] += statistics[k];
+      }
+    }
+  }
+
+  const std::vector<GpuScopeStats>& scopes() const { return scopes_; }
+
+  void report(FILE* file) const {
+    if (!enabled_) {
+      fprintf(file, "gpu profiler: no timestamp support on this queue\n");
+      return;
+    }
+
+    fprintf(file, "%-16s %8s %10s %10s %10s %9s", "gpu scope", "passes",
+            "avg ms", "min ms", "max ms", "GB/s");
+    for (uint32_t bit = 0; bit < 32; bit++) {
+      if (statistics_ & (1u << bit)) {
+        fprintf(file, " %16s", getPipelineStatisticName(bit));
+      }
+    }
+    fprintf(file, "\n");
+
+    for (const auto& scope : scopes_) {
+      if (scope.passes == 0) {
+        continue;
+      }
+
+      const double avgMs = scope.totalMs / scope.passes;
+      const double gigabytesPerSecond =
+          scope.totalMs > 0.0 ? scope.totalBytes / (scope.totalMs * 1e6) : 0.0;
+      fprintf(file, "%-16s %8llu %10.3f %10.3f %10.3f %9.2f",
+              scope.name.c_str(), (unsigned long long)scope.passes, avgMs,
+              scope.minMs, scope.maxMs, gigabytesPerSecond);
+      for (const uint64_t statistic : scope.statistics) {
+        fprintf(file, " %16llu",
+                (unsigned long long)(statistic / scope.passes));
+      }
+      fprintf(file, "\n");
+    }
+  }
+
+ private:
+  struct Slot {
+    bool recorded = false;
+    double bytes = 0.0;
+    uint64_t lastBegin = 0;
+  };
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkQueryPool timestampPool_ = VK_NULL_HANDLE;
+  VkQueryPool statisticsPool_ = VK_NULL_HANDLE;
+  VkQueryPipelineStatisticFlags statistics_ = 0;
+  uint32_t statisticCount_ = 0;
+  uint32_t scopesPerFrame_ = 0;
+  float timestampPeriod_ = 1.0f;
+  uint64_t timestampMask_ = 0;
+  bool enabled_ = false;
+  std::vector<GpuScopeStats> scopes_;
+  std::vector<Slot> slots_;
+};
+
+#endif  // GPU_PROFILER_H
@@ -29,12 +29,22 @@
 
 #include "vulkan/vulkan.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <vector>
 
+#include "gpu_profiler.h"
+#include "multi_device.h"
+#include "transfer_engine.h"
+
+// must match local_size_x in simple_shader.comp
+const uint32_t kLocalSizeX = 256;
+
 std::vector<char> readFile(const std::string& filepath) {
   std::ifstream file{filepath, std::ios::binary};
 
@@ -133,9 +143,823 @@ VkResult vkGetBestComputeQueueNPH(VkPhysicalDevice physicalDevice, uint32_t* que
   return VK_ERROR_INITIALIZATION_FAILED;
 }
 
+VkResult vkCreateStorageDescriptorSetNPH(VkDevice device, VkDescriptorPool descriptorPool,
+  VkDescriptorSetLayout descriptorSetLayout, VkBuffer inBuffer, VkBuffer outBuffer, VkDescriptorSet* descriptorSet) {
+  const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+    VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    nullptr,
+    descriptorPool,
+    1,
+    &descriptorSetLayout
+  };
+
+  const VkResult result = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, descriptorSet);
+  if (result != VK_SUCCESS) return result;
+
+  const VkDescriptorBufferInfo descriptorBufferInfos[2] = {
+    {inBuffer, 0, VK_WHOLE_SIZE},
+    {outBuffer, 0, VK_WHOLE_SIZE}
+  };
+
+  const VkWriteDescriptorSet writeDescriptorSet[2] = {
+    {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, *descriptorSet, 0, 0, 1,
+     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &descriptorBufferInfos[0], nullptr},
+    {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, *descriptorSet, 1, 0, 1,
+     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &descriptorBufferInfos[1], nullptr}
+  };
+
+  vkUpdateDescriptorSets(device, 2, writeDescriptorSet, 0, nullptr);
+
+  return VK_SUCCESS;
+}
+
+VkResult vkRecordCopyKernelNPH(VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+  VkDescriptorSet descriptorSet, uint32_t elementCount) {
+  const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    nullptr,
+    0,
+    nullptr
+  };
+
+  const VkResult result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+  if (result != VK_SUCCESS) return result;
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+    pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+
+  vkCmdDispatch(commandBuffer, (elementCount + kLocalSizeX - 1) / kLocalSizeX, 1, 1);
+
+  return vkEndCommandBuffer(commandBuffer);
+}
+
+// Runs the copy kernel kJobs times per buffer size in two ways:
+//  direct - the kernel reads and writes HOST_VISIBLE | HOST_COHERENT buffers
+//           which the host fills and reads back between jobs
+//  staged - the kernel works on DEVICE_LOCAL buffers, TransferEngine copies
+//           through a ring of staging buffers on the transfer queue, so the
+//           transfers of one job overlap the kernel of the previous one
+void runTransferBenchmark(VkPhysicalDevice physicalDevice, VkDevice device,
+  uint32_t computeQueueFamilyIndex, VkQueue computeQueue,
+  uint32_t transferQueueFamilyIndex, VkQueue transferQueue,
+  VkPipeline pipeline, VkPipelineLayout pipelineLayout, VkDescriptorSetLayout descriptorSetLayout) {
+  const uint32_t kJobs = 16;
+  const uint32_t kSlots = 2;
+  const VkDeviceSize kMinSize = 64 * 1024;
+  const VkDeviceSize kMaxSize = 16 * 1024 * 1024;
+
+  printf("transfer queue family %u, compute queue family %u\n", transferQueueFamilyIndex, computeQueueFamilyIndex);
+  printf("%10s %14s %14s %9s\n", "size KiB", "direct ms/job", "staged ms/job", "speedup");
+
+  const VkDescriptorPoolSize descriptorPoolSize = {
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    2 * (kSlots + 1)
+  };
+
+  const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    nullptr,
+    0,
+    kSlots + 1,
+    1,
+    &descriptorPoolSize
+  };
+
+  VkDescriptorPool descriptorPool = nullptr;
+  BAIL_ON_BAD_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr, &descriptorPool));
+
+  const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    nullptr,
+    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    computeQueueFamilyIndex
+  };
+
+  VkCommandPool commandPool = nullptr;
+  BAIL_ON_BAD_RESULT(vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &commandPool));
+
+  const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    nullptr,
+    commandPool,
+    VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    kSlots + 1
+  };
+
+  // the last one is used by the direct path
+  VkCommandBuffer commandBuffers[kSlots + 1] = {};
+  BAIL_ON_BAD_RESULT(vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, commandBuffers));
+
+  const VkFenceCreateInfo fenceCreateInfo = {
+    VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    nullptr,
+    0
+  };
+
+  VkFence fence = nullptr;
+  BAIL_ON_BAD_RESULT(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
+
+  std::vector<uint32_t> input(kMaxSize / sizeof(uint32_t));
+  std::vector<uint32_t> output(kMaxSize / sizeof(uint32_t));
+
+  for (VkDeviceSize size = kMinSize; size <= kMaxSize; size *= 4) {
+    const uint32_t elementCount = static_cast<uint32_t>(size / sizeof(uint32_t));
+
+    for (uint32_t k = 0; k < elementCount; k++) {
+      input[k] = rand();
+    }
+
+    // Direct path
+    DeviceBuffer directIn;
+    DeviceBuffer directOut;
+    const VkMemoryPropertyFlags hostFlags =
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      hostFlags, 0, {computeQueueFamilyIndex}, &directIn));
+    BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      hostFlags, 0, {computeQueueFamilyIndex}, &directOut));
+
+    VkDescriptorSet directSet = nullptr;
+    BAIL_ON_BAD_RESULT(vkCreateStorageDescriptorSetNPH(device, descriptorPool, descriptorSetLayout,
+      directIn.buffer, directOut.buffer, &directSet));
+
+    BAIL_ON_BAD_RESULT(vkRecordCopyKernelNPH(commandBuffers[kSlots], pipeline, pipelineLayout, directSet, elementCount));
+
+    const auto directStart = std::chrono::steady_clock::now();
+
+    for (uint32_t job = 0; job < kJobs; job++) {
+      memcpy(directIn.mapped, input.data(), size);
+
+      const VkSubmitInfo submitInfo = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        nullptr,
+        0,
+        nullptr,
+        nullptr,
+        1,
+        &commandBuffers[kSlots],
+        0,
+        nullptr
+      };
+
+      BAIL_ON_BAD_RESULT(vkQueueSubmit(computeQueue, 1, &submitInfo, fence));
+      BAIL_ON_BAD_RESULT(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+      BAIL_ON_BAD_RESULT(vkResetFences(device, 1, &fence));
+
+      memcpy(output.data(), directOut.mapped, size);
+    }
+
+    const auto directEnd = std::chrono::steady_clock::now();
+
+    BAIL_ON_BAD_RESULT(memcmp(input.data(), output.data(), size) == 0 ? VK_SUCCESS : VK_ERROR_UNKNOWN);
+    memset(output.data(), 0, size);
+
+    destroyDeviceBuffer(device, &directIn);
+    destroyDeviceBuffer(device, &directOut);
+
+    // Staged path
+    TransferEngine engine;
+    BAIL_ON_BAD_RESULT(engine.init(physicalDevice, device, transferQueueFamilyIndex, transferQueue, size, kSlots));
+
+    DeviceBuffer stagedIn[kSlots];
+    DeviceBuffer stagedOut[kSlots];
+    for (uint32_t slot = 0; slot < kSlots; slot++) {
+      BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, {computeQueueFamilyIndex, transferQueueFamilyIndex},
+        &stagedIn[slot]));
+      BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, {computeQueueFamilyIndex, transferQueueFamilyIndex},
+        &stagedOut[slot]));
+
+      VkDescriptorSet stagedSet = nullptr;
+      BAIL_ON_BAD_RESULT(vkCreateStorageDescriptorSetNPH(device, descriptorPool, descriptorSetLayout,
+        stagedIn[slot].buffer, stagedOut[slot].buffer, &stagedSet));
+
+      BAIL_ON_BAD_RESULT(vkRecordCopyKernelNPH(commandBuffers[slot], pipeline, pipelineLayout, stagedSet, elementCount));
+    }
+
+    const auto stagedStart = std::chrono::steady_clock::now();
+
+    // job + kSlots is submitted while job is still in flight, its result is
+    // collected when the slot comes around again
+    for (uint32_t job = 0; job < kJobs + kSlots; job++) {
+      const uint32_t slot = job % kSlots;
+
+      BAIL_ON_BAD_RESULT(engine.acquire(slot));
+
+      if (job >= kSlots) {
+        memcpy(output.data(), engine.downloadData(slot), size);
+      }
+
+      if (job >= kJobs) {
+        continue;
+      }
+
+      memcpy(engine.uploadData(slot), input.data(), size);
+
+      BAIL_ON_BAD_RESULT(engine.submitUpload(slot, stagedIn[slot].buffer, size));
+
+      const VkSemaphore waitSemaphore = engine.uploadedSemaphore(slot);
+      const VkSemaphore signalSemaphore = engine.computedSemaphore(slot);
+      const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+      const VkSubmitInfo submitInfo = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        nullptr,
+        1,
+        &waitSemaphore,
+        &waitStage,
+        1,
+        &commandBuffers[slot],
+        1,
+        &signalSemaphore
+      };
+
+      BAIL_ON_BAD_RESULT(vkQueueSubmit(computeQueue, 1, &submitInfo, nullptr));
+
+      BAIL_ON_BAD_RESULT(engine.submitDownload(slot, stagedOut[slot].buffer, size));
+    }
+
+    const auto stagedEnd = std::chrono::steady_clock::now();
+
+    BAIL_ON_BAD_RESULT(memcmp(input.data(), output.data(), size) == 0 ? VK_SUCCESS : VK_ERROR_UNKNOWN);
+
+    engine.destroy();
+    for (uint32_t slot = 0; slot < kSlots; slot++) {
+      destroyDeviceBuffer(device, &stagedIn[slot]);
+      destroyDeviceBuffer(device, &stagedOut[slot]);
+    }
+
+    BAIL_ON_BAD_RESULT(vkResetDescriptorPool(device, descriptorPool, 0));
+
+    const double directMs = std::chrono::duration<double, std::milli>(directEnd - directStart).count() / kJobs;
+    const double stagedMs = std::chrono::duration<double, std::milli>(stagedEnd - stagedStart).count() / kJobs;
+
+    printf("%10llu %14.3f %14.3f %8.2fx\n", (unsigned long long)(size / 1024), directMs, stagedMs,
+      directMs / stagedMs);
+  }
+
+  vkDestroyFence(device, fence, nullptr);
+  vkDestroyCommandPool(device, commandPool, nullptr);
+  vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+}
+
+// Largest chunk the streaming mode can push through the copy kernel: one
+// storage buffer range, one dispatch worth of work groups, and no more than a
+// quarter of the smallest heap the slot buffers live in
+VkDeviceSize getMaxStreamChunkSize(VkPhysicalDevice physicalDevice, uint32_t slotCount) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+  VkDeviceSize maxSize = std::min<VkDeviceSize>(props.limits.maxStorageBufferRange,
+    VkDeviceSize{sizeof(uint32_t)} * kLocalSizeX * props.limits.maxComputeWorkGroupCount[0]);
+
+  // every slot holds two device buffers and two staging buffers
+  for (uint32_t k = 0; k < memoryProperties.memoryTypeCount; k++) {
+    const VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[k].propertyFlags;
+    if (flags & (VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+      const VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[k].heapIndex].size;
+      maxSize = std::min(maxSize, heapSize / 4 / (2 * slotCount));
+    }
+  }
+
+  const VkDeviceSize granularity = sizeof(uint32_t) * kLocalSizeX;
+  return std::max(granularity, maxSize - maxSize % granularity);
+}
+
+// Streams a file of any size through the copy kernel into another file. The
+// input is cut into chunks that fit one storage buffer, and slotCount chunks
+// are in flight at once: while the kernel works on one chunk the transfer
+// queue uploads the next and downloads the previous one, and the host reads
+// and writes the files in between. Exits like BAIL_ON_BAD_RESULT when either
+// file cannot be opened.
+void runStreaming(VkPhysicalDevice physicalDevice, VkDevice device,
+  uint32_t computeQueueFamilyIndex, VkQueue computeQueue,
+  uint32_t transferQueueFamilyIndex, VkQueue transferQueue,
+  VkPipeline pipeline, VkPipelineLayout pipelineLayout, VkDescriptorSetLayout descriptorSetLayout,
+  const char* inputPath, const char* outputPath, VkDeviceSize requestedChunkSize, uint32_t slotCount) {
+  std::ifstream input(inputPath, std::ios::binary);
+  std::ofstream output(outputPath, std::ios::binary);
+  if (!input || !output) {
+    fprintf(stderr, "Cannot open %s or %s\n", inputPath, outputPath);
+    exit(-1);
+  }
+
+  const VkDeviceSize granularity = sizeof(uint32_t) * kLocalSizeX;
+  const VkDeviceSize chunkSize = std::min(getMaxStreamChunkSize(physicalDevice, slotCount),
+    std::max(granularity, requestedChunkSize - requestedChunkSize % granularity));
+
+  printf("streaming %s to %s: %u slots of %llu KiB\n", inputPath, outputPath, slotCount,
+    (unsigned long long)(chunkSize / 1024));
+
+  const VkDescriptorPoolSize descriptorPoolSize = {
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    2 * slotCount
+  };
+
+  const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    nullptr,
+    0,
+    slotCount,
+    1,
+    &descriptorPoolSize
+  };
+
+  VkDescriptorPool descriptorPool = nullptr;
+  BAIL_ON_BAD_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr, &descriptorPool));
+
+  const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    nullptr,
+    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    computeQueueFamilyIndex
+  };
+
+  VkCommandPool commandPool = nullptr;
+  BAIL_ON_BAD_RESULT(vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &commandPool));
+
+  const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    nullptr,
+    commandPool,
+    VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    slotCount
+  };
+
+  std::vector<VkCommandBuffer> commandBuffers(slotCount);
+  BAIL_ON_BAD_RESULT(vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, commandBuffers.data()));
+
+  TransferEngine engine;
+  BAIL_ON_BAD_RESULT(engine.init(physicalDevice, device, transferQueueFamilyIndex, transferQueue, chunkSize,
+    slotCount));
+
+  std::vector<DeviceBuffer> deviceIn(slotCount);
+  std::vector<DeviceBuffer> deviceOut(slotCount);
+  std::vector<VkDescriptorSet> descriptorSets(slotCount);
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, chunkSize,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, {computeQueueFamilyIndex, transferQueueFamilyIndex},
+      &deviceIn[slot]));
+    BAIL_ON_BAD_RESULT(createDeviceBuffer(physicalDevice, device, chunkSize,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, {computeQueueFamilyIndex, transferQueueFamilyIndex},
+      &deviceOut[slot]));
+
+    BAIL_ON_BAD_RESULT(vkCreateStorageDescriptorSetNPH(device, descriptorPool, descriptorSetLayout,
+      deviceIn[slot].buffer, deviceOut[slot].buffer, &descriptorSets[slot]));
+  }
+
+  // bytes of the chunk each slot is working on, 0 when the slot is idle
+  std::vector<VkDeviceSize> chunkBytes(slotCount, 0);
+  VkDeviceSize totalBytes = 0;
+  bool inputDone = false;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (uint32_t chunk = 0; ; chunk++) {
+    const uint32_t slot = chunk % slotCount;
+
+    BAIL_ON_BAD_RESULT(engine.acquire(slot));
+
+    if (chunkBytes[slot] > 0) {
+      output.write(static_cast<const char*>(engine.downloadData(slot)), chunkBytes[slot]);
+      totalBytes += chunkBytes[slot];
+      chunkBytes[slot] = 0;
+    }
+
+    if (inputDone) {
+      bool idle = true;
+      for (const VkDeviceSize bytes : chunkBytes) {
+        idle = idle && bytes == 0;
+      }
+      if (idle) {
+        break;
+      }
+      continue;
+    }
+
+    auto* const uploadData = static_cast<char*>(engine.uploadData(slot));
+    input.read(uploadData, chunkSize);
+    const VkDeviceSize bytes = static_cast<VkDeviceSize>(input.gcount());
+    inputDone = bytes < chunkSize;
+    if (bytes == 0) {
+      continue;
+    }
+
+    // the kernel works on whole elements, pad the tail of the last chunk
+    const uint32_t elementCount = static_cast<uint32_t>((bytes + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    const VkDeviceSize paddedBytes = VkDeviceSize{elementCount} * sizeof(uint32_t);
+    memset(uploadData + bytes, 0, paddedBytes - bytes);
+
+    BAIL_ON_BAD_RESULT(engine.submitUpload(slot, deviceIn[slot].buffer, paddedBytes));
+
+    BAIL_ON_BAD_RESULT(vkRecordCopyKernelNPH(commandBuffers[slot], pipeline, pipelineLayout, descriptorSets[slot],
+      elementCount));
+
+    const VkSemaphore waitSemaphore = engine.uploadedSemaphore(slot);
+    const VkSemaphore signalSemaphore = engine.computedSemaphore(slot);
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    const VkSubmitInfo submitInfo = {
+      VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      nullptr,
+      1,
+      &waitSemaphore,
+      &waitStage,
+      1,
+      &commandBuffers[slot],
+      1,
+      &signalSemaphore
+    };
+
+    BAIL_ON_BAD_RESULT(vkQueueSubmit(computeQueue, 1, &submitInfo, nullptr));
+
+    BAIL_ON_BAD_RESULT(engine.submitDownload(slot, deviceOut[slot].buffer, paddedBytes));
+
+    chunkBytes[slot] = bytes;
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("streamed %llu MiB in %.3f s: %.1f MiB/s\n", (unsigned long long)(totalBytes >> 20), seconds,
+    totalBytes / seconds / (1024.0 * 1024.0));
+
+  engine.destroy();
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    destroyDeviceBuffer(device, &deviceIn[slot]);
+    destroyDeviceBuffer(device, &deviceOut[slot]);
+  }
+
+  vkDestroyCommandPool(device, commandPool, nullptr);
+  vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+}
+
+// Everything one device needs to run the copy kernel on its share of a
+// workload split over several devices
+struct CopyDevice {
+  VkPhysicalDevice physicalDevice = nullptr;
+  VkDevice device = nullptr;
+  VkQueue queue = nullptr;
+  VkShaderModule shaderModule = nullptr;
+  VkDescriptorSetLayout descriptorSetLayout = nullptr;
+  VkPipelineLayout pipelineLayout = nullptr;
+  VkPipeline pipeline = nullptr;
+  VkDescriptorPool descriptorPool = nullptr;
+  VkDescriptorSet descriptorSet = nullptr;
+  VkCommandPool commandPool = nullptr;
+  VkCommandBuffer commandBuffer = nullptr;
+  VkFence fence = nullptr;
+  DeviceBuffer in;
+  DeviceBuffer out;
+  uint32_t capacity = 0;
+};
+
+VkResult createCopyDevice(VkPhysicalDevice physicalDevice, const std::vector<char>& compCode, CopyDevice* copyDevice) {
+  copyDevice->physicalDevice = physicalDevice;
+
+  uint32_t queueFamilyIndex = 0;
+  VkResult result = vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex);
+  if (result != VK_SUCCESS) return result;
+
+  const float queuePrioritory = 1.0f;
+  const VkDeviceQueueCreateInfo deviceQueueCreateInfo = {
+    VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+    nullptr,
+    0,
+    queueFamilyIndex,
+    1,
+    &queuePrioritory
+  };
+
+  const VkDeviceCreateInfo deviceCreateInfo = {
+    VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+    nullptr,
+    0,
+    1,
+    &deviceQueueCreateInfo,
+    0,
+    nullptr,
+    0,
+    nullptr,
+    nullptr
+  };
+
+  result = vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &copyDevice->device);
+  if (result != VK_SUCCESS) return result;
+
+  const VkDevice device = copyDevice->device;
+  vkGetDeviceQueue(device, queueFamilyIndex, 0, &copyDevice->queue);
+
+  const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+    VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    nullptr,
+    0,
+    compCode.size(),
+    (const uint32_t*)compCode.data()
+  };
+
+  result = vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr, &copyDevice->shaderModule);
+  if (result != VK_SUCCESS) return result;
+
+  const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2] = {
+    {
+      0,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      1,
+      VK_SHADER_STAGE_COMPUTE_BIT,
+      nullptr
+    },
+    {
+      1,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      1,
+      VK_SHADER_STAGE_COMPUTE_BIT,
+      nullptr
+    }
+  };
+
+  const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+    VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    nullptr,
+    0,
+    2,
+    descriptorSetLayoutBindings
+  };
+
+  result = vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCreateInfo, nullptr,
+    &copyDevice->descriptorSetLayout);
+  if (result != VK_SUCCESS) return result;
+
+  const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+    VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    nullptr,
+    0,
+    1,
+    &copyDevice->descriptorSetLayout,
+    0,
+    nullptr
+  };
+
+  result = vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &copyDevice->pipelineLayout);
+  if (result != VK_SUCCESS) return result;
+
+  const VkComputePipelineCreateInfo computePipelineCreateInfo = {
+    VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+    nullptr,
+    0,
+    {
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      nullptr,
+      0,
+      VK_SHADER_STAGE_COMPUTE_BIT,
+      copyDevice->shaderModule,
+      "main",
+      nullptr
+    },
+    copyDevice->pipelineLayout,
+    nullptr,
+    0
+  };
+
+  result = vkCreateComputePipelines(device, nullptr, 1, &computePipelineCreateInfo, nullptr, &copyDevice->pipeline);
+  if (result != VK_SUCCESS) return result;
+
+  const VkDescriptorPoolSize descriptorPoolSize = {
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    2
+  };
+
+  const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    nullptr,
+    0,
+    1,
+    1,
+    &descriptorPoolSize
+  };
+
+  result = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, nullptr, &copyDevice->descriptorPool);
+  if (result != VK_SUCCESS) return result;
+
+  const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    nullptr,
+    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    queueFamilyIndex
+  };
+
+  result = vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &copyDevice->commandPool);
+  if (result != VK_SUCCESS) return result;
+
+  const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+    VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    nullptr,
+    copyDevice->commandPool,
+    VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    1
+  };
+
+  result = vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &copyDevice->commandBuffer);
+  if (result != VK_SUCCESS) return result;
+
+  const VkFenceCreateInfo fenceCreateInfo = {
+    VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    nullptr,
+    0
+  };
+
+  return vkCreateFence(device, &fenceCreateInfo, nullptr, &copyDevice->fence);
+}
+
+// Grows the host visible in and out buffers to hold elementCount elements
+VkResult reserveCopyDevice(CopyDevice* copyDevice, uint32_t elementCount) {
+  if (elementCount <= copyDevice->capacity) {
+    return VK_SUCCESS;
+  }
+
+  const VkDevice device = copyDevice->device;
+  destroyDeviceBuffer(device, &copyDevice->in);
+  destroyDeviceBuffer(device, &copyDevice->out);
+  copyDevice->capacity = 0;
+
+  VkResult result = vkResetDescriptorPool(device, copyDevice->descriptorPool, 0);
+  if (result != VK_SUCCESS) return result;
+
+  const VkDeviceSize size = sizeof(uint32_t) * VkDeviceSize{elementCount};
+  const VkMemoryPropertyFlags hostFlags =
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+  result = createDeviceBuffer(copyDevice->physicalDevice, device, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    hostFlags, 0, {}, &copyDevice->in);
+  if (result != VK_SUCCESS) return result;
+
+  result = createDeviceBuffer(copyDevice->physicalDevice, device, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    hostFlags, 0, {}, &copyDevice->out);
+  if (result != VK_SUCCESS) return result;
+
+  result = vkCreateStorageDescriptorSetNPH(device, copyDevice->descriptorPool, copyDevice->descriptorSetLayout,
+    copyDevice->in.buffer, copyDevice->out.buffer, &copyDevice->descriptorSet);
+  if (result != VK_SUCCESS) return result;
+
+  copyDevice->capacity = elementCount;
+  return VK_SUCCESS;
+}
+
+// Copies elementCount elements from input to output through the kernel
+VkResult runCopyDevice(CopyDevice* copyDevice, const uint32_t* input, uint32_t* output, uint32_t elementCount) {
+  if (elementCount == 0) {
+    return VK_SUCCESS;
+  }
+
+  VkResult result = reserveCopyDevice(copyDevice, elementCount);
+  if (result != VK_SUCCESS) return result;
+
+  memcpy(copyDevice->in.mapped, input, sizeof(uint32_t) * elementCount);
+
+  result = vkRecordCopyKernelNPH(copyDevice->commandBuffer, copyDevice->pipeline, copyDevice->pipelineLayout,
+    copyDevice->descriptorSet, elementCount);
+  if (result != VK_SUCCESS) return result;
+
+  const VkSubmitInfo submitInfo = {
+    VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    nullptr,
+    0,
+    nullptr,
+    nullptr,
+    1,
+    &copyDevice->commandBuffer,
+    0,
+    nullptr
+  };
+
+  result = vkQueueSubmit(copyDevice->queue, 1, &submitInfo, copyDevice->fence);
+  if (result != VK_SUCCESS) return result;
+
+  result = vkWaitForFences(copyDevice->device, 1, &copyDevice->fence, VK_TRUE, UINT64_MAX);
+  if (result != VK_SUCCESS) return result;
+
+  result = vkResetFences(copyDevice->device, 1, &copyDevice->fence);
+  if (result != VK_SUCCESS) return result;
+
+  memcpy(output, copyDevice->out.mapped, sizeof(uint32_t) * elementCount);
+  return VK_SUCCESS;
+}
+
+void destroyCopyDevice(CopyDevice* copyDevice) {
+  const VkDevice device = copyDevice->device;
+  if (device == nullptr) {
+    return;
+  }
+
+  vkDeviceWaitIdle(device);
+
+  destroyDeviceBuffer(device, &copyDevice->in);
+  destroyDeviceBuffer(device, &copyDevice->out);
+  vkDestroyFence(device, copyDevice->fence, nullptr);
+  vkDestroyCommandPool(device, copyDevice->commandPool, nullptr);
+  vkDestroyDescriptorPool(device, copyDevice->descriptorPool, nullptr);
+  vkDestroyPipeline(device, copyDevice->pipeline, nullptr);
+  vkDestroyPipelineLayout(device, copyDevice->pipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(device, copyDevice->descriptorSetLayout, nullptr);
+  vkDestroyShaderModule(device, copyDevice->shaderModule, nullptr);
+  vkDestroyDevice(device, nullptr);
+
+  *copyDevice = CopyDevice{};
+}
+
+// Splits one elementCount long copy over all devices. Every device first
+// copies a short calibration range, then gets a share of the elements
+// proportional to the throughput it reached, and all shares run at once.
+void runMultiDeviceCopy(const VkPhysicalDevice* physicalDevices, uint32_t physicalDeviceCount,
+  const std::vector<char>& compCode, uint32_t elementCount) {
+  const uint32_t kCalibrationElements = 1024 * 1024;
+
+  std::vector<uint32_t> input(elementCount);
+  std::vector<uint32_t> output(elementCount);
+  for (uint32_t k = 0; k < elementCount; k++) {
+    input[k] = rand();
+  }
+
+  std::vector<CopyDevice> copyDevices(physicalDeviceCount);
+  std::vector<double> throughput(physicalDeviceCount, 0.0);
+  const uint32_t calibrationElements = std::min(kCalibrationElements, elementCount);
+
+  for (uint32_t i = 0; i < physicalDeviceCount; i++) {
+    BAIL_ON_BAD_RESULT(createCopyDevice(physicalDevices[i], compCode, &copyDevices[i]));
+
+    BAIL_ON_BAD_RESULT(calibrateThroughput([&]() {
+      return runCopyDevice(&copyDevices[i], input.data(), output.data(), calibrationElements);
+    }, calibrationElements, &throughput[i]));
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physicalDevices[i], &props);
+    printf("device %u: %s, %.1f Melements/s\n", i, props.deviceName, throughput[i] * 1e-6);
+  }
+
+  const std::vector<WorkRange> ranges = splitProportional(elementCount, throughput, kLocalSizeX);
+  std::vector<double> seconds(physicalDeviceCount, 0.0);
+
+  for (uint32_t i = 0; i < physicalDeviceCount; i++) {
+    BAIL_ON_BAD_RESULT(reserveCopyDevice(&copyDevices[i], ranges[i].end - ranges[i].begin));
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  BAIL_ON_BAD_RESULT(runConcurrently(physicalDeviceCount, [&](uint32_t i) {
+    const auto rangeStart = std::chrono::steady_clock::now();
+    const VkResult result = runCopyDevice(&copyDevices[i], input.data() + ranges[i].begin,
+      output.data() + ranges[i].begin, ranges[i].end - ranges[i].begin);
+    seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - rangeStart).count();
+    return result;
+  }));
+  const double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  BAIL_ON_BAD_RESULT(memcmp(input.data(), output.data(), sizeof(uint32_t) * elementCount) == 0 ?
+    VK_SUCCESS : VK_ERROR_UNKNOWN);
+
+  for (uint32_t i = 0; i < physicalDeviceCount; i++) {
+    printf("device %u: elements %u-%u, %.3f ms\n", i, ranges[i].begin, ranges[i].end, seconds[i] * 1e3);
+    destroyCopyDevice(&copyDevices[i]);
+  }
+
+  printf("total: %u elements on %u device(s) in %.3f ms\n", elementCount, physicalDeviceCount, totalSeconds * 1e3);
+}
+
 int main(int argc, const char * const argv[]) {
-  (void)argc;
-  (void)argv;
+  bool benchmark = false;
+  bool multiDevice = false;
+  bool profile = false;
+  uint32_t elementCount = 16 * 1024 * 1024;
+  const char* streamInput = nullptr;
+  const char* streamOutput = nullptr;
+  VkDeviceSize chunkSize = 64 * 1024 * 1024;
+  uint32_t slotCount = 3;
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--benchmark") == 0) {
+      benchmark = true;
+    } else if (strcmp(argv[arg], "--multi-device") == 0) {
+      multiDevice = true;
+    } else if (strcmp(argv[arg], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[arg], "--elements") == 0 && arg + 1 < argc) {
+      elementCount = static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--stream") == 0 && arg + 2 < argc) {
+      streamInput = argv[++arg];
+      streamOutput = argv[++arg];
+    } else if (strcmp(argv[arg], "--chunk-mib") == 0 && arg + 1 < argc) {
+      chunkSize = VkDeviceSize{strtoul(argv[++arg], nullptr, 10)} * 1024 * 1024;
+    } else if (strcmp(argv[arg], "--slots") == 0 && arg + 1 < argc) {
+      slotCount = std::max(1u, static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10)));
+    }
+  }
 
   const VkApplicationInfo applicationInfo = {
     VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -169,6 +993,13 @@ int main(int argc, const char * const argv[]) {
 
   BAIL_ON_BAD_RESULT(vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices));
 
+  if (multiDevice) {
+    runMultiDeviceCopy(physicalDevices, physicalDeviceCount, readFile("./shaders/simple_shader.comp.spv"),
+      elementCount);
+    printf("Done.\n");
+    return EXIT_SUCCESS;
+  }
+
   for (uint32_t i = 0; i < physicalDeviceCount; i++) {
     // Just for information
     VkPhysicalDeviceProperties props;
@@ -178,27 +1009,46 @@ int main(int argc, const char * const argv[]) {
     uint32_t queueFamilyIndex = 0;
     BAIL_ON_BAD_RESULT(vkGetBestComputeQueueNPH(physicalDevices[i], &queueFamilyIndex));
 
+    uint32_t transferQueueFamilyIndex = 0;
+    BAIL_ON_BAD_RESULT(vkGetBestTransferQueueNPH(physicalDevices[i], &transferQueueFamilyIndex));
+
     const float queuePrioritory = 1.0f;
-    const VkDeviceQueueCreateInfo deviceQueueCreateInfo = {
-      VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-      nullptr,
-      0,
-      queueFamilyIndex,
-      1,
-      &queuePrioritory
+    const VkDeviceQueueCreateInfo deviceQueueCreateInfos[2] = {
+      {
+        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        nullptr,
+        0,
+        queueFamilyIndex,
+        1,
+        &queuePrioritory
+      },
+      {
+        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        nullptr,
+        0,
+        transferQueueFamilyIndex,
+        1,
+        &queuePrioritory
+      }
     };
 
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevices[i], &supportedFeatures);
+
+    VkPhysicalDeviceFeatures enabledFeatures = {};
+    enabledFeatures.pipelineStatisticsQuery = profile ? supportedFeatures.pipelineStatisticsQuery : VK_FALSE;
+
     const VkDeviceCreateInfo deviceCreateInfo = {
       VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
       nullptr,
       0,
-      1,
-      &deviceQueueCreateInfo,
+      transferQueueFamilyIndex == queueFamilyIndex ? 1u : 2u,
+      deviceQueueCreateInfos,
       0,
       nullptr,
       0,
       nullptr,
-      nullptr
+      &enabledFeatures
     };
 
     VkDevice device = nullptr;
@@ -442,14 +1292,26 @@ int main(int argc, const char * const argv[]) {
       nullptr
     };
 
+    GpuProfiler profiler;
+    if (profile) {
+      BAIL_ON_BAD_RESULT(profiler.init(physicalDevices[i], device, queueFamilyIndex, 1, 1,
+        enabledFeatures.pipelineStatisticsQuery ? VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT : 0));
+    }
+
     BAIL_ON_BAD_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
 
+    // the kernel reads and writes every element once
+    profiler.beginFrame(commandBuffer, 0);
+    profiler.beginScope(commandBuffer, 0, 0, "copy", 2.0 * bufferSize);
+
     vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
 
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
       pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
 
-    vkCmdDispatch(commandBuffer, bufferSize / sizeof(int32_t), 1, 1);
+    vkCmdDispatch(commandBuffer, (bufferLength + kLocalSizeX - 1) / kLocalSizeX, 1, 1);
+
+    profiler.endScope(commandBuffer, 0, 0);
 
     BAIL_ON_BAD_RESULT(vkEndCommandBuffer(commandBuffer));
 
@@ -472,11 +1334,35 @@ int main(int argc, const char * const argv[]) {
 
     BAIL_ON_BAD_RESULT(vkQueueWaitIdle(queue));
 
+    if (profile) {
+      profiler.collect();
+      profiler.report(stdout);
+      profiler.destroy();
+    }
+
     BAIL_ON_BAD_RESULT(vkMapMemory(device, memory, 0, memorySize, 0, (void **)&payload));
 
     for (uint32_t k = 0, e = bufferSize / sizeof(int32_t); k < e; k++) {
       BAIL_ON_BAD_RESULT(payload[k + e] == payload[k] ? VK_SUCCESS : VK_ERROR_OUT_OF_HOST_MEMORY);
     }
+
+    vkUnmapMemory(device, memory);
+
+    VkQueue transferQueue = nullptr;
+    vkGetDeviceQueue(device, transferQueueFamilyIndex, 0, &transferQueue);
+
+    if (benchmark) {
+      runTransferBenchmark(physicalDevices[i], device, queueFamilyIndex, queue,
+        transferQueueFamilyIndex, transferQueue, pipeline, pipelineLayout, descriptorSetLayout);
+    }
+
+    // The file is streamed once, through the first device, so that the
+    // output is not written again for every device
+    if (streamInput != nullptr && i == 0) {
+      runStreaming(physicalDevices[i], device, queueFamilyIndex, queue,
+        transferQueueFamilyIndex, transferQueue, pipeline, pipelineLayout, descriptorSetLayout,
+        streamInput, streamOutput, chunkSize, slotCount);
+    }
   }
 
   printf("Done.\n");
@@ -0,0 +1,322 @@
+// Asynchronous upload/download through host visible staging buffers.
+//
+// Kernel buffers live in DEVICE_LOCAL memory. Each job uses one slot of a
+// ring: the host fills the slot's upload staging buffer, the transfer queue
+// copies it into the device buffer and signals the slot's `uploaded`
+// semaphore, the compute queue waits on it, runs the kernel and signals
+// `computed`, and the transfer queue copies the result back into the slot's
+// download staging buffer and signals the slot's fence. With two or more
+// slots the copies of job N+1 overlap the kernel of job N.
+
+#ifndef TRANSFER_ENGINE_H
+#define TRANSFER_ENGINE_H
+
+#include "vulkan/vulkan.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct DeviceBuffer {
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize size = 0;
+  void* mapped = nullptr;
+};
+
+// Returns the first memory type allowed by typeBits that has all of the
+// required flags, preferring one that also has the preferred flags.
+inline VkResult vkFindMemoryTypeNPH(
+    const VkPhysicalDeviceMemoryProperties& properties, uint32_t typeBits,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+    uint32_t* memoryTypeIndex) {
+  for (const VkMemoryPropertyFlags flags : {required | preferred, required}) {
+    for (uint32_t k = 0; k < properties.memoryTypeCount; k++) {
+      if ((typeBits & (1u << k)) &&
+          (properties.memoryTypes[k].propertyFlags & flags) == flags) {
+        *memoryTypeIndex = k;
+        return VK_SUCCESS;
+      }
+    }
+  }
+
+  return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+}
+
+// Creates a buffer with its own allocation. When the buffer is used from two
+// queue families it is created with VK_SHARING_MODE_CONCURRENT, which saves
+// the queue family ownership transfer barriers. Host visible buffers stay
+// mapped for their whole lifetime.
+inline VkResult createDeviceBuffer(
+    VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize size,
+    VkBufferUsageFlags usage, VkMemoryPropertyFlags required,
+    VkMemoryPropertyFlags preferred,
+    const std::vector<uint32_t>& queueFamilyIndices, DeviceBuffer* result) {
+  const bool concurrent = queueFamilyIndices.size() > 1 &&
+                          queueFamilyIndices[0] != queueFamilyIndices[1];
+
+  const VkBufferCreateInfo bufferCreateInfo = {
+      VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      nullptr,
+      0,
+      size,
+      usage,
+      concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+      concurrent ? static_cast<uint32_t>(queueFamilyIndices.size()) : 0,
+      concurrent ? queueFamilyIndices.data() : nullptr};
+
+  VkResult status =
+      vkCreateBuffer(device, &bufferCreateInfo, nullptr, &result->buffer);
+  if (status != VK_SUCCESS) return status;
+
+  VkMemoryRequirements memoryRequirements;
+  vkGetBufferMemoryRequirements(device, result->buffer, &memoryRequirements);
+
+  VkPhysicalDeviceMemoryProperties properties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &properties);
+
+  uint32_t memoryTypeIndex = 0;
+  status = vkFindMemoryTypeNPH(properties, memoryRequirements.memoryTypeBits,
+                               required, preferred, &memoryTypeIndex);
+  if (status != VK_SUCCESS) return status;
+
+  const VkMemoryAllocateInfo memoryAllocateInfo = {
+      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr, memoryRequirements.size,
+      memoryTypeIndex};
+
+  status = vkAllocateMemory(device, &memoryAllocateInfo, nullptr,
+                            &result->memory);
+  if (status != VK_SUCCESS) return status;
+
+  status = vkBindBufferMemory(device, result->buffer, result->memory, 0);
+  if (status != VK_SUCCESS) return status;
+
+  result->size = size;
+
+  if (required & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    status = vkMapMemory(device, result->memory, 0, size, 0, &result->mapped);
+  }
+
+  return status;
+}
+
+inline void destroyDeviceBuffer(VkDevice device, DeviceBuffer* buffer) {
+  if (buffer->mapped != nullptr) {
+    vkUnmapMemory(device, buffer->memory);
+  }
+  vkDestroyBuffer(device, buffer->buffer, nullptr);
+  vkFreeMemory(device, buffer->memory, nullptr);
+  *buffer = DeviceBuffer{};
+}
+
+class TransferEngine {
+ public:
+  // transferQueue may also be the queue the kernels run on, the semaphores
+  // still order the work in that case.
+  VkResult init(VkPhysicalDevice physicalDevice, VkDevice device,
+                uint32_t transferQueueFamilyIndex, VkQueue transferQueue,
+                VkDeviceSize slotSize, uint32_t slotCount) {
+    device_ = device;
+    transferQueue_ = transferQueue;
+    slotSize_ = slotSize;
+
+    const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr,
+        VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        transferQueueFamilyIndex};
+
+    VkResult status = vkCreateCommandPool(device, &commandPoolCreateInfo,
+                                          nullptr, &commandPool_);
+    if (status != VK_SUCCESS) return status;
+
+    slots_.resize(slotCount);
+    for (auto& slot : slots_) {
+      status = createDeviceBuffer(
+          physicalDevice, device, slotSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+          0, {transferQueueFamilyIndex}, &slot.upload);
+      if (status != VK_SUCCESS) return status;
+
+      // Readback is faster from cached memory when the device offers it
+      status = createDeviceBuffer(
+          physicalDevice, device, slotSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+          VK_MEMORY_PROPERTY_HOST_CACHED_BIT, {transferQueueFamilyIndex},
+          &slot.download);
+      if (status != VK_SUCCESS) return status;
+
+      VkCommandBuffer commandBuffers[2] = {};
+      const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+          VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, commandPool_,
+          VK_COMMAND_BUFFER_LEVEL_PRIMARY, 2};
+      status = vkAllocateCommandBuffers(device, &commandBufferAllocateInfo,
+                                        commandBuffers);
+      if (status != VK_SUCCESS) return status;
+      slot.uploadCommands = commandBuffers[0];
+      slot.downloadCommands = commandBuffers[1];
+
+      const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+          VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr, 0};
+      status = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr,
+                                 &slot.uploaded);
+      if (status != VK_SUCCESS) return status;
+      status = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr,
+                                 &slot.computed);
+      if (status != VK_SUCCESS) return status;
+
+      // Signaled so that the first acquire() of every slot does not block
+      const VkFenceCreateInfo fenceCreateInfo = {
+          VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr,
+          VK_FENCE_CREATE_SIGNALED_BIT};
+      status = vkCreateFence(device, &fenceCreateInfo, nullptr, &slot.done);
+      if (status != VK_SUCCESS) return status;
+    }
+
+    return VK_SUCCESS;
+  }
+
+  void destroy() {
+    if (device_ == VK_NULL_HANDLE) {
+      return;
+    }
+
+    for (auto& slot : slots_) {
+      if (slot.done != VK_NULL_HANDLE) {
+        vkWaitForFences(device_, 1, &slot.done, VK_TRUE, UINT64_MAX);
+      }
+      vkDestroyFence(device_, slot.done, nullptr);
+      vkDestroySemaphore(device_, slot.computed, nullptr);
+      vkDestroySemaphore(device_, slot.uploaded, nullptr);
+      destroyDeviceBuffer(device_, &slot.download);
+      destroyDeviceBuffer(device_, &slot.upload);
+    }
+    slots_.clear();
+
+    vkDestroyCommandPool(device_, commandPool_, nullptr);
+    commandPool_ = VK_NULL_HANDLE;
+    device_ = VK_NULL_HANDLE;
+  }
+
+  uint32_t slotCount() const { return static_cast<uint32_t>(slots_.size()); }
+
+  VkDeviceSize slotSize() const { return slotSize_; }
+
+  // Blocks until the previous job of the slot has been downloaded. After this
+  // returns the download staging memory holds that job's result and the
+  // upload staging memory may be overwritten.
+  VkResult acquire(uint32_t slot) {
+    return vkWaitForFences(device_, 1, &slots_[slot].done, VK_TRUE,
+                           UINT64_MAX);
+  }
+
+  void* uploadData(uint32_t slot) { return slots_[slot].upload.mapped; }
+
+  const void* downloadData(uint32_t slot) const {
+    return slots_[slot].download.mapped;
+  }
+
+  // Signaled by submitUpload(). The compute submission of the job must wait
+  // on it.
+  VkSemaphore uploadedSemaphore(uint32_t slot) const {
+    return slots_[slot].uploaded;
+  }
+
+  // Must be signaled by the compute submission of the job. submitDownload()
+  // waits on it.
+  VkSemaphore computedSemaphore(uint32_t slot) const {
+    return slots_[slot].computed;
+  }
+
+  // Copies `size` bytes of the slot's upload staging buffer into dst.
+  VkResult submitUpload(uint32_t slot, VkBuffer dst, VkDeviceSize size) {
+    Slot& s = slots_[slot];
+
+    VkResult status = beginCommands(s.uploadCommands);
+    if (status != VK_SUCCESS) return status;
+
+    const VkBufferCopy region = {0, 0, size};
+    vkCmdCopyBuffer(s.uploadCommands, s.upload.buffer, dst, 1, &region);
+
+    status = vkEndCommandBuffer(s.uploadCommands);
+    if (status != VK_SUCCESS) return status;
+
+    const VkSubmitInfo submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                                     nullptr,
+                                     0,
+                                     nullptr,
+                                     nullptr,
+                                     1,
+                                     &s.uploadCommands,
+                                     1,
+                                     &s.uploaded};
+
+    return vkQueueSubmit(transferQueue_, 1, &submitInfo, VK_NULL_HANDLE);
+  }
+
+  // Copies `size` bytes of src into the slot's download staging buffer once
+  // the computed semaphore is signaled, then signals the slot's fence.
+  VkResult submitDownload(uint32_t slot, VkBuffer src, VkDeviceSize size) {
+    Slot& s = slots_[slot];
+
+    VkResult status = vkResetFences(device_, 1, &s.done);
+    if (status != VK_SUCCESS) return status;
+
+    status = beginCommands(s.downloadCommands);
+    if (status != VK_SUCCESS) return status;
+
+    const VkBufferCopy region = {0, 0, size};
+    vkCmdCopyBuffer(s.downloadCommands, src, s.download.buffer, 1, &region);
+
+    // Make the copy visible to the host once the fence is signaled
+    const VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                           nullptr, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                           VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(s.downloadCommands, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    status = vkEndCommandBuffer(s.downloadCommands);
+    if (status != VK_SUCCESS) return status;
+
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    const VkSubmitInfo submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                                     nullptr,
+                                     1,
+                                     &s.computed,
+                                     &waitStage,
+                                     1,
+                                     &s.downloadCommands,
+                                     0,
+                                     nullptr};
+
+    return vkQueueSubmit(transferQueue_, 1, &submitInfo, s.done);
+  }
+
+ private:
+  struct Slot {
+    DeviceBuffer upload;
+    DeviceBuffer download;
+    VkCommandBuffer uploadCommands = VK_NULL_HANDLE;
+    VkCommandBuffer downloadCommands = VK_NULL_HANDLE;
+    VkSemaphore uploaded = VK_NULL_HANDLE;
+    VkSemaphore computed = VK_NULL_HANDLE;
+    VkFence done = VK_NULL_HANDLE;
+  };
+
+  static VkResult beginCommands(VkCommandBuffer commandBuffer) {
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+    return vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+  }
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkQueue transferQueue_ = VK_NULL_HANDLE;
+  VkCommandPool commandPool_ = VK_NULL_HANDLE;
+  VkDeviceSize slotSize_ = 0;
+  std::vector<Slot> slots_;
+};
+
+#endif  // TRANSFER_ENGINE_H
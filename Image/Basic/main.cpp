@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -15,16 +16,21 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include <optional>
-#include <png++/png.hpp>
 #include <set>
 #include <stdexcept>
 #include <vector>
 
+#include "png_decoder.h"
+
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Format of the image the quad is rendered into in headless mode. The
+// readback is written out as it is, so it holds RGBA.
+const VkFormat kHeadlessFormat = VK_FORMAT_R8G8B8A8_SRGB;
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"};
 
@@ -116,12 +122,26 @@ const std::vector<uint16_t> indices = {0, 1, 2, 2, 3, 0};
 class HelloTriangleApplication {
  public:
   void run(const std::string& imageName) {
-    initWindow();
+    if (!headless) {
+      initWindow();
+    }
     initVulkan(imageName);
-    mainLoop();
+    if (headless) {
+      renderHeadless();
+    } else {
+      mainLoop();
+    }
     cleanup();
   }
 
+  // Renders into an image the size of the texture instead of a window, see
+  // renderHeadless()
+  void setHeadless(uint32_t iterations, const std::string& outputName) {
+    headless = true;
+    headlessIterations = iterations;
+    headlessOutput = outputName;
+  }
+
  private:
   GLFWwindow* window{};
 
@@ -149,6 +169,7 @@ class HelloTriangleApplication {
 
   VkCommandPool commandPool{};
 
+  uint32_t mipLevels{};
   VkImage textureImage{};
   VkDeviceMemory textureImageMemory{};
   VkImageView textureImageView{};
@@ -172,6 +193,17 @@ class HelloTriangleApplication {
 
   bool framebufferResized = false;
 
+  // Headless mode: no window, surface or swap chain. headlessImage stands in
+  // for the swap chain images and every frame ends with a copy of it into
+  // readbackBuffer.
+  bool headless = false;
+  uint32_t headlessIterations = 1;
+  std::string headlessOutput;
+  VkImage headlessImage{};
+  VkDeviceMemory headlessImageMemory{};
+  VkBuffer readbackBuffer{};
+  VkDeviceMemory readbackBufferMemory{};
+
   void initWindow() {
     glfwInit();
 
@@ -192,10 +224,16 @@ class HelloTriangleApplication {
   void initVulkan(const std::string& imageName) {
     createInstance();
     setupDebugMessenger();
-    createSurface();
+    if (!headless) {
+      createSurface();
+    }
     pickPhysicalDevice();
     createLogicalDevice();
-    createSwapChain();
+    if (headless) {
+      createHeadlessTarget(imageName);
+    } else {
+      createSwapChain();
+    }
     createImageViews();
     createRenderPass();
     createDescriptorSetLayout();
@@ -239,7 +277,14 @@ class HelloTriangleApplication {
       vkDestroyImageView(device, imageView, nullptr);
     }
 
-    vkDestroySwapchainKHR(device, swapChain, nullptr);
+    if (headless) {
+      vkDestroyImage(device, headlessImage, nullptr);
+      vkFreeMemory(device, headlessImageMemory, nullptr);
+      vkDestroyBuffer(device, readbackBuffer, nullptr);
+      vkFreeMemory(device, readbackBufferMemory, nullptr);
+    } else {
+      vkDestroySwapchainKHR(device, swapChain, nullptr);
+    }
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
   }
@@ -275,12 +320,16 @@ class HelloTriangleApplication {
       DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (!headless) {
+      vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
 
-    glfwDestroyWindow(window);
+    if (!headless) {
+      glfwDestroyWindow(window);
 
-    glfwTerminate();
+      glfwTerminate();
+    }
   }
 
   void recreateSwapChain() {
@@ -433,9 +482,12 @@ class HelloTriangleApplication {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount =
-        static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    // Without a surface there is nothing to present to
+    if (!headless) {
+      createInfo.enabledExtensionCount =
+          static_cast<uint32_t>(deviceExtensions.size());
+      createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    }
 
     if (enableValidationLayers) {
       createInfo.enabledLayerCount =
@@ -512,6 +564,30 @@ class HelloTriangleApplication {
     swapChainExtent = extent;
   }
 
+  // Stands in for createSwapChain() in headless mode: a single image the
+  // size of the texture, and the host visible buffer it is copied to
+  void createHeadlessTarget(const std::string& imageName) {
+    // Only the header, createTextureImage() decodes the pixels
+    PngDecoder decoder(imageName);
+    swapChainExtent = {decoder.width(), decoder.height()};
+    swapChainImageFormat = kHeadlessFormat;
+
+    createImage(swapChainExtent.width, swapChainExtent.height, 1,
+                kHeadlessFormat, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, headlessImage,
+                headlessImageMemory);
+    swapChainImages = {headlessImage};
+
+    createBuffer(static_cast<VkDeviceSize>(swapChainExtent.width) *
+                     swapChainExtent.height * 4,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 readbackBuffer, readbackBufferMemory);
+  }
+
   void createImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
 
@@ -530,7 +606,10 @@ class HelloTriangleApplication {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // In headless mode the image is copied out after the pass
+    colorAttachment.finalLayout = headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -549,14 +628,27 @@ class HelloTriangleApplication {
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+    // Headless, the copy into the readback buffer waits for the pass
+    VkSubpassDependency readbackDependency{};
+    readbackDependency.srcSubpass = 0;
+    readbackDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    readbackDependency.srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    readbackDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    readbackDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    readbackDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    const std::array<VkSubpassDependency, 2> dependencies = {
+        dependency, readbackDependency};
+
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     renderPassInfo.attachmentCount = 1;
     renderPassInfo.pAttachments = &colorAttachment;
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    renderPassInfo.dependencyCount = headless ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) !=
         VK_SUCCESS) {
@@ -752,25 +844,13 @@ class HelloTriangleApplication {
   }
 
   void createTextureImage(const std::string& imageName) {
-    // Load an decode an image.
-    png::image<png::rgb_pixel> image(imageName);
-    int texWidth = image.get_width();
-    int texHeight = image.get_height();
+    // Read the header only, the pixels are decoded into the staging buffer
+    PngDecoder decoder(imageName);
+    int texWidth = decoder.width();
+    int texHeight = decoder.height();
 
     VkDeviceSize imageSize = texWidth * texHeight * 4;
 
-    std::vector<uint8_t> pixels(image.get_width() * image.get_height() * 4);
-
-    ssize_t size_read = 0;
-    for (size_t y = 0; y < image.get_height(); ++y) {
-      for (size_t x = 0; x < image.get_width(); ++x) {
-        pixels[size_read++] = image[y][x].red;
-        pixels[size_read++] = image[y][x].green;
-        pixels[size_read++] = image[y][x].blue;
-        pixels[size_read++] = 0xFF;
-      }
-    }
-
     VkBuffer stagingBuffer = nullptr;
     VkDeviceMemory stagingBufferMemory = nullptr;
     createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
@@ -780,30 +860,134 @@ class HelloTriangleApplication {
 
     void* data = nullptr;
     vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels.data(), static_cast<size_t>(imageSize));
+    decoder.readRgba8(data, static_cast<size_t>(texWidth) * 4);
     vkUnmapMemory(device, stagingBufferMemory);
 
-    createImage(
-        texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+    // The full mip chain is blitted from level 0 on the device. sRGB
+    // images cannot be storage images, so where the format cannot be
+    // blitted with linear filtering the texture keeps a single level.
+    mipLevels = 1;
+    if (supportsLinearBlit(VK_FORMAT_R8G8B8A8_SRGB)) {
+      mipLevels = static_cast<uint32_t>(
+                      std::floor(std::log2(std::max(texWidth, texHeight)))) +
+                  1;
+    }
+
+    createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                textureImageMemory);
 
     transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                           VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
     copyBufferToImage(stagingBuffer, textureImage,
                       static_cast<uint32_t>(texWidth),
                       static_cast<uint32_t>(texHeight));
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    // Leaves every level in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    generateMipmaps(textureImage, texWidth, texHeight, mipLevels);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingBufferMemory, nullptr);
   }
 
+  bool supportsLinearBlit(VkFormat format) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format,
+                                        &formatProperties);
+
+    const VkFormatFeatureFlags blitFeatures =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & blitFeatures) ==
+           blitFeatures;
+  }
+
+  // Blits every level from the one before it, all in one command buffer.
+  // Level 0 must be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+  void generateMipmaps(VkImage image, int32_t texWidth, int32_t texHeight,
+                       uint32_t mipLevels) {
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange.levelCount = 1;
+
+    int32_t mipWidth = texWidth;
+    int32_t mipHeight = texHeight;
+
+    for (uint32_t i = 1; i < mipLevels; i++) {
+      barrier.subresourceRange.baseMipLevel = i - 1;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                           nullptr, 1, &barrier);
+
+      const int32_t nextWidth = mipWidth > 1 ? mipWidth / 2 : 1;
+      const int32_t nextHeight = mipHeight > 1 ? mipHeight / 2 : 1;
+
+      VkImageBlit blit{};
+      blit.srcOffsets[0] = {0, 0, 0};
+      blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+      blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.srcSubresource.mipLevel = i - 1;
+      blit.srcSubresource.baseArrayLayer = 0;
+      blit.srcSubresource.layerCount = 1;
+      blit.dstOffsets[0] = {0, 0, 0};
+      blit.dstOffsets[1] = {nextWidth, nextHeight, 1};
+      blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.dstSubresource.mipLevel = i;
+      blit.dstSubresource.baseArrayLayer = 0;
+      blit.dstSubresource.layerCount = 1;
+
+      vkCmdBlitImage(commandBuffer, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                     VK_FILTER_LINEAR);
+
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                           nullptr, 0, nullptr, 1, &barrier);
+
+      mipWidth = nextWidth;
+      mipHeight = nextHeight;
+    }
+
+    // The last level was only ever written
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    endSingleTimeCommands(commandBuffer);
+  }
+
   void createTextureImageView() {
-    textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+    textureImageView =
+        createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB, mipLevels);
   }
 
   void createTextureSampler() {
@@ -824,6 +1008,9 @@ class HelloTriangleApplication {
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(mipLevels);
+    samplerInfo.mipLodBias = 0.0f;
 
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) !=
         VK_SUCCESS) {
@@ -831,7 +1018,8 @@ class HelloTriangleApplication {
     }
   }
 
-  VkImageView createImageView(VkImage image, VkFormat format) {
+  VkImageView createImageView(VkImage image, VkFormat format,
+                              uint32_t mipLevels = 1) {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
@@ -839,7 +1027,7 @@ class HelloTriangleApplication {
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -852,7 +1040,8 @@ class HelloTriangleApplication {
     return imageView;
   }
 
-  void createImage(uint32_t width, uint32_t height, VkFormat format,
+  void createImage(uint32_t width, uint32_t height, uint32_t mipLevels,
+                   VkFormat format,
                    VkImageTiling tiling, VkImageUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkImage& image,
                    VkDeviceMemory& imageMemory) {
@@ -862,7 +1051,7 @@ class HelloTriangleApplication {
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -893,7 +1082,8 @@ class HelloTriangleApplication {
   }
 
   void transitionImageLayout(VkImage image, VkFormat  /*format*/,
-                             VkImageLayout oldLayout, VkImageLayout newLayout) {
+                             VkImageLayout oldLayout, VkImageLayout newLayout,
+                             uint32_t mipLevels) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
     VkImageMemoryBarrier barrier{};
@@ -905,7 +1095,7 @@ class HelloTriangleApplication {
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.levelCount = mipLevels;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
@@ -1210,6 +1400,10 @@ class HelloTriangleApplication {
 
       vkCmdEndRenderPass(commandBuffers[i]);
 
+      if (headless) {
+        recordReadback(commandBuffers[i]);
+      }
+
       if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
       }
@@ -1242,6 +1436,99 @@ class HelloTriangleApplication {
     }
   }
 
+  // The render pass leaves headlessImage in
+  // VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+  void recordReadback(VkCommandBuffer commandBuffer) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {swapChainExtent.width, swapChainExtent.height, 1};
+
+    vkCmdCopyImageToBuffer(commandBuffer, headlessImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           readbackBuffer, 1, &region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = readbackBuffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                         &barrier, 0, nullptr);
+  }
+
+  // Takes the place of mainLoop() in headless mode: renders
+  // headlessIterations frames one after the other, reports the time per
+  // frame and writes the last one to headlessOutput
+  void renderHeadless() {
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffers[0];
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < headlessIterations; i++) {
+      vkResetFences(device, 1, &inFlightFences[0]);
+      if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[0]) !=
+          VK_SUCCESS) {
+        throw std::runtime_error("failed to submit draw command buffer!");
+      }
+      vkWaitForFences(device, 1, &inFlightFences[0], VK_TRUE, UINT64_MAX);
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << headlessIterations << " frame(s) of " << swapChainExtent.width
+              << "x" << swapChainExtent.height << " in " << elapsed.count()
+              << " ms, " << elapsed.count() / headlessIterations
+              << " ms per frame" << std::endl;
+
+    saveReadback(headlessOutput);
+  }
+
+  // Writes the readback buffer, tightly packed RGBA, as a binary PPM
+  void saveReadback(const std::string& filename) {
+    const uint32_t width = swapChainExtent.width;
+    const uint32_t height = swapChainExtent.height;
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("failed to open " + filename + "!");
+    }
+    file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
+
+    const char* data = nullptr;
+    vkMapMemory(device, readbackBufferMemory, 0, VK_WHOLE_SIZE, 0,
+                (void**)&data);
+
+    // One write per row, alpha dropped
+    std::vector<char> row(static_cast<size_t>(width) * 3);
+    for (uint32_t y = 0; y < height; y++) {
+      const char* pixel = data + static_cast<size_t>(y) * width * 4;
+      for (uint32_t x = 0; x < width; x++) {
+        row[x * 3 + 0] = pixel[x * 4 + 0];
+        row[x * 3 + 1] = pixel[x * 4 + 1];
+        row[x * 3 + 2] = pixel[x * 4 + 2];
+      }
+      file.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+
+    vkUnmapMemory(device, readbackBufferMemory);
+    std::cout << "Saved " << filename << std::endl;
+  }
+
   void drawFrame() {
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
                     UINT64_MAX);
@@ -1404,10 +1691,11 @@ class HelloTriangleApplication {
   bool isDeviceSuitable(VkPhysicalDevice device) {
     QueueFamilyIndices indices = findQueueFamilies(device);
 
-    bool extensionsSupported = checkDeviceExtensionSupport(device);
+    // Headless, neither the swap chain extension nor a surface is needed
+    bool extensionsSupported = headless || checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless;
+    if (!headless && extensionsSupported) {
       SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
       swapChainAdequate = !swapChainSupport.formats.empty() &&
                           !swapChainSupport.presentModes.empty();
@@ -1457,7 +1745,13 @@ class HelloTriangleApplication {
       }
 
       VkBool32 presentSupport = false;
-      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+      if (headless) {
+        // Nothing is presented, the graphics queue stands in
+        presentSupport = indices.graphicsFamily == static_cast<uint32_t>(i);
+      } else {
+        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                             &presentSupport);
+      }
 
       if (presentSupport) {
         indices.presentFamily = i;
@@ -1474,12 +1768,14 @@ class HelloTriangleApplication {
   }
 
   std::vector<const char*> getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions = nullptr;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions,
-                                        glfwExtensions + glfwExtensionCount);
+    // Headless, GLFW is never initialized and there is no surface
+    std::vector<const char*> extensions;
+    if (!headless) {
+      uint32_t glfwExtensionCount = 0;
+      const char** glfwExtensions = nullptr;
+      glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+      extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (enableValidationLayers) {
       extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1544,12 +1840,33 @@ class HelloTriangleApplication {
 
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
-    std::cout << "Format to call: " << argv[0] << " PNG_image" << '\n';
+    std::cout << "Format to call: " << argv[0] << " PNG_image "
+              << "[--headless [--iterations N] [--output FILE]]" << '\n';
     return EXIT_FAILURE;
   }
 
   HelloTriangleApplication app;
 
+  bool headless = false;
+  uint32_t iterations = 1;
+  std::string outputName = "output.ppm";
+  for (int arg = 2; arg < argc; arg++) {
+    const std::string option = argv[arg];
+    if (option == "--headless") {
+      headless = true;
+    } else if (option == "--iterations" && arg + 1 < argc) {
+      iterations = static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--output" && arg + 1 < argc) {
+      outputName = argv[++arg];
+    } else {
+      std::cerr << "unknown option " << option << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (headless) {
+    app.setHeadless(iterations, outputName);
+  }
+
   try {
     app.run(argv[1]);
   } catch (const std::exception& e) {
@@ -0,0 +1,75 @@
+// A first in, first out queue with a fixed capacity, used to join the
+// stages of the batch pipeline. push() blocks while the queue is full, so a
+// slow stage holds back the stages in front of it instead of letting work
+// pile up in memory.
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Blocks until there is room. Returns false, dropping the item, when the
+  // queue has been closed.
+  bool push(T item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notFull_.wait(lock,
+                    [this]() { return closed_ || items_.size() < capacity_; });
+      if (closed_) {
+        return false;
+      }
+      items_.push_back(std::move(item));
+    }
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  // Blocks until there is an item. Returns false once the queue is closed
+  // and every item has been taken.
+  bool pop(T* item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notEmpty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+      if (items_.empty()) {
+        return false;
+      }
+      *item = std::move(items_.front());
+      items_.pop_front();
+    }
+    notFull_.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed: wakes every waiting consumer once the
+  // remaining items are gone
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    notEmpty_.notify_all();
+    notFull_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+  std::deque<T> items_;
+  size_t capacity_;
+  bool closed_ = false;
+};
+
+#endif  // BOUNDED_QUEUE_H
@@ -0,0 +1,480 @@
+// CPU implementation of the filter kernels: for images too small to be
+// worth a round trip to the GPU, for hosts without a usable Vulkan device,
+// and as the reference the GPU output is checked against. It follows the
+// shaders step by step: the same border policy, the same order of additions
+// and, for the separable filters, an intermediate image stored in the pixel
+// format between the passes. Every RGBA pixel is one 4 wide float vector
+// (SSE on x86, NEON on ARM); rows are split into bands on a WorkerPool.
+// Only the pixels within the radius of an edge go through the border
+// policy, the interior reads its neighbours directly.
+
+#ifndef CPU_FILTER_H
+#define CPU_FILTER_H
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPU_FILTER_SSE 1
+// Half conversions in registers, part of every AVX2 capable CPU
+#if defined(__F16C__)
+#include <immintrin.h>
+#define CPU_FILTER_F16C 1
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CPU_FILTER_NEON 1
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "filter_device.h"
+#include "pixel_format.h"
+#include "worker_pool.h"
+
+// One RGBA pixel in a SIMD register
+struct Float4 {
+#if defined(CPU_FILTER_SSE)
+  __m128 v;
+
+  static Float4 zero() { return {_mm_setzero_ps()}; }
+  static Float4 load(const Vec4& p) { return {_mm_loadu_ps(&p.x)}; }
+  void store(Vec4* p) const { _mm_storeu_ps(&p->x, v); }
+
+  Float4 operator+(Float4 rhs) const { return {_mm_add_ps(v, rhs.v)}; }
+  Float4 operator-(Float4 rhs) const { return {_mm_sub_ps(v, rhs.v)}; }
+  Float4 operator*(float rhs) const {
+    return {_mm_mul_ps(v, _mm_set1_ps(rhs))};
+  }
+  Float4 operator/(float rhs) const {
+    return {_mm_div_ps(v, _mm_set1_ps(rhs))};
+  }
+#elif defined(CPU_FILTER_NEON)
+  float32x4_t v;
+
+  static Float4 zero() { return {vdupq_n_f32(0.0f)}; }
+  static Float4 load(const Vec4& p) { return {vld1q_f32(&p.x)}; }
+  void store(Vec4* p) const { vst1q_f32(&p->x, v); }
+
+  Float4 operator+(Float4 rhs) const { return {vaddq_f32(v, rhs.v)}; }
+  Float4 operator-(Float4 rhs) const { return {vsubq_f32(v, rhs.v)}; }
+  Float4 operator*(float rhs) const { return {vmulq_n_f32(v, rhs)}; }
+  Float4 operator/(float rhs) const {
+    return {vdivq_f32(v, vdupq_n_f32(rhs))};
+  }
+#else
+  Vec4 v;
+
+  static Float4 zero() { return {{0.0f, 0.0f, 0.0f, 0.0f}}; }
+  static Float4 load(const Vec4& p) { return {p}; }
+  void store(Vec4* p) const { *p = v; }
+
+  Float4 operator+(Float4 rhs) const {
+    return {{v.x + rhs.v.x, v.y + rhs.v.y, v.z + rhs.v.z, v.w + rhs.v.w}};
+  }
+  Float4 operator-(Float4 rhs) const {
+    return {{v.x - rhs.v.x, v.y - rhs.v.y, v.z - rhs.v.z, v.w - rhs.v.w}};
+  }
+  Float4 operator*(float rhs) const {
+    return {{v.x * rhs, v.y * rhs, v.z * rhs, v.w * rhs}};
+  }
+  Float4 operator/(float rhs) const {
+    return {{v.x / rhs, v.y / rhs, v.z / rhs, v.w / rhs}};
+  }
+#endif
+
+  Float4& operator+=(Float4 rhs) { return *this = *this + rhs; }
+};
+
+// Pixel index of a buffer in format, unpacked in registers where the
+// instruction set can, with the results of loadPixel()
+inline Float4 loadFloat4(PixelFormat format, const void* pixels,
+                         size_t index) {
+#if defined(CPU_FILTER_SSE)
+  if (format == kPixelRgba8) {
+    int32_t bits;
+    memcpy(&bits, static_cast<const uint8_t*>(pixels) + 4 * index, 4);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bytes = _mm_cvtsi32_si128(bits);
+    const __m128i ints =
+        _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+    return {_mm_div_ps(_mm_cvtepi32_ps(ints), _mm_set1_ps(255.0f))};
+  }
+#endif
+#if defined(CPU_FILTER_F16C)
+  if (format == kPixelRgba16f) {
+    return {_mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(
+        static_cast<const uint16_t*>(pixels) + 4 * index)))};
+  }
+#endif
+  if (format == kPixelRgba32f) {
+    return Float4::load(static_cast<const Vec4*>(pixels)[index]);
+  }
+  return Float4::load(loadPixel(format, pixels, index));
+}
+
+// Stores value as pixel index of a buffer in format, packed like
+// storePixel() does
+inline void storeFloat4(PixelFormat format, void* pixels, size_t index,
+                        Float4 value) {
+#if defined(CPU_FILTER_SSE)
+  if (format == kPixelRgba8) {
+    const __m128 scaled = _mm_mul_ps(
+        _mm_min_ps(_mm_max_ps(value.v, _mm_setzero_ps()), _mm_set1_ps(1.0f)),
+        _mm_set1_ps(255.0f));
+    // Rounds halves up like std::lround(): truncated, plus one from .5 on
+    __m128i ints = _mm_cvttps_epi32(scaled);
+    const __m128 fraction = _mm_sub_ps(scaled, _mm_cvtepi32_ps(ints));
+    ints = _mm_sub_epi32(ints, _mm_castps_si128(_mm_cmpge_ps(
+                                   fraction, _mm_set1_ps(0.5f))));
+    const __m128i words = _mm_packs_epi32(ints, ints);
+    const int32_t bits = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    memcpy(static_cast<uint8_t*>(pixels) + 4 * index, &bits, 4);
+    return;
+  }
+#endif
+#if defined(CPU_FILTER_F16C)
+  if (format == kPixelRgba16f) {
+    _mm_storel_epi64(
+        reinterpret_cast<__m128i*>(static_cast<uint16_t*>(pixels) +
+                                   4 * index),
+        _mm_cvtps_ph(value.v, _MM_FROUND_TO_NEAREST_INT));
+    return;
+  }
+#endif
+  if (format == kPixelRgba32f) {
+    value.store(static_cast<Vec4*>(pixels) + index);
+    return;
+  }
+  Vec4 unpacked;
+  value.store(&unpacked);
+  storePixel(format, pixels, index, unpacked);
+}
+
+// The border policy of the shaders' fetch(): the index pixel i reads along
+// a line of size pixels, or -1 for transparent black
+inline int32_t mapBorder(int32_t i, int32_t size, BorderMode border) {
+  if (border == kBorderZero) {
+    if (i < 0 || i >= size) {
+      return -1;
+    }
+  } else if (border == kBorderMirror) {
+    i = std::abs(i);
+    i = std::min(i, 2 * size - 2 - i);
+  }
+  return std::min(std::max(i, 0), size - 1);
+}
+
+class CpuFilter {
+ public:
+  // Filters like kernel on the GPU with pixels stored in format. Per line
+  // separable kernels are box filters, the other separable kernels
+  // Gaussians and everything else the 3x3 box. 0 threads means one per
+  // hardware thread.
+  CpuFilter(const FilterKernel& kernel, PixelFormat format,
+            uint32_t threadCount = 0)
+      : pool_(threadCount),
+        separable_(kernel.separable),
+        perLine_(kernel.perLine),
+        format_(format) {}
+
+  CpuFilter(const CpuFilter&) = delete;
+  CpuFilter& operator=(const CpuFilter&) = delete;
+
+  void setBorder(BorderMode border) { border_ = border; }
+
+  // Radius of the separable kernels, clamped like FilterDevice::setRadius()
+  void setRadius(uint32_t radius) {
+    radius_ = std::min(radius, kMaxFilterRadius);
+    weights_ = getGaussianWeights(radius_);
+  }
+
+  uint32_t radius() const { return radius_; }
+  PixelFormat format() const { return format_; }
+  uint32_t pixelSize() const { return getPixelSize(format_); }
+  uint32_t threadCount() const { return pool_.threadCount(); }
+
+  // Filters the width x height image in input into output, both row major
+  // pixels in the filter's format
+  void run(const void* input, void* output, uint32_t width, uint32_t height) {
+    const PixelFormat format = format_;
+    const Vec4* pixels = toFloat(format, input, width, height, &input_);
+
+    if (!separable_) {
+      forEachBand(height, [&](uint32_t begin, uint32_t end) {
+        filter3x3(pixels, width, height, begin, end, format, output);
+      });
+      return;
+    }
+
+    // Both passes store their result in the pixel format, like the
+    // intermediate and output buffers on the GPU
+    intermediate_.resize(size_t{getPixelSize(format)} * width * height);
+    if (perLine_) {
+      forEachBand(height, [&](uint32_t begin, uint32_t end) {
+        boxRows(pixels, width, begin, end, format, intermediate_.data());
+      });
+      const Vec4* rows =
+          toFloat(format, intermediate_.data(), width, height, &input_);
+      forEachBand(width, [&](uint32_t begin, uint32_t end) {
+        boxColumns(rows, width, height, begin, end, format, output);
+      });
+    } else {
+      forEachBand(height, [&](uint32_t begin, uint32_t end) {
+        gaussianRows(pixels, width, begin, end, format, intermediate_.data());
+      });
+      const Vec4* rows =
+          toFloat(format, intermediate_.data(), width, height, &input_);
+      forEachBand(height, [&](uint32_t begin, uint32_t end) {
+        gaussianColumns(rows, width, height, begin, end, format, output);
+      });
+    }
+  }
+
+ private:
+  // Splits [0, count) into a few bands per thread and waits for all of them
+  void forEachBand(uint32_t count,
+                   const std::function<void(uint32_t, uint32_t)>& band) {
+    const uint32_t bandCount =
+        std::max(1u, std::min(count, 4 * pool_.threadCount()));
+    for (uint32_t i = 0; i < bandCount; i++) {
+      const uint32_t begin =
+          static_cast<uint32_t>(uint64_t{count} * i / bandCount);
+      const uint32_t end =
+          static_cast<uint32_t>(uint64_t{count} * (i + 1) / bandCount);
+      pool_.submit([&band, begin, end]() { band(begin, end); });
+    }
+    pool_.wait();
+  }
+
+  // The pixels as floats: rgba32f as is, the other formats unpacked into
+  // scratch
+  const Vec4* toFloat(PixelFormat format, const void* pixels, uint32_t width,
+                      uint32_t height, std::vector<Vec4>* scratch) {
+    if (format == kPixelRgba32f) {
+      return static_cast<const Vec4*>(pixels);
+    }
+
+    scratch->resize(size_t{width} * height);
+    forEachBand(height, [&](uint32_t begin, uint32_t end) {
+      for (size_t i = size_t{begin} * width; i < size_t{end} * width; i++) {
+        loadFloat4(format, pixels, i).store(&(*scratch)[i]);
+      }
+    });
+    return scratch->data();
+  }
+
+  static void store(PixelFormat format, void* pixels, size_t index,
+                    Float4 value) {
+    storeFloat4(format, pixels, index, value);
+  }
+
+  // Pixel i of a line whose pixels are stride apart, with the border policy
+  // applied along the line
+  Float4 fetch(const Vec4* line, int32_t i, int32_t length,
+               size_t stride) const {
+    const int32_t mapped = mapBorder(i, length, border_);
+    return mapped < 0 ? Float4::zero()
+                      : Float4::load(line[size_t(mapped) * stride]);
+  }
+
+  // simple_shader.comp, tiled_shader.comp and image_shader.comp
+  void filter3x3(const Vec4* pixels, uint32_t width, uint32_t height,
+                 uint32_t begin, uint32_t end, PixelFormat format,
+                 void* output) const {
+    const int32_t w = static_cast<int32_t>(width);
+    const int32_t h = static_cast<int32_t>(height);
+    for (int32_t y = static_cast<int32_t>(begin);
+         y < static_cast<int32_t>(end); y++) {
+      // Rows above, at and below y, null for transparent black
+      const Vec4* rows[3];
+      for (int32_t dy = -1; dy <= 1; dy++) {
+        const int32_t row = mapBorder(y + dy, h, border_);
+        rows[dy + 1] = row < 0 ? nullptr : pixels + size_t(row) * width;
+      }
+
+      const auto filterEdge = [&](int32_t x) {
+        Float4 sum = Float4::zero();
+        for (int32_t dy = 0; dy < 3; dy++) {
+          for (int32_t dx = -1; dx <= 1; dx++) {
+            sum += rows[dy] == nullptr ? Float4::zero()
+                                       : fetch(rows[dy], x + dx, w, 1);
+          }
+        }
+        store(format, output, size_t(y) * width + x, sum / 9.0f);
+      };
+
+      filterEdge(0);
+      for (int32_t x = 1; x < w - 1; x++) {
+        Float4 sum = Float4::zero();
+        for (int32_t dy = 0; dy < 3; dy++) {
+          for (int32_t dx = -1; dx <= 1; dx++) {
+            sum += rows[dy] == nullptr ? Float4::zero()
+                                       : Float4::load(rows[dy][x + dx]);
+          }
+        }
+        store(format, output, size_t(y) * width + x, sum / 9.0f);
+      }
+      if (w > 1) {
+        filterEdge(w - 1);
+      }
+    }
+  }
+
+  // box_shader.comp, horizontal pass
+  void boxRows(const Vec4* pixels, uint32_t width, uint32_t begin,
+               uint32_t end, PixelFormat format, void* output) const {
+    const int32_t length = static_cast<int32_t>(width);
+    const int32_t radius = static_cast<int32_t>(radius_);
+    const float scale = 1.0f / static_cast<float>(2 * radius + 1);
+    for (uint32_t y = begin; y < end; y++) {
+      const Vec4* line = pixels + size_t{y} * width;
+      Float4 sum = Float4::zero();
+      for (int32_t i = -radius; i <= radius; i++) {
+        sum += fetch(line, i, length, 1);
+      }
+      const auto slide = [&](int32_t i, Float4 entering, Float4 leaving) {
+        store(format, output, size_t{y} * width + i, sum * scale);
+        sum += entering - leaving;
+      };
+
+      // The window is inside the line for i in [radius, length - radius - 1)
+      int32_t i = 0;
+      for (; i < std::min(radius, length); i++) {
+        slide(i, fetch(line, i + radius + 1, length, 1),
+              fetch(line, i - radius, length, 1));
+      }
+      for (; i < length - radius - 1; i++) {
+        slide(i, Float4::load(line[i + radius + 1]),
+              Float4::load(line[i - radius]));
+      }
+      for (; i < length; i++) {
+        slide(i, fetch(line, i + radius + 1, length, 1),
+              fetch(line, i - radius, length, 1));
+      }
+    }
+  }
+
+  // box_shader.comp, vertical pass over the columns [begin, end). The
+  // columns advance together one row at a time, so memory is read row by
+  // row; every column still sees the additions of the shader in order.
+  void boxColumns(const Vec4* pixels, uint32_t width, uint32_t height,
+                  uint32_t begin, uint32_t end, PixelFormat format,
+                  void* output) const {
+    const int32_t length = static_cast<int32_t>(height);
+    const int32_t radius = static_cast<int32_t>(radius_);
+    const float scale = 1.0f / static_cast<float>(2 * radius + 1);
+
+    std::vector<Float4> sums(end - begin, Float4::zero());
+    for (int32_t i = -radius; i <= radius; i++) {
+      for (uint32_t x = begin; x < end; x++) {
+        sums[x - begin] += fetch(pixels + x, i, length, width);
+      }
+    }
+    for (int32_t i = 0; i < length; i++) {
+      if (i >= radius && i < length - radius - 1) {
+        const Vec4* entering = pixels + size_t(i + radius + 1) * width;
+        const Vec4* leaving = pixels + size_t(i - radius) * width;
+        for (uint32_t x = begin; x < end; x++) {
+          Float4& sum = sums[x - begin];
+          store(format, output, size_t(i) * width + x, sum * scale);
+          sum += Float4::load(entering[x]) - Float4::load(leaving[x]);
+        }
+        continue;
+      }
+
+      for (uint32_t x = begin; x < end; x++) {
+        Float4& sum = sums[x - begin];
+        store(format, output, size_t(i) * width + x, sum * scale);
+        sum += fetch(pixels + x, i + radius + 1, length, width) -
+               fetch(pixels + x, i - radius, length, width);
+      }
+    }
+  }
+
+  // gaussian_shader.comp, horizontal pass
+  void gaussianRows(const Vec4* pixels, uint32_t width, uint32_t begin,
+                    uint32_t end, PixelFormat format, void* output) const {
+    const int32_t length = static_cast<int32_t>(width);
+    const int32_t radius = static_cast<int32_t>(radius_);
+    for (uint32_t y = begin; y < end; y++) {
+      const Vec4* line = pixels + size_t{y} * width;
+      const auto filterEdge = [&](int32_t x) {
+        Float4 sum = fetch(line, x, length, 1) * weights_[0];
+        for (int32_t k = 1; k <= radius; k++) {
+          sum += (fetch(line, x - k, length, 1) +
+                  fetch(line, x + k, length, 1)) *
+                 weights_[k];
+        }
+        store(format, output, size_t{y} * width + x, sum);
+      };
+
+      // The neighbours are inside the line for x in [radius, length - radius)
+      int32_t x = 0;
+      for (; x < std::min(radius, length); x++) {
+        filterEdge(x);
+      }
+      for (; x < length - radius; x++) {
+        Float4 sum = Float4::load(line[x]) * weights_[0];
+        for (int32_t k = 1; k <= radius; k++) {
+          sum += (Float4::load(line[x - k]) + Float4::load(line[x + k])) *
+                 weights_[k];
+        }
+        store(format, output, size_t{y} * width + x, sum);
+      }
+      for (; x < length; x++) {
+        filterEdge(x);
+      }
+    }
+  }
+
+  // gaussian_shader.comp, vertical pass over the rows [begin, end)
+  void gaussianColumns(const Vec4* pixels, uint32_t width, uint32_t height,
+                       uint32_t begin, uint32_t end, PixelFormat format,
+                       void* output) const {
+    const int32_t length = static_cast<int32_t>(height);
+    const int32_t radius = static_cast<int32_t>(radius_);
+    for (int32_t y = static_cast<int32_t>(begin);
+         y < static_cast<int32_t>(end); y++) {
+      if (y >= radius && y < length - radius) {
+        const Vec4* row = pixels + size_t(y) * width;
+        for (uint32_t x = 0; x < width; x++) {
+          Float4 sum = Float4::load(row[x]) * weights_[0];
+          for (int32_t k = 1; k <= radius; k++) {
+            sum += (Float4::load((row - size_t(k) * width)[x]) +
+                    Float4::load((row + size_t(k) * width)[x])) *
+                   weights_[k];
+          }
+          store(format, output, size_t(y) * width + x, sum);
+        }
+        continue;
+      }
+
+      for (uint32_t x = 0; x < width; x++) {
+        const Vec4* column = pixels + x;
+        Float4 sum = fetch(column, y, length, width) * weights_[0];
+        for (int32_t k = 1; k <= radius; k++) {
+          sum += (fetch(column, y - k, length, width) +
+                  fetch(column, y + k, length, width)) *
+                 weights_[k];
+        }
+        store(format, output, size_t(y) * width + x, sum);
+      }
+    }
+  }
+
+  WorkerPool pool_;
+  bool separable_;
+  bool perLine_;
+  PixelFormat format_;
+  BorderMode border_ = kBorderClamp;
+  uint32_t radius_ = 1;
+  std::vector<float> weights_ = getGaussianWeights(1);
+  std::vector<Vec4> input_;
+  std::vector<uint8_t> intermediate_;
+};
+
+#endif  // CPU_FILTER_H
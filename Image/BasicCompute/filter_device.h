@@ -0,0 +1,2425 @@
+// One Vulkan device set up to run the image filter: logical device, compute
+// pipeline, descriptor sets, command buffer and host visible pixel buffers.
+// The buffers only grow, so one FilterDevice can process images or image
+// bands of different sizes without being recreated. Pixels are stored in
+// the PixelFormat chosen at init(), see pixel_format.h.
+//
+// Everything an image needs while it is in flight (pixel buffers,
+// descriptor sets, command buffer and fence) lives in a slot. With more
+// than one slot, images can be written to one slot, filtered in another
+// and read back from a third at the same time, see submit() and wait().
+
+#ifndef FILTER_DEVICE_H
+#define FILTER_DEVICE_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "filter_graph.h"
+#include "gpu_profiler.h"
+#include "histogram.h"
+#include "image_pyramid.h"
+#include "integral_image.h"
+#include "pixel_format.h"
+#include "workgroup_tuner.h"
+
+// How the filter reads pixels outside the image. Values match the kBorder*
+// constants in the shaders.
+enum BorderMode : uint32_t {
+  kBorderClamp = 0,   // repeat the edge pixel
+  kBorderMirror = 1,  // reflect around the edge pixel: -1 reads 1
+  kBorderZero = 2,    // transparent black
+};
+
+inline bool parseBorderMode(const char* name, BorderMode* border) {
+  const std::string value = name;
+  if (value == "clamp") {
+    *border = kBorderClamp;
+  } else if (value == "mirror") {
+    *border = kBorderMirror;
+  } else if (value == "zero") {
+    *border = kBorderZero;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Format of the images the image kernels use for each pixel format. The
+// texel layout matches the buffer layout, so the pixels are copied as is.
+inline VkFormat getPixelVkFormat(PixelFormat format) {
+  switch (format) {
+    case kPixelRgba16f:
+      return VK_FORMAT_R16G16B16A16_SFLOAT;
+    case kPixelRgba8:
+      return VK_FORMAT_R8G8B8A8_UNORM;
+    default:
+      return VK_FORMAT_R32G32B32A32_SFLOAT;
+  }
+}
+
+// Largest radius of the separable filters
+const uint32_t kMaxFilterRadius = 256;
+
+// Invocations per workgroup of integral_shader.comp, the minimum of
+// maxComputeWorkGroupInvocations
+const uint32_t kIntegralGroupSize = 128;
+
+// Invocations per workgroup of histogram_shader.comp
+const uint32_t kHistogramGroupSize = 128;
+
+// Pixels each invocation of the histogram pass counts, at least. Fewer
+// workgroups mean fewer shared histograms to merge into the global one.
+const uint32_t kHistogramPixelsPerInvocation = 32;
+
+// Invocations per workgroup of mix_shader.comp
+const uint32_t kMixGroupSize = 128;
+// The tone and mix shaders get the pixel count in a 32 bit push constant,
+// so they take images of at most this many pixels
+const uint64_t kMaxCountedPixels = 0xffffffff;
+
+struct ImageConstantData {
+  uint32_t width;
+  uint32_t height;
+  uint32_t border;
+  uint32_t radius;     // separable kernels only
+  uint32_t direction;  // separable kernels only: 0 horizontal, 1 vertical
+  uint32_t level;      // image kernels only: level of the input pyramid
+};
+
+// Normalized weights of a Gaussian with sigma = radius / 3: weights[k] is
+// applied to the pixels k to the left and right of the center, so that
+// weights[0] + 2 * (weights[1] + ... + weights[radius]) is 1.
+inline std::vector<float> getGaussianWeights(uint32_t radius) {
+  const double sigma = std::max(radius / 3.0, 0.5);
+  std::vector<double> weights(radius + 1);
+  double sum = 0.0;
+  for (uint32_t k = 0; k <= radius; k++) {
+    weights[k] = std::exp(-0.5 * k * k / (sigma * sigma));
+    sum += k == 0 ? weights[k] : 2.0 * weights[k];
+  }
+
+  std::vector<float> normalized(radius + 1);
+  for (uint32_t k = 0; k <= radius; k++) {
+    normalized[k] = static_cast<float>(weights[k] / sum);
+  }
+  return normalized;
+}
+
+// A compiled filter shader. tileHalo is the halo, in pixels, of the shared
+// memory tile the kernel loads per workgroup, 0 when it reads global memory
+// directly; it limits the workgroup sizes the kernel can run with.
+// Separable kernels run a horizontal and a vertical pass through an
+// intermediate buffer and take their radius from FilterDevice::setRadius(),
+// the others are fixed 3x3 filters. Per line kernels run one invocation per
+// row or column instead of one per pixel. Every kernel reads and writes the
+// pixel format given by specialization constant 3. Image kernels are 3x3
+// filters that sample an optimally tiled copy of the input and write a
+// storage image instead of the buffers; FilterDevice copies the pixels
+// between the buffers and the images around the dispatch.
+struct FilterKernel {
+  std::string name;
+  std::vector<char> code;
+  uint32_t tileHalo = 0;
+  bool separable = false;
+  bool perLine = false;
+  bool imageIo = false;
+
+  uint32_t sharedMemorySize(const WorkgroupSize& size) const {
+    if (tileHalo == 0) {
+      return 0;
+    }
+    return sizeof(Vec4) * (size.x + 2 * tileHalo) * (size.y + 2 * tileHalo);
+  }
+};
+
+class FilterDevice {
+ public:
+  // Separable kernels run two passes
+  static constexpr uint32_t kMaxPasses = 2;
+
+  // format is the storage format of input(), output() and, for separable
+  // kernels, of the intermediate buffer between the passes. With profile
+  // set every submission is timed on the GPU, see profiler(). slotCount is
+  // the number of images that can be in flight at once.
+  VkResult init(VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex,
+                const FilterKernel& kernel, PixelFormat format,
+                bool profile = false, uint32_t slotCount = 1) {
+    physicalDevice_ = physicalDevice;
+    queueFamilyIndex_ = queueFamilyIndex;
+    format_ = format;
+    // Everything but the code, which is only needed for the shader module
+    kernel_.name = kernel.name;
+    kernel_.tileHalo = kernel.tileHalo;
+    kernel_.separable = kernel.separable;
+    kernel_.perLine = kernel.perLine;
+    kernel_.imageIo = kernel.imageIo;
+
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties_);
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties_);
+
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+
+    VkPhysicalDeviceFeatures enabledFeatures{};
+    enabledFeatures.pipelineStatisticsQuery =
+        profile ? supportedFeatures.pipelineStatisticsQuery : VK_FALSE;
+
+    if (kernel_.imageIo) {
+      // The kernel writes its storage image without a format qualifier, so
+      // one shader serves every pixel format
+      if (!supportedFeatures.shaderStorageImageWriteWithoutFormat) {
+        return VK_ERROR_FEATURE_NOT_PRESENT;
+      }
+      enabledFeatures.shaderStorageImageWriteWithoutFormat = VK_TRUE;
+
+      VkFormatProperties formatProperties;
+      vkGetPhysicalDeviceFormatProperties(
+          physicalDevice, getPixelVkFormat(format_), &formatProperties);
+      const VkFormatFeatureFlags requiredFeatures =
+          VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+          VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT |
+          VK_FORMAT_FEATURE_TRANSFER_SRC_BIT |
+          VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+      if ((formatProperties.optimalTilingFeatures & requiredFeatures) !=
+          requiredFeatures) {
+        return VK_ERROR_FORMAT_NOT_SUPPORTED;
+      }
+    }
+
+    const float queuePrioritory = 1.0f;
+    const VkDeviceQueueCreateInfo deviceQueueCreateInfo = {
+        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        nullptr,
+        0,
+        queueFamilyIndex,
+        1,
+        &queuePrioritory};
+
+    const VkDeviceCreateInfo deviceCreateInfo = {
+        VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        nullptr,
+        0,
+        1,
+        &deviceQueueCreateInfo,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        &enabledFeatures};
+
+    VkResult result =
+        vkCreateDevice(physicalDevice, &deviceCreateInfo, nullptr, &device_);
+    if (result != VK_SUCCESS) return result;
+
+    vkGetDeviceQueue(device_, queueFamilyIndex, 0, &queue_);
+
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0,
+        kernel.code.size(), (const uint32_t*)kernel.code.data()};
+
+    result = vkCreateShaderModule(device_, &shaderModuleCreateInfo, nullptr,
+                                  &shaderModule_);
+    if (result != VK_SUCCESS) return result;
+
+    // Input, output and the filter weights
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {
+        {0, inputDescriptorType(), 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {1, outputDescriptorType(), 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr}};
+
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 3,
+        descriptorSetLayoutBindings};
+
+    result =
+        vkCreateDescriptorSetLayout(device_, &descriptorSetLayoutCreateInfo,
+                                    nullptr, &descriptorSetLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(ImageConstantData),
+    };
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .setLayoutCount = 1,
+        .pSetLayouts = &descriptorSetLayout_,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    result = vkCreatePipelineLayout(device_, &pipelineLayoutCreateInfo, nullptr,
+                                    &pipelineLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    slotCount = std::max(slotCount, 1u);
+    slots_.resize(slotCount);
+    const uint32_t setCount = kMaxPasses * slotCount;
+
+    // One set per pass and slot
+    const VkDescriptorPoolSize descriptorPoolSizes[3] = {
+        {inputDescriptorType(), setCount},
+        {outputDescriptorType(), setCount},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, setCount}};
+
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        setCount,
+        3,
+        descriptorPoolSizes};
+
+    result = vkCreateDescriptorPool(device_, &descriptorPoolCreateInfo, nullptr,
+                                    &descriptorPool_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorSetLayout descriptorSetLayouts[kMaxPasses] = {
+        descriptorSetLayout_, descriptorSetLayout_};
+
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+        descriptorPool_, kMaxPasses, descriptorSetLayouts};
+
+    for (Slot& slot : slots_) {
+      result = vkAllocateDescriptorSets(device_, &descriptorSetAllocateInfo,
+                                        slot.descriptorSets);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    result = createBuffer(sizeof(float) * (kMaxFilterRadius + 1), &weights_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorBufferInfo weightsDescriptorBufferInfo = {
+        weights_.buffer, 0, VK_WHOLE_SIZE};
+
+    for (const Slot& slot : slots_) {
+      for (const VkDescriptorSet descriptorSet : slot.descriptorSets) {
+        const VkWriteDescriptorSet writeDescriptorSet = {
+            VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            nullptr,
+            descriptorSet,
+            2,
+            0,
+            1,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            nullptr,
+            &weightsDescriptorBufferInfo,
+            nullptr};
+
+        vkUpdateDescriptorSets(device_, 1, &writeDescriptorSet, 0, nullptr);
+      }
+    }
+
+    setRadius(1);
+
+    if (kernel_.imageIo) {
+      // texelFetch ignores filtering and addressing, any sampler will do
+      const VkSamplerCreateInfo samplerCreateInfo = {
+          .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+          .magFilter = VK_FILTER_NEAREST,
+          .minFilter = VK_FILTER_NEAREST,
+          .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+          .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+          .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+          .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      };
+
+      result = vkCreateSampler(device_, &samplerCreateInfo, nullptr,
+                               &sampler_);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr,
+        VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT, queueFamilyIndex};
+
+    result = vkCreateCommandPool(device_, &commandPoolCreateInfo, nullptr,
+                                 &commandPool_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, commandPool_,
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1};
+
+    const VkFenceCreateInfo fenceCreateInfo = {
+        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0};
+
+    for (Slot& slot : slots_) {
+      result = vkAllocateCommandBuffers(device_, &commandBufferAllocateInfo,
+                                        &slot.commandBuffer);
+      if (result != VK_SUCCESS) return result;
+
+      result = vkCreateFence(device_, &fenceCreateInfo, nullptr, &slot.fence);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    if (profile) {
+      // One query frame per slot
+      result = profiler_.init(
+          physicalDevice, device_, queueFamilyIndex, slotCount, 1,
+          enabledFeatures.pipelineStatisticsQuery
+              ? VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT
+              : 0);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    workgroupSize_ =
+        getDefaultWorkgroupSize(properties_.limits, dimensions());
+    return createPipeline();
+  }
+
+  void destroy() {
+    if (device_ == VK_NULL_HANDLE) {
+      return;
+    }
+
+    vkDeviceWaitIdle(device_);
+
+    for (Slot& slot : slots_) {
+      destroyBuffer(&slot.input);
+      destroyBuffer(&slot.output);
+      destroyBuffer(&slot.intermediate);
+      destroyImage(&slot.inputImage);
+      destroyImage(&slot.outputImage);
+      destroyBuffer(&slot.scratch);
+      destroyBuffer(&slot.integral);
+      destroyBuffer(&slot.histogram);
+      destroyBuffer(&slot.curve);
+      vkDestroyFence(device_, slot.fence, nullptr);
+    }
+    destroyBuffer(&weights_);
+    for (GraphNodeState& state : graphNodes_) {
+      vkDestroyPipeline(device_, state.kernel.pipeline, nullptr);
+      vkDestroyShaderModule(device_, state.kernel.shaderModule, nullptr);
+      destroyBuffer(&state.weights);
+      destroyBuffer(&state.histogram);
+      destroyBuffer(&state.curve);
+    }
+    for (MappedBuffer& buffer : graphBuffers_) {
+      destroyBuffer(&buffer);
+    }
+    vkDestroyDescriptorPool(device_, graphDescriptorPool_, nullptr);
+    vkDestroyPipeline(device_, mixPipeline_, nullptr);
+    vkDestroyPipelineLayout(device_, mixPipelineLayout_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, mixDescriptorSetLayout_, nullptr);
+    vkDestroyShaderModule(device_, mixShaderModule_, nullptr);
+    for (const VkPipeline pipeline : integralPipelines_) {
+      vkDestroyPipeline(device_, pipeline, nullptr);
+    }
+    vkDestroyPipelineLayout(device_, integralPipelineLayout_, nullptr);
+    vkDestroyDescriptorPool(device_, integralDescriptorPool_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, integralDescriptorSetLayout_,
+                                 nullptr);
+    vkDestroyShaderModule(device_, integralShaderModule_, nullptr);
+    vkDestroyPipeline(device_, tonePipeline_, nullptr);
+    vkDestroyPipelineLayout(device_, tonePipelineLayout_, nullptr);
+    vkDestroyDescriptorPool(device_, toneDescriptorPool_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, toneDescriptorSetLayout_, nullptr);
+    vkDestroyShaderModule(device_, toneShaderModule_, nullptr);
+    vkDestroyPipeline(device_, downsamplePipeline_, nullptr);
+    vkDestroyPipelineLayout(device_, downsamplePipelineLayout_, nullptr);
+    vkDestroyDescriptorPool(device_, downsampleDescriptorPool_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, downsampleDescriptorSetLayout_,
+                                 nullptr);
+    vkDestroyShaderModule(device_, downsampleShaderModule_, nullptr);
+    vkDestroySampler(device_, sampler_, nullptr);
+    profiler_.destroy();
+    vkDestroyCommandPool(device_, commandPool_, nullptr);
+    vkDestroyDescriptorPool(device_, descriptorPool_, nullptr);
+    vkDestroyPipeline(device_, pipeline_, nullptr);
+    vkDestroyPipelineLayout(device_, pipelineLayout_, nullptr);
+    vkDestroyDescriptorSetLayout(device_, descriptorSetLayout_, nullptr);
+    vkDestroyShaderModule(device_, shaderModule_, nullptr);
+    vkDestroyDevice(device_, nullptr);
+
+    *this = FilterDevice{};
+  }
+
+  const VkPhysicalDeviceProperties& properties() const { return properties_; }
+
+  const WorkgroupSize& workgroupSize() const { return workgroupSize_; }
+
+  const std::string& kernelName() const { return kernel_.name; }
+
+  PixelFormat format() const { return format_; }
+
+  uint32_t pixelSize() const { return getPixelSize(format_); }
+
+  uint32_t slotCount() const { return static_cast<uint32_t>(slots_.size()); }
+
+  // Device memory reserve() allocates per pixel and slot: input, output
+  // and, for separable kernels, the intermediate buffer
+  VkDeviceSize slotBytesPerPixel() const {
+    return VkDeviceSize{pixelSize()} * (kernel_.separable ? 3 : 2);
+  }
+
+  // Largest image one submit() can filter whatever the workgroup size: the
+  // dispatch stays within maxComputeWorkGroupCount even with one invocation
+  // per workgroup, every pixel buffer within maxStorageBufferRange and the
+  // images of image kernels within maxImageDimension2D.
+  void getMaxRunExtent(uint32_t* width, uint32_t* height,
+                       uint64_t* pixels) const {
+    const VkPhysicalDeviceLimits& limits = properties_.limits;
+    // Per line kernels dispatch rows and then columns along x
+    *width = limits.maxComputeWorkGroupCount[0];
+    *height = kernel_.perLine ? limits.maxComputeWorkGroupCount[0]
+                              : limits.maxComputeWorkGroupCount[1];
+    *pixels = limits.maxStorageBufferRange / pixelSize();
+    if (kernel_.imageIo) {
+      *width = std::min(*width, limits.maxImageDimension2D);
+      *height = std::min(*height, limits.maxImageDimension2D);
+    }
+    if (pyramid_) {
+      const uint32_t maxPyramidSize = 1u << (kMaxPyramidLevels - 1);
+      *width = std::min(*width, maxPyramidSize);
+      *height = std::min(*height, maxPyramidSize);
+    }
+    if (integral_) {
+      // One workgroup per row, and 16 bytes per entry of the table
+      *height = std::min(*height, limits.maxComputeWorkGroupCount[0]);
+      *pixels = std::min<uint64_t>(*pixels,
+                                   limits.maxStorageBufferRange / sizeof(Vec4));
+    }
+  }
+
+  void setBorder(BorderMode border) { border_ = border; }
+
+  // Radius of the separable kernels, clamped to kMaxFilterRadius. Must not
+  // be called while any slot is in flight.
+  void setRadius(uint32_t radius) {
+    radius_ = std::min(radius, kMaxFilterRadius);
+
+    const std::vector<float> weights = getGaussianWeights(radius_);
+    memcpy(weights_.mapped, weights.data(), sizeof(float) * weights.size());
+  }
+
+  // Pixels of context the filter reads on each side of a pixel
+  uint32_t radius() const { return kernel_.separable ? radius_ : 1; }
+
+  const GpuProfiler& profiler() const { return profiler_; }
+
+  // Makes sure input(slot) and output(slot) hold at least width x height
+  // pixels. Growing invalidates previously returned pointers of the slot.
+  // Different slots can be reserved from different threads.
+  VkResult reserve(uint32_t width, uint32_t height, uint32_t slotIndex = 0) {
+    Slot& slot = slots_[slotIndex];
+    if (kernel_.imageIo && (width > slot.inputImage.width ||
+                            height > slot.inputImage.height)) {
+      VkResult result = wait(slotIndex);
+      if (result != VK_SUCCESS) return result;
+
+      // Images have a fixed extent: grow both sides to cover every shape
+      // reserved so far
+      result = reserveImages(&slot, std::max(width, slot.inputImage.width),
+                             std::max(height, slot.inputImage.height));
+      if (result != VK_SUCCESS) return result;
+    }
+
+    // With a pyramid, output() takes every level
+    const VkDeviceSize size =
+        pixelSize() * (pyramid_ ? getPyramidPixelCount(width, height)
+                                : VkDeviceSize{width} * height);
+    if (size <= slot.capacity) {
+      return VK_SUCCESS;
+    }
+
+    if (slot.pending) {
+      VkResult result = wait(slotIndex);
+      if (result != VK_SUCCESS) return result;
+    }
+    destroyBuffer(&slot.input);
+    destroyBuffer(&slot.output);
+    destroyBuffer(&slot.intermediate);
+    destroyBuffer(&slot.integral);
+    slot.capacity = 0;
+
+    VkResult result = createBuffer(size, &slot.input);
+    if (result != VK_SUCCESS) return result;
+
+    result = createBuffer(size, &slot.output);
+    if (result != VK_SUCCESS) return result;
+
+    if (integral_) {
+      result = createBuffer(sizeof(Vec4) * (size / pixelSize()),
+                            &slot.integral);
+      if (result != VK_SUCCESS) return result;
+
+      updateDescriptorSet(slot.integralDescriptorSet, slot.input,
+                          slot.integral);
+    }
+
+    if (tone_) {
+      // Bindings 2 and 3 do not change, see initHistogram()
+      updateDescriptorSet(slot.toneDescriptorSet, slot.input, slot.output);
+    }
+
+    if (!graph_.nodes.empty() && slotIndex == 0) {
+      result = reserveGraph(size);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    if (kernel_.imageIo) {
+      // The descriptors point at the images, see reserveImages()
+    } else if (kernel_.separable) {
+      result = createBuffer(size, &slot.intermediate);
+      if (result != VK_SUCCESS) return result;
+
+      // The horizontal pass writes the intermediate buffer, the vertical
+      // pass reads it
+      updateDescriptorSet(slot.descriptorSets[0], slot.input,
+                          slot.intermediate);
+      updateDescriptorSet(slot.descriptorSets[1], slot.intermediate,
+                          slot.output);
+    } else {
+      updateDescriptorSet(slot.descriptorSets[0], slot.input, slot.output);
+    }
+
+    slot.capacity = size;
+    return VK_SUCCESS;
+  }
+
+  // Row major pixels in format(), see storeRgb8() and storePixel()
+  void* input(uint32_t slot = 0) { return slots_[slot].input.mapped; }
+
+  const void* output(uint32_t slot = 0) const {
+    return slots_[slot].output.mapped;
+  }
+
+  // After initIntegral(): the summed-area table of the last runIntegral(),
+  // see integral_image.h
+  const void* integral(uint32_t slot = 0) const {
+    return slots_[slot].integral.mapped;
+  }
+
+  // After initHistogram(): the histograms of the last runTone(), as
+  // countHistogram() in histogram.h returns them
+  const uint32_t* histogram(uint32_t slot = 0) const {
+    return static_cast<const uint32_t*>(slots_[slot].histogram.mapped);
+  }
+
+  // Uses the workgroup size tuned for this device and kernel. With autotune
+  // set the candidates are timed on a width x height image (reserve() must
+  // have been called for it) and the result is stored in the cache file.
+  VkResult selectWorkgroupSize(bool autotune, const char* cachePath,
+                               uint32_t width, uint32_t height) {
+    // Packed formats move less memory per invocation and can prefer
+    // different sizes
+    const std::string workgroupCacheKey = getWorkgroupCacheKey(
+        properties_, ("BasicCompute." + kernel_.name + "." +
+                      getPixelFormatName(format_))
+                         .c_str());
+
+    WorkgroupSize workgroupSize =
+        getDefaultWorkgroupSize(properties_.limits, dimensions());
+    WorkgroupSize cachedSize{};
+    if (autotune) {
+      const ImageConstantData push{width, height, border_, radius_, 0};
+      // Image kernels time their copies too, the same for every size
+      const auto recordFilter = [this, push](VkCommandBuffer commandBuffer,
+                                             VkPipeline pipeline,
+                                             const WorkgroupSize& size) {
+        recordUpload(commandBuffer, slots_[0], push.width, push.height);
+        record(commandBuffer, pipeline, slots_[0].descriptorSets, size, push);
+        recordDownload(commandBuffer, slots_[0], push.width, push.height);
+      };
+
+      const VkResult result = autotuneWorkgroupSize(
+          physicalDevice_, device_, queue_, queueFamilyIndex_, pipelineLayout_,
+          shaderModule_, "main", getWorkgroupSizeCandidates(), recordFilter,
+          &workgroupSize, 5, {format_});
+      if (result != VK_SUCCESS) return result;
+
+      storeTunedWorkgroupSize(cachePath, workgroupCacheKey, workgroupSize);
+    } else if (loadTunedWorkgroupSize(cachePath, workgroupCacheKey,
+                                      &cachedSize) &&
+               fitsWorkgroupLimits(properties_.limits, cachedSize) &&
+               fitsSharedMemory(cachedSize)) {
+      workgroupSize = cachedSize;
+    }
+
+    if (workgroupSize.x == workgroupSize_.x &&
+        workgroupSize.y == workgroupSize_.y &&
+        workgroupSize.z == workgroupSize_.z) {
+      return VK_SUCCESS;
+    }
+
+    workgroupSize_ = workgroupSize;
+    vkDestroyPipeline(device_, pipeline_, nullptr);
+    pipeline_ = VK_NULL_HANDLE;
+    return createPipeline();
+  }
+
+  // Filters the width x height image in input() into output() and waits for
+  // the result.
+  VkResult run(uint32_t width, uint32_t height) {
+    VkResult result = submit(width, height, 0);
+    if (result != VK_SUCCESS) return result;
+
+    result = wait(0);
+    if (result != VK_SUCCESS) return result;
+
+    profiler_.collect();
+    return VK_SUCCESS;
+  }
+
+  // Starts filtering the width x height image in input(slot) into
+  // output(slot) without waiting for it. Only one thread may submit; it is
+  // also the only one that touches the profiler.
+  VkResult submit(uint32_t width, uint32_t height, uint32_t slotIndex) {
+    Slot& slot = slots_[slotIndex];
+
+    // Results of earlier submissions, before this one reuses the queries
+    profiler_.collect();
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+    VkResult result =
+        vkBeginCommandBuffer(slot.commandBuffer, &commandBufferBeginInfo);
+    if (result != VK_SUCCESS) return result;
+
+    // One read and one write of every pixel per pass
+    const double bytes = 2.0 * passCount() * pixelSize() * width * height;
+
+    // The GPU time of image kernels leaves out their copies
+    profiler_.beginFrame(slot.commandBuffer, slotIndex);
+    recordUpload(slot.commandBuffer, slot, width, height);
+    profiler_.beginScope(slot.commandBuffer, slotIndex, 0,
+                         kernel_.name.c_str(), bytes);
+    record(slot.commandBuffer, pipeline_, slot.descriptorSets, workgroupSize_,
+           ImageConstantData{width, height, border_, radius_, 0});
+    profiler_.endScope(slot.commandBuffer, slotIndex, 0);
+    recordDownload(slot.commandBuffer, slot, width, height);
+
+    return endAndSubmit(&slot);
+  }
+
+  // Image kernels: lets runPyramid() filter every level of a mip chain
+  // built from the input on the device. The chain is blitted with linear
+  // filtering where the format allows it, otherwise, or with preferCompute
+  // set, downsampleCode (downsample_shader.comp) builds it in one dispatch.
+  // Must be called before the first reserve().
+  VkResult initPyramid(const std::vector<char>& downsampleCode,
+                       bool preferCompute) {
+    if (!kernel_.imageIo) {
+      return VK_ERROR_FEATURE_NOT_PRESENT;
+    }
+    pyramid_ = true;
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(
+        physicalDevice_, getPixelVkFormat(format_), &formatProperties);
+    const VkFormatFeatureFlags blitFeatures =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    pyramidBlit_ = !preferCompute &&
+                   (formatProperties.optimalTilingFeatures & blitFeatures) ==
+                       blitFeatures;
+    if (pyramidBlit_) {
+      return VK_SUCCESS;
+    }
+
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0,
+        downsampleCode.size(), (const uint32_t*)downsampleCode.data()};
+
+    VkResult result = vkCreateShaderModule(device_, &shaderModuleCreateInfo,
+                                           nullptr, &downsampleShaderModule_);
+    if (result != VK_SUCCESS) return result;
+
+    // Level 0, the levels after it and the scratch buffer
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {
+        {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1,
+         VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, kMaxPyramidLevels - 1,
+         VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr}};
+
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 3,
+        descriptorSetLayoutBindings};
+
+    result = vkCreateDescriptorSetLayout(device_,
+                                         &descriptorSetLayoutCreateInfo,
+                                         nullptr,
+                                         &downsampleDescriptorSetLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // Width, height and level count
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = 3 * sizeof(uint32_t),
+    };
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .setLayoutCount = 1,
+        .pSetLayouts = &downsampleDescriptorSetLayout_,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    result = vkCreatePipelineLayout(device_, &pipelineLayoutCreateInfo,
+                                    nullptr, &downsamplePipelineLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // The shader declares its own workgroup size
+    const VkComputePipelineCreateInfo computePipelineCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage =
+            {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = downsampleShaderModule_,
+                .pName = "main",
+            },
+        .layout = downsamplePipelineLayout_,
+    };
+
+    result = vkCreateComputePipelines(device_, VK_NULL_HANDLE, 1,
+                                      &computePipelineCreateInfo, nullptr,
+                                      &downsamplePipeline_);
+    if (result != VK_SUCCESS) return result;
+
+    const uint32_t setCount = slotCount();
+    const VkDescriptorPoolSize descriptorPoolSizes[3] = {
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, setCount},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+         (kMaxPyramidLevels - 1) * setCount},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, setCount}};
+
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        setCount,
+        3,
+        descriptorPoolSizes};
+
+    result = vkCreateDescriptorPool(device_, &descriptorPoolCreateInfo,
+                                    nullptr, &downsampleDescriptorPool_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+        downsampleDescriptorPool_, 1, &downsampleDescriptorSetLayout_};
+
+    for (Slot& slot : slots_) {
+      result = vkAllocateDescriptorSets(device_, &descriptorSetAllocateInfo,
+                                        &slot.downsampleDescriptorSet);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    return VK_SUCCESS;
+  }
+
+  // How the mip chains of runPyramid() are built, see initPyramid()
+  bool pyramidUsesBlit() const { return pyramidBlit_; }
+
+  // Image kernels after initPyramid(): uploads the width x height image in
+  // input() once, builds its mip chain on the device and filters every
+  // level into output(), packed as described in image_pyramid.h. Waits for
+  // the result.
+  VkResult runPyramid(uint32_t width, uint32_t height) {
+    Slot& slot = slots_[0];
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+    VkResult result =
+        vkBeginCommandBuffer(slot.commandBuffer, &commandBufferBeginInfo);
+    if (result != VK_SUCCESS) return result;
+
+    recordPyramid(slot.commandBuffer, slot, width, height);
+
+    const uint32_t levelCount = getPyramidLevelCount(width, height);
+    for (uint32_t level = 0; level < levelCount; level++) {
+      const uint32_t levelWidth = getPyramidLevelSize(width, level);
+      const uint32_t levelHeight = getPyramidLevelSize(height, level);
+
+      // Every level is filtered into the corner of the output image, once
+      // the copy of the level before is done with it
+      recordImageBarrier(
+          slot.commandBuffer, slot.outputImage.image, 0,
+          VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+          VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+      ImageConstantData push{levelWidth, levelHeight, border_, radius_, 0};
+      push.level = level;
+      record(slot.commandBuffer, pipeline_, slot.descriptorSets,
+             workgroupSize_, push);
+
+      recordImageBarrier(
+          slot.commandBuffer, slot.outputImage.image,
+          VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+          VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+          VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+      VkBufferImageCopy region = getImageRegion(levelWidth, levelHeight);
+      region.bufferOffset =
+          pixelSize() * getPyramidLevelOffset(width, height, level);
+      vkCmdCopyImageToBuffer(slot.commandBuffer, slot.outputImage.image,
+                             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                             slot.output.buffer, 1, &region);
+    }
+
+    const VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                           nullptr,
+                                           VK_ACCESS_TRANSFER_WRITE_BIT,
+                                           VK_ACCESS_HOST_READ_BIT};
+
+    vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    result = endAndSubmit(&slot);
+    if (result != VK_SUCCESS) return result;
+
+    return wait(0);
+  }
+
+  // Lets runIntegral() build summed-area tables of the input. subgroupCode
+  // is integral_shader.comp built with SUBGROUP_SCAN, used where the device
+  // has subgroup arithmetic in compute shaders unless preferShared is set;
+  // sharedCode is the shared memory build. Must be called before the first
+  // reserve().
+  VkResult initIntegral(const std::vector<char>& subgroupCode,
+                        const std::vector<char>& sharedCode,
+                        bool preferShared) {
+    integral_ = true;
+    integralSubgroups_ =
+        !preferShared &&
+        supportsSubgroupOperations(VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+    const std::vector<char>& code =
+        integralSubgroups_ ? subgroupCode : sharedCode;
+
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0, code.size(),
+        (const uint32_t*)code.data()};
+
+    VkResult result = vkCreateShaderModule(device_, &shaderModuleCreateInfo,
+                                           nullptr, &integralShaderModule_);
+    if (result != VK_SUCCESS) return result;
+
+    // Input pixels and the table
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2] = {
+        {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr}};
+
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 2,
+        descriptorSetLayoutBindings};
+
+    result = vkCreateDescriptorSetLayout(device_,
+                                         &descriptorSetLayoutCreateInfo,
+                                         nullptr,
+                                         &integralDescriptorSetLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // Width, height and direction
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = 3 * sizeof(uint32_t),
+    };
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .setLayoutCount = 1,
+        .pSetLayouts = &integralDescriptorSetLayout_,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    result = vkCreatePipelineLayout(device_, &pipelineLayoutCreateInfo,
+                                    nullptr, &integralPipelineLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // One pipeline per accumulation, the image size picks one per run. The
+    // shader declares its own workgroup size.
+    for (uint32_t accumulation = 0; accumulation < 2; accumulation++) {
+      result = createComputePipelineWithWorkgroupSize(
+          device_, integralPipelineLayout_, integralShaderModule_, "main",
+          WorkgroupSize{kIntegralGroupSize, 1, 1},
+          &integralPipelines_[accumulation], {format_, accumulation});
+      if (result != VK_SUCCESS) return result;
+    }
+
+    const uint32_t setCount = slotCount();
+    const VkDescriptorPoolSize descriptorPoolSize = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * setCount};
+
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        setCount,
+        1,
+        &descriptorPoolSize};
+
+    result = vkCreateDescriptorPool(device_, &descriptorPoolCreateInfo,
+                                    nullptr, &integralDescriptorPool_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+        integralDescriptorPool_, 1, &integralDescriptorSetLayout_};
+
+    for (Slot& slot : slots_) {
+      result = vkAllocateDescriptorSets(device_, &descriptorSetAllocateInfo,
+                                        &slot.integralDescriptorSet);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    return VK_SUCCESS;
+  }
+
+  // How the rows of runIntegral() are scanned, see initIntegral()
+  bool integralUsesSubgroups() const { return integralSubgroups_; }
+
+  // After initIntegral(): builds the summed-area table of the width x
+  // height image in input() into integral(), summing as accumulation says
+  // (see getIntegralAccumulation(); kIntegralUint32 needs rgba8 pixels),
+  // and waits for the result.
+  VkResult runIntegral(uint32_t width, uint32_t height,
+                       IntegralAccumulation accumulation) {
+    Slot& slot = slots_[0];
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+    VkResult result =
+        vkBeginCommandBuffer(slot.commandBuffer, &commandBufferBeginInfo);
+    if (result != VK_SUCCESS) return result;
+
+    vkCmdBindPipeline(slot.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      integralPipelines_[accumulation]);
+    vkCmdBindDescriptorSets(slot.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            integralPipelineLayout_, 0, 1,
+                            &slot.integralDescriptorSet, 0, nullptr);
+
+    // One workgroup per row, then one invocation per column
+    uint32_t push[3] = {width, height, 0};
+    vkCmdPushConstants(slot.commandBuffer, integralPipelineLayout_,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+    vkCmdDispatch(slot.commandBuffer, height, 1, 1);
+
+    const VkMemoryBarrier shaderBarrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+    vkCmdPipelineBarrier(slot.commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &shaderBarrier, 0, nullptr, 0, nullptr);
+
+    push[2] = 1;
+    vkCmdPushConstants(slot.commandBuffer, integralPipelineLayout_,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+    vkCmdDispatch(slot.commandBuffer,
+                  (width + kIntegralGroupSize - 1) / kIntegralGroupSize, 1, 1);
+
+    const VkMemoryBarrier hostBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                         nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+                                         VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(slot.commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    result = endAndSubmit(&slot);
+    if (result != VK_SUCCESS) return result;
+
+    return wait(0);
+  }
+
+  // Lets runTone() count histograms of the input and map it through the
+  // tone curve built from them, with binCount bins per channel, at most
+  // kMaxHistogramBins. subgroupCode is histogram_shader.comp built with
+  // SUBGROUP_VOTE, used where the device has subgroup vote and ballot in
+  // compute shaders unless preferShared is set; sharedCode is the shared
+  // memory build. Must be called before the first reserve().
+  VkResult initHistogram(const std::vector<char>& subgroupCode,
+                         const std::vector<char>& sharedCode,
+                         uint32_t binCount, bool preferShared) {
+    tone_ = true;
+    binCount_ = std::min(std::max(binCount, 2u), kMaxHistogramBins);
+    toneSubgroups_ = !preferShared &&
+                     supportsSubgroupOperations(
+                         VK_SUBGROUP_FEATURE_VOTE_BIT |
+                         VK_SUBGROUP_FEATURE_BALLOT_BIT);
+    const std::vector<char>& code = toneSubgroups_ ? subgroupCode : sharedCode;
+
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0, code.size(),
+        (const uint32_t*)code.data()};
+
+    VkResult result = vkCreateShaderModule(device_, &shaderModuleCreateInfo,
+                                           nullptr, &toneShaderModule_);
+    if (result != VK_SUCCESS) return result;
+
+    // Input pixels, output pixels, histograms and tone curves
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[4] = {
+        {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr}};
+
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 4,
+        descriptorSetLayoutBindings};
+
+    result = vkCreateDescriptorSetLayout(device_,
+                                         &descriptorSetLayoutCreateInfo,
+                                         nullptr, &toneDescriptorSetLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // Pixel count, pass, mode and clip
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = 4 * sizeof(uint32_t),
+    };
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .setLayoutCount = 1,
+        .pSetLayouts = &toneDescriptorSetLayout_,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    result = vkCreatePipelineLayout(device_, &pipelineLayoutCreateInfo,
+                                    nullptr, &tonePipelineLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // One pipeline for the three passes, the push constants pick one
+    result = createComputePipelineWithWorkgroupSize(
+        device_, tonePipelineLayout_, toneShaderModule_, "main",
+        WorkgroupSize{kHistogramGroupSize, 1, 1}, &tonePipeline_,
+        {format_, binCount_});
+    if (result != VK_SUCCESS) return result;
+
+    const uint32_t setCount = slotCount();
+    const VkDescriptorPoolSize descriptorPoolSize = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * setCount};
+
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        setCount,
+        1,
+        &descriptorPoolSize};
+
+    result = vkCreateDescriptorPool(device_, &descriptorPoolCreateInfo,
+                                    nullptr, &toneDescriptorPool_);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+        toneDescriptorPool_, 1, &toneDescriptorSetLayout_};
+
+    const VkDeviceSize tableSize =
+        sizeof(uint32_t) * kHistogramChannels * binCount_;
+    for (Slot& slot : slots_) {
+      result = vkAllocateDescriptorSets(device_, &descriptorSetAllocateInfo,
+                                        &slot.toneDescriptorSet);
+      if (result != VK_SUCCESS) return result;
+
+      result = createBuffer(tableSize, &slot.histogram);
+      if (result != VK_SUCCESS) return result;
+
+      result = createBuffer(tableSize, &slot.curve);
+      if (result != VK_SUCCESS) return result;
+
+      // The pixel buffers follow in reserve()
+      const VkDescriptorBufferInfo histogramBufferInfo = {
+          slot.histogram.buffer, 0, VK_WHOLE_SIZE};
+      const VkDescriptorBufferInfo curveBufferInfo = {slot.curve.buffer, 0,
+                                                      VK_WHOLE_SIZE};
+
+      const VkWriteDescriptorSet writeDescriptorSet[2] = {
+          {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+           slot.toneDescriptorSet, 2, 0, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+           nullptr, &histogramBufferInfo, nullptr},
+          {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+           slot.toneDescriptorSet, 3, 0, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+           nullptr, &curveBufferInfo, nullptr}};
+
+      vkUpdateDescriptorSets(device_, 2, writeDescriptorSet, 0, nullptr);
+    }
+
+    return VK_SUCCESS;
+  }
+
+  // How runTone() merges the counts of a subgroup, see initHistogram()
+  bool histogramUsesSubgroups() const { return toneSubgroups_; }
+
+  // After initHistogram(): counts the histograms of the pixelCount pixels in
+  // input() into histogram(), builds the tone curves mode asks for and maps
+  // the pixels through them into output(), all in one submission, and waits
+  // for the result. clip is the share of pixels kToneAutoLevels ignores at
+  // either end of each channel. Returns VK_ERROR_OUT_OF_DEVICE_MEMORY for
+  // more than kMaxCountedPixels pixels.
+  VkResult runTone(uint64_t pixelCount, ToneMode mode, float clip) {
+    if (pixelCount > kMaxCountedPixels) {
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    Slot& slot = slots_[0];
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+    VkResult result =
+        vkBeginCommandBuffer(slot.commandBuffer, &commandBufferBeginInfo);
+    if (result != VK_SUCCESS) return result;
+
+    vkCmdFillBuffer(slot.commandBuffer, slot.histogram.buffer, 0,
+                    VK_WHOLE_SIZE, 0);
+
+    const VkMemoryBarrier fillBarrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+    vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &fillBarrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(slot.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      tonePipeline_);
+    vkCmdBindDescriptorSets(slot.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            tonePipelineLayout_, 0, 1, &slot.toneDescriptorSet,
+                            0, nullptr);
+
+    const VkMemoryBarrier shaderBarrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+
+    for (uint32_t pass = 0; pass < 3; pass++) {
+      if (pass > 0) {
+        vkCmdPipelineBarrier(slot.commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &shaderBarrier, 0, nullptr, 0, nullptr);
+      }
+
+      uint32_t push[4] = {static_cast<uint32_t>(pixelCount), pass, mode, 0};
+      memcpy(&push[3], &clip, sizeof(float));
+      vkCmdPushConstants(slot.commandBuffer, tonePipelineLayout_,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+      vkCmdDispatch(slot.commandBuffer, getToneGroupCount(pixelCount, pass),
+                    1, 1);
+    }
+
+    const VkMemoryBarrier hostBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                         nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+                                         VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(slot.commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    result = endAndSubmit(&slot);
+    if (result != VK_SUCCESS) return result;
+
+    return wait(0);
+  }
+
+  // Lets runGraph() run graph on the input, see filter_graph.h. kernels are
+  // the kernels the filter nodes name, mixCode is mix_shader.comp and the
+  // histogram codes are those of initHistogram(), which tone nodes use with
+  // kDefaultHistogramBins bins unless it was called before. The main kernel
+  // of init() must not be an image kernel. Must be called before the first
+  // reserve().
+  VkResult initGraph(const FilterGraph& graph,
+                     const std::vector<FilterKernel>& kernels,
+                     const std::vector<char>& mixCode,
+                     const std::vector<char>& histogramSubgroupCode,
+                     const std::vector<char>& histogramSharedCode) {
+    if (kernel_.imageIo) {
+      return VK_ERROR_FEATURE_NOT_PRESENT;
+    }
+    graph_ = graph;
+    graphSchedule_ = scheduleFilterGraph(graph_);
+    graphNodes_.resize(graph_.nodes.size());
+
+    VkResult result = VK_SUCCESS;
+    bool hasMix = false;
+    for (size_t n = 0; n < graph_.nodes.size(); n++) {
+      GraphNode& node = graph_.nodes[n];
+      GraphNodeState& state = graphNodes_[n];
+      if (node.op == kGraphMix) {
+        hasMix = true;
+      } else if (node.op == kGraphTone) {
+        if (!tone_) {
+          result = initHistogram(histogramSubgroupCode, histogramSharedCode,
+                                 kDefaultHistogramBins, false);
+          if (result != VK_SUCCESS) return result;
+        }
+
+        const VkDeviceSize tableSize =
+            sizeof(uint32_t) * kHistogramChannels * binCount_;
+        result = createBuffer(tableSize, &state.histogram);
+        if (result != VK_SUCCESS) return result;
+
+        result = createBuffer(tableSize, &state.curve);
+        if (result != VK_SUCCESS) return result;
+      } else {
+        const auto kernel =
+            std::find_if(kernels.begin(), kernels.end(),
+                         [&node](const FilterKernel& candidate) {
+                           return candidate.name == node.kernel;
+                         });
+        if (kernel == kernels.end() || kernel->imageIo) {
+          return VK_ERROR_INITIALIZATION_FAILED;
+        }
+        result = createGraphKernel(*kernel, &state.kernel);
+        if (result != VK_SUCCESS) return result;
+
+        // Separable nodes get weights of their own radius
+        node.radius = std::min(node.radius, kMaxFilterRadius);
+        if (kernel->separable) {
+          result = createBuffer(sizeof(float) * (kMaxFilterRadius + 1),
+                                &state.weights);
+          if (result != VK_SUCCESS) return result;
+
+          const std::vector<float> weights = getGaussianWeights(node.radius);
+          memcpy(state.weights.mapped, weights.data(),
+                 sizeof(float) * weights.size());
+        }
+      }
+    }
+
+    if (hasMix) {
+      result = createMixPipeline(mixCode);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    // One set per step
+    const uint32_t setCount =
+        static_cast<uint32_t>(graphSchedule_.steps.size());
+    const VkDescriptorPoolSize descriptorPoolSize = {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * setCount};
+
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        nullptr,
+        0,
+        setCount,
+        1,
+        &descriptorPoolSize};
+
+    result = vkCreateDescriptorPool(device_, &descriptorPoolCreateInfo,
+                                    nullptr, &graphDescriptorPool_);
+    if (result != VK_SUCCESS) return result;
+
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts;
+    for (const GraphStep& step : graphSchedule_.steps) {
+      const GraphOp op = graph_.nodes[step.node].op;
+      descriptorSetLayouts.push_back(op == kGraphTone ? toneDescriptorSetLayout_
+                                     : op == kGraphMix
+                                         ? mixDescriptorSetLayout_
+                                         : descriptorSetLayout_);
+    }
+
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr,
+        graphDescriptorPool_, setCount, descriptorSetLayouts.data()};
+
+    graphDescriptorSets_.resize(setCount);
+    return vkAllocateDescriptorSets(device_, &descriptorSetAllocateInfo,
+                                    graphDescriptorSets_.data());
+  }
+
+  // The steps, waves and buffers of the graph of initGraph()
+  const GraphSchedule& graphSchedule() const { return graphSchedule_; }
+
+  // After initGraph(): runs the graph on the width x height image in
+  // input(), every step in one command buffer with a barrier between
+  // waves, and waits for the result. input() does not survive it. Returns
+  // VK_ERROR_OUT_OF_DEVICE_MEMORY for more than kMaxCountedPixels pixels.
+  VkResult runGraph(uint32_t width, uint32_t height) {
+    const uint64_t pixelCount = uint64_t{width} * height;
+    if (pixelCount > kMaxCountedPixels) {
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    Slot& slot = slots_[0];
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+
+    VkResult result =
+        vkBeginCommandBuffer(slot.commandBuffer, &commandBufferBeginInfo);
+    if (result != VK_SUCCESS) return result;
+
+    // Every histogram is cleared up front, behind a single barrier
+    bool cleared = false;
+    for (const GraphNodeState& state : graphNodes_) {
+      if (state.histogram.buffer != VK_NULL_HANDLE) {
+        vkCmdFillBuffer(slot.commandBuffer, state.histogram.buffer, 0,
+                        VK_WHOLE_SIZE, 0);
+        cleared = true;
+      }
+    }
+    if (cleared) {
+      const VkMemoryBarrier fillBarrier = {
+          VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+          VK_ACCESS_TRANSFER_WRITE_BIT,
+          VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+      vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                           &fillBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    // Writes become visible to the next wave, which may also write buffers
+    // the last one read
+    const VkMemoryBarrier shaderBarrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+
+    for (size_t k = 0; k < graphSchedule_.steps.size(); k++) {
+      const GraphStep& step = graphSchedule_.steps[k];
+      if (k > 0 && step.wave != graphSchedule_.steps[k - 1].wave) {
+        vkCmdPipelineBarrier(slot.commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &shaderBarrier, 0, nullptr, 0, nullptr);
+      }
+      recordGraphStep(slot.commandBuffer, step, graphDescriptorSets_[k],
+                      width, height, static_cast<uint32_t>(pixelCount));
+    }
+
+    const VkMemoryBarrier hostBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                         nullptr, VK_ACCESS_SHADER_WRITE_BIT,
+                                         VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(slot.commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0,
+                         nullptr, 0, nullptr);
+
+    result = endAndSubmit(&slot);
+    if (result != VK_SUCCESS) return result;
+
+    return wait(0);
+  }
+
+  // After runGraph(): output k of the graph, the result of
+  // graphSchedule().outputNodes[k]
+  const void* graphOutput(uint32_t output) const {
+    return graphBuffer(graphSchedule_.outputBuffers[output]).mapped;
+  }
+
+  // Waits until the last submit() of the slot has finished, after which
+  // output(slot) holds the result and the slot can be written again.
+  VkResult wait(uint32_t slotIndex) {
+    Slot& slot = slots_[slotIndex];
+    if (!slot.pending) {
+      return VK_SUCCESS;
+    }
+
+    VkResult result =
+        vkWaitForFences(device_, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+    if (result != VK_SUCCESS) return result;
+
+    slot.pending = false;
+    return vkResetFences(device_, 1, &slot.fence);
+  }
+
+  // Folds the GPU times of finished submissions into profiler(). Must not
+  // race with submit().
+  void collectProfile() { profiler_.collect(); }
+
+ private:
+  struct MappedBuffer {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    void* mapped = nullptr;
+  };
+
+  struct DeviceImage {
+    VkImage image = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;  // every level
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t levelCount = 1;
+    // One view per level, for the compute downsampler only
+    std::vector<VkImageView> levelViews;
+  };
+
+  struct Slot {
+    MappedBuffer input;
+    MappedBuffer output;
+    MappedBuffer intermediate;
+    VkDeviceSize capacity = 0;
+    DeviceImage inputImage;   // image kernels only
+    DeviceImage outputImage;  // image kernels only
+    MappedBuffer scratch;     // compute downsampler only
+    MappedBuffer integral;    // after initIntegral() only
+    MappedBuffer histogram;   // after initHistogram() only
+    MappedBuffer curve;       // after initHistogram() only
+    VkDescriptorSet descriptorSets[kMaxPasses] = {};
+    VkDescriptorSet downsampleDescriptorSet = VK_NULL_HANDLE;
+    VkDescriptorSet integralDescriptorSet = VK_NULL_HANDLE;
+    VkDescriptorSet toneDescriptorSet = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    bool pending = false;  // submitted and not waited for yet
+  };
+
+  // Pipeline of the filter kernel of a graph node
+  struct GraphKernel {
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    WorkgroupSize size{1, 1, 1};
+    bool perLine = false;
+  };
+
+  // What a graph node needs besides the buffers of its images
+  struct GraphNodeState {
+    GraphKernel kernel;      // filter nodes only
+    MappedBuffer weights;    // separable filter nodes only
+    MappedBuffer histogram;  // tone nodes only
+    MappedBuffer curve;      // tone nodes only
+  };
+
+  void updateDescriptorSet(VkDescriptorSet descriptorSet,
+                           const MappedBuffer& input,
+                           const MappedBuffer& output) {
+    const VkDescriptorBufferInfo in_descriptorBufferInfo = {input.buffer, 0,
+                                                            VK_WHOLE_SIZE};
+
+    const VkDescriptorBufferInfo out_descriptorBufferInfo = {output.buffer, 0,
+                                                             VK_WHOLE_SIZE};
+
+    const VkWriteDescriptorSet writeDescriptorSet[2] = {
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, descriptorSet, 0, 0,
+         1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr,
+         &in_descriptorBufferInfo, nullptr},
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, descriptorSet, 1, 0,
+         1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr,
+         &out_descriptorBufferInfo, nullptr}};
+
+    vkUpdateDescriptorSets(device_, 2, writeDescriptorSet, 0, nullptr);
+  }
+
+  uint32_t passCount() const { return kernel_.separable ? 2 : 1; }
+
+  // Workgroups of a pass of the histogram shader. The histogram and mapping
+  // passes stride over the image, so their counts only have to stay within
+  // the limit.
+  uint32_t getToneGroupCount(uint64_t pixelCount, uint32_t pass) const {
+    if (pass == 1) {
+      return 1;
+    }
+    const uint32_t pixelsPerGroup =
+        pass == 0 ? kHistogramGroupSize * kHistogramPixelsPerInvocation
+                  : kHistogramGroupSize;
+    return static_cast<uint32_t>(std::min<uint64_t>(
+        1 + (pixelCount - 1) / pixelsPerGroup,
+        properties_.limits.maxComputeWorkGroupCount[0]));
+  }
+
+  // Buffer index of graphSchedule(): 0 and 1 are the input and output of
+  // slot 0, the others belong to the graph
+  const MappedBuffer& graphBuffer(uint32_t index) const {
+    if (index < 2) {
+      return index == 0 ? slots_[0].input : slots_[0].output;
+    }
+    return graphBuffers_[index - 2];
+  }
+
+  // Pipeline of a filter node, with the default workgroup size and the
+  // layout of the main kernel
+  VkResult createGraphKernel(const FilterKernel& kernel,
+                             GraphKernel* graphKernel) {
+    graphKernel->perLine = kernel.perLine;
+    graphKernel->size = getDefaultWorkgroupSize(properties_.limits,
+                                                kernel.perLine ? 1 : 2);
+
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0,
+        kernel.code.size(), (const uint32_t*)kernel.code.data()};
+
+    VkResult result = vkCreateShaderModule(device_, &shaderModuleCreateInfo,
+                                           nullptr,
+                                           &graphKernel->shaderModule);
+    if (result != VK_SUCCESS) return result;
+
+    return createComputePipelineWithWorkgroupSize(
+        device_, pipelineLayout_, graphKernel->shaderModule, "main",
+        graphKernel->size, &graphKernel->pipeline, {format_});
+  }
+
+  VkResult createMixPipeline(const std::vector<char>& code) {
+    const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
+        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0, code.size(),
+        (const uint32_t*)code.data()};
+
+    VkResult result = vkCreateShaderModule(device_, &shaderModuleCreateInfo,
+                                           nullptr, &mixShaderModule_);
+    if (result != VK_SUCCESS) return result;
+
+    // First input, output and second input
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {
+        {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr},
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
+         nullptr}};
+
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 3,
+        descriptorSetLayoutBindings};
+
+    result = vkCreateDescriptorSetLayout(device_,
+                                         &descriptorSetLayoutCreateInfo,
+                                         nullptr, &mixDescriptorSetLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // Pixel count and the two weights
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = 3 * sizeof(uint32_t),
+    };
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .setLayoutCount = 1,
+        .pSetLayouts = &mixDescriptorSetLayout_,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    result = vkCreatePipelineLayout(device_, &pipelineLayoutCreateInfo,
+                                    nullptr, &mixPipelineLayout_);
+    if (result != VK_SUCCESS) return result;
+
+    // The shader declares its own workgroup size
+    return createComputePipelineWithWorkgroupSize(
+        device_, mixPipelineLayout_, mixShaderModule_, "main",
+        WorkgroupSize{kMixGroupSize, 1, 1}, &mixPipeline_, {format_});
+  }
+
+  // Grows the buffers of the graph to size bytes each and points the
+  // descriptor sets of the steps at them
+  VkResult reserveGraph(VkDeviceSize size) {
+    graphBuffers_.resize(std::max(graphSchedule_.bufferCount, 2u) - 2);
+    for (MappedBuffer& buffer : graphBuffers_) {
+      destroyBuffer(&buffer);
+      VkResult result = createBuffer(size, &buffer);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    for (size_t k = 0; k < graphSchedule_.steps.size(); k++) {
+      const GraphStep& step = graphSchedule_.steps[k];
+      const GraphNode& node = graph_.nodes[step.node];
+      const GraphNodeState& state = graphNodes_[step.node];
+      const VkDescriptorSet descriptorSet = graphDescriptorSets_[k];
+
+      // Tone steps all bind the buffers of the last one, only it writes
+      // the output
+      uint32_t input = step.inputs[0];
+      uint32_t output = step.output;
+      if (node.op == kGraphTone) {
+        const GraphStep& last =
+            *std::find_if(graphSchedule_.steps.begin(),
+                          graphSchedule_.steps.end(),
+                          [&step](const GraphStep& candidate) {
+                            return candidate.node == step.node &&
+                                   candidate.pass == 2;
+                          });
+        input = last.inputs[0];
+        output = last.output;
+      }
+
+      updateDescriptorSet(descriptorSet, graphBuffer(input),
+                          graphBuffer(output));
+
+      VkDescriptorBufferInfo extraBufferInfos[2] = {};
+      uint32_t extraCount = 1;
+      if (node.op == kGraphMix) {
+        extraBufferInfos[0] = {graphBuffer(step.inputs[1]).buffer, 0,
+                               VK_WHOLE_SIZE};
+      } else if (node.op == kGraphTone) {
+        extraBufferInfos[0] = {state.histogram.buffer, 0, VK_WHOLE_SIZE};
+        extraBufferInfos[1] = {state.curve.buffer, 0, VK_WHOLE_SIZE};
+        extraCount = 2;
+      } else {
+        const MappedBuffer& weights =
+            state.weights.buffer != VK_NULL_HANDLE ? state.weights : weights_;
+        extraBufferInfos[0] = {weights.buffer, 0, VK_WHOLE_SIZE};
+      }
+
+      VkWriteDescriptorSet writeDescriptorSets[2];
+      for (uint32_t e = 0; e < extraCount; e++) {
+        writeDescriptorSets[e] = {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                  nullptr,
+                                  descriptorSet,
+                                  2 + e,
+                                  0,
+                                  1,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                  nullptr,
+                                  &extraBufferInfos[e],
+                                  nullptr};
+      }
+      vkUpdateDescriptorSets(device_, extraCount, writeDescriptorSets, 0,
+                             nullptr);
+    }
+    return VK_SUCCESS;
+  }
+
+  void recordGraphStep(VkCommandBuffer commandBuffer, const GraphStep& step,
+                       VkDescriptorSet descriptorSet, uint32_t width,
+                       uint32_t height, uint32_t pixelCount) const {
+    const GraphNode& node = graph_.nodes[step.node];
+    const GraphNodeState& state = graphNodes_[step.node];
+
+    if (node.op == kGraphTone) {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        tonePipeline_);
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              tonePipelineLayout_, 0, 1, &descriptorSet, 0,
+                              nullptr);
+      uint32_t push[4] = {pixelCount, step.pass, node.mode, 0};
+      memcpy(&push[3], &kToneClip, sizeof(float));
+      vkCmdPushConstants(commandBuffer, tonePipelineLayout_,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+      vkCmdDispatch(commandBuffer, getToneGroupCount(pixelCount, step.pass), 1,
+                    1);
+      return;
+    }
+
+    if (node.op == kGraphMix) {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        mixPipeline_);
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              mixPipelineLayout_, 0, 1, &descriptorSet, 0,
+                              nullptr);
+      uint32_t push[3] = {pixelCount, 0, 0};
+      memcpy(&push[1], node.weights, 2 * sizeof(float));
+      vkCmdPushConstants(commandBuffer, mixPipelineLayout_,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+      vkCmdDispatch(commandBuffer,
+                    std::min(1 + (pixelCount - 1) / kMixGroupSize,
+                             properties_.limits.maxComputeWorkGroupCount[0]),
+                    1, 1);
+      return;
+    }
+
+    const GraphKernel& kernel = state.kernel;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      kernel.pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pipelineLayout_, 0, 1, &descriptorSet, 0, nullptr);
+    const ImageConstantData push{width,       height,    border_,
+                                 node.radius, step.pass, 0};
+    vkCmdPushConstants(commandBuffer, pipelineLayout_,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(ImageConstantData), &push);
+
+    const WorkgroupSize& size = kernel.size;
+    if (kernel.perLine) {
+      const uint32_t lineCount = step.pass == 0 ? height : width;
+      vkCmdDispatch(commandBuffer, (lineCount + size.x - 1) / size.x, 1, 1);
+    } else {
+      vkCmdDispatch(commandBuffer, (width + size.x - 1) / size.x,
+                    (height + size.y - 1) / size.y, 1);
+    }
+  }
+
+  // Subgroup operations in compute shaders, basic ones and operations,
+  // which needs Vulkan 1.1 on both the instance and the device
+  bool supportsSubgroupOperations(VkSubgroupFeatureFlags operations) const {
+    if (properties_.apiVersion < VK_API_VERSION_1_1) {
+      return false;
+    }
+
+    VkPhysicalDeviceSubgroupProperties subgroupProperties{};
+    subgroupProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties{};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &subgroupProperties;
+    vkGetPhysicalDeviceProperties2(physicalDevice_, &properties);
+
+    const VkSubgroupFeatureFlags requiredOperations =
+        VK_SUBGROUP_FEATURE_BASIC_BIT | operations;
+    return (subgroupProperties.supportedStages &
+            VK_SHADER_STAGE_COMPUTE_BIT) != 0 &&
+           (subgroupProperties.supportedOperations & requiredOperations) ==
+               requiredOperations;
+  }
+
+  VkDescriptorType inputDescriptorType() const {
+    return kernel_.imageIo ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                           : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+
+  VkDescriptorType outputDescriptorType() const {
+    return kernel_.imageIo ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                           : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+
+  // Per line kernels use 1D workgroups
+  uint32_t dimensions() const { return kernel_.perLine ? 1 : 2; }
+
+  bool fitsSharedMemory(const WorkgroupSize& size) const {
+    return kernel_.sharedMemorySize(size) <=
+           properties_.limits.maxComputeSharedMemorySize;
+  }
+
+  // The generic candidates minus the sizes whose tile does not fit into
+  // shared memory
+  std::vector<WorkgroupSize> getWorkgroupSizeCandidates() const {
+    std::vector<WorkgroupSize> candidates =
+        ::getWorkgroupSizeCandidates(properties_.limits, dimensions());
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [this](const WorkgroupSize& size) {
+                                      return !fitsSharedMemory(size);
+                                    }),
+                     candidates.end());
+    return candidates;
+  }
+
+  // Records every pass of the filter, the separable kernels with a barrier
+  // between the horizontal and the vertical pass.
+  void record(VkCommandBuffer commandBuffer, VkPipeline pipeline,
+              const VkDescriptorSet* descriptorSets,
+              const WorkgroupSize& size, ImageConstantData push) const {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+    for (uint32_t pass = 0; pass < passCount(); pass++) {
+      if (pass > 0) {
+        const VkMemoryBarrier memoryBarrier = {
+            VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT};
+
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &memoryBarrier, 0, nullptr, 0, nullptr);
+      }
+
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              pipelineLayout_, 0, 1, &descriptorSets[pass], 0,
+                              nullptr);
+
+      push.direction = pass;
+      vkCmdPushConstants(commandBuffer, pipelineLayout_,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(ImageConstantData), &push);
+
+      if (kernel_.perLine) {
+        // One invocation per row, then one per column
+        const uint32_t lineCount = pass == 0 ? push.height : push.width;
+        vkCmdDispatch(commandBuffer, (lineCount + size.x - 1) / size.x, 1, 1);
+      } else {
+        vkCmdDispatch(commandBuffer, (push.width + size.x - 1) / size.x,
+                      (push.height + size.y - 1) / size.y, 1);
+      }
+    }
+  }
+
+  // Image kernels: copies the width x height pixels of the input buffer
+  // into the input image and makes the output image writable. Nothing
+  // needs to be kept from an earlier run, so both start out undefined.
+  void recordUpload(VkCommandBuffer commandBuffer, const Slot& slot,
+                    uint32_t width, uint32_t height) const {
+    if (!kernel_.imageIo) {
+      return;
+    }
+
+    recordImageBarrier(commandBuffer, slot.inputImage.image, 0,
+                       VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    const VkBufferImageCopy region = getImageRegion(width, height);
+    vkCmdCopyBufferToImage(commandBuffer, slot.input.buffer,
+                           slot.inputImage.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    recordImageBarrier(
+        commandBuffer, slot.inputImage.image, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    recordImageBarrier(commandBuffer, slot.outputImage.image, 0,
+                       VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                       VK_IMAGE_LAYOUT_GENERAL,
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  }
+
+  // Image kernels: copies the filtered pixels from the output image into
+  // the output buffer and makes them visible to the host
+  void recordDownload(VkCommandBuffer commandBuffer, const Slot& slot,
+                      uint32_t width, uint32_t height) const {
+    if (!kernel_.imageIo) {
+      return;
+    }
+
+    recordImageBarrier(
+        commandBuffer, slot.outputImage.image, VK_ACCESS_SHADER_WRITE_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    const VkBufferImageCopy region = getImageRegion(width, height);
+    vkCmdCopyImageToBuffer(commandBuffer, slot.outputImage.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           slot.output.buffer, 1, &region);
+
+    const VkMemoryBarrier memoryBarrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                           nullptr,
+                                           VK_ACCESS_TRANSFER_WRITE_BIT,
+                                           VK_ACCESS_HOST_READ_BIT};
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0,
+                         nullptr, 0, nullptr);
+  }
+
+  VkResult endAndSubmit(Slot* slot) {
+    VkResult result = vkEndCommandBuffer(slot->commandBuffer);
+    if (result != VK_SUCCESS) return result;
+
+    const VkSubmitInfo submitInfo = {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr, 0, nullptr, nullptr, 1,
+        &slot->commandBuffer, 0, nullptr};
+
+    result = vkQueueSubmit(queue_, 1, &submitInfo, slot->fence);
+    if (result != VK_SUCCESS) return result;
+
+    slot->pending = true;
+    return VK_SUCCESS;
+  }
+
+  // Copies the input buffer into level 0 of the input image and builds the
+  // levels after it, leaving every level ready to be sampled
+  void recordPyramid(VkCommandBuffer commandBuffer, const Slot& slot,
+                     uint32_t width, uint32_t height) const {
+    const VkImage image = slot.inputImage.image;
+    const uint32_t levelCount = getPyramidLevelCount(width, height);
+
+    recordImageBarrier(commandBuffer, image, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+                       VK_IMAGE_LAYOUT_UNDEFINED,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    const VkBufferImageCopy region = getImageRegion(width, height);
+    vkCmdCopyBufferToImage(commandBuffer, slot.input.buffer, image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    if (pyramidBlit_) {
+      // Each level is blitted from the one before, which then goes to the
+      // shader
+      for (uint32_t level = 1; level < levelCount; level++) {
+        recordImageBarrier(commandBuffer, image, VK_ACCESS_TRANSFER_WRITE_BIT,
+                           VK_ACCESS_TRANSFER_READ_BIT,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, level - 1, 1);
+
+        const VkImageBlit blit = {
+            {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1},
+            {{0, 0, 0},
+             {static_cast<int32_t>(getPyramidLevelSize(width, level - 1)),
+              static_cast<int32_t>(getPyramidLevelSize(height, level - 1)),
+              1}},
+            {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1},
+            {{0, 0, 0},
+             {static_cast<int32_t>(getPyramidLevelSize(width, level)),
+              static_cast<int32_t>(getPyramidLevelSize(height, level)),
+              1}}};
+        vkCmdBlitImage(commandBuffer, image,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                       VK_FILTER_LINEAR);
+
+        recordImageBarrier(commandBuffer, image, VK_ACCESS_TRANSFER_READ_BIT,
+                           VK_ACCESS_SHADER_READ_BIT,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, level - 1,
+                           1);
+      }
+
+      // The last level, and those of larger images the image was made for
+      recordImageBarrier(commandBuffer, image, VK_ACCESS_TRANSFER_WRITE_BIT,
+                         VK_ACCESS_SHADER_READ_BIT,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, levelCount - 1);
+      return;
+    }
+
+    // Level 0 is sampled by the downsampler, the others are its storage
+    // images
+    recordImageBarrier(commandBuffer, image, VK_ACCESS_TRANSFER_WRITE_BIT,
+                       VK_ACCESS_SHADER_READ_BIT,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1);
+    if (slot.inputImage.levelCount == 1) {
+      return;
+    }
+    recordImageBarrier(commandBuffer, image, VK_ACCESS_TRANSFER_WRITE_BIT,
+                       VK_ACCESS_SHADER_WRITE_BIT,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 1);
+
+    // The counter of finished workgroups starts at 0
+    vkCmdFillBuffer(commandBuffer, slot.scratch.buffer, 0, sizeof(uint32_t),
+                    0);
+    const VkMemoryBarrier memoryBarrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT};
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    if (levelCount > 1) {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        downsamplePipeline_);
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              downsamplePipelineLayout_, 0, 1,
+                              &slot.downsampleDescriptorSet, 0, nullptr);
+
+      const uint32_t push[3] = {width, height, levelCount};
+      vkCmdPushConstants(commandBuffer, downsamplePipelineLayout_,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), push);
+
+      // One workgroup per 64x64 block, see downsample_shader.comp
+      vkCmdDispatch(commandBuffer, (width + 63) / 64, (height + 63) / 64, 1);
+    }
+
+    recordImageBarrier(commandBuffer, image, VK_ACCESS_SHADER_WRITE_BIT,
+                       VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 1);
+  }
+
+  // Tightly packed rows of width pixels at the start of the buffer
+  static VkBufferImageCopy getImageRegion(uint32_t width, uint32_t height) {
+    return VkBufferImageCopy{0,
+                             width,
+                             height,
+                             {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+                             {0, 0, 0},
+                             {width, height, 1}};
+  }
+
+  // Covers every level of the image unless told otherwise
+  static void recordImageBarrier(VkCommandBuffer commandBuffer, VkImage image,
+                                 VkAccessFlags srcAccessMask,
+                                 VkAccessFlags dstAccessMask,
+                                 VkImageLayout oldLayout,
+                                 VkImageLayout newLayout,
+                                 VkPipelineStageFlags srcStageMask,
+                                 VkPipelineStageFlags dstStageMask,
+                                 uint32_t baseLevel = 0,
+                                 uint32_t levelCount =
+                                     VK_REMAINING_MIP_LEVELS) {
+    const VkImageMemoryBarrier imageMemoryBarrier = {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        nullptr,
+        srcAccessMask,
+        dstAccessMask,
+        oldLayout,
+        newLayout,
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        image,
+        {VK_IMAGE_ASPECT_COLOR_BIT, baseLevel, levelCount, 0, 1}};
+
+    vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0,
+                         nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+  }
+
+  // Recreates the images of a slot at width x height and points the
+  // slot's descriptors at them
+  VkResult reserveImages(Slot* slot, uint32_t width, uint32_t height) {
+    destroyImage(&slot->inputImage);
+    destroyImage(&slot->outputImage);
+    destroyBuffer(&slot->scratch);
+
+    // With a pyramid the input image holds the whole mip chain, blitted
+    // from level to level or written by the downsampler
+    VkImageUsageFlags inputUsage =
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    uint32_t levelCount = 1;
+    if (pyramid_) {
+      inputUsage |= pyramidBlit_ ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                                 : VK_IMAGE_USAGE_STORAGE_BIT;
+      levelCount = getPyramidLevelCount(width, height);
+    }
+
+    VkResult result =
+        createImage(width, height, levelCount, inputUsage, &slot->inputImage);
+    if (result != VK_SUCCESS) return result;
+
+    result = createImage(
+        width, height, 1,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        &slot->outputImage);
+    if (result != VK_SUCCESS) return result;
+
+    if (pyramid_ && !pyramidBlit_) {
+      result = reserveDownsampler(slot, width, height);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    const VkDescriptorImageInfo inputDescriptorImageInfo = {
+        sampler_, slot->inputImage.view,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+    const VkDescriptorImageInfo outputDescriptorImageInfo = {
+        VK_NULL_HANDLE, slot->outputImage.view, VK_IMAGE_LAYOUT_GENERAL};
+
+    const VkWriteDescriptorSet writeDescriptorSet[2] = {
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+         slot->descriptorSets[0], 0, 0, 1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &inputDescriptorImageInfo,
+         nullptr, nullptr},
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+         slot->descriptorSets[0], 1, 0, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+         &outputDescriptorImageInfo, nullptr, nullptr}};
+
+    vkUpdateDescriptorSets(device_, 2, writeDescriptorSet, 0, nullptr);
+    return VK_SUCCESS;
+  }
+
+  // Views of the levels of the slot's input image and a scratch buffer for
+  // the compute downsampler, bound to its descriptor set
+  VkResult reserveDownsampler(Slot* slot, uint32_t width, uint32_t height) {
+    DeviceImage& image = slot->inputImage;
+    for (uint32_t level = 0; level < image.levelCount; level++) {
+      const VkImageViewCreateInfo imageViewCreateInfo = {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+          .image = image.image,
+          .viewType = VK_IMAGE_VIEW_TYPE_2D,
+          .format = getPixelVkFormat(format_),
+          .subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1},
+      };
+
+      VkImageView view = VK_NULL_HANDLE;
+      const VkResult result =
+          vkCreateImageView(device_, &imageViewCreateInfo, nullptr, &view);
+      if (result != VK_SUCCESS) return result;
+      image.levelViews.push_back(view);
+    }
+
+    // The finished workgroup counter, padded to a vec4, then level 6 and
+    // every level after it
+    VkDeviceSize scratchSize = sizeof(Vec4);
+    for (uint32_t level = 6; level < image.levelCount; level++) {
+      scratchSize += sizeof(Vec4) * getPyramidLevelSize(width, level) *
+                     getPyramidLevelSize(height, level);
+    }
+    VkResult result = createBuffer(scratchSize, &slot->scratch);
+    if (result != VK_SUCCESS) return result;
+
+    const VkDescriptorImageInfo level0DescriptorImageInfo = {
+        sampler_, image.levelViews[0],
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+    // Array elements past the last level must still be valid: they repeat
+    // it and are never written
+    VkDescriptorImageInfo levelDescriptorImageInfos[kMaxPyramidLevels - 1];
+    for (uint32_t level = 1; level < kMaxPyramidLevels; level++) {
+      levelDescriptorImageInfos[level - 1] = {
+          VK_NULL_HANDLE,
+          image.levelViews[std::min(level, image.levelCount - 1)],
+          VK_IMAGE_LAYOUT_GENERAL};
+    }
+
+    const VkDescriptorBufferInfo scratchDescriptorBufferInfo = {
+        slot->scratch.buffer, 0, VK_WHOLE_SIZE};
+
+    const VkWriteDescriptorSet writeDescriptorSet[3] = {
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+         slot->downsampleDescriptorSet, 0, 0, 1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         &level0DescriptorImageInfo, nullptr, nullptr},
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+         slot->downsampleDescriptorSet, 1, 0, kMaxPyramidLevels - 1,
+         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, levelDescriptorImageInfos, nullptr,
+         nullptr},
+        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr,
+         slot->downsampleDescriptorSet, 2, 0, 1,
+         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr,
+         &scratchDescriptorBufferInfo, nullptr}};
+
+    vkUpdateDescriptorSets(device_, 3, writeDescriptorSet, 0, nullptr);
+    return VK_SUCCESS;
+  }
+
+  // An optimally tiled 2D image in device local memory, if there is any
+  // that takes it, with levelCount mip levels
+  VkResult createImage(uint32_t width, uint32_t height, uint32_t levelCount,
+                       VkImageUsageFlags usage, DeviceImage* image) {
+    const VkImageCreateInfo imageCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = getPixelVkFormat(format_),
+        .extent = {width, height, 1},
+        .mipLevels = levelCount,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    VkResult result =
+        vkCreateImage(device_, &imageCreateInfo, nullptr, &image->image);
+    if (result != VK_SUCCESS) return result;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(device_, image->image, &memoryRequirements);
+
+    uint32_t memoryTypeIndex = VK_MAX_MEMORY_TYPES;
+    for (uint32_t k = 0; k < memoryProperties_.memoryTypeCount; k++) {
+      if ((memoryRequirements.memoryTypeBits & (1u << k)) == 0) {
+        continue;
+      }
+      if (memoryTypeIndex == VK_MAX_MEMORY_TYPES) {
+        memoryTypeIndex = k;
+      }
+      if (VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT &
+          memoryProperties_.memoryTypes[k].propertyFlags) {
+        memoryTypeIndex = k;
+        break;
+      }
+    }
+
+    if (memoryTypeIndex == VK_MAX_MEMORY_TYPES) {
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    const VkMemoryAllocateInfo memoryAllocateInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr,
+        memoryRequirements.size, memoryTypeIndex};
+
+    result = vkAllocateMemory(device_, &memoryAllocateInfo, nullptr,
+                              &image->memory);
+    if (result != VK_SUCCESS) return result;
+
+    result = vkBindImageMemory(device_, image->image, image->memory, 0);
+    if (result != VK_SUCCESS) return result;
+
+    const VkImageViewCreateInfo imageViewCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = image->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = getPixelVkFormat(format_),
+        .subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, 0, 1},
+    };
+
+    result = vkCreateImageView(device_, &imageViewCreateInfo, nullptr,
+                               &image->view);
+    if (result != VK_SUCCESS) return result;
+
+    image->width = width;
+    image->height = height;
+    image->levelCount = levelCount;
+    return VK_SUCCESS;
+  }
+
+  void destroyImage(DeviceImage* image) {
+    for (const VkImageView view : image->levelViews) {
+      vkDestroyImageView(device_, view, nullptr);
+    }
+    vkDestroyImageView(device_, image->view, nullptr);
+    vkDestroyImage(device_, image->image, nullptr);
+    vkFreeMemory(device_, image->memory, nullptr);
+    *image = DeviceImage{};
+  }
+
+  VkResult createPipeline() {
+    return createComputePipelineWithWorkgroupSize(
+        device_, pipelineLayout_, shaderModule_, "main", workgroupSize_,
+        &pipeline_, {format_});
+  }
+
+  VkResult createBuffer(VkDeviceSize size, MappedBuffer* buffer) {
+    const VkBufferCreateInfo bufferCreateInfo = {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        nullptr,
+        0,
+        size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_SHARING_MODE_EXCLUSIVE,
+        1,
+        &queueFamilyIndex_};
+
+    VkResult result =
+        vkCreateBuffer(device_, &bufferCreateInfo, nullptr, &buffer->buffer);
+    if (result != VK_SUCCESS) return result;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(device_, buffer->buffer, &memoryRequirements);
+
+    // set memoryTypeIndex to an invalid entry in the properties.memoryTypes
+    // array
+    uint32_t memoryTypeIndex = VK_MAX_MEMORY_TYPES;
+
+    for (uint32_t k = 0; k < memoryProperties_.memoryTypeCount; k++) {
+      const VkMemoryType& memoryType = memoryProperties_.memoryTypes[k];
+      if ((memoryRequirements.memoryTypeBits & (1u << k)) &&
+          (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT & memoryType.propertyFlags) &&
+          (VK_MEMORY_PROPERTY_HOST_COHERENT_BIT & memoryType.propertyFlags) &&
+          (memoryRequirements.size <
+           memoryProperties_.memoryHeaps[memoryType.heapIndex].size)) {
+        memoryTypeIndex = k;
+        break;
+      }
+    }
+
+    if (memoryTypeIndex == VK_MAX_MEMORY_TYPES) {
+      return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+
+    const VkMemoryAllocateInfo memoryAllocateInfo = {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr,
+        memoryRequirements.size, memoryTypeIndex};
+
+    result = vkAllocateMemory(device_, &memoryAllocateInfo, nullptr,
+                              &buffer->memory);
+    if (result != VK_SUCCESS) return result;
+
+    result = vkBindBufferMemory(device_, buffer->buffer, buffer->memory, 0);
+    if (result != VK_SUCCESS) return result;
+
+    return vkMapMemory(device_, buffer->memory, 0, size, 0, &buffer->mapped);
+  }
+
+  void destroyBuffer(MappedBuffer* buffer) {
+    if (buffer->mapped != nullptr) {
+      vkUnmapMemory(device_, buffer->memory);
+    }
+    vkDestroyBuffer(device_, buffer->buffer, nullptr);
+    vkFreeMemory(device_, buffer->memory, nullptr);
+    *buffer = MappedBuffer{};
+  }
+
+  VkPhysicalDevice physicalDevice_ = VK_NULL_HANDLE;
+  uint32_t queueFamilyIndex_ = 0;
+  VkPhysicalDeviceProperties properties_{};
+  VkPhysicalDeviceMemoryProperties memoryProperties_{};
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkQueue queue_ = VK_NULL_HANDLE;
+  VkShaderModule shaderModule_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout descriptorSetLayout_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout_ = VK_NULL_HANDLE;
+  VkPipeline pipeline_ = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool_ = VK_NULL_HANDLE;
+  VkCommandPool commandPool_ = VK_NULL_HANDLE;
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  std::vector<Slot> slots_;
+
+  // See initPyramid()
+  bool pyramid_ = false;
+  bool pyramidBlit_ = false;
+  VkShaderModule downsampleShaderModule_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout downsampleDescriptorSetLayout_ = VK_NULL_HANDLE;
+  VkPipelineLayout downsamplePipelineLayout_ = VK_NULL_HANDLE;
+  VkPipeline downsamplePipeline_ = VK_NULL_HANDLE;
+  VkDescriptorPool downsampleDescriptorPool_ = VK_NULL_HANDLE;
+
+  // See initIntegral()
+  bool integral_ = false;
+  bool integralSubgroups_ = false;
+  VkShaderModule integralShaderModule_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout integralDescriptorSetLayout_ = VK_NULL_HANDLE;
+  VkPipelineLayout integralPipelineLayout_ = VK_NULL_HANDLE;
+  VkPipeline integralPipelines_[2] = {};
+  VkDescriptorPool integralDescriptorPool_ = VK_NULL_HANDLE;
+
+  // See initHistogram()
+  bool tone_ = false;
+  bool toneSubgroups_ = false;
+  uint32_t binCount_ = 0;
+  VkShaderModule toneShaderModule_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout toneDescriptorSetLayout_ = VK_NULL_HANDLE;
+  VkPipelineLayout tonePipelineLayout_ = VK_NULL_HANDLE;
+  VkPipeline tonePipeline_ = VK_NULL_HANDLE;
+  VkDescriptorPool toneDescriptorPool_ = VK_NULL_HANDLE;
+
+  // See initGraph()
+  FilterGraph graph_;
+  GraphSchedule graphSchedule_;
+  std::vector<GraphNodeState> graphNodes_;
+  std::vector<MappedBuffer> graphBuffers_;  // buffers 2 and up
+  std::vector<VkDescriptorSet> graphDescriptorSets_;  // one per step
+  VkDescriptorPool graphDescriptorPool_ = VK_NULL_HANDLE;
+  VkShaderModule mixShaderModule_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout mixDescriptorSetLayout_ = VK_NULL_HANDLE;
+  VkPipelineLayout mixPipelineLayout_ = VK_NULL_HANDLE;
+  VkPipeline mixPipeline_ = VK_NULL_HANDLE;
+
+  FilterKernel kernel_;
+  PixelFormat format_ = kPixelRgba32f;
+  BorderMode border_ = kBorderClamp;
+  uint32_t radius_ = 1;
+  GpuProfiler profiler_;
+  WorkgroupSize workgroupSize_{1, 1, 1};
+  MappedBuffer weights_;
+};
+
+#endif  // FILTER_DEVICE_H
@@ -0,0 +1,352 @@
+// Filter graphs: several filters between decode and encode, recorded into
+// one command buffer. Nodes are filters, tone curves or mixes of two
+// images; edges are images of the source size. scheduleFilterGraph() turns
+// a graph into dispatches grouped in waves, which need one barrier between
+// each other and none inside, and maps the images to as few buffers as
+// their lifetimes allow, see FilterDevice::runGraph().
+//
+// Graphs are written as statements in dependency order, the source image
+// is "in":
+//   soft = gaussian(in, 4); sharp = mix(in, soft, 1.6, -0.6);
+//   out = auto-levels(sharp)
+// Nodes whose result nothing reads are the outputs of the graph.
+
+#ifndef FILTER_GRAPH_H
+#define FILTER_GRAPH_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+enum GraphOp : uint32_t {
+  kGraphFilter,  // one of the buffer kernels, see loadFilterKernel()
+  kGraphTone,    // histogram and tone curve, see histogram.h
+  kGraphMix,     // weights[0] * inputs[0] + weights[1] * inputs[1]
+};
+
+struct GraphNode {
+  std::string name;
+  GraphOp op = kGraphFilter;
+  std::string kernel;   // filter nodes only
+  uint32_t radius = 1;  // separable filter nodes only
+  ToneMode mode = kToneEqualize;  // tone nodes only
+  float weights[2] = {1.0f, 0.0f};  // mix nodes only
+  // Images read: 0 is the source, n + 1 the result of node n
+  std::vector<uint32_t> inputs;
+  // Dispatches of the node, one after the other
+  uint32_t passCount = 1;
+};
+
+struct FilterGraph {
+  std::vector<GraphNode> nodes;
+};
+
+// Buffer index of steps that read or write nothing image sized
+const uint32_t kGraphNoBuffer = UINT32_MAX;
+
+// One dispatch of the graph
+struct GraphStep {
+  uint32_t node;
+  uint32_t pass;
+  uint32_t wave;
+  uint32_t inputs[2];  // buffers read, kGraphNoBuffer when unused
+  uint32_t output;     // buffer written, kGraphNoBuffer when unused
+};
+
+struct GraphSchedule {
+  // In recording order: wave by wave, and in node order within a wave
+  std::vector<GraphStep> steps;
+  uint32_t waveCount = 0;
+  // Image sized buffers the steps use. Buffer 0 holds the source.
+  uint32_t bufferCount = 0;
+  // Images the graph would need without aliasing, the source included
+  uint32_t imageCount = 0;
+  // Nodes whose result nothing reads, and the buffers holding them
+  std::vector<uint32_t> outputNodes;
+  std::vector<uint32_t> outputBuffers;
+};
+
+namespace filter_graph_detail {
+
+inline bool isNameChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+}
+
+// Splits "name = op(arg, ...)" into its words, dropping spaces
+inline std::vector<std::string> tokenize(const std::string& statement) {
+  std::vector<std::string> tokens;
+  size_t i = 0;
+  while (i < statement.size()) {
+    const char c = statement[i];
+    if (c == ' ' || c == '\t' || c == '\r') {
+      i++;
+    } else if (isNameChar(c)) {
+      size_t end = i;
+      while (end < statement.size() && isNameChar(statement[end])) {
+        end++;
+      }
+      tokens.push_back(statement.substr(i, end - i));
+      i = end;
+    } else {
+      tokens.push_back(std::string(1, c));
+      i++;
+    }
+  }
+  return tokens;
+}
+
+}  // namespace filter_graph_detail
+
+// Parses the statements of spec, separated by ';' or new lines, into graph.
+// On failure returns false with the reason in *error.
+inline bool parseFilterGraph(const std::string& spec, FilterGraph* graph,
+                             std::string* error) {
+  graph->nodes.clear();
+  std::vector<std::string> statements;
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t end = spec.find_first_of(";\n", start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    statements.push_back(spec.substr(start, end - start));
+    start = end + 1;
+  }
+
+  const auto findImage = [graph](const std::string& name, uint32_t* image) {
+    if (name == "in") {
+      *image = 0;
+      return true;
+    }
+    for (uint32_t k = 0; k < graph->nodes.size(); k++) {
+      if (graph->nodes[k].name == name) {
+        *image = k + 1;
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (const std::string& statement : statements) {
+    const std::vector<std::string> tokens =
+        filter_graph_detail::tokenize(statement);
+    if (tokens.empty()) {
+      continue;
+    }
+    // name = op ( arg [, arg]... )
+    if (tokens.size() < 6 || tokens[1] != "=" || tokens[3] != "(" ||
+        tokens.back() != ")") {
+      *error = "expected name = op(image, ...) in \"" + statement + "\"";
+      return false;
+    }
+
+    GraphNode node;
+    node.name = tokens[0];
+    uint32_t image = 0;
+    if (node.name == "in" || findImage(node.name, &image)) {
+      *error = "image " + node.name + " is defined twice";
+      return false;
+    }
+
+    std::vector<std::string> args;
+    for (size_t k = 4; k + 1 < tokens.size(); k += 2) {
+      args.push_back(tokens[k]);
+      if (tokens[k + 1] != "," && k + 2 < tokens.size()) {
+        *error = "expected , between the arguments of " + node.name;
+        return false;
+      }
+    }
+
+    const std::string& op = tokens[2];
+    size_t imageCount = 1;
+    if (op == "simple" || op == "tiled") {
+      node.kernel = op;
+    } else if (op == "box" || op == "gaussian") {
+      node.kernel = op;
+      node.passCount = 2;
+      if (args.size() > 1) {
+        node.radius = static_cast<uint32_t>(strtoul(args[1].c_str(),
+                                                    nullptr, 10));
+      }
+    } else if (op == "equalize" || op == "auto-levels") {
+      node.op = kGraphTone;
+      parseToneMode(op.c_str(), &node.mode);
+      node.passCount = 3;
+    } else if (op == "mix") {
+      node.op = kGraphMix;
+      imageCount = 2;
+      if (args.size() != 4) {
+        *error = "mix takes two images and two weights";
+        return false;
+      }
+      node.weights[0] = strtof(args[2].c_str(), nullptr);
+      node.weights[1] = strtof(args[3].c_str(), nullptr);
+    } else {
+      *error = "unknown operation " + op;
+      return false;
+    }
+
+    if (args.size() < imageCount) {
+      *error = op + " needs " + std::to_string(imageCount) + " image(s)";
+      return false;
+    }
+    for (size_t k = 0; k < imageCount; k++) {
+      if (!findImage(args[k], &image)) {
+        *error = "image " + args[k] + " is not defined before " + node.name;
+        return false;
+      }
+      node.inputs.push_back(image);
+    }
+    graph->nodes.push_back(node);
+  }
+
+  if (graph->nodes.empty()) {
+    *error = "the graph has no nodes";
+    return false;
+  }
+  return true;
+}
+
+// Steps of the graph in waves and buffers for its images. Every step runs
+// in the wave after the last step it depends on, so each barrier covers as
+// many dispatches as possible. An image lives from the wave that writes it
+// to the last wave that reads it, the outputs to the end. Images whose
+// lifetimes do not overlap share a buffer; giving each image the lowest
+// free buffer in the order the images start uses the fewest buffers.
+inline GraphSchedule scheduleFilterGraph(const FilterGraph& graph) {
+  const uint32_t nodeCount = static_cast<uint32_t>(graph.nodes.size());
+
+  // Images: the source, the node results, then the results of the first
+  // pass of separable filters
+  std::vector<int> firstWave(nodeCount + 1, -1);
+  std::vector<int> lastWave(nodeCount + 1, -1);
+
+  struct Access {
+    std::vector<uint32_t> reads;
+    uint32_t write = kGraphNoBuffer;
+  };
+  std::vector<GraphStep> steps;
+  std::vector<Access> accesses;
+
+  for (uint32_t n = 0; n < nodeCount; n++) {
+    const GraphNode& node = graph.nodes[n];
+    int previousWave = -1;
+    uint32_t pending = kGraphNoBuffer;  // the first pass result
+    for (uint32_t pass = 0; pass < node.passCount; pass++) {
+      Access access;
+      if (node.op == kGraphTone) {
+        // The histogram and the curve stay in buffers of the node
+        if (pass != 1) {
+          access.reads = {node.inputs[0]};
+        }
+        if (pass == 2) {
+          access.write = n + 1;
+        }
+      } else if (pass == 0) {
+        access.reads = node.inputs;
+        if (node.passCount == 2) {
+          pending = static_cast<uint32_t>(firstWave.size());
+          firstWave.push_back(-1);
+          lastWave.push_back(-1);
+          access.write = pending;
+        } else {
+          access.write = n + 1;
+        }
+      } else {
+        access.reads = {pending};
+        access.write = n + 1;
+      }
+
+      int wave = previousWave + 1;
+      for (const uint32_t image : access.reads) {
+        wave = std::max(wave, firstWave[image] + 1);
+      }
+      for (const uint32_t image : access.reads) {
+        lastWave[image] = std::max(lastWave[image], wave);
+      }
+      if (access.write != kGraphNoBuffer) {
+        firstWave[access.write] = wave;
+        lastWave[access.write] = wave;
+      }
+      previousWave = wave;
+
+      steps.push_back(GraphStep{n,
+                                pass,
+                                static_cast<uint32_t>(wave),
+                                {kGraphNoBuffer, kGraphNoBuffer},
+                                kGraphNoBuffer});
+      accesses.push_back(access);
+    }
+  }
+
+  GraphSchedule schedule;
+  std::vector<bool> read(nodeCount + 1, false);
+  for (const GraphNode& node : graph.nodes) {
+    for (const uint32_t image : node.inputs) {
+      read[image] = true;
+    }
+  }
+  for (uint32_t n = 0; n < nodeCount; n++) {
+    if (!read[n + 1]) {
+      schedule.outputNodes.push_back(n);
+      lastWave[n + 1] = INT_MAX;
+    }
+  }
+
+  // Buffers in the order the images start, the source first
+  const uint32_t imageCount = static_cast<uint32_t>(firstWave.size());
+  std::vector<uint32_t> order(imageCount);
+  for (uint32_t k = 0; k < imageCount; k++) {
+    order[k] = k;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&firstWave](uint32_t a, uint32_t b) {
+                     return firstWave[a] < firstWave[b];
+                   });
+
+  std::vector<uint32_t> buffers(imageCount, kGraphNoBuffer);
+  std::vector<int> busyUntil;  // per buffer, the last wave of its image
+  for (const uint32_t image : order) {
+    uint32_t buffer = 0;
+    while (buffer < busyUntil.size() &&
+           busyUntil[buffer] >= firstWave[image]) {
+      buffer++;
+    }
+    if (buffer == busyUntil.size()) {
+      busyUntil.push_back(0);
+    }
+    busyUntil[buffer] = lastWave[image];
+    buffers[image] = buffer;
+  }
+
+  for (size_t k = 0; k < steps.size(); k++) {
+    const Access& access = accesses[k];
+    for (size_t r = 0; r < access.reads.size(); r++) {
+      steps[k].inputs[r] = buffers[access.reads[r]];
+    }
+    if (access.write != kGraphNoBuffer) {
+      steps[k].output = buffers[access.write];
+    }
+    schedule.waveCount = std::max(schedule.waveCount, steps[k].wave + 1);
+  }
+  std::stable_sort(steps.begin(), steps.end(),
+                   [](const GraphStep& a, const GraphStep& b) {
+                     return a.wave < b.wave;
+                   });
+
+  schedule.steps = steps;
+  schedule.bufferCount = static_cast<uint32_t>(busyUntil.size());
+  schedule.imageCount = imageCount;
+  for (const uint32_t node : schedule.outputNodes) {
+    schedule.outputBuffers.push_back(buffers[node + 1]);
+  }
+  return schedule;
+}
+
+#endif  // FILTER_GRAPH_H
@@ -0,0 +1,77 @@
+// Per channel histograms of the red, green and blue channels and the tone
+// curves built from them, see FilterDevice::runTone(). Values in [0, 1]
+// fall into binCount equal bins; with 256 bins every 8 bit value has its
+// own.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "pixel_format.h"
+
+// Bins per channel of the shared memory histograms of histogram_shader.comp
+const uint32_t kMaxHistogramBins = 1024;
+
+// Bins per channel unless asked otherwise, one per 8 bit value
+const uint32_t kDefaultHistogramBins = 256;
+
+// Channels counted, alpha is left alone
+const uint32_t kHistogramChannels = 3;
+
+// How the tone curve follows from the histogram. Values match the kTone*
+// constants in histogram_shader.comp.
+enum ToneMode : uint32_t {
+  // Maps every value to the share of pixels at or below it, spreading the
+  // values that occur often
+  kToneEqualize = 0,
+  // Stretches each channel linearly so that its darkest and brightest
+  // values, minus a clipped share of outliers, span [0, 1]
+  kToneAutoLevels = 1,
+};
+
+inline bool parseToneMode(const char* name, ToneMode* mode) {
+  const std::string value = name;
+  if (value == "equalize") {
+    *mode = kToneEqualize;
+  } else if (value == "auto-levels") {
+    *mode = kToneAutoLevels;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* getToneModeName(ToneMode mode) {
+  return mode == kToneEqualize ? "equalize" : "auto-levels";
+}
+
+// Share of the pixels kToneAutoLevels ignores at either end of a channel, so
+// that a few stray pixels do not hold the range open
+const float kToneClip = 0.001f;
+
+inline uint32_t getHistogramBin(float value, uint32_t binCount) {
+  const float clamped = std::min(std::max(value, 0.0f), 1.0f);
+  return std::min(static_cast<uint32_t>(clamped * binCount), binCount - 1);
+}
+
+// The histograms on the host, kHistogramChannels of binCount bins one after
+// the other, as FilterDevice::histogram() returns them
+inline std::vector<uint32_t> countHistogram(PixelFormat format,
+                                            const void* pixels,
+                                            size_t pixelCount,
+                                            uint32_t binCount) {
+  std::vector<uint32_t> counts(kHistogramChannels * binCount, 0);
+  for (size_t i = 0; i < pixelCount; i++) {
+    const Vec4 pixel = loadPixel(format, pixels, i);
+    counts[getHistogramBin(pixel.x, binCount)]++;
+    counts[binCount + getHistogramBin(pixel.y, binCount)]++;
+    counts[2 * binCount + getHistogramBin(pixel.z, binCount)]++;
+  }
+  return counts;
+}
+
+#endif  // HISTOGRAM_H
@@ -0,0 +1,57 @@
+// The input image decoder picked by file extension: QoiDecoder for .qoi,
+// PngDecoder for anything else. Both decode straight into the memory the
+// pixels are used from, this only forwards to the one that was opened.
+
+#ifndef IMAGE_DECODER_H
+#define IMAGE_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+#include "png_decoder.h"
+#include "qoi.h"
+
+class ImageDecoder {
+ public:
+  // Opens the file and reads the header. Throws std::runtime_error when the
+  // file cannot be read.
+  explicit ImageDecoder(const std::string& path) {
+    if (isQoiPath(path)) {
+      qoi_.emplace(path);
+    } else {
+      png_.emplace(path);
+    }
+  }
+
+  uint32_t width() const { return qoi_ ? qoi_->width() : png_->width(); }
+  uint32_t height() const { return qoi_ ? qoi_->height() : png_->height(); }
+
+  // 8 bit RGBA rows with an opaque alpha rowPitch bytes apart, see
+  // PngDecoder::readRgba8(). Can only be called once.
+  void readRgba8(void* pixels, size_t rowPitch) {
+    if (qoi_) {
+      qoi_->readRgba8(pixels, rowPitch);
+    } else {
+      png_->readRgba8(pixels, rowPitch);
+    }
+  }
+
+  // One row at a time, see PngDecoder::readRows(). Can only be called once.
+  void readRows(
+      const std::function<void(uint32_t, const uint8_t*)>& convertRow) {
+    if (qoi_) {
+      qoi_->readRows(convertRow);
+    } else {
+      png_->readRows(convertRow);
+    }
+  }
+
+ private:
+  std::optional<PngDecoder> png_;
+  std::optional<QoiDecoder> qoi_;
+};
+
+#endif  // IMAGE_DECODER_H
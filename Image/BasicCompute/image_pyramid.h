@@ -0,0 +1,45 @@
+// Layout of an image pyramid, the mip chain of an image: level 0 is the
+// image and every further level halves the one before, rounding down but
+// never below one pixel, down to 1x1. FilterDevice::runPyramid() returns
+// the filtered levels packed one after the other, level 0 first.
+
+#ifndef IMAGE_PYRAMID_H
+#define IMAGE_PYRAMID_H
+
+#include <algorithm>
+#include <cstdint>
+
+// Levels of a 16384 pixel wide image, the most downsample_shader.comp builds
+const uint32_t kMaxPyramidLevels = 15;
+
+inline uint32_t getPyramidLevelCount(uint32_t width, uint32_t height) {
+  uint32_t levelCount = 1;
+  for (uint32_t size = std::max(width, height); size > 1; size /= 2) {
+    levelCount++;
+  }
+  return levelCount;
+}
+
+// Width or height of a level, given the one of level 0
+inline uint32_t getPyramidLevelSize(uint32_t size, uint32_t level) {
+  return std::max(size >> level, 1u);
+}
+
+// Pixels before level in the packed pyramid of a width x height image
+inline uint64_t getPyramidLevelOffset(uint32_t width, uint32_t height,
+                                      uint32_t level) {
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < level; i++) {
+    offset += uint64_t{getPyramidLevelSize(width, i)} *
+              getPyramidLevelSize(height, i);
+  }
+  return offset;
+}
+
+// Pixels of every level of a width x height image, about 4/3 of level 0
+inline uint64_t getPyramidPixelCount(uint32_t width, uint32_t height) {
+  return getPyramidLevelOffset(width, height,
+                               getPyramidLevelCount(width, height));
+}
+
+#endif  // IMAGE_PYRAMID_H
@@ -0,0 +1,79 @@
+// Summed-area tables, or integral images: entry (x, y) holds the sum of
+// every pixel from (0, 0) to (x, y) inclusive, per channel. Once a table
+// exists the sum over any window costs four lookups whatever its size, see
+// getIntegralBoxSum(). FilterDevice::runIntegral() builds them on the
+// device; every entry is four 32 bit values, integers or floats.
+
+#ifndef INTEGRAL_IMAGE_H
+#define INTEGRAL_IMAGE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "pixel_format.h"
+
+// Values match the kIntegral* constants in integral_shader.comp
+enum IntegralAccumulation : uint32_t {
+  // The 8 bit values themselves. The entries wrap around past 2^32, about
+  // 16 million pixels of white, but the four lookups wrap back, so the sum
+  // over any window smaller than that is exact whatever the image size.
+  kIntegralUint32 = 0,
+  // The pixel values minus kIntegralFloatOffset, which keeps the sums of
+  // typical images near 0, where fp32 is most precise. The error of the
+  // lookups still grows with the image: bright 4K images are off by several
+  // 8 bit steps, see --integral-check.
+  kIntegralFloat32 = 1,
+};
+
+const float kIntegralFloatOffset = 0.5f;
+
+inline const char* getIntegralAccumulationName(
+    IntegralAccumulation accumulation) {
+  return accumulation == kIntegralUint32 ? "uint32" : "fp32";
+}
+
+// Exact integer sums for rgba8 pixels at any image size, fp32 for the
+// formats whose values are not integers
+inline IntegralAccumulation getIntegralAccumulation(PixelFormat format) {
+  return format == kPixelRgba8 ? kIntegralUint32 : kIntegralFloat32;
+}
+
+// Sum of the pixels from (x0, y0) to (x1, y1) inclusive, per channel and in
+// the units of the pixel values, from four entries of a table width pixels
+// wide. The entries are combined in 32 bits, as a shader would.
+inline Vec4 getIntegralBoxSum(const void* table,
+                              IntegralAccumulation accumulation,
+                              uint32_t width, uint32_t x0, uint32_t y0,
+                              uint32_t x1, uint32_t y1) {
+  const uint32_t* const entries = static_cast<const uint32_t*>(table);
+  const uint32_t zero[4] = {0, 0, 0, 0};
+  auto entry = [&](uint32_t x, uint32_t y) {
+    return &entries[4 * (size_t{y} * width + x)];
+  };
+  const uint32_t* const a = entry(x1, y1);
+  const uint32_t* const b = x0 > 0 ? entry(x0 - 1, y1) : zero;
+  const uint32_t* const c = y0 > 0 ? entry(x1, y0 - 1) : zero;
+  const uint32_t* const d = x0 > 0 && y0 > 0 ? entry(x0 - 1, y0 - 1) : zero;
+
+  float sum[4];
+  if (accumulation == kIntegralUint32) {
+    // Wraps around and back, so only the window has to fit 32 bits
+    for (int k = 0; k < 4; k++) {
+      sum[k] = static_cast<float>(a[k] - b[k] - c[k] + d[k]) / 255.0f;
+    }
+  } else {
+    const float area = static_cast<float>(x1 - x0 + 1) * (y1 - y0 + 1);
+    for (int k = 0; k < 4; k++) {
+      float values[4];
+      memcpy(&values[0], &a[k], sizeof(float));
+      memcpy(&values[1], &b[k], sizeof(float));
+      memcpy(&values[2], &c[k], sizeof(float));
+      memcpy(&values[3], &d[k], sizeof(float));
+      sum[k] = values[0] - values[1] - values[2] + values[3] +
+               kIntegralFloatOffset * area;
+    }
+  }
+  return Vec4{sum[0], sum[1], sum[2], sum[3]};
+}
+
+#endif  // INTEGRAL_IMAGE_H
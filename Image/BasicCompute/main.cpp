@@ -3,31 +3,49 @@
 // https://vulkan-tutorial.com/en/Texture_mapping/Combined_image_sampler
 // export VK_INSTANCE_LAYERS=VK_LAYER_KHRONOS_validation
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <vulkan/vulkan.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <limits>
+#include <memory>
 #include <png++/png.hpp>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
-struct Vec4 {
-  float x;
-  float y;
-  float z;
-  float w;
-};
+#include "bounded_queue.h"
+#include "cpu_filter.h"
+#include "filter_device.h"
+#include "image_decoder.h"
+#include "multi_device.h"
+#include "png_decoder.h"
+#include "png_encoder.h"
+#include "qoi.h"
+#include "tile_scheduler.h"
+#include "worker_pool.h"
 
-bool operator==(const Vec4& lhs, const Vec4& rhs) {
-  return lhs.x == rhs.x && lhs.y == rhs.y && lhs.z == rhs.z && lhs.w == rhs.w;
-}
+const char* const kWorkgroupCachePath = "workgroup_size.cache";
 
-struct ImageConstantData {
-  uint32_t width;
-  uint32_t height;
-};
+// Device memory the pixel buffers of a single image may take, in MiB.
+// Larger images are filtered in tiles, see tile_scheduler.h.
+const uint32_t kDefaultTileBudgetMiB = 512;
+
+// Rows used to measure each device before the image is split between them
+const uint32_t kCalibrationRows = 128;
 
 std::vector<char> readFile(const std::string& filepath) {
   std::ifstream file{filepath, std::ios::binary};
@@ -149,344 +167,2127 @@ VkResult vkGetBestComputeQueueNPH(VkPhysicalDevice physicalDevice,
   return VK_ERROR_INITIALIZATION_FAILED;
 }
 
-int main(int argc, const char* const argv[]) {
-  if (argc <= 1) {
-    printf("Format to call: %s PNG_image\n", argv[0]);
-    return EXIT_FAILURE;
+using RgbImage = png::image<png::rgb_pixel>;
+
+// Decodes a PNG or QOI into pixels in the given storage format, usually
+// straight into the mapped input buffer. rgba8 rows are written in place,
+// the other formats are converted one row at a time.
+void decodeImage(ImageDecoder& decoder, PixelFormat format, void* pixels) {
+  const uint32_t width = decoder.width();
+  if (format == kPixelRgba8) {
+    decoder.readRgba8(pixels, size_t{4} * width);
+    return;
   }
 
-  const VkApplicationInfo applicationInfo = {VK_STRUCTURE_TYPE_APPLICATION_INFO,
-                                             nullptr,
-                                             "VKComputeSample",
-                                             0,
-                                             "",
-                                             0,
-                                             VK_MAKE_VERSION(1, 0, 9)};
+  decoder.readRows([format, pixels, width](uint32_t y, const uint8_t* rgba) {
+    const size_t first = size_t{y} * width;
+    for (uint32_t x = 0; x < width; x++) {
+      storeRgb8(format, pixels, first + x, rgba[4 * x], rgba[4 * x + 1],
+                rgba[4 * x + 2]);
+    }
+  });
+}
 
-  const VkInstanceCreateInfo instanceCreateInfo = {
-      VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-      nullptr,
-      0,
-      &applicationInfo,
-      0,
-      nullptr,
-      0,
-      nullptr};
+// Decodes a PNG or QOI into a host copy in the storage format, for the paths
+// that cannot decode straight into a device buffer
+std::vector<uint8_t> decodeToHost(const std::string& path, PixelFormat format,
+                                  uint32_t* width, uint32_t* height) {
+  ImageDecoder decoder(path);
+  *width = decoder.width();
+  *height = decoder.height();
+
+  std::vector<uint8_t> pixels(size_t{getPixelSize(format)} * *width *
+                              *height);
+  decodeImage(decoder, format, pixels.data());
+  return pixels;
+}
 
-  VkInstance instance = nullptr;
-  BAIL_ON_BAD_RESULT(vkCreateInstance(&instanceCreateInfo, nullptr, &instance));
+// Converts a png++ image to the RGBA storage format pixel by pixel, as the
+// sample did before PngDecoder. Only kept as the baseline of
+// --decode-benchmark.
+void uploadImage(const RgbImage& image, PixelFormat format, void* pixels) {
+  size_t k = 0;
+  for (size_t y = 0; y < image.get_height(); ++y) {
+    for (size_t x = 0; x < image.get_width(); ++x) {
+      const png::rgb_pixel& pixel = image[y][x];
+      storeRgb8(format, pixels, k, pixel.red, pixel.green, pixel.blue);
+      k++;
+    }
+  }
+}
 
-  uint32_t physicalDeviceCount = 0;
-  BAIL_ON_BAD_RESULT(
-      vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr));
+// Row y of pixels in the storage format as 8 bit RGB, the rows PngEncoder
+// takes
+void readbackRow(PixelFormat format, const void* pixels, uint32_t width,
+                 uint32_t y, uint8_t* rgb) {
+  const size_t first = size_t{y} * width;
+  for (uint32_t x = 0; x < width; x++) {
+    loadRgb8(format, pixels, first + x, &rgb[3 * x], &rgb[3 * x + 1],
+             &rgb[3 * x + 2]);
+  }
+}
 
-  auto* const physicalDevices =
-      (VkPhysicalDevice*)malloc(sizeof(VkPhysicalDevice) * physicalDeviceCount);
+// The whole image as packed 8 bit RGB, for the paths that time the readback
+// apart from the encoding
+std::vector<uint8_t> readbackImage(PixelFormat format, const void* pixels,
+                                   uint32_t width, uint32_t height) {
+  std::vector<uint8_t> rgb(size_t{3} * width * height);
+  for (uint32_t y = 0; y < height; y++) {
+    readbackRow(format, pixels, width, y, rgb.data() + size_t{3} * width * y);
+  }
+  return rgb;
+}
 
-  BAIL_ON_BAD_RESULT(vkEnumeratePhysicalDevices(instance, &physicalDeviceCount,
-                                                physicalDevices));
+// Packed RGB as a QOI image when path ends in .qoi and as a PNG otherwise
+void writeRgbImage(const std::string& path, const std::vector<uint8_t>& rgb,
+                   uint32_t width, uint32_t height,
+                   const PngEncoder& encoder) {
+  if (isQoiPath(path)) {
+    writeQoi(path, reinterpret_cast<const char*>(rgb.data()), width, height,
+             size_t{3} * width, kQoiRgb);
+  } else {
+    encoder.write(path, width, height, rgb.data(), size_t{3} * width);
+  }
+}
 
-  for (uint32_t i = 0; i < physicalDeviceCount; i++) {
-    // Just for information
-    VkPhysicalDeviceProperties props;
-    vkGetPhysicalDeviceProperties(physicalDevices[i], &props);
-    printf("device name: %s\n", props.deviceName);
+// The PNG encoder converts the rows as it filters them, on its pool's
+// threads
+void writeImage(const char* path, PixelFormat format, const void* pixels,
+                uint32_t width, uint32_t height, const PngEncoder& encoder) {
+  if (isQoiPath(path)) {
+    writeRgbImage(path, readbackImage(format, pixels, width, height), width,
+                  height, encoder);
+    return;
+  }
+  encoder.write(path, width, height,
+                [format, pixels, width](uint32_t y, uint8_t* rgb) {
+                  readbackRow(format, pixels, width, y, rgb);
+                });
+}
 
+// Loads the compiled shader of a kernel:
+//   simple    3x3 box, nine global memory reads per pixel
+//   tiled     3x3 box from a shared memory tile with a one pixel halo
+//   box       box of any radius as horizontal and vertical running sums
+//   gaussian  Gaussian of any radius as two separable passes
+//   image     3x3 box read from an optimally tiled image with texelFetch
+FilterKernel loadFilterKernel(const std::string& name) {
+  FilterKernel kernel;
+  kernel.name = name;
+  if (name == "simple") {
+    kernel.code = readFile("./shaders/simple_shader.comp.spv");
+  } else if (name == "tiled") {
+    kernel.code = readFile("./shaders/tiled_shader.comp.spv");
+    kernel.tileHalo = 1;
+  } else if (name == "box") {
+    kernel.code = readFile("./shaders/box_shader.comp.spv");
+    kernel.separable = true;
+    kernel.perLine = true;
+  } else if (name == "gaussian") {
+    kernel.code = readFile("./shaders/gaussian_shader.comp.spv");
+    kernel.separable = true;
+  } else if (name == "image") {
+    kernel.code = readFile("./shaders/image_shader.comp.spv");
+    kernel.imageIo = true;
+  } else {
+    throw std::runtime_error("unknown kernel: " + name);
+  }
+  return kernel;
+}
+
+// Filters the image rows [rows.begin, rows.end) on one device. The band is
+// uploaded with filter radius halo rows above and below so its edge rows see
+// the same neighbours as in the whole image; only the interior rows are
+// copied back. image and output hold pixels in the device's format.
+VkResult filterBand(FilterDevice& filterDevice,
+                    const std::vector<uint8_t>& image, uint32_t width,
+                    uint32_t height, WorkRange rows,
+                    std::vector<uint8_t>* output) {
+  if (rows.begin == rows.end) {
+    return VK_SUCCESS;
+  }
+
+  const uint32_t halo = filterDevice.radius();
+  const uint32_t haloBegin = rows.begin > halo ? rows.begin - halo : 0;
+  const uint32_t haloEnd = std::min(rows.end + halo, height);
+  const uint32_t bandHeight = haloEnd - haloBegin;
+
+  VkResult result = filterDevice.reserve(width, bandHeight);
+  if (result != VK_SUCCESS) return result;
+
+  const size_t rowSize = size_t{filterDevice.pixelSize()} * width;
+  memcpy(filterDevice.input(), image.data() + haloBegin * rowSize,
+         rowSize * bandHeight);
+
+  result = filterDevice.run(width, bandHeight);
+  if (result != VK_SUCCESS) return result;
+
+  memcpy(output->data() + rows.begin * rowSize,
+         static_cast<const uint8_t*>(filterDevice.output()) +
+             (rows.begin - haloBegin) * rowSize,
+         rowSize * (rows.end - rows.begin));
+
+  return VK_SUCCESS;
+}
+
+// Splits the image into row bands sized by the measured throughput of each
+// device and filters all bands concurrently.
+void filterOnAllDevices(const std::vector<VkPhysicalDevice>& physicalDevices,
+                        const FilterKernel& kernel, PixelFormat format,
+                        BorderMode border, uint32_t radius, bool autotune,
+                        bool profile, const std::vector<uint8_t>& image,
+                        uint32_t width, uint32_t height,
+                        const PngEncoder& encoder) {
+  const uint32_t deviceCount = static_cast<uint32_t>(physicalDevices.size());
+  std::vector<FilterDevice> filterDevices(deviceCount);
+  std::vector<double> throughput(deviceCount, 0.0);
+  std::vector<uint8_t> output(image.size());
+
+  const uint32_t calibrationRows = std::min(kCalibrationRows, height);
+
+  for (uint32_t i = 0; i < deviceCount; i++) {
     uint32_t queueFamilyIndex = 0;
     BAIL_ON_BAD_RESULT(
         vkGetBestComputeQueueNPH(physicalDevices[i], &queueFamilyIndex));
 
-    const float queuePrioritory = 1.0f;
-    const VkDeviceQueueCreateInfo deviceQueueCreateInfo = {
-        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        nullptr,
-        0,
-        queueFamilyIndex,
-        1,
-        &queuePrioritory};
-
-    const VkDeviceCreateInfo deviceCreateInfo = {
-        VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        nullptr,
-        0,
-        1,
-        &deviceQueueCreateInfo,
-        0,
-        nullptr,
-        0,
-        nullptr,
-        nullptr};
-
-    VkDevice device = nullptr;
+    FilterDevice& filterDevice = filterDevices[i];
     BAIL_ON_BAD_RESULT(
-        vkCreateDevice(physicalDevices[i], &deviceCreateInfo, nullptr, &device));
+        filterDevice.init(physicalDevices[i], queueFamilyIndex, kernel,
+                          format, profile));
+    filterDevice.setBorder(border);
+    filterDevice.setRadius(radius);
+
+    BAIL_ON_BAD_RESULT(filterDevice.reserve(width, calibrationRows));
+    BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+        autotune, kWorkgroupCachePath, width, calibrationRows));
+
+    BAIL_ON_BAD_RESULT(calibrateThroughput(
+        [&]() {
+          return filterBand(filterDevice, image, width, height,
+                            {0, calibrationRows}, &output);
+        },
+        calibrationRows, &throughput[i]));
+
+    printf("device %u: %s, workgroup size %ux%u, %.0f rows/s\n", i,
+           filterDevice.properties().deviceName,
+           filterDevice.workgroupSize().x, filterDevice.workgroupSize().y,
+           throughput[i]);
+  }
 
-    VkPhysicalDeviceMemoryProperties properties;
+  const std::vector<WorkRange> bands = splitProportional(height, throughput);
+  std::vector<double> seconds(deviceCount, 0.0);
 
-    vkGetPhysicalDeviceMemoryProperties(physicalDevices[i], &properties);
+  // Band plus halo rows
+  for (uint32_t i = 0; i < deviceCount; i++) {
+    BAIL_ON_BAD_RESULT(filterDevices[i].reserve(
+        width, std::min(bands[i].end - bands[i].begin + 2 * radius, height)));
+  }
 
-    // Load an decode an image.
-    png::image<png::rgb_pixel> image(argv[1]);
-    const int32_t width = image.get_width();
-    const int32_t height = image.get_height();
-    const int32_t bufferLength = width * height;
+  const auto start = std::chrono::steady_clock::now();
+  BAIL_ON_BAD_RESULT(runConcurrently(deviceCount, [&](uint32_t i) {
+    const auto bandStart = std::chrono::steady_clock::now();
+    const VkResult result =
+        filterBand(filterDevices[i], image, width, height, bands[i], &output);
+    seconds[i] = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - bandStart)
+                     .count();
+    return result;
+  }));
+  const double totalSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  for (uint32_t i = 0; i < deviceCount; i++) {
+    printf("device %u: rows %u-%u (%u), %.3f ms\n", i, bands[i].begin,
+           bands[i].end, bands[i].end - bands[i].begin, seconds[i] * 1e3);
+    if (profile) {
+      filterDevices[i].profiler().report(stdout);
+    }
+    filterDevices[i].destroy();
+  }
+  printf("total: %.3f ms on %u device(s)\n", totalSeconds * 1e3, deviceCount);
 
-    using BufferDataT = Vec4;
+  writeImage("output.png", format, output.data(), width, height, encoder);
+}
 
-    const uint32_t bufferSize = sizeof(BufferDataT) * bufferLength;
+// Filters the image whole and in tiles on one device and compares the two.
+// Unless budget is set it is a quarter of what the whole image needs, which
+// forces several tiles. Filters reading a fixed neighbourhood must match
+// exactly; the running sums of per line kernels start at a different pixel
+// in every tile, so they may round differently by one step of the storage
+// format. Returns whether the outputs match.
+bool checkTiling(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+                 PixelFormat format, BorderMode border, uint32_t radius,
+                 bool autotune, const std::vector<uint8_t>& image,
+                 uint32_t width, uint32_t height, VkDeviceSize budget) {
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                       kernel, format, /*profile=*/false,
+                                       /*slotCount=*/2));
+  filterDevice.setBorder(border);
+  filterDevice.setRadius(radius);
+
+  const size_t pixelCount = size_t{width} * height;
+  if (budget == 0) {
+    budget = filterDevice.slotBytesPerPixel() * filterDevice.slotCount() *
+             pixelCount / 4;
+  }
 
-    // set memoryTypeIndex to an invalid entry in the properties.memoryTypes
-    // array
-    uint32_t memoryTypeIndex = VK_MAX_MEMORY_TYPES;
+  TilePlan plan;
+  if (!planDeviceTiles(filterDevice, width, height, budget, &plan)) {
+    printf("tile check: a budget of %llu bytes does not fit one tile\n",
+           static_cast<unsigned long long>(budget));
+    filterDevice.destroy();
+    return false;
+  }
 
-    for (uint32_t k = 0; k < properties.memoryTypeCount; k++) {
-      if ((VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &
-           properties.memoryTypes[k].propertyFlags) &&
-          (VK_MEMORY_PROPERTY_HOST_COHERENT_BIT &
-           properties.memoryTypes[k].propertyFlags) &&
-          (bufferSize <
-           properties.memoryHeaps[properties.memoryTypes[k].heapIndex].size)) {
-        memoryTypeIndex = k;
-        break;
+  BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+  memcpy(filterDevice.input(), image.data(), image.size());
+  BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+      autotune, kWorkgroupCachePath, width, height));
+  BAIL_ON_BAD_RESULT(filterDevice.run(width, height));
+
+  std::vector<Vec4> reference(pixelCount);
+  for (size_t i = 0; i < pixelCount; i++) {
+    reference[i] = loadPixel(format, filterDevice.output(), i);
+  }
+
+  std::vector<uint8_t> tiled(image.size());
+  BAIL_ON_BAD_RESULT(filterTiled(filterDevice, plan, image.data(), width,
+                                 tiled.data()));
+
+  float maxDiff = 0.0f;
+  size_t differentCount = 0;
+  for (size_t i = 0; i < pixelCount; i++) {
+    const Vec4 output = loadPixel(format, tiled.data(), i);
+    const float diff = std::max({std::abs(output.x - reference[i].x),
+                                 std::abs(output.y - reference[i].y),
+                                 std::abs(output.z - reference[i].z),
+                                 std::abs(output.w - reference[i].w)});
+    maxDiff = std::max(maxDiff, diff);
+    differentCount += diff > 0.0f ? 1 : 0;
+  }
+
+  float tolerance = 0.0f;
+  if (kernel.perLine) {
+    tolerance = format == kPixelRgba8     ? 1.0f / 255.0f
+                : format == kPixelRgba16f ? 1.0f / 1024.0f
+                                          : 1e-5f;
+  }
+  const bool match = maxDiff <= tolerance;
+
+  printf(
+      "tile check: %s kernel, %s pixels, %ux%u image, %zu tiles of up to "
+      "%ux%u, halo %u: %zu pixels differ, max diff %g: %s\n",
+      kernel.name.c_str(), getPixelFormatName(format), width, height,
+      plan.tiles.size(), plan.inputWidth, plan.inputHeight,
+      filterDevice.radius(), differentCount, maxDiff,
+      match ? "ok" : "MISMATCH");
+
+  filterDevice.destroy();
+  return match;
+}
+
+// Builds the summed-area table of the image on one device and compares the
+// sums over the window of the given radius around every pixel, read from
+// the table with four lookups, to sums in double precision. Integer tables
+// must be exact up to the conversion to float, fp32 tables must get the
+// mean of every window within half a step of an 8 bit channel. rgba8 images
+// are also summed in fp32 for comparison, which does not count. Returns
+// whether the table of the format's accumulation passes.
+bool checkIntegral(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+                   PixelFormat format, uint32_t radius, bool preferShared,
+                   const std::vector<uint8_t>& image, uint32_t width,
+                   uint32_t height) {
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                       kernel, format));
+  BAIL_ON_BAD_RESULT(filterDevice.initIntegral(
+      readFile("./shaders/integral_subgroup_shader.comp.spv"),
+      readFile("./shaders/integral_shader.comp.spv"), preferShared));
+
+  uint32_t maxWidth = 0;
+  uint32_t maxHeight = 0;
+  uint64_t maxPixels = 0;
+  filterDevice.getMaxRunExtent(&maxWidth, &maxHeight, &maxPixels);
+  if (width > maxWidth || height > maxHeight ||
+      uint64_t{width} * height > maxPixels) {
+    printf("integral check: the table of a %ux%u image does not fit\n", width,
+           height);
+    filterDevice.destroy();
+    return false;
+  }
+
+  BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+  memcpy(filterDevice.input(), image.data(), image.size());
+
+  // Reference table in double with a row and a column of zeros in front,
+  // exact for any image that fits a device buffer
+  const size_t stride = size_t{width} + 1;
+  std::vector<double> reference(4 * stride * (size_t{height} + 1), 0.0);
+  for (uint32_t y = 0; y < height; y++) {
+    double rowSum[4] = {0.0, 0.0, 0.0, 0.0};
+    for (uint32_t x = 0; x < width; x++) {
+      const Vec4 pixel = loadPixel(format, image.data(), size_t{y} * width + x);
+      const float values[4] = {pixel.x, pixel.y, pixel.z, pixel.w};
+      for (int k = 0; k < 4; k++) {
+        rowSum[k] += values[k];
+        reference[4 * ((y + 1) * stride + x + 1) + k] =
+            reference[4 * (y * stride + x + 1) + k] + rowSum[k];
       }
     }
+  }
 
-    BAIL_ON_BAD_RESULT(memoryTypeIndex == VK_MAX_MEMORY_TYPES
-                           ? VK_ERROR_OUT_OF_HOST_MEMORY
-                           : VK_SUCCESS);
+  const IntegralAccumulation formatAccumulation =
+      getIntegralAccumulation(format);
+  std::vector<IntegralAccumulation> accumulations = {formatAccumulation};
+  if (formatAccumulation != kIntegralFloat32) {
+    accumulations.push_back(kIntegralFloat32);
+  }
 
-    const VkMemoryAllocateInfo memoryAllocateInfo = {
-        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr, bufferSize, memoryTypeIndex};
+  bool match = false;
+  for (const IntegralAccumulation accumulation : accumulations) {
+    const auto start = std::chrono::steady_clock::now();
+    BAIL_ON_BAD_RESULT(filterDevice.runIntegral(width, height, accumulation));
+    const double milliseconds = std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+
+    float maxError = 0.0f;
+    for (uint32_t y = 0; y < height; y++) {
+      const uint32_t y0 = y > radius ? y - radius : 0;
+      const uint32_t y1 = std::min(y + radius, height - 1);
+      for (uint32_t x = 0; x < width; x++) {
+        const uint32_t x0 = x > radius ? x - radius : 0;
+        const uint32_t x1 = std::min(x + radius, width - 1);
+        const Vec4 sum = getIntegralBoxSum(filterDevice.integral(),
+                                           accumulation, width, x0, y0, x1,
+                                           y1);
+        const float sums[4] = {sum.x, sum.y, sum.z, sum.w};
+        const double area = double{x1 - x0 + 1.0} * (y1 - y0 + 1);
+        for (int k = 0; k < 4; k++) {
+          const double expected =
+              reference[4 * ((y1 + 1) * stride + x1 + 1) + k] -
+              reference[4 * ((y1 + 1) * stride + x0) + k] -
+              reference[4 * (y0 * stride + x1 + 1) + k] +
+              reference[4 * (y0 * stride + x0) + k];
+          maxError = std::max(
+              maxError,
+              static_cast<float>(std::abs(sums[k] - expected) / area));
+        }
+      }
+    }
 
-    VkDeviceMemory memoryIn = nullptr;
-    BAIL_ON_BAD_RESULT(
-        vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &memoryIn));
+    const float tolerance =
+        accumulation == kIntegralUint32 ? 1e-6f : 0.5f / 255.0f;
+    const bool comparison = accumulation != formatAccumulation;
+    if (!comparison) {
+      match = maxError <= tolerance;
+    }
+    printf(
+        "integral check: %ux%u %s image, %s sums, %s scan, radius %u, "
+        "%.3f ms: max error of the window means %g: %s%s\n",
+        width, height, getPixelFormatName(format),
+        getIntegralAccumulationName(accumulation),
+        filterDevice.integralUsesSubgroups() ? "subgroup" : "shared memory",
+        radius, milliseconds, maxError,
+        maxError <= tolerance ? "ok" : "MISMATCH",
+        comparison ? " (comparison only)" : "");
+  }
 
-    VkDeviceMemory memoryOut = nullptr;
-    BAIL_ON_BAD_RESULT(
-        vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &memoryOut));
+  filterDevice.destroy();
+  return match;
+}
 
-    BufferDataT* payload = nullptr;
-    BAIL_ON_BAD_RESULT(
-        vkMapMemory(device, memoryIn, 0, bufferSize, 0, (void**)&payload));
-
-    uint32_t k = 0;
-    for (size_t y = 0; y < height; ++y) {
-      for (size_t x = 0; x < width; ++x) {
-        payload[k].x = image[y][x].red / 255.0;
-        payload[k].y = image[y][x].green / 255.0;
-        payload[k].z = image[y][x].blue / 255.0;
-        payload[k].w = 1.0;
-        k++;
+// Builds the mip chain of the image on the device with the image kernel
+// and filters every level of it, writing output_level<N>.png per level. The
+// image is uploaded once; coarse-to-fine filters would read the levels the
+// same way.
+void filterPyramid(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+                   PixelFormat format, BorderMode border, bool autotune,
+                   bool preferCompute, const char* imagePath,
+                   const PngEncoder& encoder) {
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                       kernel, format));
+  filterDevice.setBorder(border);
+  BAIL_ON_BAD_RESULT(filterDevice.initPyramid(
+      readFile("./shaders/downsample_shader.comp.spv"), preferCompute));
+
+  ImageDecoder decoder(imagePath);
+  const uint32_t width = decoder.width();
+  const uint32_t height = decoder.height();
+  uint32_t maxWidth = 0;
+  uint32_t maxHeight = 0;
+  uint64_t maxPixels = 0;
+  filterDevice.getMaxRunExtent(&maxWidth, &maxHeight, &maxPixels);
+  if (width > maxWidth || height > maxHeight ||
+      getPyramidPixelCount(width, height) > maxPixels) {
+    printf("A pyramid takes images of up to %ux%u and %llu pixels\n",
+           maxWidth, maxHeight, static_cast<unsigned long long>(maxPixels));
+    filterDevice.destroy();
+    return;
+  }
+
+  BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+  decodeImage(decoder, format, filterDevice.input());
+  BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+      autotune, kWorkgroupCachePath, width, height));
+
+  const uint32_t levelCount = getPyramidLevelCount(width, height);
+  printf("%s kernel, %s pixels, %u levels built by %s, workgroup size: "
+         "%ux%u\n",
+         kernel.name.c_str(), getPixelFormatName(format), levelCount,
+         filterDevice.pyramidUsesBlit() ? "blits" : "the downsampler",
+         filterDevice.workgroupSize().x, filterDevice.workgroupSize().y);
+
+  BAIL_ON_BAD_RESULT(filterDevice.runPyramid(width, height));
+
+  const uint8_t* const output =
+      static_cast<const uint8_t*>(filterDevice.output());
+  for (uint32_t level = 0; level < levelCount; level++) {
+    const std::string path = "output_level" + std::to_string(level) + ".png";
+    writeImage(path.c_str(), format,
+               output + filterDevice.pixelSize() *
+                            getPyramidLevelOffset(width, height, level),
+               getPyramidLevelSize(width, level),
+               getPyramidLevelSize(height, level), encoder);
+  }
+
+  filterDevice.destroy();
+}
+
+// Counts the histograms of the image and maps it through the tone curve of
+// mode on one device, in a single submission, and writes output.png. The
+// device histograms are checked against countHistogram() on the host;
+// returns whether they match.
+bool toneImage(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+               PixelFormat format, ToneMode mode, uint32_t binCount,
+               bool preferShared, const char* imagePath,
+               const PngEncoder& encoder) {
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                       kernel, format));
+  BAIL_ON_BAD_RESULT(filterDevice.initHistogram(
+      readFile("./shaders/histogram_subgroup_shader.comp.spv"),
+      readFile("./shaders/histogram_shader.comp.spv"), binCount,
+      preferShared));
+
+  ImageDecoder decoder(imagePath);
+  const uint32_t width = decoder.width();
+  const uint32_t height = decoder.height();
+  const uint64_t pixelCount = uint64_t{width} * height;
+  if (pixelCount > kMaxCountedPixels) {
+    printf("%ux%u is too large for the histogram shaders\n", width, height);
+    filterDevice.destroy();
+    return false;
+  }
+  BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+  decodeImage(decoder, format, filterDevice.input());
+  const std::vector<uint32_t> reference =
+      countHistogram(format, filterDevice.input(), pixelCount, binCount);
+
+  const auto start = std::chrono::steady_clock::now();
+  BAIL_ON_BAD_RESULT(filterDevice.runTone(pixelCount, mode, kToneClip));
+  const double milliseconds = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+
+  const bool match = memcmp(filterDevice.histogram(), reference.data(),
+                            sizeof(uint32_t) * reference.size()) == 0;
+  printf(
+      "%s: %ux%u %s image, %u bins, %s histogram, %.3f ms: histogram %s\n",
+      getToneModeName(mode), width, height,
+      getPixelFormatName(format), binCount,
+      filterDevice.histogramUsesSubgroups() ? "subgroup" : "shared memory",
+      milliseconds, match ? "ok" : "MISMATCH");
+
+  writeImage("output.png", format, filterDevice.output(), width, height,
+             encoder);
+
+  filterDevice.destroy();
+  return match;
+}
+
+// Runs the filter graph spec (see filter_graph.h) on the image in one
+// submission and writes every output of the graph to <node name>.png.
+// Returns false when the graph does not parse or the image is too large.
+bool filterGraph(VkPhysicalDevice physicalDevice, PixelFormat format,
+                 BorderMode border, const char* spec, const char* imagePath,
+                 const PngEncoder& encoder) {
+  FilterGraph graph;
+  std::string error;
+  if (!parseFilterGraph(spec, &graph, &error)) {
+    printf("graph: %s\n", error.c_str());
+    return false;
+  }
+
+  std::vector<FilterKernel> kernels;
+  for (const GraphNode& node : graph.nodes) {
+    if (node.op == kGraphFilter &&
+        std::none_of(kernels.begin(), kernels.end(),
+                     [&node](const FilterKernel& kernel) {
+                       return kernel.name == node.kernel;
+                     })) {
+      kernels.push_back(loadFilterKernel(node.kernel));
+    }
+  }
+
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  // The main kernel of the device is not used, any buffer kernel will do
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(
+      physicalDevice, queueFamilyIndex,
+      kernels.empty() ? loadFilterKernel("simple") : kernels[0], format));
+  filterDevice.setBorder(border);
+  BAIL_ON_BAD_RESULT(filterDevice.initGraph(
+      graph, kernels, readFile("./shaders/mix_shader.comp.spv"),
+      readFile("./shaders/histogram_subgroup_shader.comp.spv"),
+      readFile("./shaders/histogram_shader.comp.spv")));
+
+  ImageDecoder decoder(imagePath);
+  const uint32_t width = decoder.width();
+  const uint32_t height = decoder.height();
+  if (uint64_t{width} * height > kMaxCountedPixels) {
+    printf("%ux%u is too large for the graph shaders\n", width, height);
+    filterDevice.destroy();
+    return false;
+  }
+  BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+  decodeImage(decoder, format, filterDevice.input());
+
+  const auto start = std::chrono::steady_clock::now();
+  BAIL_ON_BAD_RESULT(filterDevice.runGraph(width, height));
+  const double milliseconds = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+
+  const GraphSchedule& schedule = filterDevice.graphSchedule();
+  const double imageMiB =
+      static_cast<double>(filterDevice.pixelSize()) * width * height /
+      (1 << 20);
+  printf(
+      "graph: %ux%u %s image, %zu nodes, %zu dispatches in %u waves, "
+      "%u buffers for %u images (%.1f MiB instead of %.1f MiB), "
+      "%.3f ms\n",
+      width, height, getPixelFormatName(format), graph.nodes.size(),
+      schedule.steps.size(), schedule.waveCount, schedule.bufferCount,
+      schedule.imageCount, imageMiB * schedule.bufferCount,
+      imageMiB * schedule.imageCount, milliseconds);
+
+  for (uint32_t k = 0; k < schedule.outputNodes.size(); k++) {
+    const std::string path =
+        graph.nodes[schedule.outputNodes[k]].name + ".png";
+    writeImage(path.c_str(), format, filterDevice.graphOutput(k), width,
+               height, encoder);
+  }
+
+  filterDevice.destroy();
+  return true;
+}
+
+// Host time spent in each stage of a service job, in milliseconds
+struct JobTimes {
+  double decode = 0.0;  // includes writing the pixels to the device
+  double dispatch = 0.0;
+  double readback = 0.0;
+  double encode = 0.0;
+  const char* backend = "gpu";
+
+  double total() const { return decode + dispatch + readback + encode; }
+};
+
+// Returns the milliseconds since *start and moves *start to now
+double lapMilliseconds(std::chrono::steady_clock::time_point* start) {
+  const auto now = std::chrono::steady_clock::now();
+  const double ms =
+      std::chrono::duration<double, std::milli>(now - *start).count();
+  *start = now;
+  return ms;
+}
+
+// Where images are filtered, see --backend
+enum Backend : uint32_t {
+  kBackendGpu,
+  kBackendCpu,   // CpuFilter, no Vulkan needed
+  kBackendAuto,  // the CPU below a calibrated image size, the GPU above
+};
+
+inline bool parseBackend(const char* name, Backend* backend) {
+  const std::string value = name;
+  if (value == "gpu") {
+    *backend = kBackendGpu;
+  } else if (value == "cpu") {
+    *backend = kBackendCpu;
+  } else if (value == "auto") {
+    *backend = kBackendAuto;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Sides of the square images the backends are timed on, and the runs of
+// which the fastest counts
+const uint32_t kCalibrationSides[2] = {128, 1024};
+const uint32_t kCalibrationRuns = 3;
+
+// Returns the pixel count from which filterDevice filters an image faster
+// than cpuFilter. Each is timed on two sizes and modelled as a fixed cost
+// per image plus a cost per pixel; the threshold is where the two lines
+// cross. The GPU cost is FilterDevice::run(), submit to fence, as decoding
+// and reading back cost the same on either backend.
+uint64_t calibrateCpuThreshold(FilterDevice& filterDevice,
+                               CpuFilter& cpuFilter) {
+  double pixels[2];
+  double cpuMs[2];
+  double gpuMs[2];
+  for (int i = 0; i < 2; i++) {
+    const uint32_t side = kCalibrationSides[i];
+    pixels[i] = static_cast<double>(side) * side;
+
+    // Zeros, so no pass is slowed down by denormals or NaNs
+    const size_t size = size_t{cpuFilter.pixelSize()} * side * side;
+    std::vector<uint8_t> input(size);
+    std::vector<uint8_t> output(size);
+    BAIL_ON_BAD_RESULT(filterDevice.reserve(side, side));
+    memset(filterDevice.input(), 0, size);
+
+    cpuMs[i] = std::numeric_limits<double>::max();
+    gpuMs[i] = std::numeric_limits<double>::max();
+    BAIL_ON_BAD_RESULT(filterDevice.run(side, side));
+    for (uint32_t run = 0; run < kCalibrationRuns; run++) {
+      auto start = std::chrono::steady_clock::now();
+      cpuFilter.run(input.data(), output.data(), side, side);
+      cpuMs[i] = std::min(cpuMs[i], lapMilliseconds(&start));
+
+      BAIL_ON_BAD_RESULT(filterDevice.run(side, side));
+      gpuMs[i] = std::min(gpuMs[i], lapMilliseconds(&start));
+    }
+  }
+
+  const double cpuPerPixel = (cpuMs[1] - cpuMs[0]) / (pixels[1] - pixels[0]);
+  const double gpuPerPixel = (gpuMs[1] - gpuMs[0]) / (pixels[1] - pixels[0]);
+  if (cpuPerPixel <= gpuPerPixel) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+  const double cpuFixed = cpuMs[0] - cpuPerPixel * pixels[0];
+  const double gpuFixed = gpuMs[0] - gpuPerPixel * pixels[0];
+  const double crossing = (gpuFixed - cpuFixed) / (cpuPerPixel - gpuPerPixel);
+  return crossing > 0.0 ? static_cast<uint64_t>(crossing) : 0;
+}
+
+// Filters one image on the CPU and writes it to output.png
+void filterOnCpu(const char* imagePath, CpuFilter& cpuFilter,
+                 const PngEncoder& encoder) {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  const std::vector<uint8_t> pixels =
+      decodeToHost(imagePath, cpuFilter.format(), &width, &height);
+  std::vector<uint8_t> output(pixels.size());
+
+  printf("cpu backend, %s pixels, radius %u, %u threads\n",
+         getPixelFormatName(cpuFilter.format()), cpuFilter.radius(),
+         cpuFilter.threadCount());
+
+  cpuFilter.run(pixels.data(), output.data(), width, height);
+  writeImage("output.png", cpuFilter.format(), output.data(), width, height,
+             encoder);
+}
+
+// Where the service filters its jobs: images of fewer than cpuThreshold
+// pixels on cpu, the others on device. --backend can rule either out, which
+// leaves it null.
+struct FilterBackends {
+  FilterDevice* device = nullptr;
+  CpuFilter* cpu = nullptr;
+  uint64_t cpuThreshold = 0;
+};
+
+// Throws a failed Vulkan call of a job, so that it is answered like a decode
+// error instead of ending the service
+void checkJobResult(VkResult result, const char* call) {
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error(std::string(call) + " failed with VkResult " +
+                             std::to_string(result));
+  }
+}
+
+// Filters one image with backends that are already set up. Only the pixel
+// buffers grow when the image is larger than every image before it, and
+// images too large for the device are filtered in tiles. Decode, encode and
+// Vulkan errors are returned as text so that one bad job does not stop the
+// service.
+bool runJob(const FilterBackends& backends, const PngEncoder& encoder,
+            bool autotune, bool* workgroupSelected,
+            const std::string& inputPath, const std::string& outputPath,
+            JobTimes* times, std::string* error) {
+  auto lap = std::chrono::steady_clock::now();
+  try {
+    ImageDecoder decoder(inputPath);
+    const uint32_t width = decoder.width();
+    const uint32_t height = decoder.height();
+
+    if (uint64_t{width} * height < backends.cpuThreshold) {
+      CpuFilter& cpuFilter = *backends.cpu;
+      const size_t size = size_t{cpuFilter.pixelSize()} * width * height;
+      std::vector<uint8_t> pixels(size);
+      std::vector<uint8_t> output(size);
+      decodeImage(decoder, cpuFilter.format(), pixels.data());
+      times->decode = lapMilliseconds(&lap);
+
+      cpuFilter.run(pixels.data(), output.data(), width, height);
+      times->dispatch = lapMilliseconds(&lap);
+      times->backend = "cpu";
+
+      const std::vector<uint8_t> rgb =
+          readbackImage(cpuFilter.format(), output.data(), width, height);
+      times->readback = lapMilliseconds(&lap);
+
+      writeRgbImage(outputPath, rgb, width, height, encoder);
+      times->encode = lapMilliseconds(&lap);
+      return true;
+    }
+
+    FilterDevice& filterDevice = *backends.device;
+    TilePlan plan;
+    if (!planDeviceTiles(filterDevice, width, height,
+                         VkDeviceSize{kDefaultTileBudgetMiB} << 20, &plan)) {
+      throw std::runtime_error("image does not fit the device");
+    }
+
+    // Images too large for one dispatch or the budget stay on the host and
+    // stream through the device tile by tile
+    const bool tiled = plan.tiles.size() > 1;
+    std::vector<uint8_t> pixels;
+    std::vector<uint8_t> output;
+    if (tiled) {
+      pixels.resize(size_t{filterDevice.pixelSize()} * width * height);
+      output.resize(pixels.size());
+      checkJobResult(filterDevice.reserve(plan.inputWidth, plan.inputHeight),
+                     "reserve");
+      decodeImage(decoder, filterDevice.format(), pixels.data());
+    } else {
+      checkJobResult(filterDevice.reserve(width, height), "reserve");
+      decodeImage(decoder, filterDevice.format(), filterDevice.input());
+    }
+    times->decode = lapMilliseconds(&lap);
+
+    // The first job picks the workgroup size, tuning on its image if asked
+    if (!*workgroupSelected) {
+      checkJobResult(filterDevice.selectWorkgroupSize(
+                         autotune, kWorkgroupCachePath, plan.inputWidth,
+                         plan.inputHeight),
+                     "selectWorkgroupSize");
+      *workgroupSelected = true;
+      lap = std::chrono::steady_clock::now();
+    }
+
+    if (tiled) {
+      checkJobResult(filterTiled(filterDevice, plan, pixels.data(), width,
+                                 output.data()),
+                     "filterTiled");
+    } else {
+      checkJobResult(filterDevice.run(width, height), "run");
+    }
+    times->dispatch = lapMilliseconds(&lap);
+
+    const std::vector<uint8_t> rgb =
+        readbackImage(filterDevice.format(),
+                      tiled ? output.data() : filterDevice.output(), width,
+                      height);
+    times->readback = lapMilliseconds(&lap);
+
+    writeRgbImage(outputPath, rgb, width, height, encoder);
+    times->encode = lapMilliseconds(&lap);
+  } catch (const std::exception& e) {
+    *error = e.what();
+    return false;
+  }
+
+  return true;
+}
+
+// Reads jobs from in, one per line: "INPUT [OUTPUT]", where OUTPUT defaults
+// to output.png and is written as QOI when it ends in .qoi. Every job is
+// answered on out with its stage times and backend. Returns false when a
+// "quit" line asks the service to stop, and true when in ends or out can no
+// longer be written, as when a client disconnects before its answer.
+bool serveJobs(const FilterBackends& backends, const PngEncoder& encoder,
+               bool autotune, bool* workgroupSelected, FILE* in, FILE* out,
+               JobTimes* totals, uint32_t* jobCount) {
+  char line[4096];
+  while (fgets(line, sizeof(line), in) != nullptr) {
+    std::istringstream words(line);
+    std::string inputPath;
+    std::string outputPath = "output.png";
+    if (!(words >> inputPath)) {
+      continue;
+    }
+    if (inputPath == "quit") {
+      return false;
+    }
+    words >> outputPath;
+
+    JobTimes times;
+    std::string error;
+    if (!runJob(backends, encoder, autotune, workgroupSelected, inputPath,
+                outputPath, &times, &error)) {
+      fprintf(out, "error: %s: %s\n", inputPath.c_str(), error.c_str());
+      if (fflush(out) != 0) {
+        return true;
       }
+      continue;
     }
 
-    vkUnmapMemory(device, memoryIn);
+    fprintf(out,
+            "%s: decode %.3f dispatch %.3f readback %.3f encode %.3f "
+            "total %.3f ms on %s\n",
+            outputPath.c_str(), times.decode, times.dispatch, times.readback,
+            times.encode, times.total(), times.backend);
 
-    BAIL_ON_BAD_RESULT(
-        vkMapMemory(device, memoryOut, 0, bufferSize, 0, (void**)&payload));
+    totals->decode += times.decode;
+    totals->dispatch += times.dispatch;
+    totals->readback += times.readback;
+    totals->encode += times.encode;
+    (*jobCount)++;
 
-    for (; k < bufferSize / sizeof(BufferDataT); k++) {
-      payload[k].x = rand() * 0.1;
-      payload[k].y = rand() * 0.1;
-      payload[k].z = rand() * 0.1;
-      payload[k].w = rand() * 0.1;
+    if (fflush(out) != 0) {
+      return true;
     }
+  }
 
-    vkUnmapMemory(device, memoryOut);
+  return true;
+}
 
-    const VkBufferCreateInfo bufferCreateInfo = {
-        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        nullptr,
-        0,
-        bufferSize,
-        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-        VK_SHARING_MODE_EXCLUSIVE,
-        1,
-        &queueFamilyIndex};
+int createServerSocket(const char* path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
 
-    VkBuffer in_buffer = nullptr;
-    BAIL_ON_BAD_RESULT(
-        vkCreateBuffer(device, &bufferCreateInfo, nullptr, &in_buffer));
+  const int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (serverSocket < 0) {
+    return -1;
+  }
 
-    BAIL_ON_BAD_RESULT(vkBindBufferMemory(device, in_buffer, memoryIn, 0));
+  unlink(path);
+  if (bind(serverSocket, reinterpret_cast<const sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(serverSocket, 4) != 0) {
+    close(serverSocket);
+    return -1;
+  }
 
-    VkBuffer out_buffer = nullptr;
-    BAIL_ON_BAD_RESULT(
-        vkCreateBuffer(device, &bufferCreateInfo, nullptr, &out_buffer));
-
-    BAIL_ON_BAD_RESULT(vkBindBufferMemory(device, out_buffer, memoryOut, 0));
-
-    const auto compCode = readFile("./shaders/simple_shader.comp.spv");
-
-    VkShaderModuleCreateInfo shaderModuleCreateInfo = {
-        VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0,
-        compCode.size(),                  // sizeof(shader),
-        (const uint32_t*)compCode.data()  // shader
-    };
-
-    VkShaderModule shader_module = nullptr;
-
-    BAIL_ON_BAD_RESULT(vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr,
-                                            &shader_module));
-
-    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2] = {
-        {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
-         nullptr},
-        {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT,
-         nullptr}};
-
-    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
-        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0, 2,
-        descriptorSetLayoutBindings};
-
-    VkDescriptorSetLayout descriptorSetLayout = nullptr;
-    BAIL_ON_BAD_RESULT(vkCreateDescriptorSetLayout(
-        device, &descriptorSetLayoutCreateInfo, nullptr, &descriptorSetLayout));
-
-    VkPushConstantRange pushConstantRange{
-        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .offset = 0,
-        .size = sizeof(ImageConstantData),
-    };
-
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .pNext = nullptr,
-        .flags = 0,
-        .setLayoutCount = 1,
-        .pSetLayouts = &descriptorSetLayout,
-        .pushConstantRangeCount = 1,
-        .pPushConstantRanges = &pushConstantRange,
-    };
-
-    VkPipelineLayout pipelineLayout = nullptr;
-    BAIL_ON_BAD_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo,
-                                              nullptr, &pipelineLayout));
-
-    VkComputePipelineCreateInfo computePipelineCreateInfo = {
-        VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-        nullptr,
-        0,
-        {VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr, 0,
-         VK_SHADER_STAGE_COMPUTE_BIT, shader_module, "main", nullptr},
-        pipelineLayout,
-        nullptr,
-        0};
-
-    VkPipeline pipeline = nullptr;
-    BAIL_ON_BAD_RESULT(vkCreateComputePipelines(
-        device, nullptr, 1, &computePipelineCreateInfo, nullptr, &pipeline));
-
-    VkCommandPoolCreateInfo commandPoolCreateInfo = {
-        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0, queueFamilyIndex};
-
-    VkDescriptorPoolSize descriptorPoolSize = {
-        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2};
-
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
-        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-        nullptr,
-        0,
-        1,
-        1,
-        &descriptorPoolSize};
-
-    VkDescriptorPool descriptorPool = nullptr;
-    BAIL_ON_BAD_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo,
-                                              nullptr, &descriptorPool));
-
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
-        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr, descriptorPool, 1,
-        &descriptorSetLayout};
-
-    VkDescriptorSet descriptorSet = nullptr;
-    BAIL_ON_BAD_RESULT(vkAllocateDescriptorSets(
-        device, &descriptorSetAllocateInfo, &descriptorSet));
-
-    VkDescriptorBufferInfo in_descriptorBufferInfo = {in_buffer, 0,
-                                                      VK_WHOLE_SIZE};
-
-    VkDescriptorBufferInfo out_descriptorBufferInfo = {out_buffer, 0,
-                                                       VK_WHOLE_SIZE};
-
-    VkWriteDescriptorSet writeDescriptorSet[2] = {
-        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, descriptorSet, 0, 0, 1,
-         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &in_descriptorBufferInfo, nullptr},
-        {VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr, descriptorSet, 1, 0, 1,
-         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &out_descriptorBufferInfo, nullptr}};
-
-    vkUpdateDescriptorSets(device, 2, writeDescriptorSet, 0, nullptr);
-
-    VkCommandPool commandPool = nullptr;
+  return serverSocket;
+}
+
+// Long running mode: the device, pipeline, descriptor set and command buffer
+// are created once and every job reuses them. Jobs come from stdin, or from
+// clients of a UNIX socket when socketPath is set; each client is served
+// until it disconnects. The CPU backend needs no device, physicalDevice is
+// then VK_NULL_HANDLE; the auto backend times both on startup and sends
+// each job to the faster one for its size.
+void serve(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+           PixelFormat format, BorderMode border, uint32_t radius,
+           bool autotune, bool profile, const char* socketPath,
+           Backend backend, uint32_t threadCount,
+           const PngEncoder& encoder) {
+  const auto start = std::chrono::steady_clock::now();
+
+  // A client that disconnects early makes the write of its answer fail
+  // instead of killing the service
+  signal(SIGPIPE, SIG_IGN);
+
+  FilterBackends backends;
+  FilterDevice filterDevice;
+  if (backend != kBackendCpu) {
+    uint32_t queueFamilyIndex = 0;
     BAIL_ON_BAD_RESULT(
-        vkCreateCommandPool(device, &commandPoolCreateInfo, nullptr, &commandPool));
+        vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
 
-    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, commandPool,
-        VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1};
+    BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                         kernel, format, profile));
+    filterDevice.setBorder(border);
+    filterDevice.setRadius(radius);
+    backends.device = &filterDevice;
 
-    VkCommandBuffer commandBuffer = nullptr;
-    BAIL_ON_BAD_RESULT(vkAllocateCommandBuffers(
-        device, &commandBufferAllocateInfo, &commandBuffer));
+    fprintf(stderr, "device name: %s\n",
+            filterDevice.properties().deviceName);
+  }
 
-    VkCommandBufferBeginInfo commandBufferBeginInfo = {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr,
-        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, nullptr};
+  std::unique_ptr<CpuFilter> cpuFilter;
+  if (backend != kBackendGpu) {
+    cpuFilter = std::make_unique<CpuFilter>(kernel, format, threadCount);
+    cpuFilter->setBorder(border);
+    cpuFilter->setRadius(radius);
+    backends.cpu = cpuFilter.get();
+    backends.cpuThreshold =
+        backend == kBackendCpu
+            ? std::numeric_limits<uint64_t>::max()
+            : calibrateCpuThreshold(filterDevice, *cpuFilter);
+
+    fprintf(stderr, "cpu backend: %u threads, images under %llu pixels\n",
+            cpuFilter->threadCount(),
+            static_cast<unsigned long long>(backends.cpuThreshold));
+  }
 
-    BAIL_ON_BAD_RESULT(
-        vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  fprintf(stderr, "ready in %.3f ms\n",
+          std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - start)
+              .count());
+
+  JobTimes totals;
+  uint32_t jobCount = 0;
+  bool workgroupSelected = false;
+
+  if (socketPath == nullptr) {
+    serveJobs(backends, encoder, autotune, &workgroupSelected, stdin, stdout,
+              &totals, &jobCount);
+  } else {
+    const int serverSocket = createServerSocket(socketPath);
+    if (serverSocket < 0) {
+      fprintf(stderr, "Cannot listen on %s\n", socketPath);
+      exit(-1);
+    }
+    fprintf(stderr, "listening on %s\n", socketPath);
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    bool running = true;
+    while (running) {
+      const int client = accept(serverSocket, nullptr, nullptr);
+      if (client < 0) {
+        continue;
+      }
 
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                            pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+      FILE* const in = fdopen(client, "r");
+      FILE* const out = fdopen(dup(client), "w");
+      running = serveJobs(backends, encoder, autotune, &workgroupSelected, in,
+                          out, &totals, &jobCount);
+      fclose(out);
+      fclose(in);
+    }
 
-    // Push constants
-    ImageConstantData push{.width = static_cast<uint32_t>(width),
-                           .height = static_cast<uint32_t>(height)};
+    close(serverSocket);
+    unlink(socketPath);
+  }
 
-    vkCmdPushConstants(commandBuffer, pipelineLayout,
-                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
-                       sizeof(ImageConstantData), &push);
+  if (jobCount > 0) {
+    printf(
+        "%u jobs, average: decode %.3f dispatch %.3f readback %.3f encode "
+        "%.3f total %.3f ms\n",
+        jobCount, totals.decode / jobCount, totals.dispatch / jobCount,
+        totals.readback / jobCount, totals.encode / jobCount,
+        totals.total() / jobCount);
+  }
+  if (backends.device != nullptr) {
+    if (profile) {
+      filterDevice.profiler().report(stdout);
+    }
+    filterDevice.destroy();
+  }
+}
 
-    vkCmdDispatch(commandBuffer, width, height, 1);
+// Images in flight in batch mode unless --depth says otherwise
+const uint32_t kDefaultBatchDepth = 4;
+
+// Expands every directory to the PNG and QOI files directly inside it,
+// sorted by name. Files are taken as they are. Outputs keep the name, and
+// so the format, of their input.
+std::vector<std::string> listBatchImages(
+    const std::vector<std::string>& paths) {
+  std::vector<std::string> images;
+  for (const std::string& path : paths) {
+    if (!std::filesystem::is_directory(path)) {
+      images.push_back(path);
+      continue;
+    }
 
-    BAIL_ON_BAD_RESULT(vkEndCommandBuffer(commandBuffer));
+    std::vector<std::string> directoryImages;
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      const std::filesystem::path extension = entry.path().extension();
+      if (entry.is_regular_file() &&
+          (extension == ".png" || extension == ".qoi")) {
+        directoryImages.push_back(entry.path().string());
+      }
+    }
+    std::sort(directoryImages.begin(), directoryImages.end());
+    images.insert(images.end(), directoryImages.begin(),
+                  directoryImages.end());
+  }
+  return images;
+}
 
-    VkQueue queue = nullptr;
-    vkGetDeviceQueue(device, queueFamilyIndex, 0, &queue);
+// One image on its way through the batch pipeline
+struct BatchJob {
+  std::string inputPath;
+  std::string outputPath;
+  uint32_t slot = 0;  // FilterDevice slot holding the pixels
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<uint8_t> rgb;  // filled by the readback stage
+};
 
-    VkSubmitInfo submitInfo = {
-        VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr, 0, nullptr, nullptr, 1, &commandBuffer, 0, nullptr};
+// Seconds the threads of one stage spent working, not waiting on the
+// queues around them or on the GPU
+struct BatchStage {
+  const char* name;
+  uint32_t threadCount;
+  std::vector<double> busySeconds;  // one entry per thread
 
-    BAIL_ON_BAD_RESULT(vkQueueSubmit(queue, 1, &submitInfo, nullptr));
+  BatchStage(const char* stageName, uint32_t threads)
+      : name(stageName), threadCount(threads), busySeconds(threads, 0.0) {}
 
-    BAIL_ON_BAD_RESULT(vkQueueWaitIdle(queue));
+  double totalBusySeconds() const {
+    double total = 0.0;
+    for (const double seconds : busySeconds) {
+      total += seconds;
+    }
+    return total;
+  }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Filters many images with the stages of runJob() overlapped:
+//
+//   decode threads -> upload ring -> dispatch -> readback -> encode threads
+//
+// The upload ring is depth FilterDevice slots. A decode thread takes a free
+// slot and decodes straight into its mapped input buffer, the dispatch
+// thread submits it, the readback thread waits for it, copies the output
+// out as packed RGB and hands the slot back. Bounded queues join the
+// stages, so at most depth images are on the device and at most depth
+// more wait to be encoded. Reports images/s and how busy every stage was;
+// the busiest one is what limits the throughput.
+void runBatch(VkPhysicalDevice physicalDevice, const FilterKernel& kernel,
+              PixelFormat format, BorderMode border, uint32_t radius,
+              bool autotune, const std::vector<std::string>& inputPaths,
+              const std::string& outputDirectory, uint32_t depth,
+              uint32_t threadCount, const PngEncoder& encoder) {
+  depth = std::max(depth, 1u);
+  const uint32_t cpuThreads =
+      threadCount > 0 ? threadCount
+                      : std::max(std::thread::hardware_concurrency() / 2, 1u);
+
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  // Always profiled, the GPU timestamps are the device's busy time
+  FilterDevice filterDevice;
+  BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevice, queueFamilyIndex,
+                                       kernel, format, /*profile=*/true,
+                                       depth));
+  filterDevice.setBorder(border);
+  filterDevice.setRadius(radius);
+
+  // Tuning, if asked for, runs on the size of the first readable image.
+  // Unreadable ones are reported by the decode stage.
+  for (const std::string& path : inputPaths) {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    try {
+      const ImageDecoder decoder(path);
+      width = decoder.width();
+      height = decoder.height();
+    } catch (const std::exception&) {
+      continue;
+    }
+
+    BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+    BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+        autotune, kWorkgroupCachePath, width, height));
+    break;
+  }
+
+  std::filesystem::create_directories(outputDirectory);
+
+  printf("%s: %zu images, %s kernel, %s pixels, depth %u, %u decode and "
+         "%u encode threads\n",
+         filterDevice.properties().deviceName, inputPaths.size(),
+         kernel.name.c_str(), getPixelFormatName(format), depth, cpuThreads,
+         cpuThreads);
+
+  BoundedQueue<uint32_t> freeSlots(depth);
+  for (uint32_t slot = 0; slot < depth; slot++) {
+    freeSlots.push(slot);
+  }
+  BoundedQueue<BatchJob> decoded(depth);
+  BoundedQueue<BatchJob> submitted(depth);
+  BoundedQueue<BatchJob> readBack(depth);
+
+  BatchStage decodeStage("decode", cpuThreads);
+  BatchStage dispatchStage("dispatch", 1);
+  BatchStage readbackStage("readback", 1);
+  BatchStage encodeStage("encode", cpuThreads);
+
+  std::atomic<size_t> nextInput{0};
+  std::atomic<uint32_t> failedCount{0};
+  std::atomic<uint32_t> doneCount{0};
+  std::atomic<uint64_t> pixelCount{0};
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> decoders;
+  for (uint32_t i = 0; i < cpuThreads; i++) {
+    decoders.emplace_back([&, i]() {
+      double& busy = decodeStage.busySeconds[i];
+      for (size_t index = nextInput++; index < inputPaths.size();
+           index = nextInput++) {
+        BatchJob job;
+        job.inputPath = inputPaths[index];
+        job.outputPath =
+            (std::filesystem::path(outputDirectory) /
+             std::filesystem::path(job.inputPath).filename())
+                .string();
+
+        bool hasSlot = false;
+        auto lap = std::chrono::steady_clock::now();
+        try {
+          ImageDecoder decoder(job.inputPath);
+          job.width = decoder.width();
+          job.height = decoder.height();
+          busy += secondsSince(lap);
+
+          freeSlots.pop(&job.slot);
+          hasSlot = true;
+
+          lap = std::chrono::steady_clock::now();
+          BAIL_ON_BAD_RESULT(
+              filterDevice.reserve(job.width, job.height, job.slot));
+          decodeImage(decoder, format, filterDevice.input(job.slot));
+          busy += secondsSince(lap);
+        } catch (const std::exception& e) {
+          busy += secondsSince(lap);
+          fprintf(stderr, "error: %s: %s\n", job.inputPath.c_str(),
+                  e.what());
+          failedCount++;
+          if (hasSlot) {
+            freeSlots.push(job.slot);
+          }
+          continue;
+        }
+
+        decoded.push(std::move(job));
+      }
+    });
+  }
+
+  std::thread dispatcher([&]() {
+    BatchJob job;
+    while (decoded.pop(&job)) {
+      const auto lap = std::chrono::steady_clock::now();
+      BAIL_ON_BAD_RESULT(filterDevice.submit(job.width, job.height, job.slot));
+      dispatchStage.busySeconds[0] += secondsSince(lap);
+      submitted.push(std::move(job));
+    }
+    submitted.close();
+  });
+
+  std::thread reader([&]() {
+    BatchJob job;
+    while (submitted.pop(&job)) {
+      BAIL_ON_BAD_RESULT(filterDevice.wait(job.slot));
+
+      const auto lap = std::chrono::steady_clock::now();
+      job.rgb = readbackImage(format, filterDevice.output(job.slot),
+                              job.width, job.height);
+      readbackStage.busySeconds[0] += secondsSince(lap);
+
+      freeSlots.push(job.slot);
+      pixelCount += uint64_t{job.width} * job.height;
+      readBack.push(std::move(job));
+    }
+    readBack.close();
+  });
+
+  std::vector<std::thread> encoders;
+  for (uint32_t i = 0; i < cpuThreads; i++) {
+    encoders.emplace_back([&, i]() {
+      BatchJob job;
+      while (readBack.pop(&job)) {
+        const auto lap = std::chrono::steady_clock::now();
+        try {
+          writeRgbImage(job.outputPath, job.rgb, job.width, job.height,
+                        encoder);
+          doneCount++;
+        } catch (const std::exception& e) {
+          fprintf(stderr, "error: %s: %s\n", job.outputPath.c_str(),
+                  e.what());
+          failedCount++;
+        }
+        encodeStage.busySeconds[i] += secondsSince(lap);
+      }
+    });
+  }
+
+  for (auto& decoder : decoders) {
+    decoder.join();
+  }
+  decoded.close();
+  dispatcher.join();
+  reader.join();
+  for (auto& encoder : encoders) {
+    encoder.join();
+  }
+
+  const double seconds = secondsSince(start);
+
+  filterDevice.collectProfile();
+  const auto& scopes = filterDevice.profiler().scopes();
+  const bool gpuTimed = !scopes.empty() && scopes[0].passes > 0;
+
+  printf("%u images, %u failed, %.3f s: %.1f images/s, %.1f Mpix/s\n",
+         doneCount.load(), failedCount.load(), seconds,
+         doneCount / seconds, pixelCount * 1e-6 / seconds);
+  printf("%-10s %8s %10s %12s\n", "stage", "threads", "busy ms",
+         "utilization");
+
+  const char* bottleneck = "";
+  double bottleneckUtilization = -1.0;
+  const auto report = [&](const char* name, uint32_t threads,
+                          double busySeconds) {
+    const double utilization = busySeconds / (seconds * threads);
+    printf("%-10s %8u %10.1f %11.1f%%\n", name, threads, busySeconds * 1e3,
+           utilization * 100.0);
+    if (utilization > bottleneckUtilization) {
+      bottleneck = name;
+      bottleneckUtilization = utilization;
+    }
+  };
+
+  report(decodeStage.name, decodeStage.threadCount,
+         decodeStage.totalBusySeconds());
+  report(dispatchStage.name, 1u, dispatchStage.totalBusySeconds());
+  if (gpuTimed) {
+    report("gpu", 1u, scopes[0].totalMs * 1e-3);
+  } else {
+    printf("%-10s %8u %10s %12s\n", "gpu", 1u, "-", "no timestamps");
+  }
+  report(readbackStage.name, 1u, readbackStage.totalBusySeconds());
+  report(encodeStage.name, encodeStage.threadCount,
+         encodeStage.totalBusySeconds());
+  printf("bottleneck: %s\n", bottleneck);
+
+  filterDevice.destroy();
+}
+
+// Frame sizes of the kernel benchmark: 1080p, 4K and 8K
+const uint32_t kBenchmarkSizes[][2] = {
+    {1920, 1080}, {3840, 2160}, {7680, 4320}};
+
+const uint32_t kBenchmarkRuns = 10;
+
+// The CPU filter takes far longer per run
+const uint32_t kCpuBenchmarkRuns = 3;
+
+// A repeatable pattern that differs between neighbouring pixels, so a kernel
+// reading the wrong neighbour shows up in the comparison
+void fillBenchmarkImage(PixelFormat format, void* pixels, uint32_t width,
+                        uint32_t height) {
+  size_t k = 0;
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      const Vec4 pixel = {((x * 7 + y * 13) % 256) / 255.0f,
+                          ((x * 3 + y * 5) % 251) / 250.0f,
+                          ((x ^ y) % 241) / 240.0f, 1.0f};
+      storePixel(format, pixels, k, pixel);
+      k++;
+    }
+  }
+}
+
+// Filters the current input once to warm up, then kBenchmarkRuns times.
+// Returns the fastest host time, submit to fence, and the average GPU time,
+// which is 0 when the device has no timestamps.
+VkResult timeFilter(FilterDevice& filterDevice, uint32_t width,
+                    uint32_t height, double* hostMs, double* gpuMs) {
+  VkResult result = filterDevice.run(width, height);
+  if (result != VK_SUCCESS) return result;
+
+  const auto& scopes = filterDevice.profiler().scopes();
+  const double gpuTotalBefore = scopes.empty() ? 0.0 : scopes[0].totalMs;
+  const uint64_t gpuPassesBefore = scopes.empty() ? 0 : scopes[0].passes;
+
+  *hostMs = std::numeric_limits<double>::max();
+  for (uint32_t run = 0; run < kBenchmarkRuns; run++) {
+    const auto start = std::chrono::steady_clock::now();
+    result = filterDevice.run(width, height);
+    if (result != VK_SUCCESS) return result;
+    *hostMs = std::min(*hostMs, std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count());
+  }
+
+  const uint64_t gpuPasses =
+      scopes.empty() ? 0 : scopes[0].passes - gpuPassesBefore;
+  *gpuMs = gpuPasses > 0 ? (scopes[0].totalMs - gpuTotalBefore) / gpuPasses
+                         : 0.0;
+  return VK_SUCCESS;
+}
+
+// Times every kernel at 1080p, 4K and 8K on one device with pixels stored
+// in format and checks that all of them produce the output of the CPU
+// filter, which is timed first and is the baseline of the speedups. The
+// host time of the image kernel includes copying the buffers into and out
+// of its images, its GPU time is the dispatch alone. Kernels the device
+// cannot run with this format are skipped.
+void runKernelBenchmark(VkPhysicalDevice physicalDevice,
+                        const std::vector<FilterKernel>& kernels,
+                        PixelFormat format, BorderMode border, bool autotune,
+                        uint32_t threadCount) {
+  uint32_t queueFamilyIndex = 0;
+  BAIL_ON_BAD_RESULT(
+      vkGetBestComputeQueueNPH(physicalDevice, &queueFamilyIndex));
+
+  std::vector<FilterDevice> filterDevices;
+  for (const FilterKernel& kernel : kernels) {
+    FilterDevice filterDevice;
+    const VkResult result =
+        filterDevice.init(physicalDevice, queueFamilyIndex, kernel, format,
+                          /*profile=*/true);
+    if (result == VK_ERROR_FEATURE_NOT_PRESENT ||
+        result == VK_ERROR_FORMAT_NOT_SUPPORTED) {
+      printf("%s kernel: not supported with %s pixels, skipped\n",
+             kernel.name.c_str(), getPixelFormatName(format));
+      filterDevice.destroy();
+      continue;
+    }
+    BAIL_ON_BAD_RESULT(result);
+    filterDevice.setBorder(border);
+
+    const uint32_t width = kBenchmarkSizes[0][0];
+    const uint32_t height = kBenchmarkSizes[0][1];
+    BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+    fillBenchmarkImage(format, filterDevice.input(), width, height);
+    BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+        autotune, kWorkgroupCachePath, width, height));
+    filterDevices.push_back(std::move(filterDevice));
+  }
+  if (filterDevices.empty()) {
+    printf("No kernel runs with %s pixels on this device\n",
+           getPixelFormatName(format));
+    return;
+  }
+
+  printf("device name: %s, pixel format: %s\n",
+         filterDevices[0].properties().deviceName, getPixelFormatName(format));
+  printf("%-10s %-8s %10s %10s %10s %9s %8s %10s\n", "size", "kernel",
+         "workgroup", "host ms", "gpu ms", "Mpix/s", "speedup", "max diff");
+
+  // The kernels are all 3x3 box filters, and so is the CPU filter of the
+  // first one
+  CpuFilter cpuFilter(kernels[0], format, threadCount);
+  cpuFilter.setBorder(border);
+
+  std::vector<uint8_t> reference;
+  for (const auto& size : kBenchmarkSizes) {
+    const uint32_t width = size[0];
+    const uint32_t height = size[1];
+    const size_t pixelCount = size_t{width} * height;
+    char sizeName[32];
+    snprintf(sizeName, sizeof(sizeName), "%ux%u", width, height);
+
+    double referenceMs = std::numeric_limits<double>::max();
+    reference.resize(size_t{getPixelSize(format)} * pixelCount);
+    {
+      std::vector<uint8_t> input(reference.size());
+      fillBenchmarkImage(format, input.data(), width, height);
+      for (uint32_t run = 0; run < kCpuBenchmarkRuns; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        cpuFilter.run(input.data(), reference.data(), width, height);
+        referenceMs = std::min(
+            referenceMs, std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count());
+      }
+    }
+
+    char threadsName[32];
+    snprintf(threadsName, sizeof(threadsName), "%u thr",
+             cpuFilter.threadCount());
+    printf("%-10s %-8s %10s %10.3f %10s %9.1f %7.2fx %10s\n", sizeName, "cpu",
+           threadsName, referenceMs, "-", pixelCount / (referenceMs * 1e3),
+           1.0, "-");
+
+    for (FilterDevice& filterDevice : filterDevices) {
+      BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+      fillBenchmarkImage(format, filterDevice.input(), width, height);
+
+      double hostMs = 0.0;
+      double gpuMs = 0.0;
+      BAIL_ON_BAD_RESULT(
+          timeFilter(filterDevice, width, height, &hostMs, &gpuMs));
+      const double ms = gpuMs > 0.0 ? gpuMs : hostMs;
+
+      float maxDiff = 0.0f;
+      for (size_t i = 0; i < pixelCount; i++) {
+        const Vec4 output = loadPixel(format, filterDevice.output(), i);
+        const Vec4 expected = loadPixel(format, reference.data(), i);
+        maxDiff = std::max({maxDiff, std::abs(output.x - expected.x),
+                            std::abs(output.y - expected.y),
+                            std::abs(output.z - expected.z),
+                            std::abs(output.w - expected.w)});
+      }
+
+      char workgroupName[32];
+      snprintf(workgroupName, sizeof(workgroupName), "%ux%u",
+               filterDevice.workgroupSize().x, filterDevice.workgroupSize().y);
+
+      printf("%-10s %-8s %10s %10.3f %10.3f %9.1f %7.2fx %10.2g\n", sizeName,
+             filterDevice.kernelName().c_str(), workgroupName, hostMs, gpuMs,
+             pixelCount / (ms * 1e3), referenceMs / ms, maxDiff);
+    }
+  }
+
+  for (auto& filterDevice : filterDevices) {
+    filterDevice.destroy();
+  }
+}
+
+// Decodes every image three ways and reports the time per image: png++
+// followed by a per pixel copy, as the sample used to, PngDecoder on one
+// thread, and PngDecoder on a worker pool with one image per task. The
+// pixels are written in the storage format, as into the input buffer.
+void runDecodeBenchmark(const std::vector<std::string>& paths,
+                        PixelFormat format, uint32_t threadCount) {
+  std::vector<std::vector<uint8_t>> pixels(paths.size());
+  size_t pixelCount = 0;
+  for (size_t i = 0; i < paths.size(); i++) {
+    const ImageDecoder decoder(paths[i]);
+    const size_t imagePixels = size_t{decoder.width()} * decoder.height();
+    pixels[i].resize(getPixelSize(format) * imagePixels);
+    pixelCount += imagePixels;
+  }
+
+  printf("%zu images, %.1f Mpix, %s pixels\n", paths.size(),
+         pixelCount * 1e-6, getPixelFormatName(format));
+  printf("%-24s %10s %10s %9s\n", "decoder", "ms/image", "images/s",
+         "Mpix/s");
+
+  const auto report = [&](const char* name,
+                          std::chrono::steady_clock::time_point start) {
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    printf("%-24s %10.3f %10.1f %9.1f\n", name,
+           seconds * 1e3 / paths.size(), paths.size() / seconds,
+           pixelCount * 1e-6 / seconds);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++) {
+    const RgbImage image(paths[i]);
+    uploadImage(image, format, pixels[i].data());
+  }
+  report("png++ and copy", start);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++) {
+    ImageDecoder decoder(paths[i]);
+    decodeImage(decoder, format, pixels[i].data());
+  }
+  report("direct", start);
+
+  WorkerPool pool(threadCount);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < paths.size(); i++) {
+    pool.submit([&paths, &pixels, format, i]() {
+      try {
+        ImageDecoder decoder(paths[i]);
+        decodeImage(decoder, format, pixels[i].data());
+      } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+      }
+    });
+  }
+  pool.wait();
+
+  char poolName[32];
+  snprintf(poolName, sizeof(poolName), "direct, %u workers",
+           pool.threadCount());
+  report(poolName, start);
+}
+
+// Times encoding the images to memory: png++, then the chunked encoder on
+// the calling thread and on a worker pool with options, then on the pool
+// with every filter mode at a few levels, for the size against the time.
+void runEncodeBenchmark(const std::vector<std::string>& paths,
+                        const PngEncodeOptions& options,
+                        uint32_t threadCount) {
+  std::vector<RgbImage> images;
+  std::vector<std::vector<uint8_t>> rgb;
+  size_t pixelCount = 0;
+  for (const std::string& path : paths) {
+    images.emplace_back(path);
+    const RgbImage& image = images.back();
+    const uint32_t width = image.get_width();
+    const uint32_t height = image.get_height();
+    rgb.emplace_back(size_t{3} * width * height);
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        const png::rgb_pixel pixel = image[y][x];
+        uint8_t* out = &rgb.back()[size_t{3} * (size_t{y} * width + x)];
+        out[0] = pixel.red;
+        out[1] = pixel.green;
+        out[2] = pixel.blue;
+      }
+    }
+    pixelCount += size_t{width} * height;
+  }
+
+  printf("%zu images, %.1f Mpix\n", paths.size(), pixelCount * 1e-6);
+  printf("%-32s %10s %9s %10s\n", "encoder", "ms/image", "Mpix/s",
+         "KiB/image");
+
+  const auto report = [&](const char* name,
+                          std::chrono::steady_clock::time_point start,
+                          size_t bytes) {
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    printf("%-32s %10.3f %9.1f %10.1f\n", name,
+           seconds * 1e3 / paths.size(), pixelCount * 1e-6 / seconds,
+           bytes / 1024.0 / paths.size());
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  size_t bytes = 0;
+  for (RgbImage& image : images) {
+    std::ostringstream stream;
+    image.write_stream(stream);
+    bytes += stream.str().size();
+  }
+  report("png++", start, bytes);
+
+  WorkerPool pool(threadCount);
+  const auto encodeAll = [&](const char* name, const PngEncoder& encoder) {
+    const auto encodeStart = std::chrono::steady_clock::now();
+    size_t encodedBytes = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+      const uint32_t width = images[i].get_width();
+      encodedBytes += encoder
+                   .encode(width, images[i].get_height(), rgb[i].data(),
+                           size_t{3} * width)
+                   .size();
+    }
+    report(name, encodeStart, encodedBytes);
+  };
+
+  char name[64];
+  snprintf(name, sizeof(name), "chunked, level %d %s", options.level,
+           getPngFilterModeName(options.filter));
+  encodeAll(name, PngEncoder(options));
+  snprintf(name, sizeof(name), "chunked, level %d %s, %u workers",
+           options.level, getPngFilterModeName(options.filter),
+           pool.threadCount());
+  encodeAll(name, PngEncoder(options, &pool));
+
+  for (const int level : {1, 6, 9}) {
+    for (int filter = kPngFilterNone; filter <= kPngFilterAdaptive;
+         filter++) {
+      PngEncodeOptions sweep;
+      sweep.level = level;
+      sweep.filter = static_cast<PngFilterMode>(filter);
+      snprintf(name, sizeof(name), "chunked, level %d %s, %u workers", level,
+               getPngFilterModeName(sweep.filter), pool.threadCount());
+      encodeAll(name, PngEncoder(sweep, &pool));
+    }
+  }
+}
+
+int main(int argc, const char* const argv[]) {
+  std::vector<std::string> imagePaths;
+  const char* socketPath = nullptr;
+  const char* batchDirectory = nullptr;
+  uint32_t batchDepth = kDefaultBatchDepth;
+  bool autotune = false;
+  bool multiDevice = false;
+  bool profile = false;
+  bool service = false;
+  bool benchmark = false;
+  bool decodeBenchmark = false;
+  bool encodeBenchmark = false;
+  bool tileCheck = false;
+  bool pyramid = false;
+  bool integralCheck = false;
+  bool integralShared = false;
+  bool pyramidCompute = false;
+  bool tone = false;
+  bool toneShared = false;
+  ToneMode toneMode = kToneEqualize;
+  uint32_t binCount = kDefaultHistogramBins;
+  const char* graphSpec = nullptr;
+  uint32_t tileBudgetMiB = 0;
+  uint32_t threadCount = 0;
+  PngEncodeOptions pngOptions;
+  const char* kernelName = "tiled";
+  const char* formatName = nullptr;
+  BorderMode border = kBorderClamp;
+  uint32_t radius = 1;
+  Backend backend = kBackendGpu;
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--autotune") == 0) {
+      autotune = true;
+    } else if (strcmp(argv[arg], "--multi-device") == 0) {
+      multiDevice = true;
+    } else if (strcmp(argv[arg], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[arg], "--serve") == 0) {
+      service = true;
+      if (arg + 1 < argc && strncmp(argv[arg + 1], "--", 2) != 0) {
+        socketPath = argv[++arg];
+      }
+    } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+      batchDirectory = argv[++arg];
+    } else if (strcmp(argv[arg], "--depth") == 0 && arg + 1 < argc) {
+      batchDepth = static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--benchmark") == 0) {
+      benchmark = true;
+    } else if (strcmp(argv[arg], "--decode-benchmark") == 0) {
+      decodeBenchmark = true;
+    } else if (strcmp(argv[arg], "--encode-benchmark") == 0) {
+      encodeBenchmark = true;
+    } else if (strcmp(argv[arg], "--tile-check") == 0) {
+      tileCheck = true;
+    } else if (strcmp(argv[arg], "--integral-check") == 0) {
+      integralCheck = true;
+    } else if (strcmp(argv[arg], "--integral-shared") == 0) {
+      integralCheck = true;
+      integralShared = true;
+    } else if (strcmp(argv[arg], "--pyramid") == 0) {
+      pyramid = true;
+    } else if (strcmp(argv[arg], "--pyramid-compute") == 0) {
+      pyramid = true;
+      pyramidCompute = true;
+    } else if (strcmp(argv[arg], "--tone") == 0 && arg + 1 < argc) {
+      tone = true;
+      if (!parseToneMode(argv[++arg], &toneMode)) {
+        printf("Unknown tone mode %s, use equalize or auto-levels\n",
+               argv[arg]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg], "--tone-shared") == 0) {
+      toneShared = true;
+    } else if (strcmp(argv[arg], "--bins") == 0 && arg + 1 < argc) {
+      binCount = static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--graph") == 0 && arg + 1 < argc) {
+      graphSpec = argv[++arg];
+    } else if (strcmp(argv[arg], "--tile-budget") == 0 && arg + 1 < argc) {
+      tileBudgetMiB =
+          static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+      threadCount = static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--png-level") == 0 && arg + 1 < argc) {
+      pngOptions.level = atoi(argv[++arg]);
+      if (pngOptions.level < 0 || pngOptions.level > 9) {
+        printf("--png-level takes 0 to 9\n");
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg], "--png-filter") == 0 && arg + 1 < argc) {
+      if (!parsePngFilterMode(argv[++arg], &pngOptions.filter)) {
+        printf(
+            "Unknown PNG filter %s, use none, sub, up, average, paeth or "
+            "adaptive\n",
+            argv[arg]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg], "--kernel") == 0 && arg + 1 < argc) {
+      kernelName = argv[++arg];
+    } else if (strcmp(argv[arg], "--format") == 0 && arg + 1 < argc) {
+      formatName = argv[++arg];
+    } else if (strcmp(argv[arg], "--radius") == 0 && arg + 1 < argc) {
+      radius = static_cast<uint32_t>(strtoul(argv[++arg], nullptr, 10));
+    } else if (strcmp(argv[arg], "--border") == 0 && arg + 1 < argc) {
+      if (!parseBorderMode(argv[++arg], &border)) {
+        printf("Unknown border mode %s, use clamp, mirror or zero\n",
+               argv[arg]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg], "--backend") == 0 && arg + 1 < argc) {
+      if (!parseBackend(argv[++arg], &backend)) {
+        printf("Unknown backend %s, use gpu, cpu or auto\n", argv[arg]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      imagePaths.push_back(argv[arg]);
+    }
+  }
+
+  if (imagePaths.empty() && !service && !benchmark) {
+    printf(
+        "Format to call: %s PNG_image [--autotune] [--multi-device] "
+        "[--profile] [--tile-budget MB] [--backend gpu|cpu|auto]\n"
+        "            or: %s --tile-check PNG_image [--tile-budget MB]\n"
+        "            or: %s --pyramid|--pyramid-compute PNG_image "
+        "--kernel image\n"
+        "            or: %s --integral-check|--integral-shared PNG_image "
+        "[--radius N]\n"
+        "            or: %s --tone equalize|auto-levels PNG_image "
+        "[--bins N] [--tone-shared]\n"
+        "            or: %s --graph \"a = gaussian(in, 4); "
+        "b = mix(in, a, 1.6, -0.6); ...\" PNG_image\n"
+        "            or: %s --serve [SOCKET] [--autotune] [--profile] "
+        "[--backend gpu|cpu|auto]\n"
+        "            or: %s --batch OUTPUT_DIR PNG_image|DIR... [--depth N] "
+        "[--threads N] [--autotune]\n"
+        "            or: %s --benchmark [--autotune] [--threads N]\n"
+        "            or: %s --decode-benchmark PNG_image... [--threads N]\n"
+        "            or: %s --encode-benchmark PNG_image... [--threads N]\n"
+        "Common options: [--kernel simple|tiled|box|gaussian|image] "
+        "[--radius N] [--border clamp|mirror|zero] "
+        "[--format rgba32f|rgba16f|rgba8] [--png-level 0-9] "
+        "[--png-filter none|sub|up|average|paeth|adaptive]\n"
+        "Images named *.qoi are read and written as QOI instead of PNG\n",
+        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+        argv[0], argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  PixelFormat format = kPixelRgba32f;
+  if (formatName != nullptr && !parsePixelFormat(formatName, &format)) {
+    printf("Unknown pixel format %s, use rgba32f, rgba16f or rgba8\n",
+           formatName);
+    return EXIT_FAILURE;
+  }
+
+  if (decodeBenchmark) {
+    runDecodeBenchmark(imagePaths, format, threadCount);
+    return EXIT_SUCCESS;
+  }
+
+  if (encodeBenchmark) {
+    runEncodeBenchmark(imagePaths, pngOptions, threadCount);
+    return EXIT_SUCCESS;
+  }
+
+  // Output images are compressed in chunks on this pool
+  WorkerPool encodePool(threadCount);
+  const PngEncoder encoder(pngOptions, &encodePool);
+
+  if (backend != kBackendGpu &&
+      (benchmark || batchDirectory != nullptr || tileCheck || multiDevice ||
+       pyramid || integralCheck || tone || graphSpec != nullptr)) {
+    printf("--backend cpu and auto only apply to single images and --serve\n");
+    return EXIT_FAILURE;
+  }
+
+  // Vulkan 1.1 for the subgroup operations of the integral image and the
+  // histogram, where the device has them
+  const VkApplicationInfo applicationInfo = {VK_STRUCTURE_TYPE_APPLICATION_INFO,
+                                             nullptr,
+                                             "VKComputeSample",
+                                             0,
+                                             "",
+                                             0,
+                                             VK_API_VERSION_1_1};
+
+  const VkInstanceCreateInfo instanceCreateInfo = {
+      VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+      nullptr,
+      0,
+      &applicationInfo,
+      0,
+      nullptr,
+      0,
+      nullptr};
+
+  // The CPU backend runs without Vulkan, and auto falls back to it on hosts
+  // without a usable device
+  VkInstance instance = nullptr;
+  uint32_t physicalDeviceCount = 0;
+  if (backend != kBackendCpu) {
+    VkResult result = vkCreateInstance(&instanceCreateInfo, nullptr, &instance);
+    if (result == VK_SUCCESS) {
+      result =
+          vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
+    } else {
+      instance = nullptr;
+    }
+    if (result != VK_SUCCESS || physicalDeviceCount == 0) {
+      // Every mode but the CPU backend filters on physicalDevices[0]
+      if (backend == kBackendGpu) {
+        printf("No usable Vulkan device, this needs one or --backend cpu\n");
+        if (instance != nullptr) {
+          vkDestroyInstance(instance, nullptr);
+        }
+        return EXIT_FAILURE;
+      }
+      printf("No usable Vulkan device, filtering on the CPU\n");
+      backend = kBackendCpu;
+      physicalDeviceCount = 0;
+    }
+  }
+
+  std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+
+  if (physicalDeviceCount > 0) {
+    BAIL_ON_BAD_RESULT(vkEnumeratePhysicalDevices(
+        instance, &physicalDeviceCount, physicalDevices.data()));
+  }
+
+  if (benchmark) {
+    // All of them are 3x3 box filters at radius 1
+    const std::vector<FilterKernel> kernels = {
+        loadFilterKernel("simple"), loadFilterKernel("tiled"),
+        loadFilterKernel("box"), loadFilterKernel("image")};
+    // Every format unless one was asked for
+    std::vector<PixelFormat> formats = {kPixelRgba32f, kPixelRgba16f,
+                                        kPixelRgba8};
+    if (formatName != nullptr) {
+      formats = {format};
+    }
+    for (const VkPhysicalDevice physicalDevice : physicalDevices) {
+      for (const PixelFormat benchmarkFormat : formats) {
+        runKernelBenchmark(physicalDevice, kernels, benchmarkFormat, border,
+                           autotune, threadCount);
+      }
+    }
+    vkDestroyInstance(instance, nullptr);
+    return EXIT_SUCCESS;
+  }
+
+  const FilterKernel kernel = loadFilterKernel(kernelName);
+
+  if (batchDirectory != nullptr) {
+    const std::vector<std::string> batchImages = listBatchImages(imagePaths);
+    if (batchImages.empty()) {
+      printf("No PNG or QOI images to process\n");
+      vkDestroyInstance(instance, nullptr);
+      return EXIT_FAILURE;
+    }
+    runBatch(physicalDevices[0], kernel, format, border, radius, autotune,
+             batchImages, batchDirectory, batchDepth, threadCount, encoder);
+    vkDestroyInstance(instance, nullptr);
+    return EXIT_SUCCESS;
+  }
+
+  if (service) {
+    serve(backend == kBackendCpu ? VK_NULL_HANDLE : physicalDevices[0],
+          kernel, format, border, radius, autotune, profile, socketPath,
+          backend, threadCount, encoder);
+    vkDestroyInstance(instance, nullptr);
+    return EXIT_SUCCESS;
+  }
+
+  const char* const imagePath = imagePaths[0].c_str();
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  if (integralCheck) {
+    const std::vector<uint8_t> pixels =
+        decodeToHost(imagePath, format, &width, &height);
+    const bool match =
+        checkIntegral(physicalDevices[0], kernel, format, radius,
+                      integralShared, pixels, width, height);
+    vkDestroyInstance(instance, nullptr);
+    return match ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (graphSpec != nullptr) {
+    const bool parsed =
+        filterGraph(physicalDevices[0], format, border, graphSpec, imagePath,
+                    encoder);
+    vkDestroyInstance(instance, nullptr);
+    return parsed ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-    BufferDataT* payloadIn = nullptr;
+  if (tone) {
+    if (binCount < 2 || binCount > kMaxHistogramBins) {
+      printf("--bins takes 2 to %u bins\n", kMaxHistogramBins);
+      vkDestroyInstance(instance, nullptr);
+      return EXIT_FAILURE;
+    }
+    const bool match = toneImage(physicalDevices[0], kernel, format, toneMode,
+                                 binCount, toneShared, imagePath, encoder);
+    vkDestroyInstance(instance, nullptr);
+    return match ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (pyramid) {
+    if (!kernel.imageIo) {
+      printf("--pyramid needs --kernel image\n");
+      vkDestroyInstance(instance, nullptr);
+      return EXIT_FAILURE;
+    }
+    filterPyramid(physicalDevices[0], kernel, format, border, autotune,
+                  pyramidCompute, imagePath, encoder);
+    vkDestroyInstance(instance, nullptr);
+    printf("Done.\n");
+    return EXIT_SUCCESS;
+  }
+
+  if (tileCheck) {
+    const std::vector<uint8_t> pixels =
+        decodeToHost(imagePath, format, &width, &height);
+    const bool match = checkTiling(
+        physicalDevices[0], kernel, format, border, radius, autotune, pixels,
+        width, height, VkDeviceSize{tileBudgetMiB} << 20);
+    vkDestroyInstance(instance, nullptr);
+    return match ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Only the header for now, the pixels are decoded into their destination
+  {
+    const ImageDecoder decoder(imagePath);
+    width = decoder.width();
+    height = decoder.height();
+  }
+
+  if (backend != kBackendGpu) {
+    CpuFilter cpuFilter(kernel, format, threadCount);
+    cpuFilter.setBorder(border);
+    cpuFilter.setRadius(radius);
+
+    // The first device is timed against the CPU on this kernel
+    if (backend == kBackendAuto) {
+      uint32_t queueFamilyIndex = 0;
+      BAIL_ON_BAD_RESULT(
+          vkGetBestComputeQueueNPH(physicalDevices[0], &queueFamilyIndex));
+
+      FilterDevice filterDevice;
+      BAIL_ON_BAD_RESULT(filterDevice.init(physicalDevices[0],
+                                           queueFamilyIndex, kernel, format));
+      filterDevice.setBorder(border);
+      filterDevice.setRadius(radius);
+      const uint64_t cpuThreshold =
+          calibrateCpuThreshold(filterDevice, cpuFilter);
+      filterDevice.destroy();
+
+      printf("auto backend: the CPU filters images under %llu pixels\n",
+             static_cast<unsigned long long>(cpuThreshold));
+      if (uint64_t{width} * height < cpuThreshold) {
+        backend = kBackendCpu;
+      }
+    }
+
+    if (backend == kBackendCpu) {
+      filterOnCpu(imagePath, cpuFilter, encoder);
+      vkDestroyInstance(instance, nullptr);
+      printf("Done.\n");
+      return EXIT_SUCCESS;
+    }
+  }
+
+  if (multiDevice) {
+    // The bands are copied out of one host copy in the storage format
+    const std::vector<uint8_t> pixels =
+        decodeToHost(imagePath, format, &width, &height);
+    filterOnAllDevices(physicalDevices, kernel, format, border, radius,
+                       autotune, profile, pixels, width, height, encoder);
+    vkDestroyInstance(instance, nullptr);
+    printf("Done.\n");
+    return EXIT_SUCCESS;
+  }
+
+  for (uint32_t i = 0; i < physicalDeviceCount; i++) {
+    // Just for information
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physicalDevices[i], &props);
+    printf("device name: %s\n", props.deviceName);
+
+    uint32_t queueFamilyIndex = 0;
     BAIL_ON_BAD_RESULT(
-        vkMapMemory(device, memoryIn, 0, bufferSize, 0, (void**)&payloadIn));
+        vkGetBestComputeQueueNPH(physicalDevices[i], &queueFamilyIndex));
 
-    BufferDataT* payloadOut = nullptr;
+    // Two slots, so that tiles of a large image overlap
+    FilterDevice filterDevice;
     BAIL_ON_BAD_RESULT(
-        vkMapMemory(device, memoryOut, 0, bufferSize, 0, (void**)&payloadOut));
-
-    // Write output image
-    const char* outputImageName = "output.png";
-    png::image<png::rgb_pixel> outputImage(width, height);
-    k = 0;
-    for (size_t y = 0; y < height; ++y) {
-      for (size_t x = 0; x < width; ++x) {
-        outputImage[y][x].red = payloadOut[k].x * 255.0;
-        outputImage[y][x].green = payloadOut[k].y * 255.0;
-        outputImage[y][x].blue = payloadOut[k].z * 255.0;
-        k++;
-      }
+        filterDevice.init(physicalDevices[i], queueFamilyIndex, kernel,
+                          format, profile, /*slotCount=*/2));
+    filterDevice.setBorder(border);
+    filterDevice.setRadius(radius);
+
+    const uint32_t budgetMiB =
+        tileBudgetMiB > 0 ? tileBudgetMiB : kDefaultTileBudgetMiB;
+    TilePlan plan;
+    if (!planDeviceTiles(filterDevice, width, height,
+                         VkDeviceSize{budgetMiB} << 20, &plan)) {
+      printf("A tile budget of %u MB is too small for radius %u\n",
+             budgetMiB, filterDevice.radius());
+      return EXIT_FAILURE;
     }
 
-    outputImage.write(outputImageName);
+    if (plan.tiles.size() == 1) {
+      BAIL_ON_BAD_RESULT(filterDevice.reserve(width, height));
+      ImageDecoder decoder(imagePath);
+      decodeImage(decoder, format, filterDevice.input());
+
+      // Start from the size tuned for this device, if any
+      BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+          autotune, kWorkgroupCachePath, width, height));
+
+      printf("%s kernel, %s pixels, radius %u, workgroup size: %ux%u\n",
+             kernel.name.c_str(), getPixelFormatName(format),
+             filterDevice.radius(), filterDevice.workgroupSize().x,
+             filterDevice.workgroupSize().y);
+
+      BAIL_ON_BAD_RESULT(filterDevice.run(width, height));
+
+      // Write output image
+      writeImage("output.png", format, filterDevice.output(), width, height,
+                 encoder);
+    } else {
+      // Too large for one dispatch or the budget: the image stays on the
+      // host and streams through the device tile by tile
+      const std::vector<uint8_t> pixels =
+          decodeToHost(imagePath, format, &width, &height);
+      std::vector<uint8_t> output(pixels.size());
+
+      BAIL_ON_BAD_RESULT(
+          filterDevice.reserve(plan.inputWidth, plan.inputHeight));
+      BAIL_ON_BAD_RESULT(filterDevice.selectWorkgroupSize(
+          autotune, kWorkgroupCachePath, plan.inputWidth, plan.inputHeight));
+
+      printf(
+          "%s kernel, %s pixels, radius %u, workgroup size: %ux%u, %zu "
+          "tiles of up to %ux%u\n",
+          kernel.name.c_str(), getPixelFormatName(format),
+          filterDevice.radius(), filterDevice.workgroupSize().x,
+          filterDevice.workgroupSize().y, plan.tiles.size(), plan.inputWidth,
+          plan.inputHeight);
+
+      BAIL_ON_BAD_RESULT(filterTiled(filterDevice, plan, pixels.data(),
+                                     width, output.data()));
+
+      writeImage("output.png", format, output.data(), width, height,
+                 encoder);
+    }
+
+    if (profile) {
+      filterDevice.profiler().report(stdout);
+    }
+
+    filterDevice.destroy();
   }
 
+  vkDestroyInstance(instance, nullptr);
+
   printf("Done.\n");
 }
@@ -0,0 +1,96 @@
+// Helpers for fanning one workload out over several Vulkan devices: split a
+// range proportionally to measured device throughput and run one host
+// thread per device.
+
+#ifndef MULTI_DEVICE_H
+#define MULTI_DEVICE_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+struct WorkRange {
+  uint32_t begin;
+  uint32_t end;
+};
+
+// Splits [0, total) into one consecutive range per weight, sized in
+// proportion to the weights. Every range except the last is a multiple of
+// granularity. Ranges may be empty when a weight is very small.
+inline std::vector<WorkRange> splitProportional(
+    uint32_t total, const std::vector<double>& weights,
+    uint32_t granularity = 1) {
+  double weightSum = 0.0;
+  for (const double weight : weights) {
+    weightSum += weight;
+  }
+
+  std::vector<WorkRange> ranges;
+  uint32_t begin = 0;
+  double accumulated = 0.0;
+  for (size_t i = 0; i < weights.size(); i++) {
+    accumulated += weights[i];
+
+    uint32_t end = total;
+    if (i + 1 < weights.size() && weightSum > 0.0) {
+      end = static_cast<uint32_t>(total * (accumulated / weightSum));
+      end -= end % granularity;
+      end = std::max(begin, std::min(end, total));
+    }
+
+    ranges.push_back({begin, end});
+    begin = end;
+  }
+
+  return ranges;
+}
+
+// Calls fn(index) for every index in [0, count) on its own thread and
+// returns the first failure, if any.
+inline VkResult runConcurrently(uint32_t count,
+                                const std::function<VkResult(uint32_t)>& fn) {
+  std::vector<VkResult> results(count, VK_SUCCESS);
+  std::vector<std::thread> threads;
+  threads.reserve(count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    threads.emplace_back([&results, &fn, i]() { results[i] = fn(i); });
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const VkResult result : results) {
+    if (result != VK_SUCCESS) {
+      return result;
+    }
+  }
+
+  return VK_SUCCESS;
+}
+
+// Runs job once as a warm-up, then times a second run. Returns items per
+// second, which is the weight splitProportional() expects.
+inline VkResult calibrateThroughput(const std::function<VkResult()>& job,
+                                    uint32_t items, double* throughput) {
+  VkResult result = job();
+  if (result != VK_SUCCESS) return result;
+
+  const auto start = std::chrono::steady_clock::now();
+  result = job();
+  const auto end = std::chrono::steady_clock::now();
+  if (result != VK_SUCCESS) return result;
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  *throughput = items / std::max(seconds, 1e-9);
+
+  return VK_SUCCESS;
+}
+
+#endif  // MULTI_DEVICE_H
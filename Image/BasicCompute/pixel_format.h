@@ -0,0 +1,263 @@
+// Storage formats of the filter's pixel buffers. The kernels always compute
+// in 32 bit float, packed formats only shrink what every pass reads and
+// writes, which is what bounds these filters. The helpers below pack and
+// unpack single pixels on the host, usually straight in mapped memory.
+
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+struct Vec4 {
+  float x;
+  float y;
+  float z;
+  float w;
+};
+
+inline bool operator==(const Vec4& lhs, const Vec4& rhs) {
+  return lhs.x == rhs.x && lhs.y == rhs.y && lhs.z == rhs.z && lhs.w == rhs.w;
+}
+
+// Values match the kPixel* constants in the shaders
+enum PixelFormat : uint32_t {
+  kPixelRgba32f = 0,  // four floats, 16 bytes
+  kPixelRgba16f = 1,  // four halfs, 8 bytes
+  kPixelRgba8 = 2,    // four unorm bytes, 4 bytes
+};
+
+inline bool parsePixelFormat(const char* name, PixelFormat* format) {
+  const std::string value = name;
+  if (value == "rgba32f") {
+    *format = kPixelRgba32f;
+  } else if (value == "rgba16f") {
+    *format = kPixelRgba16f;
+  } else if (value == "rgba8") {
+    *format = kPixelRgba8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* getPixelFormatName(PixelFormat format) {
+  switch (format) {
+    case kPixelRgba16f:
+      return "rgba16f";
+    case kPixelRgba8:
+      return "rgba8";
+    default:
+      return "rgba32f";
+  }
+}
+
+inline uint32_t getPixelSize(PixelFormat format) {
+  switch (format) {
+    case kPixelRgba16f:
+      return 8;
+    case kPixelRgba8:
+      return 4;
+    default:
+      return 16;
+  }
+}
+
+// IEEE 754 binary16 conversions, rounding to nearest even like
+// packHalf2x16 does on most devices.
+inline uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t exponent = (bits >> 23) & 0xff;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (exponent == 0xff) {
+    // Infinity stays infinity, NaN stays a (quiet) NaN
+    return static_cast<uint16_t>(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+  }
+
+  const int32_t halfExponent = static_cast<int32_t>(exponent) - 127 + 15;
+  if (halfExponent >= 0x1f) {
+    return static_cast<uint16_t>(sign | 0x7c00);
+  }
+
+  uint32_t shift = 13;
+  uint32_t half = 0;
+  if (halfExponent <= 0) {
+    // Subnormal half, or zero below half the smallest subnormal
+    if (halfExponent < -10) {
+      return static_cast<uint16_t>(sign);
+    }
+    mantissa |= 0x800000;
+    shift = static_cast<uint32_t>(14 - halfExponent);
+    half = mantissa >> shift;
+  } else {
+    half = (static_cast<uint32_t>(halfExponent) << 10) | (mantissa >> shift);
+  }
+
+  // A carry out of the mantissa correctly bumps the exponent
+  const uint32_t remainder = mantissa & ((1u << shift) - 1);
+  const uint32_t halfway = 1u << (shift - 1);
+  if (remainder > halfway || (remainder == halfway && (half & 1) != 0)) {
+    half++;
+  }
+  return static_cast<uint16_t>(sign | half);
+}
+
+inline float halfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  const uint32_t mantissa = half & 0x3ff;
+
+  if (exponent == 0) {
+    // Zero or subnormal: mantissa * 2^-24
+    const float value = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign != 0 ? -value : value;
+  }
+
+  const uint32_t biasedExponent =
+      exponent == 0x1f ? 0xff : exponent + 127 - 15;
+  const uint32_t bits = sign | (biasedExponent << 23) | (mantissa << 13);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Half of every 8 bit unorm value, so that uploading an 8 bit image to a
+// half buffer is a table lookup per channel
+inline const uint16_t* getUnorm8HalfTable() {
+  static const std::array<uint16_t, 256> table = [] {
+    std::array<uint16_t, 256> halfs{};
+    for (uint32_t i = 0; i < 256; i++) {
+      halfs[i] = floatToHalf(i / 255.0f);
+    }
+    return halfs;
+  }();
+  return table.data();
+}
+
+inline uint8_t unormToByte(float value) {
+  return static_cast<uint8_t>(
+      std::lround(std::min(std::max(value, 0.0f), 1.0f) * 255.0f));
+}
+
+// Writes pixel `index` of a buffer in the given format from 8 bit RGB with
+// an alpha of 1. Decoded images take this path, so 8 bit data never goes
+// through float on its way into an rgba8 or rgba16f buffer.
+inline void storeRgb8(PixelFormat format, void* pixels, size_t index,
+                      uint8_t red, uint8_t green, uint8_t blue) {
+  switch (format) {
+    case kPixelRgba8: {
+      uint8_t* const pixel = static_cast<uint8_t*>(pixels) + 4 * index;
+      pixel[0] = red;
+      pixel[1] = green;
+      pixel[2] = blue;
+      pixel[3] = 255;
+      break;
+    }
+    case kPixelRgba16f: {
+      const uint16_t* const halfs = getUnorm8HalfTable();
+      uint16_t* const pixel = static_cast<uint16_t*>(pixels) + 4 * index;
+      pixel[0] = halfs[red];
+      pixel[1] = halfs[green];
+      pixel[2] = halfs[blue];
+      pixel[3] = halfs[255];
+      break;
+    }
+    default: {
+      Vec4& pixel = static_cast<Vec4*>(pixels)[index];
+      pixel.x = red / 255.0f;
+      pixel.y = green / 255.0f;
+      pixel.z = blue / 255.0f;
+      pixel.w = 1.0f;
+      break;
+    }
+  }
+}
+
+// Reads pixel `index` back as 8 bit RGB. Float formats are truncated, as
+// the sample always did, rgba8 is returned as is.
+inline void loadRgb8(PixelFormat format, const void* pixels, size_t index,
+                     uint8_t* red, uint8_t* green, uint8_t* blue) {
+  if (format == kPixelRgba8) {
+    const uint8_t* const pixel =
+        static_cast<const uint8_t*>(pixels) + 4 * index;
+    *red = pixel[0];
+    *green = pixel[1];
+    *blue = pixel[2];
+    return;
+  }
+
+  float rgb[3];
+  if (format == kPixelRgba16f) {
+    const uint16_t* const pixel =
+        static_cast<const uint16_t*>(pixels) + 4 * index;
+    for (int c = 0; c < 3; c++) {
+      rgb[c] = halfToFloat(pixel[c]);
+    }
+  } else {
+    const Vec4& pixel = static_cast<const Vec4*>(pixels)[index];
+    rgb[0] = pixel.x;
+    rgb[1] = pixel.y;
+    rgb[2] = pixel.z;
+  }
+
+  uint8_t* const out[3] = {red, green, blue};
+  for (int c = 0; c < 3; c++) {
+    *out[c] = static_cast<uint8_t>(
+        std::min(std::max(rgb[c], 0.0f), 1.0f) * 255.0);
+  }
+}
+
+inline void storePixel(PixelFormat format, void* pixels, size_t index,
+                       const Vec4& value) {
+  switch (format) {
+    case kPixelRgba8: {
+      uint8_t* const pixel = static_cast<uint8_t*>(pixels) + 4 * index;
+      pixel[0] = unormToByte(value.x);
+      pixel[1] = unormToByte(value.y);
+      pixel[2] = unormToByte(value.z);
+      pixel[3] = unormToByte(value.w);
+      break;
+    }
+    case kPixelRgba16f: {
+      uint16_t* const pixel = static_cast<uint16_t*>(pixels) + 4 * index;
+      pixel[0] = floatToHalf(value.x);
+      pixel[1] = floatToHalf(value.y);
+      pixel[2] = floatToHalf(value.z);
+      pixel[3] = floatToHalf(value.w);
+      break;
+    }
+    default:
+      static_cast<Vec4*>(pixels)[index] = value;
+      break;
+  }
+}
+
+inline Vec4 loadPixel(PixelFormat format, const void* pixels, size_t index) {
+  switch (format) {
+    case kPixelRgba8: {
+      const uint8_t* const pixel =
+          static_cast<const uint8_t*>(pixels) + 4 * index;
+      return Vec4{pixel[0] / 255.0f, pixel[1] / 255.0f, pixel[2] / 255.0f,
+                  pixel[3] / 255.0f};
+    }
+    case kPixelRgba16f: {
+      const uint16_t* const pixel =
+          static_cast<const uint16_t*>(pixels) + 4 * index;
+      return Vec4{halfToFloat(pixel[0]), halfToFloat(pixel[1]),
+                  halfToFloat(pixel[2]), halfToFloat(pixel[3])};
+    }
+    default:
+      return static_cast<const Vec4*>(pixels)[index];
+  }
+}
+
+#endif  // PIXEL_FORMAT_H
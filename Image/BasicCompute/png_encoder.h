@@ -0,0 +1,412 @@
+// PNG encoding that spreads deflate over a worker pool, the way pigz does
+// for gzip. The filtered scanlines are cut into chunks of about
+// kPngChunkBytes, each compressed on its own as raw deflate that ends in a
+// sync flush, with the 32 KB of filtered data before it as the dictionary,
+// so matches still reach back across chunk boundaries. The pieces join
+// into one zlib stream whose Adler-32 is combined from those of the chunks.
+// Every chunk filters the rows it needs itself, so chunks share nothing
+// and the output does not depend on the number of threads.
+
+#ifndef PNG_ENCODER_H
+#define PNG_ENCODER_H
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "worker_pool.h"
+
+// How the filter of each row is chosen. The fixed ones use the same PNG
+// filter type for every row.
+enum PngFilterMode {
+  kPngFilterNone = 0,
+  kPngFilterSub = 1,
+  kPngFilterUp = 2,
+  kPngFilterAverage = 3,
+  kPngFilterPaeth = 4,
+  // Tries all five and keeps the one with the smallest sum of absolute
+  // values, taking the bytes as signed, libpng's heuristic
+  kPngFilterAdaptive = 5,
+};
+
+inline const char* getPngFilterModeName(PngFilterMode mode) {
+  static const char* const kNames[] = {"none",  "sub",   "up",
+                                       "average", "paeth", "adaptive"};
+  return kNames[mode];
+}
+
+inline bool parsePngFilterMode(const char* name, PngFilterMode* mode) {
+  for (int i = kPngFilterNone; i <= kPngFilterAdaptive; i++) {
+    const PngFilterMode candidate = static_cast<PngFilterMode>(i);
+    if (strcmp(name, getPngFilterModeName(candidate)) == 0) {
+      *mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct PngEncodeOptions {
+  // zlib level, 0 stores, 1 is fastest, 9 smallest
+  int level = 6;
+  PngFilterMode filter = kPngFilterAdaptive;
+};
+
+// Filtered bytes per compressed chunk, pigz's block size doubled: small
+// enough to keep every thread busy on a 1080p frame, large enough that the
+// sync flush at the end of each costs nothing measurable
+const size_t kPngChunkBytes = 256 * 1024;
+
+// The deflate window, the most a match can reach back
+const size_t kPngWindowBytes = 32 * 1024;
+
+// Fills row y of the image with 8 bit RGB pixels. Called from the pool's
+// threads at once, for any row and possibly more than once for a row.
+using PngRowSource = std::function<void(uint32_t y, uint8_t* rgb)>;
+
+class PngEncoder {
+ public:
+  // Chunks are compressed on pool, or one after the other on the calling
+  // thread without one. The pool may be shared with other encoders, but
+  // encode() must not run on one of its threads.
+  explicit PngEncoder(const PngEncodeOptions& options = PngEncodeOptions(),
+                      WorkerPool* pool = nullptr)
+      : options_(options), pool_(pool) {}
+
+  const PngEncodeOptions& options() const { return options_; }
+
+  // An 8 bit RGB PNG of the whole file. Throws std::runtime_error when
+  // deflate fails or rows throws.
+  std::vector<uint8_t> encode(uint32_t width, uint32_t height,
+                              const PngRowSource& rows) const {
+    const size_t rowBytes = size_t{3} * width;
+    const size_t filteredRowBytes = rowBytes + 1;
+    const uint32_t chunkRows = static_cast<uint32_t>(
+        std::max<size_t>(kPngChunkBytes / filteredRowBytes, 1));
+    const uint32_t chunkCount =
+        std::max<uint32_t>((height + chunkRows - 1) / chunkRows, 1);
+
+    std::vector<Chunk> chunks(chunkCount);
+    std::mutex mutex;
+    std::condition_variable finished;
+    uint32_t remaining = chunkCount;
+    std::string error;
+    for (uint32_t i = 0; i < chunkCount; i++) {
+      Chunk& chunk = chunks[i];
+      chunk.firstRow = i * chunkRows;
+      chunk.endRow = std::min(chunk.firstRow + chunkRows, height);
+      chunk.last = i + 1 == chunkCount;
+      const auto task = [&, i]() {
+        std::string chunkError;
+        try {
+          compressChunk(width, rows, &chunks[i]);
+        } catch (const std::exception& e) {
+          chunkError = e.what();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!chunkError.empty() && error.empty()) {
+          error = chunkError;
+        }
+        if (--remaining == 0) {
+          finished.notify_one();
+        }
+      };
+      if (pool_ != nullptr) {
+        pool_->submit(task);
+      } else {
+        task();
+      }
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&remaining]() { return remaining == 0; });
+    }
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    // Width, height, 8 bits, RGB, deflate, adaptive filtering, no interlace
+    uint8_t header[13] = {};
+    storeBigEndian(width, header);
+    storeBigEndian(height, header + 4);
+    header[8] = 8;
+    header[9] = 2;
+    appendChunk("IHDR", {{header, sizeof(header)}}, &png);
+
+    // One IDAT per compressed chunk, the first after the zlib header, the
+    // last followed by the Adler-32 of all the filtered data
+    const uint8_t zlibHeader[2] = {0x78, getZlibLevelFlags(options_.level)};
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (const Chunk& chunk : chunks) {
+      adler = adler32_combine(adler, chunk.adler,
+                             static_cast<z_off_t>(chunk.filteredSize));
+    }
+    uint8_t trailer[4];
+    storeBigEndian(static_cast<uint32_t>(adler), trailer);
+    for (uint32_t i = 0; i < chunkCount; i++) {
+      std::vector<Piece> pieces;
+      if (i == 0) {
+        pieces.push_back({zlibHeader, sizeof(zlibHeader)});
+      }
+      pieces.push_back(
+          {chunks[i].compressed.data(), chunks[i].compressed.size()});
+      if (i + 1 == chunkCount) {
+        pieces.push_back({trailer, sizeof(trailer)});
+      }
+      appendChunk("IDAT", pieces, &png);
+    }
+    appendChunk("IEND", {}, &png);
+    return png;
+  }
+
+  // Packed RGB rows rowPitch bytes apart
+  std::vector<uint8_t> encode(uint32_t width, uint32_t height,
+                              const uint8_t* rgb, size_t rowPitch) const {
+    return encode(width, height, [=](uint32_t y, uint8_t* row) {
+      memcpy(row, rgb + y * rowPitch, size_t{3} * width);
+    });
+  }
+
+  // Encodes and writes path with a single write. Throws std::runtime_error
+  // when the file cannot be written.
+  void write(const std::string& path, uint32_t width, uint32_t height,
+             const PngRowSource& rows) const {
+    writeFile(path, encode(width, height, rows));
+  }
+
+  void write(const std::string& path, uint32_t width, uint32_t height,
+             const uint8_t* rgb, size_t rowPitch) const {
+    writeFile(path, encode(width, height, rgb, rowPitch));
+  }
+
+ private:
+  struct Chunk {
+    uint32_t firstRow = 0;
+    uint32_t endRow = 0;
+    bool last = false;
+    std::vector<uint8_t> compressed;
+    uLong adler = 0;
+    size_t filteredSize = 0;
+  };
+
+  struct Piece {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  static void storeBigEndian(uint32_t value, uint8_t* bytes) {
+    bytes[0] = static_cast<uint8_t>(value >> 24);
+    bytes[1] = static_cast<uint8_t>(value >> 16);
+    bytes[2] = static_cast<uint8_t>(value >> 8);
+    bytes[3] = static_cast<uint8_t>(value);
+  }
+
+  // FLEVEL as zlib sets it for the level, and the check bits that make the
+  // header a multiple of 31
+  static uint8_t getZlibLevelFlags(int level) {
+    const int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    const int flags = flevel << 6;
+    return static_cast<uint8_t>(flags + 31 - (0x78 * 256 + flags) % 31);
+  }
+
+  static void appendChunk(const char* type, const std::vector<Piece>& pieces,
+                          std::vector<uint8_t>* png) {
+    size_t size = 0;
+    for (const Piece& piece : pieces) {
+      size += piece.size;
+    }
+    uint8_t length[4];
+    storeBigEndian(static_cast<uint32_t>(size), length);
+    png->insert(png->end(), length, length + 4);
+
+    const auto* typeBytes = reinterpret_cast<const uint8_t*>(type);
+    uLong crc = crc32(0L, typeBytes, 4);
+    png->insert(png->end(), typeBytes, typeBytes + 4);
+    for (const Piece& piece : pieces) {
+      crc = crc32(crc, piece.data, static_cast<uInt>(piece.size));
+      png->insert(png->end(), piece.data, piece.data + piece.size);
+    }
+    uint8_t crcBytes[4];
+    storeBigEndian(static_cast<uint32_t>(crc), crcBytes);
+    png->insert(png->end(), crcBytes, crcBytes + 4);
+  }
+
+  static void writeFile(const std::string& path,
+                        const std::vector<uint8_t>& png) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    const bool written = fwrite(png.data(), 1, png.size(), file) == png.size();
+    if (fclose(file) != 0 || !written) {
+      throw std::runtime_error("failed to write " + path);
+    }
+  }
+
+  // The distances of a + b - c to a, b and c written out, and selects
+  // instead of branches, so that the loops over a row vectorize
+  static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    const int pa = std::abs(b - c);
+    const int pb = std::abs(a - c);
+    const int pc = std::abs(a + b - 2 * c);
+    const uint8_t bc = pb <= pc ? b : c;
+    return pa <= pb && pa <= pc ? a : bc;
+  }
+
+  // One row with the given filter type into out, the type byte first. The
+  // first pixel has no left neighbours, so it gets a loop of its own and the
+  // rest run without branches.
+  static void applyFilter(int type, const uint8_t* row,
+                          const uint8_t* previous, size_t rowBytes,
+                          uint8_t* out) {
+    const size_t bpp = std::min<size_t>(3, rowBytes);
+    out[0] = static_cast<uint8_t>(type);
+    uint8_t* filtered = out + 1;
+    switch (type) {
+      case kPngFilterSub:
+        memcpy(filtered, row, bpp);
+        for (size_t i = bpp; i < rowBytes; i++) {
+          filtered[i] = static_cast<uint8_t>(row[i] - row[i - bpp]);
+        }
+        break;
+      case kPngFilterUp:
+        for (size_t i = 0; i < rowBytes; i++) {
+          filtered[i] = static_cast<uint8_t>(row[i] - previous[i]);
+        }
+        break;
+      case kPngFilterAverage:
+        for (size_t i = 0; i < bpp; i++) {
+          filtered[i] = static_cast<uint8_t>(row[i] - previous[i] / 2);
+        }
+        for (size_t i = bpp; i < rowBytes; i++) {
+          filtered[i] = static_cast<uint8_t>(
+              row[i] - (row[i - bpp] + previous[i]) / 2);
+        }
+        break;
+      case kPngFilterPaeth:
+        for (size_t i = 0; i < bpp; i++) {
+          filtered[i] = static_cast<uint8_t>(row[i] - previous[i]);
+        }
+        for (size_t i = bpp; i < rowBytes; i++) {
+          filtered[i] = static_cast<uint8_t>(
+              row[i] - paeth(row[i - bpp], previous[i], previous[i - bpp]));
+        }
+        break;
+      default:
+        memcpy(filtered, row, rowBytes);
+        break;
+    }
+  }
+
+  // The sum of the absolute values of a filtered row, taking the bytes as
+  // signed
+  static uint32_t getFilterCost(const uint8_t* filtered, size_t rowBytes) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < rowBytes; i++) {
+      const int value = static_cast<int8_t>(filtered[i]);
+      sum += static_cast<uint32_t>(value < 0 ? -value : value);
+    }
+    return sum;
+  }
+
+  void filterRow(const uint8_t* row, const uint8_t* previous,
+                 size_t rowBytes, uint8_t* out,
+                 std::vector<uint8_t>* trial) const {
+    if (options_.filter != kPngFilterAdaptive) {
+      applyFilter(options_.filter, row, previous, rowBytes, out);
+      return;
+    }
+    applyFilter(kPngFilterNone, row, previous, rowBytes, out);
+    uint32_t best = getFilterCost(out + 1, rowBytes);
+    for (int type = kPngFilterSub; type <= kPngFilterPaeth; type++) {
+      applyFilter(type, row, previous, rowBytes, trial->data());
+      const uint32_t sum = getFilterCost(trial->data() + 1, rowBytes);
+      if (sum < best) {
+        best = sum;
+        memcpy(out, trial->data(), rowBytes + 1);
+      }
+    }
+  }
+
+  // Filters the chunk's rows, and before them as many rows as the
+  // dictionary needs, then deflates the chunk's part
+  void compressChunk(uint32_t width, const PngRowSource& rows,
+                     Chunk* chunk) const {
+    const size_t rowBytes = size_t{3} * width;
+    const size_t filteredRowBytes = rowBytes + 1;
+    const uint32_t dictionaryRows = static_cast<uint32_t>(std::min<size_t>(
+        (kPngWindowBytes + filteredRowBytes - 1) / filteredRowBytes,
+        chunk->firstRow));
+    const uint32_t firstRow = chunk->firstRow - dictionaryRows;
+
+    std::vector<uint8_t> previous(rowBytes, 0);
+    std::vector<uint8_t> row(rowBytes);
+    std::vector<uint8_t> trial(filteredRowBytes);
+    std::vector<uint8_t> filtered(filteredRowBytes *
+                                  (chunk->endRow - firstRow));
+    if (firstRow > 0) {
+      rows(firstRow - 1, previous.data());
+    }
+    for (uint32_t y = firstRow; y < chunk->endRow; y++) {
+      rows(y, row.data());
+      filterRow(row.data(), previous.data(), rowBytes,
+                filtered.data() + (y - firstRow) * filteredRowBytes, &trial);
+      std::swap(row, previous);
+    }
+
+    const size_t dictionarySize = dictionaryRows * filteredRowBytes;
+    const uint8_t* data = filtered.data() + dictionarySize;
+    chunk->filteredSize = filtered.size() - dictionarySize;
+    chunk->adler = adler32(adler32(0L, Z_NULL, 0), data,
+                           static_cast<uInt>(chunk->filteredSize));
+
+    // libpng's strategy for filtered rows
+    z_stream stream{};
+    if (deflateInit2(&stream, options_.level, Z_DEFLATED, -15, 8,
+                     options_.filter == kPngFilterNone ? Z_DEFAULT_STRATEGY
+                                                       : Z_FILTERED) != Z_OK) {
+      throw std::runtime_error("deflateInit2 failed");
+    }
+    if (dictionarySize > 0) {
+      const size_t primed = std::min(dictionarySize, kPngWindowBytes);
+      deflateSetDictionary(&stream, data - primed,
+                           static_cast<uInt>(primed));
+    }
+
+    // Never more than the bound, the 5 bytes of the empty stored block a
+    // sync flush adds and a little slack
+    chunk->compressed.resize(deflateBound(&stream, chunk->filteredSize) + 16);
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = static_cast<uInt>(chunk->filteredSize);
+    stream.next_out = chunk->compressed.data();
+    stream.avail_out = static_cast<uInt>(chunk->compressed.size());
+    const int result =
+        deflate(&stream, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool complete =
+        chunk->last ? result == Z_STREAM_END
+                    : result == Z_OK && stream.avail_in == 0 &&
+                          stream.avail_out > 0;
+    chunk->compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (!complete) {
+      throw std::runtime_error("deflate failed");
+    }
+  }
+
+  PngEncodeOptions options_;
+  WorkerPool* pool_;
+};
+
+#endif  // PNG_ENCODER_H
@@ -0,0 +1,301 @@
+// QOI, the Quite OK Image format (qoiformat.org): lossless like PNG, but
+// coded in a single pass over the pixels with no filtering and no entropy
+// coder, so it is written about as fast as a PPM at a size closer to PNG.
+// The encoder reads the pixels where they are, a mapped readback buffer
+// with its row pitch included, and QoiDecoder decodes straight into the
+// memory the pixels are used from, like PngDecoder.
+
+#ifndef QOI_H
+#define QOI_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// How the encoder reads pixels: packed 8 bit RGB, or 4 bytes per pixel in
+// RGBA or BGRA order. Alpha is not kept, the images are RGB like the PPM
+// and PNG output.
+enum QoiPixels {
+  kQoiRgb,
+  kQoiRgba,
+  kQoiBgra,
+};
+
+const size_t kQoiHeaderBytes = 14;
+// Seven zero bytes and a one close the stream
+const size_t kQoiEndBytes = 8;
+// The reference implementation's limit, which keeps the sizes in range
+const uint64_t kQoiMaxPixels = 400000000;
+
+const uint8_t kQoiOpIndex = 0x00;
+const uint8_t kQoiOpDiff = 0x40;
+const uint8_t kQoiOpLuma = 0x80;
+const uint8_t kQoiOpRun = 0xc0;
+const uint8_t kQoiOpRgb = 0xfe;
+const uint8_t kQoiOpRgba = 0xff;
+// Runs of 63 and 64 would read as kQoiOpRgb and kQoiOpRgba
+const uint32_t kQoiMaxRun = 62;
+
+inline bool isQoiPath(const std::string& path) {
+  const size_t dot = path.rfind('.');
+  return dot != std::string::npos && path.substr(dot) == ".qoi";
+}
+
+inline uint32_t getQoiHash(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+  return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+}
+
+// What the encoder carries from one row to the next
+struct QoiEncodeState {
+  // Recently seen pixels by hash, red in the low byte, alpha always 255
+  uint32_t index[64] = {};
+  uint32_t previous = 0xff000000;
+  uint32_t run = 0;
+};
+
+// Encodes width pixels, kStride bytes apart with red and blue at kRed and
+// kBlue, into out and returns the end. Writes at most 4 * width + 1 bytes.
+template <int kStride, int kRed, int kBlue>
+inline char* encodeQoiRow(const uint8_t* pixel, uint32_t width,
+                          QoiEncodeState* state, char* out) {
+  uint32_t previous = state->previous;
+  uint32_t run = state->run;
+  for (uint32_t x = 0; x < width; x++, pixel += kStride) {
+    const uint32_t r = pixel[kRed];
+    const uint32_t g = pixel[1];
+    const uint32_t b = pixel[kBlue];
+    const uint32_t current = r | g << 8 | b << 16 | 0xff000000;
+    if (current == previous) {
+      if (++run == kQoiMaxRun) {
+        *out++ = static_cast<char>(kQoiOpRun | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      *out++ = static_cast<char>(kQoiOpRun | (run - 1));
+      run = 0;
+    }
+
+    const uint32_t hash = getQoiHash(r, g, b, 255);
+    if (state->index[hash] == current) {
+      *out++ = static_cast<char>(kQoiOpIndex | hash);
+    } else {
+      state->index[hash] = current;
+      // Differences to the previous pixel, wrapping around like the bytes
+      const int dr = static_cast<int8_t>(r - (previous & 0xff));
+      const int dg = static_cast<int8_t>(g - (previous >> 8 & 0xff));
+      const int db = static_cast<int8_t>(b - (previous >> 16 & 0xff));
+      const int drg = dr - dg;
+      const int dbg = db - dg;
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        *out++ = static_cast<char>(kQoiOpDiff | (dr + 2) << 4 |
+                                   (dg + 2) << 2 | (db + 2));
+      } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 &&
+                 dbg >= -8 && dbg <= 7) {
+        *out++ = static_cast<char>(kQoiOpLuma | (dg + 32));
+        *out++ = static_cast<char>((drg + 8) << 4 | (dbg + 8));
+      } else {
+        out[0] = static_cast<char>(kQoiOpRgb);
+        out[1] = static_cast<char>(r);
+        out[2] = static_cast<char>(g);
+        out[3] = static_cast<char>(b);
+        out += 4;
+      }
+    }
+    previous = current;
+  }
+  state->previous = previous;
+  state->run = run;
+  return out;
+}
+
+// Appends a QOI image of the pixels, rows rowPitch bytes apart, to out. The
+// buffer grows a row at a time, so a reused one is not filled to the worst
+// case size for every image.
+inline void appendQoi(const char* pixels, uint32_t width, uint32_t height,
+                      size_t rowPitch, QoiPixels layout,
+                      std::vector<char>* out) {
+  if (uint64_t{width} * height > kQoiMaxPixels) {
+    throw std::runtime_error("image too large for QOI");
+  }
+
+  const size_t start = out->size();
+  out->resize(start + kQoiHeaderBytes);
+  char* header = out->data() + start;
+  memcpy(header, "qoif", 4);
+  for (int i = 0; i < 4; i++) {
+    header[4 + i] = static_cast<char>(width >> (24 - 8 * i));
+    header[8 + i] = static_cast<char>(height >> (24 - 8 * i));
+  }
+  header[12] = 3;  // RGB
+  header[13] = 0;  // sRGB
+
+  QoiEncodeState state;
+  const size_t rowBound = size_t{4} * width + 1;
+  for (uint32_t y = 0; y < height; y++) {
+    const size_t used = out->size();
+    out->resize(used + rowBound);
+    const auto* row = reinterpret_cast<const uint8_t*>(pixels + y * rowPitch);
+    char* const first = out->data() + used;
+    char* end = first;
+    switch (layout) {
+      case kQoiRgb:
+        end = encodeQoiRow<3, 0, 2>(row, width, &state, first);
+        break;
+      case kQoiRgba:
+        end = encodeQoiRow<4, 0, 2>(row, width, &state, first);
+        break;
+      case kQoiBgra:
+        end = encodeQoiRow<4, 2, 0>(row, width, &state, first);
+        break;
+    }
+    out->resize(used + (end - first));
+  }
+
+  if (state.run > 0) {
+    out->push_back(static_cast<char>(kQoiOpRun | (state.run - 1)));
+  }
+  out->insert(out->end(), kQoiEndBytes - 1, 0);
+  out->push_back(1);
+}
+
+// Encodes and writes path with a single write. Throws std::runtime_error
+// when the file cannot be written.
+inline void writeQoi(const std::string& path, const char* pixels,
+                     uint32_t width, uint32_t height, size_t rowPitch,
+                     QoiPixels layout) {
+  std::vector<char> qoi;
+  appendQoi(pixels, width, height, rowPitch, layout, &qoi);
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("cannot open " + path);
+  }
+  const bool written = fwrite(qoi.data(), 1, qoi.size(), file) == qoi.size();
+  if (fclose(file) != 0 || !written) {
+    throw std::runtime_error("failed to write " + path);
+  }
+}
+
+// Decodes QOI images of either channel count into 8 bit RGBA rows with an
+// opaque alpha, the layout PngDecoder produces
+class QoiDecoder {
+ public:
+  // Reads the file and its header. Throws std::runtime_error when the file
+  // cannot be read or is not a QOI image.
+  explicit QoiDecoder(const std::string& path) : path_(path) {
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    data_.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(data_.data()),
+              static_cast<std::streamsize>(data_.size()));
+    if (!file || data_.size() < kQoiHeaderBytes + kQoiEndBytes ||
+        memcmp(data_.data(), "qoif", 4) != 0) {
+      throw std::runtime_error(path + ": not a QOI image");
+    }
+
+    for (int i = 0; i < 4; i++) {
+      width_ = width_ << 8 | data_[4 + i];
+      height_ = height_ << 8 | data_[8 + i];
+    }
+    const uint8_t channels = data_[12];
+    const uint8_t colorspace = data_[13];
+    if (width_ == 0 || height_ == 0 ||
+        uint64_t{width_} * height_ > kQoiMaxPixels ||
+        (channels != 3 && channels != 4) || colorspace > 1) {
+      throw std::runtime_error(path + ": bad QOI header");
+    }
+    // The end marker is not read, so the longest op never runs off the end
+    end_ = data_.size() - kQoiEndBytes;
+  }
+
+  uint32_t width() const { return width_; }
+  uint32_t height() const { return height_; }
+
+  // Decodes the image as 8 bit RGBA rows rowPitch bytes apart. Can only be
+  // called once.
+  void readRgba8(void* pixels, size_t rowPitch) {
+    for (uint32_t y = 0; y < height_; y++) {
+      decodeRow(static_cast<uint8_t*>(pixels) + y * rowPitch);
+    }
+  }
+
+  // Decodes one row at a time into a scratch row and calls convertRow(y,
+  // rgba) for it, for destinations in other layouts. Can only be called
+  // once.
+  void readRows(
+      const std::function<void(uint32_t, const uint8_t*)>& convertRow) {
+    std::vector<uint8_t> row(size_t{4} * width_);
+    for (uint32_t y = 0; y < height_; y++) {
+      decodeRow(row.data());
+      convertRow(y, row.data());
+    }
+  }
+
+ private:
+  void decodeRow(uint8_t* rgba) {
+    for (uint32_t x = 0; x < width_; x++, rgba += 4) {
+      if (run_ > 0) {
+        run_--;
+      } else {
+        if (position_ >= end_) {
+          throw std::runtime_error(path_ + ": truncated QOI image");
+        }
+        const uint8_t* op = &data_[position_];
+        if (op[0] == kQoiOpRgb) {
+          memcpy(pixel_, op + 1, 3);
+          position_ += 4;
+        } else if (op[0] == kQoiOpRgba) {
+          memcpy(pixel_, op + 1, 4);
+          position_ += 5;
+        } else if ((op[0] & 0xc0) == kQoiOpIndex) {
+          memcpy(pixel_, index_[op[0]], 4);
+          position_ += 1;
+        } else if ((op[0] & 0xc0) == kQoiOpDiff) {
+          pixel_[0] += (op[0] >> 4 & 3) - 2;
+          pixel_[1] += (op[0] >> 2 & 3) - 2;
+          pixel_[2] += (op[0] & 3) - 2;
+          position_ += 1;
+        } else if ((op[0] & 0xc0) == kQoiOpLuma) {
+          const int dg = (op[0] & 0x3f) - 32;
+          pixel_[0] += dg - 8 + (op[1] >> 4);
+          pixel_[1] += dg;
+          pixel_[2] += dg - 8 + (op[1] & 0x0f);
+          position_ += 2;
+        } else {
+          // This pixel is the first of the run
+          run_ = op[0] & 0x3f;
+          position_ += 1;
+        }
+        memcpy(index_[getQoiHash(pixel_[0], pixel_[1], pixel_[2],
+                                 pixel_[3])],
+               pixel_, 4);
+      }
+      rgba[0] = pixel_[0];
+      rgba[1] = pixel_[1];
+      rgba[2] = pixel_[2];
+      rgba[3] = 0xff;
+    }
+  }
+
+  std::string path_;
+  std::vector<uint8_t> data_;
+  size_t position_ = kQoiHeaderBytes;
+  size_t end_ = 0;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  uint8_t index_[64][4] = {};
+  uint8_t pixel_[4] = {0, 0, 0, 255};
+  uint32_t run_ = 0;
+};
+
+#endif  // QOI_H
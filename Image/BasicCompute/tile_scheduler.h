@@ -0,0 +1,194 @@
+// Filtering of images too large for one dispatch or one allocation. The
+// image is split into tiles whose input overlaps its neighbours by the
+// filter radius (the halo), so every output pixel sees the same neighbours
+// as in the whole image and the tiles stitch together without seams. The
+// tiles stream through the slots of one FilterDevice, whose buffers stay
+// within a fixed memory budget however large the image is.
+
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "filter_device.h"
+
+struct ImageRect {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+struct Tile {
+  ImageRect output;  // pixels the tile writes
+  ImageRect input;   // output plus the halo, clipped to the image
+};
+
+struct TilePlan {
+  // Largest input of any tile, the size every slot is reserved for
+  uint32_t inputWidth = 0;
+  uint32_t inputHeight = 0;
+  std::vector<Tile> tiles;
+};
+
+// Splits a width x height image into tiles whose input, halo included, is
+// at most maxWidth x maxHeight and maxPixels pixels. Whole rows are used
+// when they fit, as they need no halo columns and copy in one piece.
+// Returns false when not even one output pixel plus its halo fits.
+inline bool planTiles(uint32_t width, uint32_t height, uint32_t halo,
+                      uint32_t maxWidth, uint32_t maxHeight,
+                      uint64_t maxPixels, TilePlan* plan) {
+  if (width == 0 || height == 0) {
+    return false;
+  }
+
+  const uint64_t fullRows = maxPixels / width;
+  uint32_t inputWidth = width;
+  if (width > maxWidth ||
+      fullRows < std::min<uint64_t>(height, 2 * uint64_t{halo} + 1)) {
+    inputWidth = static_cast<uint32_t>(std::min<uint64_t>(
+        {width, maxWidth,
+         static_cast<uint64_t>(std::sqrt(static_cast<double>(maxPixels)))}));
+  }
+  const uint32_t inputHeight = static_cast<uint32_t>(std::min<uint64_t>(
+      {height, maxHeight, maxPixels / std::max(inputWidth, 1u)}));
+
+  // A split axis loses the halo on both sides of every tile
+  const auto getStep = [halo](uint32_t input, uint32_t size) -> uint32_t {
+    if (input == size) {
+      return size;
+    }
+    return input > 2 * halo ? input - 2 * halo : 0;
+  };
+  const uint32_t stepX = getStep(inputWidth, width);
+  const uint32_t stepY = getStep(inputHeight, height);
+  if (stepX == 0 || stepY == 0) {
+    return false;
+  }
+
+  plan->inputWidth = 0;
+  plan->inputHeight = 0;
+  plan->tiles.clear();
+  for (uint32_t y = 0; y < height; y += stepY) {
+    for (uint32_t x = 0; x < width; x += stepX) {
+      Tile tile;
+      tile.output = {x, y, std::min(stepX, width - x),
+                     std::min(stepY, height - y)};
+
+      const uint32_t inputX = x > halo ? x - halo : 0;
+      const uint32_t inputY = y > halo ? y - halo : 0;
+      tile.input = {
+          inputX, inputY,
+          std::min(x + tile.output.width + halo, width) - inputX,
+          std::min(y + tile.output.height + halo, height) - inputY};
+
+      plan->inputWidth = std::max(plan->inputWidth, tile.input.width);
+      plan->inputHeight = std::max(plan->inputHeight, tile.input.height);
+      plan->tiles.push_back(tile);
+    }
+  }
+  return true;
+}
+
+// Plans the tiles of a width x height image for filterDevice. The budget,
+// in bytes, covers the pixel buffers of every slot.
+inline bool planDeviceTiles(const FilterDevice& filterDevice, uint32_t width,
+                            uint32_t height, VkDeviceSize budget,
+                            TilePlan* plan) {
+  uint32_t maxWidth = 0;
+  uint32_t maxHeight = 0;
+  uint64_t maxPixels = 0;
+  filterDevice.getMaxRunExtent(&maxWidth, &maxHeight, &maxPixels);
+
+  maxPixels = std::min<uint64_t>(
+      maxPixels, budget / (filterDevice.slotBytesPerPixel() *
+                           filterDevice.slotCount()));
+
+  return planTiles(width, height, filterDevice.radius(), maxWidth, maxHeight,
+                   maxPixels, plan);
+}
+
+// Copies a rectangle of pixels between two row major images
+inline void copyRect(const void* source, uint32_t sourceWidth,
+                     uint32_t sourceX, uint32_t sourceY, void* destination,
+                     uint32_t destinationWidth, uint32_t destinationX,
+                     uint32_t destinationY, uint32_t width, uint32_t height,
+                     uint32_t pixelSize) {
+  const size_t rowSize = size_t{pixelSize} * width;
+  for (uint32_t row = 0; row < height; row++) {
+    const size_t sourceIndex =
+        size_t{sourceY + row} * sourceWidth + sourceX;
+    const size_t destinationIndex =
+        size_t{destinationY + row} * destinationWidth + destinationX;
+    memcpy(static_cast<uint8_t*>(destination) + destinationIndex * pixelSize,
+           static_cast<const uint8_t*>(source) + sourceIndex * pixelSize,
+           rowSize);
+  }
+}
+
+// Filters the image planned for, width pixels wide, into output, both in
+// filterDevice's format, one tile at a time. Tiles take turns in the slots,
+// so copying a tile in or out overlaps filtering the tiles in the other
+// slots. The workgroup size must have been selected already.
+inline VkResult filterTiled(FilterDevice& filterDevice, const TilePlan& plan,
+                            const void* image, uint32_t width, void* output) {
+  const uint32_t slotCount = filterDevice.slotCount();
+  const uint32_t pixelSize = filterDevice.pixelSize();
+
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    const VkResult result =
+        filterDevice.reserve(plan.inputWidth, plan.inputHeight, slot);
+    if (result != VK_SUCCESS) return result;
+  }
+
+  // Copies the interior of a finished tile into the output image
+  const auto finishTile = [&](size_t index) {
+    const Tile& tile = plan.tiles[index];
+    const uint32_t slot = static_cast<uint32_t>(index % slotCount);
+    VkResult result = filterDevice.wait(slot);
+    if (result != VK_SUCCESS) return result;
+
+    copyRect(filterDevice.output(slot), tile.input.width,
+             tile.output.x - tile.input.x, tile.output.y - tile.input.y,
+             output, width, tile.output.x, tile.output.y, tile.output.width,
+             tile.output.height, pixelSize);
+    return VK_SUCCESS;
+  };
+
+  for (size_t index = 0; index < plan.tiles.size(); index++) {
+    const Tile& tile = plan.tiles[index];
+    const uint32_t slot = static_cast<uint32_t>(index % slotCount);
+
+    // The tile that used the slot before must be out first
+    if (index >= slotCount) {
+      const VkResult result = finishTile(index - slotCount);
+      if (result != VK_SUCCESS) return result;
+    }
+
+    copyRect(image, width, tile.input.x, tile.input.y,
+             filterDevice.input(slot), tile.input.width, 0, 0,
+             tile.input.width, tile.input.height, pixelSize);
+
+    const VkResult result =
+        filterDevice.submit(tile.input.width, tile.input.height, slot);
+    if (result != VK_SUCCESS) return result;
+  }
+
+  const size_t tileCount = plan.tiles.size();
+  for (size_t index = tileCount > slotCount ? tileCount - slotCount : 0;
+       index < tileCount; index++) {
+    const VkResult result = finishTile(index);
+    if (result != VK_SUCCESS) return result;
+  }
+
+  filterDevice.collectProfile();
+  return VK_SUCCESS;
+}
+
+#endif  // TILE_SCHEDULER_H
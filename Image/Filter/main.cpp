@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -16,16 +17,22 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include <optional>
-#include <png++/png.hpp>
 #include <set>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "png_decoder.h"
+
 const uint32_t WIDTH = 600;
 const uint32_t HEIGHT = 600;
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Format of the image the quad is rendered into in headless mode. The
+// readback is written out as it is, so it holds RGBA.
+const VkFormat kHeadlessFormat = VK_FORMAT_R8G8B8A8_SRGB;
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"};
 
@@ -61,10 +68,22 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance,
   }
 }
 
+// Filters of the two pass separable shader, see shaders/shader_ubo.frag
+enum FilterMode : int32_t {
+  kFilterBox = 0,
+  kFilterGaussian = 1,
+};
+
 struct ImageConstantData {
   glm::vec2 size;
+  glm::vec2 direction;  // (1, 0) in the horizontal pass, (0, 1) in the vertical
+  int32_t radius;
+  int32_t mode;
 };
 
+// Format of the image the horizontal pass renders into
+const VkFormat kOffscreenFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+
 struct QueueFamilyIndices {
   std::optional<uint32_t> graphicsFamily;
   std::optional<uint32_t> presentFamily;
@@ -120,17 +139,39 @@ const std::vector<uint16_t> indices = {0, 1, 2, 2, 3, 0};
 
 class HelloTriangleApplication {
  public:
+  void setFilter(FilterMode mode, int radius) {
+    filterMode = mode;
+    filterRadius = radius;
+  }
+
   void run(const std::string& imageName) {
-    initWindow();
+    if (!headless) {
+      initWindow();
+    }
     initVulkan(imageName);
-    mainLoop();
+    if (headless) {
+      renderHeadless();
+    } else {
+      mainLoop();
+    }
     cleanup();
   }
 
+  // Renders into an image the size of the texture instead of a window, see
+  // renderHeadless()
+  void setHeadless(uint32_t iterations, const std::string& outputName) {
+    headless = true;
+    headlessIterations = iterations;
+    headlessOutput = outputName;
+  }
+
  private:
   int texWidth{};
   int texHeight{};
 
+  FilterMode filterMode = kFilterBox;
+  int filterRadius = 1;
+
   GLFWwindow* window{};
 
   VkInstance instance{};
@@ -155,8 +196,18 @@ class HelloTriangleApplication {
   VkPipelineLayout pipelineLayout{};
   VkPipeline graphicsPipeline{};
 
+  // The horizontal pass renders the texture into the offscreen image at
+  // texture resolution, the vertical pass samples it into the swap chain
+  VkRenderPass offscreenRenderPass{};
+  VkPipeline horizontalPipeline{};
+  VkImage offscreenImage{};
+  VkDeviceMemory offscreenImageMemory{};
+  VkImageView offscreenImageView{};
+  VkFramebuffer offscreenFramebuffer{};
+
   VkCommandPool commandPool{};
 
+  uint32_t mipLevels{};
   VkImage textureImage{};
   VkDeviceMemory textureImageMemory{};
   VkImageView textureImageView{};
@@ -169,6 +220,7 @@ class HelloTriangleApplication {
 
   VkDescriptorPool descriptorPool{};
   std::vector<VkDescriptorSet> descriptorSets;
+  VkDescriptorSet offscreenDescriptorSet{};
 
   std::vector<VkCommandBuffer> commandBuffers;
 
@@ -180,6 +232,17 @@ class HelloTriangleApplication {
 
   bool framebufferResized = false;
 
+  // Headless mode: no window, surface or swap chain. headlessImage stands in
+  // for the swap chain images and every frame ends with a copy of it into
+  // readbackBuffer.
+  bool headless = false;
+  uint32_t headlessIterations = 1;
+  std::string headlessOutput;
+  VkImage headlessImage{};
+  VkDeviceMemory headlessImageMemory{};
+  VkBuffer readbackBuffer{};
+  VkDeviceMemory readbackBufferMemory{};
+
   void initWindow() {
     glfwInit();
 
@@ -200,19 +263,26 @@ class HelloTriangleApplication {
   void initVulkan(const std::string& imageName) {
     createInstance();
     setupDebugMessenger();
-    createSurface();
+    if (!headless) {
+      createSurface();
+    }
     pickPhysicalDevice();
     createLogicalDevice();
-    createSwapChain();
+    if (headless) {
+      createHeadlessTarget(imageName);
+    } else {
+      createSwapChain();
+    }
     createImageViews();
     createRenderPass();
     createDescriptorSetLayout();
-    createGraphicsPipeline();
-    createFramebuffers();
     createCommandPool();
     createTextureImage(imageName);
     createTextureImageView();
     createTextureSampler();
+    createOffscreenTarget();
+    createGraphicsPipeline();
+    createFramebuffers();
     createVertexBuffer();
     createIndexBuffer();
     createDescriptorPool();
@@ -240,6 +310,7 @@ class HelloTriangleApplication {
                          commandBuffers.data());
 
     vkDestroyPipeline(device, graphicsPipeline, nullptr);
+    vkDestroyPipeline(device, horizontalPipeline, nullptr);
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
     vkDestroyRenderPass(device, renderPass, nullptr);
 
@@ -247,7 +318,14 @@ class HelloTriangleApplication {
       vkDestroyImageView(device, imageView, nullptr);
     }
 
-    vkDestroySwapchainKHR(device, swapChain, nullptr);
+    if (headless) {
+      vkDestroyImage(device, headlessImage, nullptr);
+      vkFreeMemory(device, headlessImageMemory, nullptr);
+      vkDestroyBuffer(device, readbackBuffer, nullptr);
+      vkFreeMemory(device, readbackBufferMemory, nullptr);
+    } else {
+      vkDestroySwapchainKHR(device, swapChain, nullptr);
+    }
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
   }
@@ -255,6 +333,12 @@ class HelloTriangleApplication {
   void cleanup() {
     cleanupSwapChain();
 
+    vkDestroyFramebuffer(device, offscreenFramebuffer, nullptr);
+    vkDestroyRenderPass(device, offscreenRenderPass, nullptr);
+    vkDestroyImageView(device, offscreenImageView, nullptr);
+    vkDestroyImage(device, offscreenImage, nullptr);
+    vkFreeMemory(device, offscreenImageMemory, nullptr);
+
     vkDestroySampler(device, textureSampler, nullptr);
     vkDestroyImageView(device, textureImageView, nullptr);
 
@@ -283,12 +367,16 @@ class HelloTriangleApplication {
       DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (!headless) {
+      vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
 
-    glfwDestroyWindow(window);
+    if (!headless) {
+      glfwDestroyWindow(window);
 
-    glfwTerminate();
+      glfwTerminate();
+    }
   }
 
   void recreateSwapChain() {
@@ -441,9 +529,12 @@ class HelloTriangleApplication {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount =
-        static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    // Without a surface there is nothing to present to
+    if (!headless) {
+      createInfo.enabledExtensionCount =
+          static_cast<uint32_t>(deviceExtensions.size());
+      createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    }
 
     if (enableValidationLayers) {
       createInfo.enabledLayerCount =
@@ -520,6 +611,30 @@ class HelloTriangleApplication {
     swapChainExtent = extent;
   }
 
+  // Stands in for createSwapChain() in headless mode: a single image the
+  // size of the texture, and the host visible buffer it is copied to
+  void createHeadlessTarget(const std::string& imageName) {
+    // Only the header, createTextureImage() decodes the pixels
+    PngDecoder decoder(imageName);
+    swapChainExtent = {decoder.width(), decoder.height()};
+    swapChainImageFormat = kHeadlessFormat;
+
+    createImage(swapChainExtent.width, swapChainExtent.height, 1,
+                kHeadlessFormat, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, headlessImage,
+                headlessImageMemory);
+    swapChainImages = {headlessImage};
+
+    createBuffer(static_cast<VkDeviceSize>(swapChainExtent.width) *
+                     swapChainExtent.height * 4,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 readbackBuffer, readbackBufferMemory);
+  }
+
   void createImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
 
@@ -538,7 +653,10 @@ class HelloTriangleApplication {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // In headless mode the image is copied out after the pass
+    colorAttachment.finalLayout = headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -557,14 +675,27 @@ class HelloTriangleApplication {
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+    // Headless, the copy into the readback buffer waits for the pass
+    VkSubpassDependency readbackDependency{};
+    readbackDependency.srcSubpass = 0;
+    readbackDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    readbackDependency.srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    readbackDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    readbackDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    readbackDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    const std::array<VkSubpassDependency, 2> dependencies = {
+        dependency, readbackDependency};
+
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     renderPassInfo.attachmentCount = 1;
     renderPassInfo.pAttachments = &colorAttachment;
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    renderPassInfo.dependencyCount = headless ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) !=
         VK_SUCCESS) {
@@ -572,6 +703,85 @@ class HelloTriangleApplication {
     }
   }
 
+  void createOffscreenTarget() {
+    createImage(
+        texWidth, texHeight, 1, kOffscreenFormat, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, offscreenImage,
+        offscreenImageMemory);
+
+    offscreenImageView = createImageView(offscreenImage, kOffscreenFormat);
+
+    // Every texel is overwritten by the full screen quad, nothing to load
+    VkAttachmentDescription colorAttachment{};
+    colorAttachment.format = kOffscreenFormat;
+    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkAttachmentReference colorAttachmentRef{};
+    colorAttachmentRef.attachment = 0;
+    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorAttachmentRef;
+
+    // The previous frame's vertical pass must be done reading the image
+    // before it is written again, and this frame's vertical pass reads it
+    // after it is written
+    std::array<VkSubpassDependency, 2> dependencies{};
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcAccessMask = 0;
+    dependencies[0].dstStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = 1;
+    renderPassInfo.pAttachments = &colorAttachment;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    renderPassInfo.dependencyCount =
+        static_cast<uint32_t>(dependencies.size());
+    renderPassInfo.pDependencies = dependencies.data();
+
+    if (vkCreateRenderPass(device, &renderPassInfo, nullptr,
+                           &offscreenRenderPass) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create offscreen render pass!");
+    }
+
+    VkFramebufferCreateInfo framebufferInfo{};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = offscreenRenderPass;
+    framebufferInfo.attachmentCount = 1;
+    framebufferInfo.pAttachments = &offscreenImageView;
+    framebufferInfo.width = static_cast<uint32_t>(texWidth);
+    framebufferInfo.height = static_cast<uint32_t>(texHeight);
+    framebufferInfo.layers = 1;
+
+    if (vkCreateFramebuffer(device, &framebufferInfo, nullptr,
+                            &offscreenFramebuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create offscreen framebuffer!");
+    }
+  }
+
   void createDescriptorSetLayout() {
     VkDescriptorSetLayoutBinding samplerLayoutBinding{};
     samplerLayoutBinding.binding = 1;
@@ -729,6 +939,18 @@ class HelloTriangleApplication {
       throw std::runtime_error("failed to create graphics pipeline!");
     }
 
+    // Same shaders and state for the horizontal pass, sized to the texture
+    viewport.width = static_cast<float>(texWidth);
+    viewport.height = static_cast<float>(texHeight);
+    scissor.extent = {static_cast<uint32_t>(texWidth),
+                      static_cast<uint32_t>(texHeight)};
+    pipelineInfo.renderPass = offscreenRenderPass;
+
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
+                                  nullptr, &horizontalPipeline) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create horizontal pass pipeline!");
+    }
+
     vkDestroyShaderModule(device, fragShaderModule, nullptr);
     vkDestroyShaderModule(device, vertShaderModule, nullptr);
   }
@@ -769,25 +991,13 @@ class HelloTriangleApplication {
   }
 
   void createTextureImage(const std::string& imageName) {
-    // Load an decode an image.
-    png::image<png::rgb_pixel> image(imageName);
-    texWidth = image.get_width();
-    texHeight = image.get_height();
+    // Read the header only, the pixels are decoded into the staging buffer
+    PngDecoder decoder(imageName);
+    texWidth = decoder.width();
+    texHeight = decoder.height();
 
     VkDeviceSize imageSize = texWidth * texHeight * 4;
 
-    std::vector<uint8_t> pixels(image.get_width() * image.get_height() * 4);
-
-    ssize_t size_read = 0;
-    for (size_t y = 0; y < image.get_height(); ++y) {
-      for (size_t x = 0; x < image.get_width(); ++x) {
-        pixels[size_read++] = image[y][x].red;
-        pixels[size_read++] = image[y][x].green;
-        pixels[size_read++] = image[y][x].blue;
-        pixels[size_read++] = 0xFF;
-      }
-    }
-
     VkBuffer stagingBuffer = nullptr;
     VkDeviceMemory stagingBufferMemory = nullptr;
     createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
@@ -797,30 +1007,134 @@ class HelloTriangleApplication {
 
     void* data = nullptr;
     vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels.data(), static_cast<size_t>(imageSize));
+    decoder.readRgba8(data, static_cast<size_t>(texWidth) * 4);
     vkUnmapMemory(device, stagingBufferMemory);
 
-    createImage(
-        texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+    // The full mip chain is blitted from level 0 on the device. sRGB
+    // images cannot be storage images, so where the format cannot be
+    // blitted with linear filtering the texture keeps a single level.
+    mipLevels = 1;
+    if (supportsLinearBlit(VK_FORMAT_R8G8B8A8_SRGB)) {
+      mipLevels = static_cast<uint32_t>(
+                      std::floor(std::log2(std::max(texWidth, texHeight)))) +
+                  1;
+    }
+
+    createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                textureImageMemory);
 
     transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                           VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
     copyBufferToImage(stagingBuffer, textureImage,
                       static_cast<uint32_t>(texWidth),
                       static_cast<uint32_t>(texHeight));
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    // Leaves every level in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    generateMipmaps(textureImage, texWidth, texHeight, mipLevels);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingBufferMemory, nullptr);
   }
 
+  bool supportsLinearBlit(VkFormat format) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format,
+                                        &formatProperties);
+
+    const VkFormatFeatureFlags blitFeatures =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & blitFeatures) ==
+           blitFeatures;
+  }
+
+  // Blits every level from the one before it, all in one command buffer.
+  // Level 0 must be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+  void generateMipmaps(VkImage image, int32_t texWidth, int32_t texHeight,
+                       uint32_t mipLevels) {
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange.levelCount = 1;
+
+    int32_t mipWidth = texWidth;
+    int32_t mipHeight = texHeight;
+
+    for (uint32_t i = 1; i < mipLevels; i++) {
+      barrier.subresourceRange.baseMipLevel = i - 1;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                           nullptr, 1, &barrier);
+
+      const int32_t nextWidth = mipWidth > 1 ? mipWidth / 2 : 1;
+      const int32_t nextHeight = mipHeight > 1 ? mipHeight / 2 : 1;
+
+      VkImageBlit blit{};
+      blit.srcOffsets[0] = {0, 0, 0};
+      blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+      blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.srcSubresource.mipLevel = i - 1;
+      blit.srcSubresource.baseArrayLayer = 0;
+      blit.srcSubresource.layerCount = 1;
+      blit.dstOffsets[0] = {0, 0, 0};
+      blit.dstOffsets[1] = {nextWidth, nextHeight, 1};
+      blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.dstSubresource.mipLevel = i;
+      blit.dstSubresource.baseArrayLayer = 0;
+      blit.dstSubresource.layerCount = 1;
+
+      vkCmdBlitImage(commandBuffer, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                     VK_FILTER_LINEAR);
+
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                           nullptr, 0, nullptr, 1, &barrier);
+
+      mipWidth = nextWidth;
+      mipHeight = nextHeight;
+    }
+
+    // The last level was only ever written
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    endSingleTimeCommands(commandBuffer);
+  }
+
   void createTextureImageView() {
-    textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+    textureImageView =
+        createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB, mipLevels);
   }
 
   void createTextureSampler() {
@@ -831,9 +1145,10 @@ class HelloTriangleApplication {
     samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
     samplerInfo.magFilter = VK_FILTER_LINEAR;
     samplerInfo.minFilter = VK_FILTER_LINEAR;
-    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    // Wide filters must not wrap around to the opposite edge
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
     samplerInfo.anisotropyEnable = VK_TRUE;
     samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
     samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
@@ -841,6 +1156,9 @@ class HelloTriangleApplication {
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(mipLevels);
+    samplerInfo.mipLodBias = 0.0f;
 
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) !=
         VK_SUCCESS) {
@@ -848,7 +1166,8 @@ class HelloTriangleApplication {
     }
   }
 
-  VkImageView createImageView(VkImage image, VkFormat format) {
+  VkImageView createImageView(VkImage image, VkFormat format,
+                              uint32_t mipLevels = 1) {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
@@ -856,7 +1175,7 @@ class HelloTriangleApplication {
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -869,7 +1188,8 @@ class HelloTriangleApplication {
     return imageView;
   }
 
-  void createImage(uint32_t width, uint32_t height, VkFormat format,
+  void createImage(uint32_t width, uint32_t height, uint32_t mipLevels,
+                   VkFormat format,
                    VkImageTiling tiling, VkImageUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkImage& image,
                    VkDeviceMemory& imageMemory) {
@@ -879,7 +1199,7 @@ class HelloTriangleApplication {
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -910,7 +1230,8 @@ class HelloTriangleApplication {
   }
 
   void transitionImageLayout(VkImage image, VkFormat  /*format*/,
-                             VkImageLayout oldLayout, VkImageLayout newLayout) {
+                             VkImageLayout oldLayout, VkImageLayout newLayout,
+                             uint32_t mipLevels) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
     VkImageMemoryBarrier barrier{};
@@ -922,7 +1243,7 @@ class HelloTriangleApplication {
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.levelCount = mipLevels;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
@@ -1027,16 +1348,17 @@ class HelloTriangleApplication {
   }
 
   void createDescriptorPool() {
+    // One set per swap chain image plus the one for the offscreen image
     std::array<VkDescriptorPoolSize, 1> poolSizes{};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     poolSizes[0].descriptorCount =
-        static_cast<uint32_t>(swapChainImages.size());
+        static_cast<uint32_t>(swapChainImages.size()) + 1;
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = static_cast<uint32_t>(swapChainImages.size());
+    poolInfo.maxSets = static_cast<uint32_t>(swapChainImages.size()) + 1;
 
     if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) !=
         VK_SUCCESS) {
@@ -1081,6 +1403,33 @@ class HelloTriangleApplication {
                              static_cast<uint32_t>(descriptorWrites.size()),
                              descriptorWrites.data(), 0, nullptr);
     }
+
+    VkDescriptorSetAllocateInfo offscreenAllocInfo{};
+    offscreenAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    offscreenAllocInfo.descriptorPool = descriptorPool;
+    offscreenAllocInfo.descriptorSetCount = 1;
+    offscreenAllocInfo.pSetLayouts = &descriptorSetLayout;
+
+    if (vkAllocateDescriptorSets(device, &offscreenAllocInfo,
+                                 &offscreenDescriptorSet) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate descriptor sets!");
+    }
+
+    VkDescriptorImageInfo offscreenImageInfo{};
+    offscreenImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    offscreenImageInfo.imageView = offscreenImageView;
+    offscreenImageInfo.sampler = textureSampler;
+
+    VkWriteDescriptorSet offscreenWrite{};
+    offscreenWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    offscreenWrite.dstSet = offscreenDescriptorSet;
+    offscreenWrite.dstBinding = 1;
+    offscreenWrite.dstArrayElement = 0;
+    offscreenWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    offscreenWrite.descriptorCount = 1;
+    offscreenWrite.pImageInfo = &offscreenImageInfo;
+
+    vkUpdateDescriptorSets(device, 1, &offscreenWrite, 0, nullptr);
   }
 
   void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
@@ -1194,6 +1543,50 @@ class HelloTriangleApplication {
         throw std::runtime_error("failed to begin recording command buffer!");
       }
 
+      VkBuffer vertexBuffers[] = {vertexBuffer};
+      VkDeviceSize offsets[] = {0};
+
+      ImageConstantData push{};
+      push.size = glm::vec2{texWidth, texHeight};
+      push.radius = filterRadius;
+      push.mode = filterMode;
+
+      // Horizontal pass: texture into the offscreen image
+      VkRenderPassBeginInfo offscreenPassInfo{};
+      offscreenPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+      offscreenPassInfo.renderPass = offscreenRenderPass;
+      offscreenPassInfo.framebuffer = offscreenFramebuffer;
+      offscreenPassInfo.renderArea.offset = {0, 0};
+      offscreenPassInfo.renderArea.extent = {static_cast<uint32_t>(texWidth),
+                                             static_cast<uint32_t>(texHeight)};
+
+      vkCmdBeginRenderPass(commandBuffers[i], &offscreenPassInfo,
+                           VK_SUBPASS_CONTENTS_INLINE);
+
+      vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        horizontalPipeline);
+
+      vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+
+      vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0,
+                           VK_INDEX_TYPE_UINT16);
+
+      vkCmdBindDescriptorSets(commandBuffers[i],
+                              VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
+                              0, 1, &descriptorSets[i], 0, nullptr);
+
+      push.direction = glm::vec2{1.0f, 0.0f};
+      vkCmdPushConstants(
+          commandBuffers[i], pipelineLayout,
+          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+          sizeof(ImageConstantData), &push);
+
+      vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()),
+                       1, 0, 0, 0);
+
+      vkCmdEndRenderPass(commandBuffers[i]);
+
+      // Vertical pass: offscreen image into the swap chain image
       VkRenderPassBeginInfo renderPassInfo{};
       renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
       renderPassInfo.renderPass = renderPass;
@@ -1211,29 +1604,25 @@ class HelloTriangleApplication {
       vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
                         graphicsPipeline);
 
-      VkBuffer vertexBuffers[] = {vertexBuffer};
-      VkDeviceSize offsets[] = {0};
-      vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
-
-      vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0,
-                           VK_INDEX_TYPE_UINT16);
-
       vkCmdBindDescriptorSets(commandBuffers[i],
                               VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
-                              0, 1, &descriptorSets[i], 0, nullptr);
-
-      vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()),
-                       1, 0, 0, 0);
+                              0, 1, &offscreenDescriptorSet, 0, nullptr);
 
-      ImageConstantData push{};
-      push.size = glm::vec2{texWidth, texHeight};
+      push.direction = glm::vec2{0.0f, 1.0f};
       vkCmdPushConstants(
           commandBuffers[i], pipelineLayout,
           VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
           sizeof(ImageConstantData), &push);
 
+      vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()),
+                       1, 0, 0, 0);
+
       vkCmdEndRenderPass(commandBuffers[i]);
 
+      if (headless) {
+        recordReadback(commandBuffers[i]);
+      }
+
       if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
       }
@@ -1266,6 +1655,99 @@ class HelloTriangleApplication {
     }
   }
 
+  // The render pass leaves headlessImage in
+  // VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+  void recordReadback(VkCommandBuffer commandBuffer) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {swapChainExtent.width, swapChainExtent.height, 1};
+
+    vkCmdCopyImageToBuffer(commandBuffer, headlessImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           readbackBuffer, 1, &region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = readbackBuffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                         &barrier, 0, nullptr);
+  }
+
+  // Takes the place of mainLoop() in headless mode: renders
+  // headlessIterations frames one after the other, reports the time per
+  // frame and writes the last one to headlessOutput
+  void renderHeadless() {
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffers[0];
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < headlessIterations; i++) {
+      vkResetFences(device, 1, &inFlightFences[0]);
+      if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[0]) !=
+          VK_SUCCESS) {
+        throw std::runtime_error("failed to submit draw command buffer!");
+      }
+      vkWaitForFences(device, 1, &inFlightFences[0], VK_TRUE, UINT64_MAX);
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << headlessIterations << " frame(s) of " << swapChainExtent.width
+              << "x" << swapChainExtent.height << " in " << elapsed.count()
+              << " ms, " << elapsed.count() / headlessIterations
+              << " ms per frame" << std::endl;
+
+    saveReadback(headlessOutput);
+  }
+
+  // Writes the readback buffer, tightly packed RGBA, as a binary PPM
+  void saveReadback(const std::string& filename) {
+    const uint32_t width = swapChainExtent.width;
+    const uint32_t height = swapChainExtent.height;
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("failed to open " + filename + "!");
+    }
+    file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
+
+    const char* data = nullptr;
+    vkMapMemory(device, readbackBufferMemory, 0, VK_WHOLE_SIZE, 0,
+                (void**)&data);
+
+    // One write per row, alpha dropped
+    std::vector<char> row(static_cast<size_t>(width) * 3);
+    for (uint32_t y = 0; y < height; y++) {
+      const char* pixel = data + static_cast<size_t>(y) * width * 4;
+      for (uint32_t x = 0; x < width; x++) {
+        row[x * 3 + 0] = pixel[x * 4 + 0];
+        row[x * 3 + 1] = pixel[x * 4 + 1];
+        row[x * 3 + 2] = pixel[x * 4 + 2];
+      }
+      file.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+
+    vkUnmapMemory(device, readbackBufferMemory);
+    std::cout << "Saved " << filename << std::endl;
+  }
+
   void drawFrame() {
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
                     UINT64_MAX);
@@ -1428,10 +1910,11 @@ class HelloTriangleApplication {
   bool isDeviceSuitable(VkPhysicalDevice device) {
     QueueFamilyIndices indices = findQueueFamilies(device);
 
-    bool extensionsSupported = checkDeviceExtensionSupport(device);
+    // Headless, neither the swap chain extension nor a surface is needed
+    bool extensionsSupported = headless || checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless;
+    if (!headless && extensionsSupported) {
       SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
       swapChainAdequate = !swapChainSupport.formats.empty() &&
                           !swapChainSupport.presentModes.empty();
@@ -1481,7 +1964,13 @@ class HelloTriangleApplication {
       }
 
       VkBool32 presentSupport = false;
-      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+      if (headless) {
+        // Nothing is presented, the graphics queue stands in
+        presentSupport = indices.graphicsFamily == static_cast<uint32_t>(i);
+      } else {
+        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                             &presentSupport);
+      }
 
       if (presentSupport) {
         indices.presentFamily = i;
@@ -1498,12 +1987,14 @@ class HelloTriangleApplication {
   }
 
   std::vector<const char*> getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions = nullptr;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions,
-                                        glfwExtensions + glfwExtensionCount);
+    // Headless, GLFW is never initialized and there is no surface
+    std::vector<const char*> extensions;
+    if (!headless) {
+      uint32_t glfwExtensionCount = 0;
+      const char** glfwExtensions = nullptr;
+      glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+      extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (enableValidationLayers) {
       extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1568,12 +2059,49 @@ class HelloTriangleApplication {
 
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
-    std::cout << "Format to call: " << argv[0] << " PNG_image" << '\n';
+    std::cout << "Format to call: " << argv[0]
+              << " PNG_image [--filter box|gaussian] [--radius N] "
+              << "[--headless [--iterations N] [--output FILE]]" << '\n';
     return EXIT_FAILURE;
   }
 
   HelloTriangleApplication app;
 
+  FilterMode mode = kFilterBox;
+  int radius = 1;
+  bool headless = false;
+  uint32_t iterations = 1;
+  std::string outputName = "output.ppm";
+  for (int arg = 2; arg < argc; arg++) {
+    const std::string option = argv[arg];
+    if (option == "--filter" && arg + 1 < argc) {
+      const std::string name = argv[++arg];
+      if (name == "box") {
+        mode = kFilterBox;
+      } else if (name == "gaussian") {
+        mode = kFilterGaussian;
+      } else {
+        std::cerr << "unknown filter " << name << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (option == "--radius" && arg + 1 < argc) {
+      radius = std::max(std::atoi(argv[++arg]), 0);
+    } else if (option == "--headless") {
+      headless = true;
+    } else if (option == "--iterations" && arg + 1 < argc) {
+      iterations = static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--output" && arg + 1 < argc) {
+      outputName = argv[++arg];
+    } else {
+      std::cerr << "unknown option " << option << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  app.setFilter(mode, radius);
+  if (headless) {
+    app.setHeadless(iterations, outputName);
+  }
+
   try {
     app.run(argv[1]);
   } catch (const std::exception& e) {
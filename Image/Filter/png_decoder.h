@@ -0,0 +1,155 @@
+// PNG decoding straight into the memory the pixels are used from, usually a
+// mapped Vulkan buffer. libpng hands out rows of 8 bit RGBA with an opaque
+// alpha, which are either written in place or converted one row at a time,
+// so there is no decoded image object and no second copy of the image.
+
+#ifndef PNG_DECODER_H
+#define PNG_DECODER_H
+
+#include <png.h>
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class PngDecoder {
+ public:
+  // Opens the file and reads the header. Throws std::runtime_error, like
+  // png::image does, when the file cannot be read.
+  explicit PngDecoder(const std::string& path) {
+    file_ = fopen(path.c_str(), "rb");
+    if (file_ == nullptr) {
+      throw std::runtime_error("cannot open " + path);
+    }
+
+    png_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, this, onError,
+                                  onWarning);
+    info_ = png_ != nullptr ? png_create_info_struct(png_) : nullptr;
+    if (info_ == nullptr) {
+      close();
+      throw std::runtime_error("out of memory decoding " + path);
+    }
+
+    if (setjmp(png_jmpbuf(png_)) != 0) {
+      const std::string error = path + ": " + error_;
+      close();
+      throw std::runtime_error(error);
+    }
+
+    png_init_io(png_, file_);
+    png_read_info(png_, info_);
+
+    width_ = png_get_image_width(png_, info_);
+    height_ = png_get_image_height(png_, info_);
+
+    // The conversions of png::image<png::rgb_pixel>, plus an opaque alpha
+    const int colorType = png_get_color_type(png_, info_);
+    const int bitDepth = png_get_bit_depth(png_, info_);
+    if (colorType == PNG_COLOR_TYPE_PALETTE) {
+      png_set_palette_to_rgb(png_);
+    }
+    if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
+      png_set_expand_gray_1_2_4_to_8(png_);
+    }
+    if (bitDepth == 16) {
+      png_set_strip_16(png_);
+    }
+    if ((colorType & PNG_COLOR_MASK_ALPHA) != 0) {
+      png_set_strip_alpha(png_);
+    }
+    if ((colorType & PNG_COLOR_MASK_COLOR) == 0) {
+      png_set_gray_to_rgb(png_);
+    }
+    png_set_filler(png_, 0xff, PNG_FILLER_AFTER);
+    interlacePasses_ = png_set_interlace_handling(png_);
+    png_read_update_info(png_, info_);
+  }
+
+  PngDecoder(const PngDecoder&) = delete;
+  PngDecoder& operator=(const PngDecoder&) = delete;
+
+  ~PngDecoder() { close(); }
+
+  uint32_t width() const { return width_; }
+  uint32_t height() const { return height_; }
+
+  // Decodes the image as 8 bit RGBA rows rowPitch bytes apart. Can only be
+  // called once.
+  void readRgba8(void* pixels, size_t rowPitch) {
+    std::vector<png_bytep> rows(height_);
+    for (uint32_t y = 0; y < height_; y++) {
+      rows[y] = static_cast<png_bytep>(pixels) + y * rowPitch;
+    }
+
+    if (setjmp(png_jmpbuf(png_)) != 0) {
+      throw std::runtime_error(error_);
+    }
+    png_read_image(png_, rows.data());
+    png_read_end(png_, nullptr);
+  }
+
+  // Decodes one row at a time into a scratch row and calls convertRow(y,
+  // rgba) for it, for destinations in other layouts. Interlaced images are
+  // only complete after the last pass, so they are decoded whole first. Can
+  // only be called once.
+  void readRows(
+      const std::function<void(uint32_t, const uint8_t*)>& convertRow) {
+    const size_t rowSize = size_t{4} * width_;
+    if (interlacePasses_ > 1) {
+      std::vector<uint8_t> image(rowSize * height_);
+      readRgba8(image.data(), rowSize);
+      for (uint32_t y = 0; y < height_; y++) {
+        convertRow(y, image.data() + y * rowSize);
+      }
+      return;
+    }
+
+    std::vector<uint8_t> row(rowSize);
+    if (setjmp(png_jmpbuf(png_)) != 0) {
+      throw std::runtime_error(error_);
+    }
+    for (uint32_t y = 0; y < height_; y++) {
+      png_read_row(png_, row.data(), nullptr);
+      convertRow(y, row.data());
+    }
+    png_read_end(png_, nullptr);
+  }
+
+ private:
+  static void onError(png_structp png, png_const_charp message) {
+    PngDecoder* const decoder =
+        static_cast<PngDecoder*>(png_get_error_ptr(png));
+    decoder->error_ = message;
+    longjmp(png_jmpbuf(png), 1);
+  }
+
+  static void onWarning(png_structp /*png*/, png_const_charp /*message*/) {}
+
+  void close() {
+    if (png_ != nullptr) {
+      png_destroy_read_struct(&png_, info_ != nullptr ? &info_ : nullptr,
+                              nullptr);
+    }
+    if (file_ != nullptr) {
+      fclose(file_);
+    }
+    png_ = nullptr;
+    info_ = nullptr;
+    file_ = nullptr;
+  }
+
+  FILE* file_ = nullptr;
+  png_structp png_ = nullptr;
+  png_infop info_ = nullptr;
+  std::string error_;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  int interlacePasses_ = 1;
+};
+
+#endif  // PNG_DECODER_H
@@ -6,37 +6,44 @@ layout(location = 0) in vec2 fragTexCoord;
 
 layout(location = 0) out vec4 outColor;
 
+// One pass of a separable filter, run once along x and once along y
 layout(push_constant) uniform Image {
     vec2 size;
+    vec2 direction;
+    int radius;
+    int mode;
 } push;
 
+const int kFilterBox = 0;
+const int kFilterGaussian = 1;
+
+float weight(int k) {
+  if (push.mode == kFilterGaussian) {
+    float sigma = max(float(push.radius) / 3.0, 0.5);
+    return exp(-float(k * k) / (2.0 * sigma * sigma));
+  }
+  return 1.0;
+}
+
 void main() {
-  // Box filter
-
-  const vec2 texOffset = vec2(1.0/push.size.x, 1.0/push.size.y); //vec2(1.0/512.0, 1.0/512.0);
-  const float wt = 1.0/9.0;
-
-  vec2 tc0 = fragTexCoord + vec2(-texOffset.s, -texOffset.t);
-  vec2 tc1 = fragTexCoord + vec2(0.0, -texOffset.t);
-  vec2 tc2 = fragTexCoord + vec2(+texOffset.s, -texOffset.t);
-  vec2 tc3 = fragTexCoord + vec2(-texOffset.s, 0.0);
-  vec2 tc4 = fragTexCoord + vec2(0.0, 0.0);
-  vec2 tc5 = fragTexCoord + vec2(+texOffset.s, 0.0);
-  vec2 tc6 = fragTexCoord + vec2(-texOffset.s, +texOffset.t);
-  vec2 tc7 = fragTexCoord + vec2(0.0, +texOffset.t);
-  vec2 tc8 = fragTexCoord + vec2(+texOffset.s, +texOffset.t);
-
-  vec4 col0 = texture(texSampler, tc0);
-  vec4 col1 = texture(texSampler, tc1);
-  vec4 col2 = texture(texSampler, tc2);
-  vec4 col3 = texture(texSampler, tc3);
-  vec4 col4 = texture(texSampler, tc4);
-  vec4 col5 = texture(texSampler, tc5);
-  vec4 col6 = texture(texSampler, tc6);
-  vec4 col7 = texture(texSampler, tc7);
-  vec4 col8 = texture(texSampler, tc8);
-
-  vec4 sum = (wt * col0 + wt * col1 + wt * col2 + wt * col3 + wt * col4 +
-              wt * col5 + wt * col6 + wt * col7 + wt * col8);
-  outColor = vec4(sum.rgb, 1.0);
+  const vec2 texStep = push.direction / push.size;
+
+  vec4 sum = weight(0) * texture(texSampler, fragTexCoord);
+  float total = weight(0);
+
+  // Two neighbouring texels per fetch: the bilinear sampler blends texels k
+  // and k + 1 in the ratio of their weights when sampled at the weighted
+  // offset, which halves the number of texture reads
+  for (int k = 1; k <= push.radius; k += 2) {
+    float w0 = weight(k);
+    float w1 = k + 1 <= push.radius ? weight(k + 1) : 0.0;
+    float w = w0 + w1;
+    float offset = (float(k) * w0 + float(k + 1) * w1) / w;
+
+    sum += w * texture(texSampler, fragTexCoord + offset * texStep);
+    sum += w * texture(texSampler, fragTexCoord - offset * texStep);
+    total += 2.0 * w;
+  }
+
+  outColor = vec4(sum.rgb / total, 1.0);
 }
@@ -47,6 +47,7 @@ using std::chrono::steady_clock;
 
 #include "ErrorHandling.h"
 #include "Vertex.h"
+#include "gpu_profiler.h"
 
 // Config
 ///////////////////////
@@ -291,8 +292,12 @@ int main() try {
 
   VkPhysicalDevice physicalDevice = getPhysicalDevice(instance);
 
+  VkPhysicalDeviceFeatures supportedFeatures = {};
+  vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+
   VkPhysicalDeviceFeatures features = {};
   features.shaderStorageImageWriteWithoutFormat = VK_TRUE;
+  features.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
   VkPhysicalDeviceProperties physicalDeviceProperties =
       getPhysicalDeviceProperties(physicalDevice);
   VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties =
@@ -378,6 +383,28 @@ int main() try {
   VkSemaphore computeDoneS = initSemaphore(device);
   VkSemaphore transferDoneS = initSemaphore(device);
 
+  // GPU time of the render pass and of the compute pass. The command buffers
+  // are recorded once, so each swapchain image gets its own query slot.
+  GpuProfiler renderProfiler;
+  VkResult errorCode = renderProfiler.init(
+      physicalDevice, device, queueFamily, imageCount, 1,
+      features.pipelineStatisticsQuery
+          ? VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+                VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT
+          : 0);
+  RESULT_HANDLER(errorCode, "GpuProfiler::init");
+
+  GpuProfiler computeProfiler;
+  errorCode = computeProfiler.init(
+      physicalDevice, device, computeQueueFamily, imageCount, 1,
+      features.pipelineStatisticsQuery
+          ? VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT
+          : 0);
+  RESULT_HANDLER(errorCode, "GpuProfiler::init");
+
+  // color attachment writes of one frame
+  const double frameBytes = 4.0 * ::windowWidth * ::windowHeight;
+
   VkCommandPool commandPool = initCommandPool(device, queueFamily);
   VkCommandPool computeCommandPool =
       initCommandPool(device, computeQueueFamily);
@@ -386,6 +413,9 @@ int main() try {
       acquireCommandBuffers(device, commandPool, imageCount);
   for (size_t i = 0; i < commandBuffers.size(); ++i) {
     beginCommandBuffer(commandBuffers[i]);
+    renderProfiler.beginFrame(commandBuffers[i], i);
+    renderProfiler.beginScope(commandBuffers[i], i, 0, "render pass",
+                              frameBytes);
     recordBeginRenderPass(commandBuffers[i], renderPass, framebuffers[i],
                           ::clearColor, ::windowWidth, ::windowHeight);
 
@@ -400,6 +430,7 @@ int main() try {
     recordDraw(commandBuffers[i], triangle);
 
     recordEndRenderPass(commandBuffers[i]);
+    renderProfiler.endScope(commandBuffers[i], i, 0);
 
     recordImageBarrier(commandBuffers[i], swapchainImages[i],
                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
@@ -418,6 +449,7 @@ int main() try {
                         swapchainImageViews[i], VK_IMAGE_LAYOUT_GENERAL);
 
     beginCommandBuffer(computeCommandBuffers[i]);
+    computeProfiler.beginFrame(computeCommandBuffers[i], i);
     recordBindPipeline(computeCommandBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE,
                        computePipeline);
     recordBindDescriptorSet(computeCommandBuffers[i],
@@ -432,7 +464,9 @@ int main() try {
                        VK_IMAGE_LAYOUT_GENERAL, queueFamily,
                        computeQueueFamily);
 
+    computeProfiler.beginScope(computeCommandBuffers[i], i, 0, "compute");
     vkCmdDispatch(computeCommandBuffers[i], ::windowWidth, ::windowHeight, 1);
+    computeProfiler.endScope(computeCommandBuffers[i], i, 0);
 
     recordImageBarrier(computeCommandBuffers[i], swapchainImages[i],
                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
@@ -480,9 +514,12 @@ int main() try {
                   transferDoneS);
     present(queue, swapchain, nextSwapchainImageIndex, transferDoneS);
     ++frames;
+
+    renderProfiler.collect();
+    computeProfiler.collect();
   }
 
-  VkResult errorCode = vkDeviceWaitIdle(device);
+  errorCode = vkDeviceWaitIdle(device);
   RESULT_HANDLER(errorCode, "vkDeviceWaitIdle");
 
   steady_clock::time_point end = steady_clock::now();
@@ -490,6 +527,13 @@ int main() try {
   cout << "Rendered " << frames << " frames in " << time_span.count()
        << " seconds. Average FPS is " << frames / time_span.count() << endl;
 
+  renderProfiler.collect();
+  computeProfiler.collect();
+  renderProfiler.report(stdout);
+  computeProfiler.report(stdout);
+  renderProfiler.destroy();
+  computeProfiler.destroy();
+
   killCommandPool(device, computeCommandPool);
   killCommandPool(device, commandPool);
 
@@ -0,0 +1,248 @@
+// Continuous capture of presented frames into one stream, a file or stdout,
+// for piping into an external encoder:
+//   raw  packed 8 bit RGB, frame after frame, the size is given out of band
+//        (ffmpeg -f rawvideo -pixel_format rgb24 -video_size WxH -i -)
+//   y4m  YUV4MPEG2, 4:2:0 full range BT.601, self describing
+//        (ffmpeg -i -)
+//   ppm  binary PPMs one after the other (ffmpeg -f image2pipe -i -)
+//   qoi  QOI images one after the other, about as fast to write as ppm
+//        and a fraction of the size (ffmpeg -f qoi_pipe -i -)
+// Frames come from the readback ring's writer thread, one at a time, see
+// readback_ring.h.
+
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "qoi.h"
+#include "readback_ring.h"
+#include "rgb_rows.h"
+
+enum StreamFormat {
+  kStreamRaw,
+  kStreamY4m,
+  kStreamPpm,
+  kStreamQoi,
+};
+
+inline bool parseStreamFormat(const std::string& name, StreamFormat* format) {
+  if (name == "raw") {
+    *format = kStreamRaw;
+  } else if (name == "y4m") {
+    *format = kStreamY4m;
+  } else if (name == "ppm") {
+    *format = kStreamPpm;
+  } else if (name == "qoi") {
+    *format = kStreamQoi;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// From the extension of path, raw unless it is .y4m, .ppm or .qoi
+inline StreamFormat getStreamFormatForPath(const std::string& path) {
+  const size_t dot = path.rfind('.');
+  StreamFormat format = kStreamRaw;
+  if (dot != std::string::npos) {
+    parseStreamFormat(path.substr(dot + 1), &format);
+  }
+  return format;
+}
+
+class FrameStream {
+ public:
+  // path "-" is stdout. The frame rate, fpsNumerator / fpsDenominator, only
+  // goes into the y4m header. Throws std::runtime_error when the file
+  // cannot be opened.
+  FrameStream(const std::string& path, StreamFormat format,
+              uint32_t fpsNumerator, uint32_t fpsDenominator)
+      : path_(path),
+        format_(format),
+        fpsNumerator_(fpsNumerator),
+        fpsDenominator_(fpsDenominator) {
+    if (path == "-") {
+      file_ = stdout;
+    } else {
+      file_ = fopen(path.c_str(), "wb");
+      if (file_ == nullptr) {
+        throw std::runtime_error("cannot open " + path);
+      }
+    }
+  }
+
+  FrameStream(const FrameStream&) = delete;
+  FrameStream& operator=(const FrameStream&) = delete;
+
+  ~FrameStream() {
+    if (file_ == stdout) {
+      fflush(file_);
+    } else {
+      fclose(file_);
+    }
+  }
+
+  // Converts the frame into one buffer and writes it with one call. Raw and
+  // y4m streams have one size, frames of another size are skipped. Every
+  // ppm and qoi image carries its own size.
+  void write(const ReadbackFrame& frame) {
+    if (failed_) {
+      return;
+    }
+    if (frames_ == 0) {
+      start_ = std::chrono::steady_clock::now();
+      width_ = frame.width;
+      height_ = frame.height;
+    } else if ((format_ == kStreamRaw || format_ == kStreamY4m) &&
+               (frame.width != width_ || frame.height != height_)) {
+      skipped_++;
+      return;
+    }
+
+    buffer_.clear();
+    if (format_ == kStreamY4m) {
+      if (frames_ == 0) {
+        appendText("YUV4MPEG2 W" + std::to_string(width_) + " H" +
+                   std::to_string(height_) + " F" +
+                   std::to_string(fpsNumerator_) + ":" +
+                   std::to_string(fpsDenominator_) +
+                   " Ip A1:1 C420jpeg XCOLORRANGE=FULL\n");
+      }
+      appendText("FRAME\n");
+      appendYuv420(frame);
+    } else if (format_ == kStreamQoi) {
+      // Encoded from the readback memory, with no RGB copy in between
+      appendQoi(frame.pixels, frame.width, frame.height,
+                static_cast<size_t>(frame.rowPitch),
+                frame.bgra ? kQoiBgra : kQoiRgba, &buffer_);
+    } else {
+      if (format_ == kStreamPpm) {
+        appendText("P6\n" + std::to_string(frame.width) + "\n" +
+                   std::to_string(frame.height) + "\n255\n");
+      }
+      appendRgb(frame);
+    }
+
+    if (fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size()) {
+      failed_ = true;
+      throw std::runtime_error("failed to write to " + path_ +
+                               ", capture stopped");
+    }
+    frames_++;
+    bytes_ += buffer_.size();
+    end_ = std::chrono::steady_clock::now();
+  }
+
+  // Once a write has failed the capture is over, and the render loop can
+  // stop copying frames out. Safe to call from any thread.
+  bool failed() const { return failed_; }
+  uint64_t frames() const { return frames_; }
+  uint64_t bytes() const { return bytes_; }
+  // Frames left out for having another size than the first
+  uint64_t skipped() const { return skipped_; }
+  // From the first frame handed in to the last one written
+  double seconds() const {
+    return std::chrono::duration<double>(end_ - start_).count();
+  }
+
+ private:
+  void appendText(const std::string& text) {
+    buffer_.insert(buffer_.end(), text.begin(), text.end());
+  }
+
+  void appendRgb(const ReadbackFrame& frame) {
+    const size_t offset = buffer_.size();
+    buffer_.resize(offset + static_cast<size_t>(frame.width) * frame.height *
+                                3);
+    convertRowsToRgb(frame.pixels, frame.width, frame.height,
+                     static_cast<size_t>(frame.rowPitch), frame.bgra,
+                     buffer_.data() + offset);
+  }
+
+  // Full resolution luma, then Cb and Cr of every 2x2 block, the last
+  // column and row repeated for odd sizes. Fixed point BT.601 with 16
+  // fraction bits.
+  void appendYuv420(const ReadbackFrame& frame) {
+    const uint32_t width = frame.width;
+    const uint32_t height = frame.height;
+    const uint32_t chromaWidth = (width + 1) / 2;
+    const uint32_t chromaHeight = (height + 1) / 2;
+    const size_t offset = buffer_.size();
+    const size_t lumaSize = static_cast<size_t>(width) * height;
+    const size_t chromaSize = static_cast<size_t>(chromaWidth) * chromaHeight;
+    buffer_.resize(offset + lumaSize + 2 * chromaSize);
+    auto* luma = reinterpret_cast<uint8_t*>(buffer_.data() + offset);
+    uint8_t* cb = luma + lumaSize;
+    uint8_t* cr = cb + chromaSize;
+
+    const int red = frame.bgra ? 2 : 0;
+    const int blue = frame.bgra ? 0 : 2;
+    const auto load = [&frame](uint32_t x, uint32_t y) {
+      return reinterpret_cast<const uint8_t*>(frame.pixels +
+                                              y * frame.rowPitch + x * 4);
+    };
+
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        const uint8_t* pixel = load(x, y);
+        luma[static_cast<size_t>(y) * width + x] = static_cast<uint8_t>(
+            (19595 * pixel[red] + 38470 * pixel[1] + 7471 * pixel[blue] +
+             32768) >>
+            16);
+      }
+    }
+
+    for (uint32_t cy = 0; cy < chromaHeight; cy++) {
+      const uint32_t y0 = 2 * cy;
+      const uint32_t y1 = std::min(y0 + 1, height - 1);
+      for (uint32_t cx = 0; cx < chromaWidth; cx++) {
+        const uint32_t x0 = 2 * cx;
+        const uint32_t x1 = std::min(x0 + 1, width - 1);
+        const uint8_t* block[4] = {load(x0, y0), load(x1, y0), load(x0, y1),
+                                   load(x1, y1)};
+        int r = 0;
+        int g = 0;
+        int b = 0;
+        for (const uint8_t* pixel : block) {
+          r += pixel[red];
+          g += pixel[1];
+          b += pixel[blue];
+        }
+        // Sums of 4 pixels, so 18 fraction bits, 128 << 18 is the offset
+        const size_t index = static_cast<size_t>(cy) * chromaWidth + cx;
+        cb[index] = static_cast<uint8_t>(
+            (-11059 * r - 21709 * g + 32768 * b + (128 << 18) + (1 << 17)) >>
+            18);
+        cr[index] = static_cast<uint8_t>(
+            (32768 * r - 27439 * g - 5329 * b + (128 << 18) + (1 << 17)) >>
+            18);
+      }
+    }
+  }
+
+  std::string path_;
+  FILE* file_ = nullptr;
+  StreamFormat format_;
+  uint32_t fpsNumerator_;
+  uint32_t fpsDenominator_;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  // One converted frame, reused
+  std::vector<char> buffer_;
+  std::atomic<bool> failed_{false};
+  uint64_t frames_ = 0;
+  uint64_t bytes_ = 0;
+  uint64_t skipped_ = 0;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point end_;
+};
+
+#endif  // FRAME_STREAM_H
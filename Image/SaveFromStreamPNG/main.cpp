@@ -9,6 +9,8 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -16,14 +18,28 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
+#include <memory>
 #include <optional>
-#include <png++/png.hpp>
 #include <set>
 #include <stdexcept>
 #include <vector>
 
+#include "frame_stream.h"
+#include "image_decoder.h"
+#include "png_encoder.h"
+#include "readback_ring.h"
+#include "rgb_rows.h"
+
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Screenshots being copied or written at once, see readback_ring.h. One per
+// frame in flight and one for the writer.
+const uint32_t kReadbackSlots = MAX_FRAMES_IN_FLIGHT + 1;
+
+// Frames a continuous capture may have in flight or queued for the writer
+// unless asked otherwise
+const uint32_t kCaptureSlots = 6;
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"};
 
@@ -116,20 +132,46 @@ const std::vector<Vertex> vertices = {{{-1.0f, 1.0f}, {0.0f, 1.0f}},
 
 const std::vector<uint16_t> indices = {0, 1, 2, 2, 3, 0};
 
+// Continuous capture of the presented frames, see frame_stream.h
+struct CaptureOptions {
+  // File to stream to, "-" for stdout, empty for no capture
+  std::string path;
+  StreamFormat format = kStreamRaw;
+  // Every Nth presented frame
+  uint32_t every = 1;
+  // Readback slots, the frames the writer may fall behind by
+  uint32_t queue = kCaptureSlots;
+  // Once they are all busy: hold the render loop back, or drop the frame
+  bool block = false;
+  // Presentation rate, for the y4m header
+  uint32_t fps = 60;
+};
+
 class HelloTriangleApplication {
  public:
   void run(const std::string& imageName) {
     loadImage(imageName);
+    if (!capture.path.empty()) {
+      openCapture();
+    }
     initWindow();
     initVulkan();
     mainLoop();
     cleanup();
   }
 
+  // Streams the presented frames instead of saving screenshots
+  void setCapture(const CaptureOptions& options) { capture = options; }
+
+  void setPngOptions(const PngEncodeOptions& options) {
+    pngEncoder = PngEncoder(options, &encodePool);
+  }
+
  private:
   int texWidth{};
   int texHeight{};
-  std::vector<uint8_t> pixels;
+  // Open from loadImage() until createTextureImage() decodes the pixels
+  std::optional<ImageDecoder> imageDecoder;
 
   GLFWwindow* window{};
 
@@ -157,6 +199,7 @@ class HelloTriangleApplication {
 
   VkCommandPool commandPool{};
 
+  uint32_t mipLevels{};
   VkImage textureImage{};
   VkDeviceMemory textureImageMemory{};
   VkImageView textureImageView{};
@@ -180,23 +223,25 @@ class HelloTriangleApplication {
 
   bool framebufferResized = false;
 
+  // S saves a screenshot through the ring, see mainLoop() and drawFrame()
+  ReadbackRing readbackRing;
+  bool captureRequested = false;
+  bool captureKeyDown = false;
+  // Screenshots are compressed in chunks on every core, see png_encoder.h
+  WorkerPool encodePool;
+  PngEncoder pngEncoder{PngEncodeOptions(), &encodePool};
+
+  // Continuous capture: every capture.every-th frame goes through the ring
+  // into frameStream, see drawFrame()
+  CaptureOptions capture;
+  std::unique_ptr<FrameStream> frameStream;
+  uint64_t presentedFrames = 0;
+
   void loadImage(const std::string& imageName) {
-    // Load an decode an image.
-    png::image<png::rgb_pixel> image(imageName);
-    texWidth = image.get_width();
-    texHeight = image.get_height();
-
-    pixels.resize(texWidth * texHeight * 4);
-
-    ssize_t size_read = 0;
-    for (size_t y = 0; y < texHeight; ++y) {
-      for (size_t x = 0; x < texWidth; ++x) {
-        pixels[size_read++] = image[y][x].red;
-        pixels[size_read++] = image[y][x].green;
-        pixels[size_read++] = image[y][x].blue;
-        pixels[size_read++] = 0xFF;
-      }
-    }
+    // Only the header, the window is sized to the image
+    imageDecoder.emplace(imageName);
+    texWidth = imageDecoder->width();
+    texHeight = imageDecoder->height();
   }
 
   void initWindow() {
@@ -238,238 +283,32 @@ class HelloTriangleApplication {
     createDescriptorSets();
     createCommandBuffers();
     createSyncObjects();
+    createReadbackRing();
   }
 
-  uint32_t getMemoryTypeIndex(uint32_t typeBits,
-                              VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice,
-                                        &deviceMemoryProperties);
-    for (uint32_t i = 0; i < deviceMemoryProperties.memoryTypeCount; i++) {
-      if ((typeBits & 1) == 1) {
-        if ((deviceMemoryProperties.memoryTypes[i].propertyFlags &
-             properties) == properties) {
-          return i;
-        }
-      }
-      typeBits >>= 1;
-    }
-    return 0;
-  }
-
-  void submitWork(VkCommandBuffer cmdBuffer, VkQueue queue) {
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cmdBuffer;
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    VkFence fence = nullptr;
-    if (vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create fence!");
-    }
-    if (vkQueueSubmit(queue, 1, &submitInfo, fence) != VK_SUCCESS) {
-      throw std::runtime_error("failed to submit to queue!");
-    }
-    if (vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
-      throw std::runtime_error("failed to wait for fence!");
-    }
-    vkDestroyFence(device, fence, nullptr);
-  }
-
-  void insertImageMemoryBarrier(VkCommandBuffer cmdbuffer, VkImage image,
-                                VkAccessFlags srcAccessMask,
-                                VkAccessFlags dstAccessMask,
-                                VkImageLayout oldImageLayout,
-                                VkImageLayout newImageLayout,
-                                VkPipelineStageFlags srcStageMask,
-                                VkPipelineStageFlags dstStageMask,
-                                VkImageSubresourceRange subresourceRange) {
-    VkImageMemoryBarrier imageMemoryBarrier{};
-    imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-    imageMemoryBarrier.srcAccessMask = srcAccessMask;
-    imageMemoryBarrier.dstAccessMask = dstAccessMask;
-    imageMemoryBarrier.oldLayout = oldImageLayout;
-    imageMemoryBarrier.newLayout = newImageLayout;
-    imageMemoryBarrier.image = image;
-    imageMemoryBarrier.subresourceRange = subresourceRange;
-
-    vkCmdPipelineBarrier(cmdbuffer, srcStageMask, dstStageMask, 0, 0, nullptr,
-                         0, nullptr, 1, &imageMemoryBarrier);
-  }
-
-  void saveImage() {
-    // Create the linear tiled destination image to copy to and to read the
-    // memory from
-    VkImageCreateInfo imgCreateInfo{};
-
-    imgCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-
-    imgCreateInfo.imageType = VK_IMAGE_TYPE_2D;
-    imgCreateInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
-    imgCreateInfo.extent.width = texWidth;
-    imgCreateInfo.extent.height = texHeight;
-    imgCreateInfo.extent.depth = 1;
-    imgCreateInfo.arrayLayers = 1;
-    imgCreateInfo.mipLevels = 1;
-    imgCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imgCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imgCreateInfo.tiling = VK_IMAGE_TILING_LINEAR;
-    imgCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    // Create the image
-    VkImage dstImage = nullptr;
-    if (vkCreateImage(device, &imgCreateInfo, nullptr, &dstImage) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to create image!");
-    }
-
-    // Create memory to back up the image
-    VkMemoryRequirements memRequirements;
-    VkMemoryAllocateInfo memAllocInfo{};
-    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-
-    VkDeviceMemory dstImageMemory = nullptr;
-    vkGetImageMemoryRequirements(device, dstImage, &memRequirements);
-    memAllocInfo.allocationSize = memRequirements.size;
-    // Memory must be host visible to copy from
-    memAllocInfo.memoryTypeIndex =
-        getMemoryTypeIndex(memRequirements.memoryTypeBits,
-                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    if (vkAllocateMemory(device, &memAllocInfo, nullptr, &dstImageMemory) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate image memory!");
-    }
-    vkBindImageMemory(device, dstImage, dstImageMemory, 0);
-
-    // Do the actual blit from the offscreen image to our host visible
-    // destination image
-    VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
-    cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdBufAllocateInfo.commandPool = commandPool;
-    cmdBufAllocateInfo.commandBufferCount = 1;
-
-    VkCommandBuffer copyCmd = nullptr;
-    if (vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &copyCmd) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate command buffers!");
-    }
-
-    VkCommandBufferBeginInfo cmdBufInfo{};
-    cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(copyCmd, &cmdBufInfo);
-
-    // Transition destination image to transfer destination layout
-    insertImageMemoryBarrier(
-        copyCmd, dstImage, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    // colorAttachment.image is already in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-    // and does not need to be transitioned
-
-    VkImageCopy imageCopyRegion{};
-    imageCopyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageCopyRegion.srcSubresource.layerCount = 1;
-    imageCopyRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    imageCopyRegion.dstSubresource.layerCount = 1;
-    imageCopyRegion.extent.width = texWidth;
-    imageCopyRegion.extent.height = texHeight;
-    imageCopyRegion.extent.depth = 1;
-
-    vkCmdCopyImage(copyCmd,
-                   // textureImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                   swapChainImages[currentFrame],
-                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dstImage,
-                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageCopyRegion);
-
-    // Transition destination image to general layout, which is the required
-    // layout for mapping the image memory later on
-    insertImageMemoryBarrier(
-        copyCmd, dstImage, VK_ACCESS_TRANSFER_WRITE_BIT,
-        VK_ACCESS_MEMORY_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    vkEndCommandBuffer(copyCmd);
-
-    submitWork(copyCmd, graphicsQueue);
-
-    // Get layout of the image (including row pitch)
-    VkImageSubresource subResource{};
-    subResource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    VkSubresourceLayout subResourceLayout;
-
-    vkGetImageSubresourceLayout(device, dstImage, &subResource,
-                                &subResourceLayout);
-
-    // Map image memory so we can start copying from it
-    const char* imagedata = nullptr;
-    vkMapMemory(device, dstImageMemory, 0, VK_WHOLE_SIZE, 0,
-                (void**)&imagedata);
-    imagedata += subResourceLayout.offset;
-
-    /*
-            Save host visible framebuffer image to disk (ppm format)
-    */
-
-    const char* filename = "output.png";
-
-    png::image<png::rgb_pixel> output_image(texWidth, texHeight);
-
-    // If source is BGR (destination is always RGB) and we can't use blit (which
-    // does automatic conversion), we'll have to manually swizzle color
-    // components Check if source is BGR and needs swizzle
-    std::vector<VkFormat> formatsBGR = {VK_FORMAT_B8G8R8A8_SRGB,
-                                        VK_FORMAT_B8G8R8A8_UNORM,
-                                        VK_FORMAT_B8G8R8A8_SNORM};
-    const bool colorSwizzle =
-        (std::find(formatsBGR.begin(), formatsBGR.end(),
-                   this->swapChainImageFormat /*VK_FORMAT_R8G8B8A8_UNORM*/) !=
-         formatsBGR.end());
-
-    // ppm binary pixel data
-    for (int32_t y = 0; y < texHeight; y++) {
-      auto* row = (unsigned int*)imagedata;
-      for (int32_t x = 0; x < texWidth; x++) {
-        if (colorSwizzle) {
-          output_image[y][x].red = *((char*)row + 2);
-          output_image[y][x].green = *((char*)row + 1);
-          output_image[y][x].blue = *((char*)row);
-        } else {
-          output_image[y][x].red = *((char*)row);
-          output_image[y][x].green = *((char*)row + 1);
-          output_image[y][x].blue = *((char*)row + 2);
-        }
-        row++;
-      }
-      imagedata += subResourceLayout.rowPitch;
-    }
-
-    output_image.write("output.png");
-
-    std::cout << "Framebuffer image saved to " << filename << '\n';
-
-    // Clean up resources
-    vkUnmapMemory(device, dstImageMemory);
-    vkFreeMemory(device, dstImageMemory, nullptr);
-    vkDestroyImage(device, dstImage, nullptr);
+  // Runs on the readback writer thread. The encoder's threads convert the
+  // rows out of the readback memory as they filter them.
+  void writePng(const char* filename, const ReadbackFrame& frame) const {
+    const RgbConverter converter = getBestRgbConverter();
+    pngEncoder.write(filename, frame.width, frame.height,
+                     [&frame, converter](uint32_t y, uint8_t* rgb) {
+                       convertRowToRgb(converter,
+                                       frame.pixels + y * frame.rowPitch,
+                                       frame.width, frame.bgra,
+                                       reinterpret_cast<char*>(rgb));
+                     });
   }
 
   void mainLoop() {
     while (!glfwWindowShouldClose(window)) {
       glfwPollEvents();
 
-      if (GLFW_PRESS == glfwGetKey(window, GLFW_KEY_S)) {
-        saveImage();
+      // One screenshot per press of S, unless every frame is streamed
+      const bool keyDown = GLFW_PRESS == glfwGetKey(window, GLFW_KEY_S);
+      if (keyDown && !captureKeyDown && !frameStream) {
+        captureRequested = true;
       }
+      captureKeyDown = keyDown;
 
       drawFrame();
     }
@@ -500,6 +339,15 @@ class HelloTriangleApplication {
   }
 
   void cleanup() {
+    readbackRing.destroy();
+    if (frameStream) {
+      reportCapture();
+      frameStream.reset();
+    } else if (readbackRing.dropped() > 0) {
+      std::cout << readbackRing.dropped()
+                << " screenshot(s) dropped, every readback slot was busy"
+                << std::endl;
+    }
     cleanupSwapChain();
 
     vkDestroySampler(device, textureSampler, nullptr);
@@ -548,6 +396,7 @@ class HelloTriangleApplication {
 
     vkDeviceWaitIdle(device);
 
+    readbackRing.destroy();
     cleanupSwapChain();
 
     createSwapChain();
@@ -558,6 +407,7 @@ class HelloTriangleApplication {
     createDescriptorPool();
     createDescriptorSets();
     createCommandBuffers();
+    createReadbackRing();
 
     imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
   }
@@ -768,6 +618,54 @@ class HelloTriangleApplication {
     swapChainExtent = extent;
   }
 
+  void openCapture() {
+#if defined(SIGPIPE)
+    // An encoder that exits early fails the write, which ends the capture,
+    // instead of killing the sample
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    frameStream = std::make_unique<FrameStream>(capture.path, capture.format,
+                                                capture.fps, capture.every);
+  }
+
+  // On stderr, stdout may be carrying the stream
+  void reportCapture() {
+    const double megabytes = static_cast<double>(frameStream->bytes()) / 1e6;
+    const double seconds = frameStream->seconds();
+    std::cerr << "Captured " << frameStream->frames() << " frame(s) to "
+              << capture.path << ", " << readbackRing.dropped()
+              << " dropped";
+    if (frameStream->skipped() > 0) {
+      std::cerr << ", " << frameStream->skipped()
+                << " skipped for a new size";
+    }
+    std::cerr << ", " << megabytes << " MB in " << seconds << " s, "
+              << (seconds > 0 ? megabytes / seconds : 0.0)
+              << " MB/s sustained, render loop stalled "
+              << readbackRing.stalledSeconds() << " s" << std::endl;
+  }
+
+  void createReadbackRing() {
+    QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+    if (frameStream) {
+      readbackRing.create(physicalDevice, device,
+                          indices.graphicsFamily.value(), capture.queue,
+                          swapChainExtent, swapChainImageFormat,
+                          [this](const ReadbackFrame& frame) {
+                            frameStream->write(frame);
+                          });
+      return;
+    }
+    readbackRing.create(physicalDevice, device, indices.graphicsFamily.value(),
+                        kReadbackSlots, swapChainExtent, swapChainImageFormat,
+                        [this](const ReadbackFrame& frame) {
+                          writePng("output.png", frame);
+                          std::cout << "Screenshot " << frame.number
+                                    << " saved to output.png"
+                                    << std::endl;
+                        });
+  }
+
   void createImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
 
@@ -1028,30 +926,135 @@ class HelloTriangleApplication {
 
     void* data = nullptr;
     vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels.data(), static_cast<size_t>(imageSize));
+    imageDecoder->readRgba8(data, static_cast<size_t>(texWidth) * 4);
+    imageDecoder.reset();
     vkUnmapMemory(device, stagingBufferMemory);
 
-    createImage(
-        texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+    // The full mip chain is blitted from level 0 on the device. sRGB
+    // images cannot be storage images, so where the format cannot be
+    // blitted with linear filtering the texture keeps a single level.
+    mipLevels = 1;
+    if (supportsLinearBlit(VK_FORMAT_R8G8B8A8_SRGB)) {
+      mipLevels = static_cast<uint32_t>(
+                      std::floor(std::log2(std::max(texWidth, texHeight)))) +
+                  1;
+    }
+
+    createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                textureImageMemory);
 
     transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                           VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
     copyBufferToImage(stagingBuffer, textureImage,
                       static_cast<uint32_t>(texWidth),
                       static_cast<uint32_t>(texHeight));
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    // Leaves every level in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    generateMipmaps(textureImage, texWidth, texHeight, mipLevels);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingBufferMemory, nullptr);
   }
 
+  bool supportsLinearBlit(VkFormat format) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format,
+                                        &formatProperties);
+
+    const VkFormatFeatureFlags blitFeatures =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & blitFeatures) ==
+           blitFeatures;
+  }
+
+  // Blits every level from the one before it, all in one command buffer.
+  // Level 0 must be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+  void generateMipmaps(VkImage image, int32_t texWidth, int32_t texHeight,
+                       uint32_t mipLevels) {
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange.levelCount = 1;
+
+    int32_t mipWidth = texWidth;
+    int32_t mipHeight = texHeight;
+
+    for (uint32_t i = 1; i < mipLevels; i++) {
+      barrier.subresourceRange.baseMipLevel = i - 1;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                           nullptr, 1, &barrier);
+
+      const int32_t nextWidth = mipWidth > 1 ? mipWidth / 2 : 1;
+      const int32_t nextHeight = mipHeight > 1 ? mipHeight / 2 : 1;
+
+      VkImageBlit blit{};
+      blit.srcOffsets[0] = {0, 0, 0};
+      blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+      blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.srcSubresource.mipLevel = i - 1;
+      blit.srcSubresource.baseArrayLayer = 0;
+      blit.srcSubresource.layerCount = 1;
+      blit.dstOffsets[0] = {0, 0, 0};
+      blit.dstOffsets[1] = {nextWidth, nextHeight, 1};
+      blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.dstSubresource.mipLevel = i;
+      blit.dstSubresource.baseArrayLayer = 0;
+      blit.dstSubresource.layerCount = 1;
+
+      vkCmdBlitImage(commandBuffer, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                     VK_FILTER_LINEAR);
+
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                           nullptr, 0, nullptr, 1, &barrier);
+
+      mipWidth = nextWidth;
+      mipHeight = nextHeight;
+    }
+
+    // The last level was only ever written
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    endSingleTimeCommands(commandBuffer);
+  }
+
   void createTextureImageView() {
-    textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+    textureImageView =
+        createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB, mipLevels);
   }
 
   void createTextureSampler() {
@@ -1072,6 +1075,9 @@ class HelloTriangleApplication {
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(mipLevels);
+    samplerInfo.mipLodBias = 0.0f;
 
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) !=
         VK_SUCCESS) {
@@ -1079,7 +1085,8 @@ class HelloTriangleApplication {
     }
   }
 
-  VkImageView createImageView(VkImage image, VkFormat format) {
+  VkImageView createImageView(VkImage image, VkFormat format,
+                              uint32_t mipLevels = 1) {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
@@ -1087,7 +1094,7 @@ class HelloTriangleApplication {
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -1100,7 +1107,8 @@ class HelloTriangleApplication {
     return imageView;
   }
 
-  void createImage(uint32_t width, uint32_t height, VkFormat format,
+  void createImage(uint32_t width, uint32_t height, uint32_t mipLevels,
+                   VkFormat format,
                    VkImageTiling tiling, VkImageUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkImage& image,
                    VkDeviceMemory& imageMemory) {
@@ -1110,7 +1118,7 @@ class HelloTriangleApplication {
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -1141,7 +1149,8 @@ class HelloTriangleApplication {
   }
 
   void transitionImageLayout(VkImage image, VkFormat  /*format*/,
-                             VkImageLayout oldLayout, VkImageLayout newLayout) {
+                             VkImageLayout oldLayout, VkImageLayout newLayout,
+                             uint32_t mipLevels) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
     VkImageMemoryBarrier barrier{};
@@ -1153,7 +1162,7 @@ class HelloTriangleApplication {
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.levelCount = mipLevels;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
@@ -1500,6 +1509,8 @@ class HelloTriangleApplication {
   void drawFrame() {
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
                     UINT64_MAX);
+    // Before the fence is reset below
+    readbackRing.poll();
 
     uint32_t imageIndex = 0;
     VkResult result = vkAcquireNextImageKHR(
@@ -1529,8 +1540,25 @@ class HelloTriangleApplication {
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
 
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+    // A screenshot, or a streamed frame, is copied out by a second command
+    // buffer in the same submit, see readback_ring.h
+    std::array<VkCommandBuffer, 2> submitted = {commandBuffers[imageIndex],
+                                                VK_NULL_HANDLE};
+    const bool streamed =
+        frameStream && !frameStream->failed() &&
+        presentedFrames++ % capture.every == 0;
+    if (captureRequested || streamed) {
+      captureRequested = false;
+      submitted[1] = readbackRing.recordCopy(swapChainImages[imageIndex],
+                                             inFlightFences[currentFrame],
+                                             capture.block);
+      if (submitted[1] == VK_NULL_HANDLE && !streamed) {
+        std::cout << "Screenshot dropped, every readback slot is busy"
+                  << std::endl;
+      }
+    }
+    submitInfo.commandBufferCount = submitted[1] != VK_NULL_HANDLE ? 2 : 1;
+    submitInfo.pCommandBuffers = submitted.data();
 
     VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
     submitInfo.signalSemaphoreCount = 1;
@@ -1799,12 +1827,69 @@ class HelloTriangleApplication {
 
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
-    std::cout << "Format to call: " << argv[0] << " PNG_image" << '\n';
+    std::cout << "Format to call: " << argv[0] << " PNG_image|QOI_image "
+              << "[--capture FILE|- [--capture-format raw|y4m|ppm|qoi] "
+              << "[--capture-every N] [--capture-queue N] "
+              << "[--capture-policy drop|block] [--capture-fps N]] "
+              << "[--png-level 0-9] "
+              << "[--png-filter none|sub|up|average|paeth|adaptive]" << '\n';
     return EXIT_FAILURE;
   }
 
   HelloTriangleApplication app;
 
+  CaptureOptions capture;
+  PngEncodeOptions pngOptions;
+  bool captureFormatGiven = false;
+  for (int arg = 2; arg < argc; arg++) {
+    const std::string option = argv[arg];
+    if (option == "--capture" && arg + 1 < argc) {
+      capture.path = argv[++arg];
+    } else if (option == "--capture-format" && arg + 1 < argc) {
+      if (!parseStreamFormat(argv[++arg], &capture.format)) {
+        std::cerr << "unknown capture format " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+      captureFormatGiven = true;
+    } else if (option == "--capture-every" && arg + 1 < argc) {
+      capture.every =
+          static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--capture-queue" && arg + 1 < argc) {
+      capture.queue =
+          static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--capture-policy" && arg + 1 < argc) {
+      const std::string policy = argv[++arg];
+      if (policy != "drop" && policy != "block") {
+        std::cerr << "unknown capture policy " << policy << std::endl;
+        return EXIT_FAILURE;
+      }
+      capture.block = policy == "block";
+    } else if (option == "--capture-fps" && arg + 1 < argc) {
+      capture.fps = static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--png-level" && arg + 1 < argc) {
+      pngOptions.level = std::atoi(argv[++arg]);
+      if (pngOptions.level < 0 || pngOptions.level > 9) {
+        std::cerr << "--png-level takes 0 to 9" << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (option == "--png-filter" && arg + 1 < argc) {
+      if (!parsePngFilterMode(argv[++arg], &pngOptions.filter)) {
+        std::cerr << "unknown PNG filter " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else {
+      std::cerr << "unknown option " << option << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (!capture.path.empty()) {
+    if (!captureFormatGiven) {
+      capture.format = getStreamFormatForPath(capture.path);
+    }
+    app.setCapture(capture);
+  }
+  app.setPngOptions(pngOptions);
+
   try {
     app.run(argv[1]);
   } catch (const std::exception& e) {
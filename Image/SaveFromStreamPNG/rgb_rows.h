@@ -0,0 +1,195 @@
+// Conversion of rows of 4 byte pixels, RGBA or BGRA, to packed 8 bit RGB,
+// for the PPM writer and the capture stream. The widest kernel the CPU can
+// run is picked once at run time: AVX2 or SSSE3 on x86 with GCC or Clang,
+// NEON on ARM, plain C++ otherwise. Each kernel takes as many whole vectors
+// of pixels as fit in the row and leaves the rest to the plain C++ loop.
+
+#ifndef RGB_ROWS_H
+#define RGB_ROWS_H
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RGB_ROWS_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RGB_ROWS_NEON 1
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+enum RgbConverter {
+  kRgbScalar,
+  kRgbSsse3,
+  kRgbAvx2,
+  kRgbNeon,
+};
+
+inline const char* getRgbConverterName(RgbConverter converter) {
+  switch (converter) {
+    case kRgbSsse3:
+      return "ssse3";
+    case kRgbAvx2:
+      return "avx2";
+    case kRgbNeon:
+      return "neon";
+    default:
+      return "scalar";
+  }
+}
+
+inline bool isRgbConverterSupported(RgbConverter converter) {
+  switch (converter) {
+#if defined(RGB_ROWS_X86)
+    case kRgbSsse3:
+      return __builtin_cpu_supports("ssse3");
+    case kRgbAvx2:
+      return __builtin_cpu_supports("avx2");
+#elif defined(RGB_ROWS_NEON)
+    case kRgbNeon:
+      return true;
+#endif
+    case kRgbScalar:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline RgbConverter getBestRgbConverter() {
+  static const RgbConverter best = [] {
+    for (RgbConverter converter : {kRgbAvx2, kRgbSsse3, kRgbNeon}) {
+      if (isRgbConverterSupported(converter)) {
+        return converter;
+      }
+    }
+    return kRgbScalar;
+  }();
+  return best;
+}
+
+// Pixels first to width of the row
+inline void convertPixelsToRgb(const char* pixels, uint32_t first,
+                               uint32_t width, bool bgra, char* rgb) {
+  const int red = bgra ? 2 : 0;
+  const int blue = bgra ? 0 : 2;
+  const char* pixel = pixels + static_cast<size_t>(first) * 4;
+  char* out = rgb + static_cast<size_t>(first) * 3;
+  for (uint32_t x = first; x < width; x++) {
+    out[0] = pixel[red];
+    out[1] = pixel[1];
+    out[2] = pixel[blue];
+    out += 3;
+    pixel += 4;
+  }
+}
+
+#if defined(RGB_ROWS_X86)
+// Picks red, green and blue of the 4 pixels of a 16 byte lane into its low
+// 12 bytes
+inline __m128i getRgbShuffle(bool bgra) {
+  return bgra ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                              -1, -1)
+              : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1,
+                              -1, -1);
+}
+
+// 16 pixels into 3 full stores. Returns the pixels converted.
+__attribute__((target("ssse3"))) inline uint32_t convertRowSsse3(
+    const char* pixels, uint32_t first, uint32_t width, bool bgra,
+    char* rgb) {
+  const __m128i shuffle = getRgbShuffle(bgra);
+  uint32_t x = first;
+  for (; x + 16 <= width; x += 16) {
+    const auto* in = reinterpret_cast<const __m128i*>(pixels + 4 * x);
+    const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(in), shuffle);
+    const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), shuffle);
+    const __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), shuffle);
+    const __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), shuffle);
+    auto* out = reinterpret_cast<__m128i*>(rgb + 3 * x);
+    _mm_storeu_si128(out, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(b, 4),
+                                           _mm_slli_si128(c, 8)));
+    _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(c, 8),
+                                           _mm_slli_si128(d, 4)));
+  }
+  return x;
+}
+
+// 8 pixels per 32 byte store, of which the last 8 bytes are overwritten by
+// the next one, so the loop stops a store short of the end of the row and
+// hands the rest to the SSSE3 loop
+__attribute__((target("avx2"))) inline uint32_t convertRowAvx2(
+    const char* pixels, uint32_t width, bool bgra, char* rgb) {
+  const __m128i laneShuffle = getRgbShuffle(bgra);
+  const __m256i shuffle = _mm256_setr_m128i(laneShuffle, laneShuffle);
+  // The 12 bytes of the second lane next to those of the first
+  const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  uint32_t x = 0;
+  for (; x + 11 <= width; x += 8) {
+    const __m256i in =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + 4 * x));
+    const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(in, shuffle), pack);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgb + 3 * x), packed);
+  }
+  return convertRowSsse3(pixels, x, width, bgra, rgb);
+}
+#endif
+
+#if defined(RGB_ROWS_NEON)
+// 16 pixels per deinterleaving load and interleaving store
+inline uint32_t convertRowNeon(const char* pixels, uint32_t width, bool bgra,
+                               char* rgb) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16x4_t in =
+        vld4q_u8(reinterpret_cast<const uint8_t*>(pixels + 4 * x));
+    uint8x16x3_t out;
+    out.val[0] = bgra ? in.val[2] : in.val[0];
+    out.val[1] = in.val[1];
+    out.val[2] = bgra ? in.val[0] : in.val[2];
+    vst3q_u8(reinterpret_cast<uint8_t*>(rgb + 3 * x), out);
+  }
+  return x;
+}
+#endif
+
+// One row of width pixels into width * 3 bytes of rgb. converter must be
+// supported.
+inline void convertRowToRgb(RgbConverter converter, const char* pixels,
+                            uint32_t width, bool bgra, char* rgb) {
+  uint32_t done = 0;
+  switch (converter) {
+#if defined(RGB_ROWS_X86)
+    case kRgbSsse3:
+      done = convertRowSsse3(pixels, 0, width, bgra, rgb);
+      break;
+    case kRgbAvx2:
+      done = convertRowAvx2(pixels, width, bgra, rgb);
+      break;
+#elif defined(RGB_ROWS_NEON)
+    case kRgbNeon:
+      done = convertRowNeon(pixels, width, bgra, rgb);
+      break;
+#endif
+    default:
+      break;
+  }
+  convertPixelsToRgb(pixels, done, width, bgra, rgb);
+}
+
+// height rows rowPitch bytes apart into tightly packed RGB
+inline void convertRowsToRgb(const char* pixels, uint32_t width,
+                             uint32_t height, size_t rowPitch, bool bgra,
+                             char* rgb,
+                             RgbConverter converter = getBestRgbConverter()) {
+  const size_t rowBytes = static_cast<size_t>(width) * 3;
+  for (uint32_t y = 0; y < height; y++) {
+    convertRowToRgb(converter, pixels + y * rowPitch, width, bgra,
+                    rgb + y * rowBytes);
+  }
+}
+
+#endif  // RGB_ROWS_H
@@ -0,0 +1,100 @@
+// A fixed set of threads running queued tasks in submission order. Used to
+// spread CPU work such as PNG decoding over all cores.
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class WorkerPool {
+ public:
+  // 0 threads means one per hardware thread
+  explicit WorkerPool(uint32_t threadCount = 0) {
+    if (threadCount == 0) {
+      threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    threads_.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++) {
+      threads_.emplace_back([this]() { work(); });
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Runs the tasks still queued, then joins the threads
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    taskReady_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  uint32_t threadCount() const {
+    return static_cast<uint32_t>(threads_.size());
+  }
+
+  // Tasks must not throw
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+      pending_++;
+    }
+    taskReady_.notify_one();
+  }
+
+  // Blocks until every task submitted so far has finished
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    allDone_.wait(lock, [this]() { return pending_ == 0; });
+  }
+
+ private:
+  void work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        taskReady_.wait(lock,
+                        [this]() { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+
+      task();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_--;
+      }
+      allDone_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable taskReady_;
+  std::condition_variable allDone_;
+  std::deque<std::function<void()>> tasks_;
+  uint64_t pending_ = 0;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+#endif  // WORKER_POOL_H
@@ -9,6 +9,8 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -16,14 +18,36 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <optional>
-#include <png++/png.hpp>
 #include <set>
 #include <stdexcept>
 #include <vector>
 
+#include "frame_stream.h"
+#include "image_decoder.h"
+#include "qoi.h"
+#include "readback_ring.h"
+#include "rgb_rows.h"
+
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Screenshots being copied or written at once, see readback_ring.h. One per
+// frame in flight and one for the writer.
+const uint32_t kReadbackSlots = MAX_FRAMES_IN_FLIGHT + 1;
+
+// Frames a continuous capture may have in flight or queued for the writer
+// unless asked otherwise
+const uint32_t kCaptureSlots = 6;
+
+// Format of the image the quad is rendered into in headless mode. The
+// readback is written out as it is, so it holds RGBA.
+const VkFormat kHeadlessFormat = VK_FORMAT_R8G8B8A8_SRGB;
+
+// The PPM writer converts and writes this many bytes of RGB at a time
+const size_t kPpmBandBytes = 1 << 20;
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"};
 
@@ -116,20 +140,56 @@ const std::vector<Vertex> vertices = {{{-1.0f, 1.0f}, {0.0f, 1.0f}},
 
 const std::vector<uint16_t> indices = {0, 1, 2, 2, 3, 0};
 
+// Continuous capture of the presented frames, see frame_stream.h
+struct CaptureOptions {
+  // File to stream to, "-" for stdout, empty for no capture
+  std::string path;
+  StreamFormat format = kStreamRaw;
+  // Every Nth presented frame
+  uint32_t every = 1;
+  // Readback slots, the frames the writer may fall behind by
+  uint32_t queue = kCaptureSlots;
+  // Once they are all busy: hold the render loop back, or drop the frame
+  bool block = false;
+  // Presentation rate, for the y4m header
+  uint32_t fps = 60;
+};
+
 class HelloTriangleApplication {
  public:
   void run(const std::string& imageName) {
     loadImage(imageName);
-    initWindow();
+    if (!capture.path.empty()) {
+      openCapture();
+    }
+    if (!headless) {
+      initWindow();
+    }
     initVulkan();
-    mainLoop();
+    if (headless) {
+      renderHeadless();
+    } else {
+      mainLoop();
+    }
     cleanup();
   }
 
+  // Renders into an image the size of the texture instead of a window, see
+  // renderHeadless()
+  void setHeadless(uint32_t iterations, const std::string& outputName) {
+    headless = true;
+    headlessIterations = iterations;
+    headlessOutput = outputName;
+  }
+
+  // Streams the presented frames instead of saving screenshots
+  void setCapture(const CaptureOptions& options) { capture = options; }
+
  private:
   int texWidth{};
   int texHeight{};
-  std::vector<uint8_t> pixels;
+  // Open from loadImage() until createTextureImage() decodes the pixels
+  std::optional<ImageDecoder> imageDecoder;
 
   GLFWwindow* window{};
 
@@ -157,6 +217,7 @@ class HelloTriangleApplication {
 
   VkCommandPool commandPool{};
 
+  uint32_t mipLevels{};
   VkImage textureImage{};
   VkDeviceMemory textureImageMemory{};
   VkImageView textureImageView{};
@@ -179,25 +240,34 @@ class HelloTriangleApplication {
   size_t currentFrame = 0;
 
   bool framebufferResized = false;
-  bool screenshotSaved = false;
+
+  // Headless mode: no window, surface or swap chain. headlessImage stands in
+  // for the swap chain images and every frame ends with a copy of it into
+  // readbackBuffer.
+  bool headless = false;
+  uint32_t headlessIterations = 1;
+  std::string headlessOutput;
+  VkImage headlessImage{};
+  VkDeviceMemory headlessImageMemory{};
+  VkBuffer readbackBuffer{};
+  VkDeviceMemory readbackBufferMemory{};
+
+  // S saves a screenshot through the ring, see mainLoop() and drawFrame()
+  ReadbackRing readbackRing;
+  bool captureRequested = false;
+  bool captureKeyDown = false;
+
+  // Continuous capture: every capture.every-th frame goes through the ring
+  // into frameStream, see drawFrame()
+  CaptureOptions capture;
+  std::unique_ptr<FrameStream> frameStream;
+  uint64_t presentedFrames = 0;
 
   void loadImage(const std::string& imageName) {
-    // Load an decode an image.
-    png::image<png::rgb_pixel> image(imageName);
-    texWidth = image.get_width();
-    texHeight = image.get_height();
-
-    pixels.resize(texWidth * texHeight * 4);
-
-    ssize_t size_read = 0;
-    for (size_t y = 0; y < texHeight; ++y) {
-      for (size_t x = 0; x < texWidth; ++x) {
-        pixels[size_read++] = image[y][x].red;
-        pixels[size_read++] = image[y][x].green;
-        pixels[size_read++] = image[y][x].blue;
-        pixels[size_read++] = 0xFF;
-      }
-    }
+    // Only the header, the window is sized to the image
+    imageDecoder.emplace(imageName);
+    texWidth = imageDecoder->width();
+    texHeight = imageDecoder->height();
   }
 
   void initWindow() {
@@ -220,10 +290,16 @@ class HelloTriangleApplication {
   void initVulkan() {
     createInstance();
     setupDebugMessenger();
-    createSurface();
+    if (!headless) {
+      createSurface();
+    }
     pickPhysicalDevice();
     createLogicalDevice();
-    createSwapChain();
+    if (headless) {
+      createHeadlessTarget();
+    } else {
+      createSwapChain();
+    }
     createImageViews();
     createRenderPass();
     createDescriptorSetLayout();
@@ -239,15 +315,21 @@ class HelloTriangleApplication {
     createDescriptorSets();
     createCommandBuffers();
     createSyncObjects();
+    if (!headless) {
+      createReadbackRing();
+    }
   }
 
   void mainLoop() {
     while (!glfwWindowShouldClose(window)) {
       glfwPollEvents();
 
-      if (GLFW_PRESS == glfwGetKey(window, GLFW_KEY_S)) {
-        saveScreenshot("output.ppm");
+      // One screenshot per press of S, unless every frame is streamed
+      const bool keyDown = GLFW_PRESS == glfwGetKey(window, GLFW_KEY_S);
+      if (keyDown && !captureKeyDown && !frameStream) {
+        captureRequested = true;
       }
+      captureKeyDown = keyDown;
 
       drawFrame();
     }
@@ -272,12 +354,28 @@ class HelloTriangleApplication {
       vkDestroyImageView(device, imageView, nullptr);
     }
 
-    vkDestroySwapchainKHR(device, swapChain, nullptr);
+    if (headless) {
+      vkDestroyImage(device, headlessImage, nullptr);
+      vkFreeMemory(device, headlessImageMemory, nullptr);
+      vkDestroyBuffer(device, readbackBuffer, nullptr);
+      vkFreeMemory(device, readbackBufferMemory, nullptr);
+    } else {
+      vkDestroySwapchainKHR(device, swapChain, nullptr);
+    }
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
   }
 
   void cleanup() {
+    readbackRing.destroy();
+    if (frameStream) {
+      reportCapture();
+      frameStream.reset();
+    } else if (readbackRing.dropped() > 0) {
+      std::cout << readbackRing.dropped()
+                << " screenshot(s) dropped, every readback slot was busy"
+                << std::endl;
+    }
     cleanupSwapChain();
 
     vkDestroySampler(device, textureSampler, nullptr);
@@ -308,12 +406,16 @@ class HelloTriangleApplication {
       DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (!headless) {
+      vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
 
-    glfwDestroyWindow(window);
+    if (!headless) {
+      glfwDestroyWindow(window);
 
-    glfwTerminate();
+      glfwTerminate();
+    }
   }
 
   void recreateSwapChain() {
@@ -326,6 +428,7 @@ class HelloTriangleApplication {
 
     vkDeviceWaitIdle(device);
 
+    readbackRing.destroy();
     cleanupSwapChain();
 
     createSwapChain();
@@ -336,6 +439,7 @@ class HelloTriangleApplication {
     createDescriptorPool();
     createDescriptorSets();
     createCommandBuffers();
+    createReadbackRing();
 
     imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
   }
@@ -466,9 +570,12 @@ class HelloTriangleApplication {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount =
-        static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    // Without a surface there is nothing to present to
+    if (!headless) {
+      createInfo.enabledExtensionCount =
+          static_cast<uint32_t>(deviceExtensions.size());
+      createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    }
 
     if (enableValidationLayers) {
       createInfo.enabledLayerCount =
@@ -512,7 +619,8 @@ class HelloTriangleApplication {
     createInfo.imageColorSpace = surfaceFormat.colorSpace;
     createInfo.imageExtent = extent;
     createInfo.imageArrayLayers = 1;
-    createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    createInfo.imageUsage =
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
 
     QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
     uint32_t queueFamilyIndices[] = {indices.graphicsFamily.value(),
@@ -545,6 +653,78 @@ class HelloTriangleApplication {
     swapChainExtent = extent;
   }
 
+  // Stands in for createSwapChain() in headless mode: a single image the
+  // size of the texture, and the host visible buffer it is copied to
+  void createHeadlessTarget() {
+    swapChainExtent = {static_cast<uint32_t>(texWidth),
+                       static_cast<uint32_t>(texHeight)};
+    swapChainImageFormat = kHeadlessFormat;
+
+    createImage(swapChainExtent.width, swapChainExtent.height, 1,
+                kHeadlessFormat, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, headlessImage,
+                headlessImageMemory);
+    swapChainImages = {headlessImage};
+
+    createBuffer(static_cast<VkDeviceSize>(swapChainExtent.width) *
+                     swapChainExtent.height * 4,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 readbackBuffer, readbackBufferMemory);
+  }
+
+  void openCapture() {
+#if defined(SIGPIPE)
+    // An encoder that exits early fails the write, which ends the capture,
+    // instead of killing the sample
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    frameStream = std::make_unique<FrameStream>(capture.path, capture.format,
+                                                capture.fps, capture.every);
+  }
+
+  // On stderr, stdout may be carrying the stream
+  void reportCapture() {
+    const double megabytes = static_cast<double>(frameStream->bytes()) / 1e6;
+    const double seconds = frameStream->seconds();
+    std::cerr << "Captured " << frameStream->frames() << " frame(s) to "
+              << capture.path << ", " << readbackRing.dropped()
+              << " dropped";
+    if (frameStream->skipped() > 0) {
+      std::cerr << ", " << frameStream->skipped()
+                << " skipped for a new size";
+    }
+    std::cerr << ", " << megabytes << " MB in " << seconds << " s, "
+              << (seconds > 0 ? megabytes / seconds : 0.0)
+              << " MB/s sustained, render loop stalled "
+              << readbackRing.stalledSeconds() << " s" << std::endl;
+  }
+
+  void createReadbackRing() {
+    QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+    if (frameStream) {
+      readbackRing.create(physicalDevice, device,
+                          indices.graphicsFamily.value(), capture.queue,
+                          swapChainExtent, swapChainImageFormat,
+                          [this](const ReadbackFrame& frame) {
+                            frameStream->write(frame);
+                          });
+      return;
+    }
+    readbackRing.create(physicalDevice, device, indices.graphicsFamily.value(),
+                        kReadbackSlots, swapChainExtent, swapChainImageFormat,
+                        [](const ReadbackFrame& frame) {
+                          writePpm("output.ppm", frame.pixels, frame.width,
+                                   frame.height, frame.rowPitch, frame.bgra);
+                          std::cout << "Screenshot " << frame.number
+                                    << " saved to output.ppm"
+                                    << std::endl;
+                        });
+  }
+
   void createImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
 
@@ -563,7 +743,10 @@ class HelloTriangleApplication {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // In headless mode the image is copied out after the pass
+    colorAttachment.finalLayout = headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -582,14 +765,27 @@ class HelloTriangleApplication {
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+    // Headless, the copy into the readback buffer waits for the pass
+    VkSubpassDependency readbackDependency{};
+    readbackDependency.srcSubpass = 0;
+    readbackDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    readbackDependency.srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    readbackDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    readbackDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    readbackDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    const std::array<VkSubpassDependency, 2> dependencies = {
+        dependency, readbackDependency};
+
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     renderPassInfo.attachmentCount = 1;
     renderPassInfo.pAttachments = &colorAttachment;
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    renderPassInfo.dependencyCount = headless ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) !=
         VK_SUCCESS) {
@@ -805,30 +1001,135 @@ class HelloTriangleApplication {
 
     void* data = nullptr;
     vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels.data(), static_cast<size_t>(imageSize));
+    imageDecoder->readRgba8(data, static_cast<size_t>(texWidth) * 4);
+    imageDecoder.reset();
     vkUnmapMemory(device, stagingBufferMemory);
 
-    createImage(
-        texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+    // The full mip chain is blitted from level 0 on the device. sRGB
+    // images cannot be storage images, so where the format cannot be
+    // blitted with linear filtering the texture keeps a single level.
+    mipLevels = 1;
+    if (supportsLinearBlit(VK_FORMAT_R8G8B8A8_SRGB)) {
+      mipLevels = static_cast<uint32_t>(
+                      std::floor(std::log2(std::max(texWidth, texHeight)))) +
+                  1;
+    }
+
+    createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                textureImageMemory);
 
     transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                           VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
     copyBufferToImage(stagingBuffer, textureImage,
                       static_cast<uint32_t>(texWidth),
                       static_cast<uint32_t>(texHeight));
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    // Leaves every level in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    generateMipmaps(textureImage, texWidth, texHeight, mipLevels);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingBufferMemory, nullptr);
   }
 
+  bool supportsLinearBlit(VkFormat format) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format,
+                                        &formatProperties);
+
+    const VkFormatFeatureFlags blitFeatures =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & blitFeatures) ==
+           blitFeatures;
+  }
+
+  // Blits every level from the one before it, all in one command buffer.
+  // Level 0 must be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+  void generateMipmaps(VkImage image, int32_t texWidth, int32_t texHeight,
+                       uint32_t mipLevels) {
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange.levelCount = 1;
+
+    int32_t mipWidth = texWidth;
+    int32_t mipHeight = texHeight;
+
+    for (uint32_t i = 1; i < mipLevels; i++) {
+      barrier.subresourceRange.baseMipLevel = i - 1;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                           nullptr, 1, &barrier);
+
+      const int32_t nextWidth = mipWidth > 1 ? mipWidth / 2 : 1;
+      const int32_t nextHeight = mipHeight > 1 ? mipHeight / 2 : 1;
+
+      VkImageBlit blit{};
+      blit.srcOffsets[0] = {0, 0, 0};
+      blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
+      blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.srcSubresource.mipLevel = i - 1;
+      blit.srcSubresource.baseArrayLayer = 0;
+      blit.srcSubresource.layerCount = 1;
+      blit.dstOffsets[0] = {0, 0, 0};
+      blit.dstOffsets[1] = {nextWidth, nextHeight, 1};
+      blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      blit.dstSubresource.mipLevel = i;
+      blit.dstSubresource.baseArrayLayer = 0;
+      blit.dstSubresource.layerCount = 1;
+
+      vkCmdBlitImage(commandBuffer, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                     VK_FILTER_LINEAR);
+
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                           nullptr, 0, nullptr, 1, &barrier);
+
+      mipWidth = nextWidth;
+      mipHeight = nextHeight;
+    }
+
+    // The last level was only ever written
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    endSingleTimeCommands(commandBuffer);
+  }
+
   void createTextureImageView() {
-    textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+    textureImageView =
+        createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB, mipLevels);
   }
 
   void createTextureSampler() {
@@ -849,6 +1150,9 @@ class HelloTriangleApplication {
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(mipLevels);
+    samplerInfo.mipLodBias = 0.0f;
 
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) !=
         VK_SUCCESS) {
@@ -856,7 +1160,8 @@ class HelloTriangleApplication {
     }
   }
 
-  VkImageView createImageView(VkImage image, VkFormat format) {
+  VkImageView createImageView(VkImage image, VkFormat format,
+                              uint32_t mipLevels = 1) {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
@@ -864,7 +1169,7 @@ class HelloTriangleApplication {
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -877,7 +1182,8 @@ class HelloTriangleApplication {
     return imageView;
   }
 
-  void createImage(uint32_t width, uint32_t height, VkFormat format,
+  void createImage(uint32_t width, uint32_t height, uint32_t mipLevels,
+                   VkFormat format,
                    VkImageTiling tiling, VkImageUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkImage& image,
                    VkDeviceMemory& imageMemory) {
@@ -887,7 +1193,7 @@ class HelloTriangleApplication {
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -918,7 +1224,8 @@ class HelloTriangleApplication {
   }
 
   void transitionImageLayout(VkImage image, VkFormat  /*format*/,
-                             VkImageLayout oldLayout, VkImageLayout newLayout) {
+                             VkImageLayout oldLayout, VkImageLayout newLayout,
+                             uint32_t mipLevels) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
     VkImageMemoryBarrier barrier{};
@@ -930,7 +1237,7 @@ class HelloTriangleApplication {
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.levelCount = mipLevels;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
@@ -1242,6 +1549,10 @@ class HelloTriangleApplication {
 
       vkCmdEndRenderPass(commandBuffers[i]);
 
+      if (headless) {
+        recordReadback(commandBuffers[i]);
+      }
+
       if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
       }
@@ -1274,9 +1585,93 @@ class HelloTriangleApplication {
     }
   }
 
+  // The render pass leaves headlessImage in
+  // VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+  void recordReadback(VkCommandBuffer commandBuffer) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {swapChainExtent.width, swapChainExtent.height, 1};
+
+    vkCmdCopyImageToBuffer(commandBuffer, headlessImage,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           readbackBuffer, 1, &region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = readbackBuffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                         &barrier, 0, nullptr);
+  }
+
+  // Takes the place of mainLoop() in headless mode: renders
+  // headlessIterations frames one after the other, reports the time per
+  // frame and writes the last one to headlessOutput
+  void renderHeadless() {
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffers[0];
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < headlessIterations; i++) {
+      vkResetFences(device, 1, &inFlightFences[0]);
+      if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[0]) !=
+          VK_SUCCESS) {
+        throw std::runtime_error("failed to submit draw command buffer!");
+      }
+      vkWaitForFences(device, 1, &inFlightFences[0], VK_TRUE, UINT64_MAX);
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << headlessIterations << " frame(s) of " << swapChainExtent.width
+              << "x" << swapChainExtent.height << " in " << elapsed.count()
+              << " ms, " << elapsed.count() / headlessIterations
+              << " ms per frame" << std::endl;
+
+    saveReadback(headlessOutput);
+  }
+
+  // Writes the readback buffer, tightly packed RGBA, as a QOI image when
+  // filename ends in .qoi and as a binary PPM otherwise
+  void saveReadback(const std::string& filename) {
+    const char* data = nullptr;
+    vkMapMemory(device, readbackBufferMemory, 0, VK_WHOLE_SIZE, 0,
+                (void**)&data);
+    const VkDeviceSize rowPitch =
+        static_cast<VkDeviceSize>(swapChainExtent.width) * 4;
+    if (isQoiPath(filename)) {
+      writeQoi(filename, data, swapChainExtent.width, swapChainExtent.height,
+               static_cast<size_t>(rowPitch), kQoiRgba);
+    } else {
+      writePpm(filename.c_str(), data, swapChainExtent.width,
+               swapChainExtent.height, rowPitch, false);
+    }
+    vkUnmapMemory(device, readbackBufferMemory);
+
+    std::cout << "Saved " << filename << std::endl;
+  }
+
   void drawFrame() {
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
                     UINT64_MAX);
+    // Before the fence is reset below
+    readbackRing.poll();
 
     uint32_t imageIndex = 0;
     VkResult result = vkAcquireNextImageKHR(
@@ -1306,8 +1701,25 @@ class HelloTriangleApplication {
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
 
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+    // A screenshot, or a streamed frame, is copied out by a second command
+    // buffer in the same submit, see readback_ring.h
+    std::array<VkCommandBuffer, 2> submitted = {commandBuffers[imageIndex],
+                                                VK_NULL_HANDLE};
+    const bool streamed =
+        frameStream && !frameStream->failed() &&
+        presentedFrames++ % capture.every == 0;
+    if (captureRequested || streamed) {
+      captureRequested = false;
+      submitted[1] = readbackRing.recordCopy(swapChainImages[imageIndex],
+                                             inFlightFences[currentFrame],
+                                             capture.block);
+      if (submitted[1] == VK_NULL_HANDLE && !streamed) {
+        std::cout << "Screenshot dropped, every readback slot is busy"
+                  << std::endl;
+      }
+    }
+    submitInfo.commandBufferCount = submitted[1] != VK_NULL_HANDLE ? 2 : 1;
+    submitInfo.pCommandBuffers = submitted.data();
 
     VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
     submitInfo.signalSemaphoreCount = 1;
@@ -1345,317 +1757,34 @@ class HelloTriangleApplication {
     currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
   }
 
-  void insertImageMemoryBarrier(VkCommandBuffer cmdbuffer, VkImage image,
-                                VkAccessFlags srcAccessMask,
-                                VkAccessFlags dstAccessMask,
-                                VkImageLayout oldImageLayout,
-                                VkImageLayout newImageLayout,
-                                VkPipelineStageFlags srcStageMask,
-                                VkPipelineStageFlags dstStageMask,
-                                VkImageSubresourceRange subresourceRange) {
-    VkImageMemoryBarrier imageMemoryBarrier{};
-    imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-    imageMemoryBarrier.srcAccessMask = srcAccessMask;
-    imageMemoryBarrier.dstAccessMask = dstAccessMask;
-    imageMemoryBarrier.oldLayout = oldImageLayout;
-    imageMemoryBarrier.newLayout = newImageLayout;
-    imageMemoryBarrier.image = image;
-    imageMemoryBarrier.subresourceRange = subresourceRange;
-
-    vkCmdPipelineBarrier(cmdbuffer, srcStageMask, dstStageMask, 0, 0, nullptr,
-                         0, nullptr, 1, &imageMemoryBarrier);
-  }
-
-  uint32_t getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties,
-                         VkBool32* memTypeFound = nullptr) const {
-    VkPhysicalDeviceMemoryProperties memoryProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
-      if ((typeBits & 1) == 1) {
-        if ((memoryProperties.memoryTypes[i].propertyFlags & properties) ==
-            properties) {
-          if (memTypeFound) {
-            *memTypeFound = true;
-          }
-          return i;
-        }
-      }
-      typeBits >>= 1;
-    }
-
-    if (memTypeFound) {
-      *memTypeFound = false;
-      return 0;
-    } else {
-      throw std::runtime_error("Could not find a matching memory type");
-    }
-  }
-
-  VkCommandBuffer createCommandBuffer(VkCommandBufferLevel level,
-                                      bool begin = false) {
-    VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
-    cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBufAllocateInfo.commandPool = commandPool;
-    cmdBufAllocateInfo.level = level;
-    cmdBufAllocateInfo.commandBufferCount = 1;
-    VkCommandBuffer cmdBuffer = nullptr;
-    if (vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &cmdBuffer) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate command buffers!");
-    }
-    // If requested, also start recording for the new command buffer
-    if (begin) {
-      VkCommandBufferBeginInfo cmdBufInfo{};
-      cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-      if (vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo) != VK_SUCCESS) {
-        throw std::runtime_error("failed to begin recording command buffer!");
-      }
-    }
-    return cmdBuffer;
-  }
-
-  void flushCommandBuffer(VkCommandBuffer commandBuffer, VkQueue queue,
-                          bool free = true) {
-    if (commandBuffer == VK_NULL_HANDLE) {
-      return;
-    }
-
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-      throw std::runtime_error("failed to record command buffer!");
-    }
-
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-    // Create fence to ensure that the command buffer has finished executing
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = 0;
-    VkFence fence = nullptr;
-    if (vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create fence!");
-    }
-    // Submit to the queue
-    if (vkQueueSubmit(queue, 1, &submitInfo, fence) != VK_SUCCESS) {
-      throw std::runtime_error("failed to submit draw command buffer!");
-    }
-    // Wait for the fence to signal that command buffer has finished executing
-    const uint64_t DEFAULT_FENCE_TIMEOUT = 100000000000;
-    vkWaitForFences(device, 1, &fence, VK_TRUE, DEFAULT_FENCE_TIMEOUT);
-    vkDestroyFence(device, fence, nullptr);
-    if (free) {
-      vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
-    }
-  }
-
-  void saveScreenshot(const char* filename) {
-    screenshotSaved = false;
-    bool supportsBlit = true;
-
-    // Check blit support for source and destination
-    VkFormatProperties formatProps;
-
-    // Check if the device supports blitting from optimal images (the swapchain
-    // images are in optimal format)
-    vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChainImageFormat,
-                                        &formatProps);
-    if (!(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT)) {
-      std::cerr << "Device does not support blitting from optimal tiled "
-                   "images, using copy instead of blit!"
-                << std::endl;
-      supportsBlit = false;
-    }
-
-    // Check if the device supports blitting to linear images
-    vkGetPhysicalDeviceFormatProperties(physicalDevice,
-                                        VK_FORMAT_R8G8B8A8_UNORM, &formatProps);
-    if (!(formatProps.linearTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
-      std::cerr << "Device does not support blitting to linear tiled images, "
-                   "using copy instead of blit!"
-                << std::endl;
-      supportsBlit = false;
-    }
-
-    // Source for the copy is the last rendered swapchain image
-    VkImage srcImage = swapChainImages[currentFrame];
-
-    // Create the linear tiled destination image to copy to and to read the
-    // memory from
-    VkImageCreateInfo imageCreateCI{};
-    imageCreateCI.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageCreateCI.imageType = VK_IMAGE_TYPE_2D;
-    // Note that vkCmdBlitImage (if supported) will also do format conversions
-    // if the swapchain color format would differ
-    imageCreateCI.format = VK_FORMAT_R8G8B8A8_UNORM;
-    imageCreateCI.extent.width = texWidth;
-    imageCreateCI.extent.height = texHeight;
-    imageCreateCI.extent.depth = 1;
-    imageCreateCI.arrayLayers = 1;
-    imageCreateCI.mipLevels = 1;
-    imageCreateCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageCreateCI.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageCreateCI.tiling = VK_IMAGE_TILING_LINEAR;
-    imageCreateCI.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    // Create the image
-    VkImage dstImage = nullptr;
-    if (vkCreateImage(device, &imageCreateCI, nullptr, &dstImage) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to create image!");
-    }
-    // Create memory to back up the image
-    VkMemoryRequirements memRequirements;
-    VkMemoryAllocateInfo memAllocInfo{};
-    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    VkDeviceMemory dstImageMemory = nullptr;
-    vkGetImageMemoryRequirements(device, dstImage, &memRequirements);
-    memAllocInfo.allocationSize = memRequirements.size;
-    // Memory must be host visible to copy from
-    memAllocInfo.memoryTypeIndex =
-        getMemoryType(memRequirements.memoryTypeBits,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    if (vkAllocateMemory(device, &memAllocInfo, nullptr, &dstImageMemory) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate image memory!");
-    }
-    vkBindImageMemory(device, dstImage, dstImageMemory, 0);
-
-    // Do the actual blit from the swapchain image to our host visible
-    // destination image
-    VkCommandBuffer copyCmd =
-        createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-    // Transition destination image to transfer destination layout
-    insertImageMemoryBarrier(
-        copyCmd, dstImage, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    // Transition swapchain image from present to transfer source layout
-    insertImageMemoryBarrier(
-        copyCmd, srcImage, VK_ACCESS_MEMORY_READ_BIT,
-        VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    // If source and destination support blit we'll blit as this also does
-    // automatic format conversion (e.g. from BGR to RGB)
-    if (supportsBlit) {
-      // Define the region to blit (we will blit the whole swapchain image)
-      VkOffset3D blitSize;
-      blitSize.x = texWidth;
-      blitSize.y = texHeight;
-      blitSize.z = 1;
-      VkImageBlit imageBlitRegion{};
-      imageBlitRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      imageBlitRegion.srcSubresource.layerCount = 1;
-      imageBlitRegion.srcOffsets[1] = blitSize;
-      imageBlitRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      imageBlitRegion.dstSubresource.layerCount = 1;
-      imageBlitRegion.dstOffsets[1] = blitSize;
-
-      // Issue the blit command
-      vkCmdBlitImage(copyCmd, srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                     dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                     &imageBlitRegion, VK_FILTER_NEAREST);
-    } else {
-      // Otherwise use image copy (requires us to manually flip components)
-      VkImageCopy imageCopyRegion{};
-      imageCopyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      imageCopyRegion.srcSubresource.layerCount = 1;
-      imageCopyRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      imageCopyRegion.dstSubresource.layerCount = 1;
-      imageCopyRegion.extent.width = texWidth;
-      imageCopyRegion.extent.height = texHeight;
-      imageCopyRegion.extent.depth = 1;
-
-      // Issue the copy command
-      vkCmdCopyImage(copyCmd, srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                     dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                     &imageCopyRegion);
-    }
-
-    // Transition destination image to general layout, which is the required
-    // layout for mapping the image memory later on
-    insertImageMemoryBarrier(
-        copyCmd, dstImage, VK_ACCESS_TRANSFER_WRITE_BIT,
-        VK_ACCESS_MEMORY_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    // Transition back the swap chain image after the blit is done
-    insertImageMemoryBarrier(
-        copyCmd, srcImage, VK_ACCESS_TRANSFER_READ_BIT,
-        VK_ACCESS_MEMORY_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1});
-
-    flushCommandBuffer(copyCmd, graphicsQueue);
-
-    // Get layout of the image (including row pitch)
-    VkImageSubresource subResource{VK_IMAGE_ASPECT_COLOR_BIT, 0, 0};
-    VkSubresourceLayout subResourceLayout;
-    vkGetImageSubresourceLayout(device, dstImage, &subResource,
-                                &subResourceLayout);
-
-    // Map image memory so we can start copying from it
-    const char* data = nullptr;
-    vkMapMemory(device, dstImageMemory, 0, VK_WHOLE_SIZE, 0, (void**)&data);
-    data += subResourceLayout.offset;
-
+  // Binary PPM of the image at data, rows rowPitch bytes apart and 4 bytes
+  // per pixel, swapped from BGR when colorSwizzle is set. Runs on the
+  // readback writer thread.
+  static void writePpm(const char* filename, const char* data, uint32_t width,
+                       uint32_t height, VkDeviceSize rowPitch,
+                       bool colorSwizzle) {
     std::ofstream file(filename, std::ios::out | std::ios::binary);
 
     // ppm header
-    file << "P6\n" << texWidth << "\n" << texHeight << "\n" << 255 << "\n";
-
-    // If source is BGR (destination is always RGB) and we can't use blit (which
-    // does automatic conversion), we'll have to manually swizzle color
-    // components
-    bool colorSwizzle = false;
-    // Check if source is BGR
-    // Note: Not complete, only contains most common and basic BGR surface
-    // formats for demonstration purposes
-    if (!supportsBlit) {
-      std::vector<VkFormat> formatsBGR = {VK_FORMAT_B8G8R8A8_SRGB,
-                                          VK_FORMAT_B8G8R8A8_UNORM,
-                                          VK_FORMAT_B8G8R8A8_SNORM};
-      colorSwizzle = (std::find(formatsBGR.begin(), formatsBGR.end(),
-                                swapChainImageFormat) != formatsBGR.end());
-    }
-
-    // ppm binary pixel data
-    for (uint32_t y = 0; y < texHeight; y++) {
-      auto* row = (unsigned int*)data;
-      for (uint32_t x = 0; x < texWidth; x++) {
-        if (colorSwizzle) {
-          file.write((char*)row + 2, 1);
-          file.write((char*)row + 1, 1);
-          file.write((char*)row, 1);
-        } else {
-          file.write((char*)row, 3);
-        }
-        row++;
-      }
-      data += subResourceLayout.rowPitch;
+    file << "P6\n" << width << "\n" << height << "\n" << 255 << "\n";
+
+    // ppm binary pixel data, whole bands of rows converted at once and
+    // written with one call, see rgb_rows.h
+    const size_t rowBytes = std::max<size_t>(static_cast<size_t>(width) * 3, 1);
+    const uint32_t bandRows = static_cast<uint32_t>(
+        std::max<size_t>(kPpmBandBytes / rowBytes, 1));
+    std::vector<char> band(rowBytes * std::min(bandRows, height));
+    for (uint32_t y = 0; y < height; y += bandRows) {
+      const uint32_t rows = std::min(bandRows, height - y);
+      convertRowsToRgb(data + y * rowPitch, width, rows,
+                       static_cast<size_t>(rowPitch), colorSwizzle,
+                       band.data());
+      file.write(band.data(), static_cast<std::streamsize>(rowBytes * rows));
     }
     file.close();
-
-    std::cout << "Screenshot saved to disk" << std::endl;
-
-    // Clean up resources
-    vkUnmapMemory(device, dstImageMemory);
-    vkFreeMemory(device, dstImageMemory, nullptr);
-    vkDestroyImage(device, dstImage, nullptr);
-
-    screenshotSaved = true;
+    if (!file) {
+      throw std::runtime_error(std::string("failed to write ") + filename);
+    }
   }
 
   VkShaderModule createShaderModule(const std::vector<char>& code) {
@@ -1749,10 +1878,11 @@ class HelloTriangleApplication {
   bool isDeviceSuitable(VkPhysicalDevice device) {
     QueueFamilyIndices indices = findQueueFamilies(device);
 
-    bool extensionsSupported = checkDeviceExtensionSupport(device);
+    // Headless, neither the swap chain extension nor a surface is needed
+    bool extensionsSupported = headless || checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless;
+    if (!headless && extensionsSupported) {
       SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
       swapChainAdequate = !swapChainSupport.formats.empty() &&
                           !swapChainSupport.presentModes.empty();
@@ -1802,7 +1932,13 @@ class HelloTriangleApplication {
       }
 
       VkBool32 presentSupport = false;
-      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+      if (headless) {
+        // Nothing is presented, the graphics queue stands in
+        presentSupport = indices.graphicsFamily == static_cast<uint32_t>(i);
+      } else {
+        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                             &presentSupport);
+      }
 
       if (presentSupport) {
         indices.presentFamily = i;
@@ -1819,12 +1955,14 @@ class HelloTriangleApplication {
   }
 
   std::vector<const char*> getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions = nullptr;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions,
-                                        glfwExtensions + glfwExtensionCount);
+    // Headless, GLFW is never initialized and there is no surface
+    std::vector<const char*> extensions;
+    if (!headless) {
+      uint32_t glfwExtensionCount = 0;
+      const char** glfwExtensions = nullptr;
+      glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+      extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (enableValidationLayers) {
       extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1887,14 +2025,133 @@ class HelloTriangleApplication {
   }
 };
 
+// Frame sizes of the converter benchmark: 1080p, 4K and 8K
+const uint32_t kConvertBenchmarkSizes[][2] = {
+    {1920, 1080}, {3840, 2160}, {7680, 4320}};
+
+const uint32_t kConvertBenchmarkRuns = 10;
+
+// Times every RGB converter the CPU supports on BGRA frames with padded
+// rows, as a readback may have, and checks each against the scalar loop.
+// Returns whether they all match.
+bool runConvertBenchmark() {
+  bool matched = true;
+  for (const auto& size : kConvertBenchmarkSizes) {
+    const uint32_t width = size[0];
+    const uint32_t height = size[1];
+    const size_t rowPitch = static_cast<size_t>(width) * 4 + 256;
+    std::vector<char> pixels(rowPitch * height);
+    for (size_t i = 0; i < pixels.size(); i++) {
+      pixels[i] = static_cast<char>(i * 7 + i / 4093);
+    }
+    std::vector<char> expected(static_cast<size_t>(width) * height * 3);
+    convertRowsToRgb(pixels.data(), width, height, rowPitch, true,
+                     expected.data(), kRgbScalar);
+
+    for (const RgbConverter converter :
+         {kRgbScalar, kRgbSsse3, kRgbAvx2, kRgbNeon}) {
+      if (!isRgbConverterSupported(converter)) {
+        continue;
+      }
+      std::vector<char> rgb(expected.size(), 0);
+      double bestMs = std::numeric_limits<double>::max();
+      for (uint32_t run = 0; run < kConvertBenchmarkRuns; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        convertRowsToRgb(pixels.data(), width, height, rowPitch, true,
+                         rgb.data(), converter);
+        bestMs = std::min(bestMs, std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count());
+      }
+      const bool match = rgb == expected;
+      matched = matched && match;
+      // Bytes read per millisecond, 1e6 of them a GB/s
+      const double gigabytesPerSecond =
+          static_cast<double>(width) * height * 4 / bestMs / 1e6;
+      std::cout << width << "x" << height << " "
+                << getRgbConverterName(converter) << ": " << bestMs
+                << " ms, " << gigabytesPerSecond << " GB/s"
+                << (match ? "" : ", MISMATCH") << std::endl;
+    }
+  }
+  return matched;
+}
+
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
-    std::cout << "Format to call: " << argv[0] << " PNG_image" << '\n';
+    std::cout << "Format to call: " << argv[0] << " PNG_image|QOI_image "
+              << "[--headless [--iterations N] [--output FILE.ppm|FILE.qoi]] "
+              << "[--capture FILE|- [--capture-format raw|y4m|ppm|qoi] "
+              << "[--capture-every N] [--capture-queue N] "
+              << "[--capture-policy drop|block] [--capture-fps N]]" << '\n'
+              << "            or: " << argv[0] << " --convert-benchmark"
+              << '\n';
     return EXIT_FAILURE;
   }
 
+  if (std::string(argv[1]) == "--convert-benchmark") {
+    std::cout << "best RGB converter: "
+              << getRgbConverterName(getBestRgbConverter()) << std::endl;
+    return runConvertBenchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   HelloTriangleApplication app;
 
+  bool headless = false;
+  uint32_t iterations = 1;
+  std::string outputName = "output.ppm";
+  CaptureOptions capture;
+  bool captureFormatGiven = false;
+  for (int arg = 2; arg < argc; arg++) {
+    const std::string option = argv[arg];
+    if (option == "--headless") {
+      headless = true;
+    } else if (option == "--iterations" && arg + 1 < argc) {
+      iterations = static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--output" && arg + 1 < argc) {
+      outputName = argv[++arg];
+    } else if (option == "--capture" && arg + 1 < argc) {
+      capture.path = argv[++arg];
+    } else if (option == "--capture-format" && arg + 1 < argc) {
+      if (!parseStreamFormat(argv[++arg], &capture.format)) {
+        std::cerr << "unknown capture format " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+      }
+      captureFormatGiven = true;
+    } else if (option == "--capture-every" && arg + 1 < argc) {
+      capture.every =
+          static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--capture-queue" && arg + 1 < argc) {
+      capture.queue =
+          static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else if (option == "--capture-policy" && arg + 1 < argc) {
+      const std::string policy = argv[++arg];
+      if (policy != "drop" && policy != "block") {
+        std::cerr << "unknown capture policy " << policy << std::endl;
+        return EXIT_FAILURE;
+      }
+      capture.block = policy == "block";
+    } else if (option == "--capture-fps" && arg + 1 < argc) {
+      capture.fps = static_cast<uint32_t>(std::max(std::atoi(argv[++arg]), 1));
+    } else {
+      std::cerr << "unknown option " << option << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (headless) {
+    if (!capture.path.empty()) {
+      std::cerr << "--capture needs a window, not --headless" << std::endl;
+      return EXIT_FAILURE;
+    }
+    app.setHeadless(iterations, outputName);
+  }
+  if (!capture.path.empty()) {
+    if (!captureFormatGiven) {
+      capture.format = getStreamFormatForPath(capture.path);
+    }
+    app.setCapture(capture);
+  }
+
   try {
     app.run(argv[1]);
   } catch (const std::exception& e) {
@@ -0,0 +1,382 @@
+// Screenshots that cost the render loop a few recorded commands instead of
+// a pipeline drain and a file write. A fixed ring of host visible buffers,
+// mapped once, receives copies of swap chain images. The copies are
+// recorded into a small command buffer that goes into the frame's own
+// submit, under the frame's fence. poll() checks those fences without
+// waiting and hands finished slots to a writer thread, which encodes
+// straight from the mapped memory and then returns the slot to the ring.
+
+#ifndef READBACK_RING_H
+#define READBACK_RING_H
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// One captured frame as the writer sees it, valid until the writer returns
+struct ReadbackFrame {
+  const char* pixels;
+  uint32_t width;
+  uint32_t height;
+  VkDeviceSize rowPitch;
+  // 4 bytes per pixel, blue first when set
+  bool bgra;
+  // Captures so far, this one included
+  uint64_t number;
+};
+
+// Runs on the writer thread, one frame at a time
+using ReadbackWriter = std::function<void(const ReadbackFrame&)>;
+
+class ReadbackRing {
+ public:
+  ReadbackRing() = default;
+  ReadbackRing(const ReadbackRing&) = delete;
+  ReadbackRing& operator=(const ReadbackRing&) = delete;
+  ~ReadbackRing() { destroy(); }
+
+  // Slots hold one image of extent in format, a 4 byte color format. The
+  // copies are recorded into command buffers of queueFamily.
+  void create(VkPhysicalDevice physicalDevice, VkDevice device,
+              uint32_t queueFamily, uint32_t slotCount, VkExtent2D extent,
+              VkFormat format, ReadbackWriter writer) {
+    device_ = device;
+    extent_ = extent;
+    bgra_ = format == VK_FORMAT_B8G8R8A8_SRGB ||
+            format == VK_FORMAT_B8G8R8A8_UNORM ||
+            format == VK_FORMAT_B8G8R8A8_SNORM;
+    writer_ = std::move(writer);
+
+    // Slot command buffers are rerecorded for every capture
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+                     VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamily;
+    if (vkCreateCommandPool(device_, &poolInfo, nullptr, &commandPool_) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to create readback command pool!");
+    }
+
+    slots_.resize(slotCount);
+    std::vector<VkCommandBuffer> commandBuffers(slotCount);
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool_;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = slotCount;
+    if (vkAllocateCommandBuffers(device_, &allocInfo, commandBuffers.data()) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate readback command buffers!");
+    }
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    const VkDeviceSize size =
+        static_cast<VkDeviceSize>(extent_.width) * extent_.height * 4;
+    for (uint32_t i = 0; i < slotCount; i++) {
+      Slot& slot = slots_[i];
+      slot.commandBuffer = commandBuffers[i];
+
+      VkBufferCreateInfo bufferInfo{};
+      bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+      bufferInfo.size = size;
+      bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+      bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+      if (vkCreateBuffer(device_, &bufferInfo, nullptr, &slot.buffer) !=
+          VK_SUCCESS) {
+        throw std::runtime_error("failed to create readback buffer!");
+      }
+
+      VkMemoryRequirements memRequirements;
+      vkGetBufferMemoryRequirements(device_, slot.buffer, &memRequirements);
+
+      // The writer reads every byte, cached memory makes that much faster
+      // where there is any
+      VkMemoryAllocateInfo memAllocInfo{};
+      memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+      memAllocInfo.allocationSize = memRequirements.size;
+      memAllocInfo.memoryTypeIndex = findMemoryType(
+          memoryProperties, memRequirements.memoryTypeBits,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+              VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+      if (memAllocInfo.memoryTypeIndex == UINT32_MAX) {
+        memAllocInfo.memoryTypeIndex = findMemoryType(
+            memoryProperties, memRequirements.memoryTypeBits,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+      }
+      if (memAllocInfo.memoryTypeIndex == UINT32_MAX ||
+          vkAllocateMemory(device_, &memAllocInfo, nullptr, &slot.memory) !=
+              VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate readback memory!");
+      }
+      vkBindBufferMemory(device_, slot.buffer, slot.memory, 0);
+      vkMapMemory(device_, slot.memory, 0, VK_WHOLE_SIZE, 0, &slot.mapped);
+
+      freeSlots_.push_back(i);
+    }
+
+    stopping_ = false;
+    writerThread_ = std::thread(&ReadbackRing::writeFrames, this);
+  }
+
+  // Writes what has been captured and frees everything. The device must be
+  // idle.
+  void destroy() {
+    if (device_ == VK_NULL_HANDLE) {
+      return;
+    }
+    poll();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    queued_.notify_one();
+    writerThread_.join();
+
+    for (Slot& slot : slots_) {
+      vkDestroyBuffer(device_, slot.buffer, nullptr);
+      vkFreeMemory(device_, slot.memory, nullptr);
+    }
+    vkDestroyCommandPool(device_, commandPool_, nullptr);
+    slots_.clear();
+    freeSlots_.clear();
+    device_ = VK_NULL_HANDLE;
+  }
+
+  // Records the copy of image, a swap chain image in
+  // VK_IMAGE_LAYOUT_PRESENT_SRC_KHR that the commands submitted before
+  // render, into a free slot. The returned command buffer goes into the
+  // same submit as the frame, which signals fence. When every slot is still
+  // busy it waits for one if waitForSlot is set, holding the render loop
+  // back to the writer's pace; otherwise it returns VK_NULL_HANDLE and
+  // counts the frame as dropped.
+  VkCommandBuffer recordCopy(VkImage image, VkFence fence,
+                             bool waitForSlot = false) {
+    uint32_t index = 0;
+    if (!acquireSlot(waitForSlot, &index)) {
+      return VK_NULL_HANDLE;
+    }
+    Slot& slot = slots_[index];
+    slot.fence = fence;
+    slot.number = ++captures_;
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin readback command buffer!");
+    }
+
+    VkImageMemoryBarrier imageBarrier{};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = image;
+    imageBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(slot.commandBuffer,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 1, &imageBarrier);
+
+    VkBufferImageCopy region{};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {extent_.width, extent_.height, 1};
+    vkCmdCopyImageToBuffer(slot.commandBuffer, image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer,
+                           1, &region);
+
+    // Back for presentation, which waits on the semaphore the submit
+    // signals after these commands
+    imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    imageBarrier.dstAccessMask = 0;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    VkBufferMemoryBarrier bufferBarrier{};
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.buffer = slot.buffer;
+    bufferBarrier.offset = 0;
+    bufferBarrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &imageBarrier);
+    vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                         &bufferBarrier, 0, nullptr);
+
+    if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record readback command buffer!");
+    }
+    return slot.commandBuffer;
+  }
+
+  // Queues every slot whose fence has signaled for the writer, without
+  // waiting on any. Must run before those fences are reset for reuse.
+  // Slots go in capture order, stopping at the first copy still running, so
+  // that a stream of frames stays in order.
+  void poll() {
+    std::vector<uint32_t> pending;
+    for (uint32_t i = 0; i < slots_.size(); i++) {
+      if (slots_[i].fence != VK_NULL_HANDLE) {
+        pending.push_back(i);
+      }
+    }
+    std::sort(pending.begin(), pending.end(), [this](uint32_t a, uint32_t b) {
+      return slots_[a].number < slots_[b].number;
+    });
+    for (const uint32_t i : pending) {
+      Slot& slot = slots_[i];
+      if (vkGetFenceStatus(device_, slot.fence) != VK_SUCCESS) {
+        break;
+      }
+      slot.fence = VK_NULL_HANDLE;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        written_.push_back(i);
+      }
+      queued_.notify_one();
+    }
+  }
+
+  // Captures refused because no slot was free
+  uint64_t dropped() const { return dropped_; }
+
+  // Time recordCopy() spent waiting for a free slot
+  double stalledSeconds() const {
+    return std::chrono::duration<double>(stalled_).count();
+  }
+
+ private:
+  struct Slot {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    void* mapped = nullptr;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    // The fence of the submit with the copy, until poll() sees it signaled
+    VkFence fence = VK_NULL_HANDLE;
+    uint64_t number = 0;
+  };
+
+  static uint32_t findMemoryType(
+      const VkPhysicalDeviceMemoryProperties& memoryProperties,
+      uint32_t typeBits, VkMemoryPropertyFlags properties) {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+      if ((typeBits & (1u << i)) != 0 &&
+          (memoryProperties.memoryTypes[i].propertyFlags & properties) ==
+              properties) {
+        return i;
+      }
+    }
+    return UINT32_MAX;
+  }
+
+  bool acquireSlot(bool wait, uint32_t* index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (freeSlots_.empty() && !wait) {
+      dropped_++;
+      return false;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    while (freeSlots_.empty()) {
+      // Copies still on the device finish in capture order, so the oldest
+      // is the one to wait for. Once none is left, the writer has them.
+      const Slot* oldest = nullptr;
+      for (const Slot& slot : slots_) {
+        if (slot.fence != VK_NULL_HANDLE &&
+            (oldest == nullptr || slot.number < oldest->number)) {
+          oldest = &slot;
+        }
+      }
+      if (oldest != nullptr) {
+        lock.unlock();
+        vkWaitForFences(device_, 1, &oldest->fence, VK_TRUE, UINT64_MAX);
+        poll();
+        lock.lock();
+      } else {
+        returned_.wait(lock, [this] { return !freeSlots_.empty(); });
+      }
+    }
+    stalled_ += std::chrono::steady_clock::now() - start;
+    *index = freeSlots_.front();
+    freeSlots_.pop_front();
+    return true;
+  }
+
+  // The writer thread: takes finished slots in capture order, returns them
+  // to the ring once written
+  void writeFrames() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      queued_.wait(lock, [this] { return stopping_ || !written_.empty(); });
+      if (written_.empty()) {
+        return;
+      }
+      const uint32_t index = written_.front();
+      written_.pop_front();
+      lock.unlock();
+
+      const Slot& slot = slots_[index];
+      ReadbackFrame frame{};
+      frame.pixels = static_cast<const char*>(slot.mapped);
+      frame.width = extent_.width;
+      frame.height = extent_.height;
+      frame.rowPitch = static_cast<VkDeviceSize>(extent_.width) * 4;
+      frame.bgra = bgra_;
+      frame.number = slot.number;
+      try {
+        writer_(frame);
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+
+      lock.lock();
+      freeSlots_.push_back(index);
+      returned_.notify_one();
+    }
+  }
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkCommandPool commandPool_ = VK_NULL_HANDLE;
+  VkExtent2D extent_{};
+  bool bgra_ = false;
+  ReadbackWriter writer_;
+  std::vector<Slot> slots_;
+  uint64_t captures_ = 0;
+  uint64_t dropped_ = 0;
+  std::chrono::steady_clock::duration stalled_{};
+
+  // Slot indices: free ones, and the ones queued for the writer. Only the
+  // writer thread reads slots_ entries queued to it.
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable returned_;
+  std::deque<uint32_t> freeSlots_;
+  std::deque<uint32_t> written_;
+  bool stopping_ = false;
+  std::thread writerThread_;
+};
+
+#endif  // READBACK_RING_H
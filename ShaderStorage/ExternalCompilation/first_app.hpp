@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 
+#include "gpu_profiler.h"
 #include "lve_device.hpp"
 #include "lve_pipeline.hpp"
 #include "lve_swap_chain.hpp"
@@ -26,6 +27,7 @@ class FirstApp {
  private:
   void createPipelineLayout();
   void createPipeline();
+  void createGpuProfiler();
   void createCommandBuffers();
   void drawFrame();
 
@@ -35,6 +37,7 @@ class FirstApp {
   std::unique_ptr<LvePipeline> lvePipeline;
   VkPipelineLayout pipelineLayout{};
   std::vector<VkCommandBuffer> commandBuffers;
+  GpuProfiler gpuProfiler;
 };
 
 }  // namespace lve
\ No newline at end of file
@@ -147,8 +147,15 @@ void LveDevice::createLogicalDevice() {
     queueCreateInfos.push_back(queueCreateInfo);
   }
 
+  VkPhysicalDeviceFeatures supportedFeatures = {};
+  vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+
   VkPhysicalDeviceFeatures deviceFeatures = {};
   deviceFeatures.samplerAnisotropy = VK_TRUE;
+  // optional, lets the GPU profiler count shader invocations
+  deviceFeatures.pipelineStatisticsQuery =
+      supportedFeatures.pipelineStatisticsQuery;
+  enabledFeatures = deviceFeatures;
 
   VkDeviceCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -1,6 +1,7 @@
 #include "first_app.hpp"
 
 #include <array>
+#include <cstdio>
 #include <stdexcept>
 
 namespace lve {
@@ -8,10 +9,12 @@ namespace lve {
 FirstApp::FirstApp() {
   createPipelineLayout();
   createPipeline();
+  createGpuProfiler();
   createCommandBuffers();
 }
 
 FirstApp::~FirstApp() {
+  gpuProfiler.destroy();
   vkDestroyPipelineLayout(lveDevice.device(), pipelineLayout, nullptr);
 }
 
@@ -22,6 +25,9 @@ void FirstApp::run() {
   }
 
   vkDeviceWaitIdle(lveDevice.device());
+
+  gpuProfiler.collect();
+  gpuProfiler.report(stdout);
 }
 
 void FirstApp::createPipelineLayout() {
@@ -49,6 +55,22 @@ void FirstApp::createPipeline() {
       pipelineConfig);
 }
 
+void FirstApp::createGpuProfiler() {
+  // One query slot per swapchain image, the command buffers are recorded once
+  const VkQueryPipelineStatisticFlags statistics =
+      lveDevice.enabledFeatures.pipelineStatisticsQuery
+          ? VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+                VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT
+          : 0;
+
+  if (gpuProfiler.init(lveDevice.getPhysicalDevice(), lveDevice.device(),
+                       lveDevice.findPhysicalQueueFamilies().graphicsFamily,
+                       static_cast<uint32_t>(lveSwapChain.imageCount()), 1,
+                       statistics) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create gpu profiler query pools");
+  }
+}
+
 void FirstApp::createCommandBuffers() {
   commandBuffers.resize(lveSwapChain.imageCount());
 
@@ -71,6 +93,12 @@ void FirstApp::createCommandBuffers() {
       throw std::runtime_error("failed to begin recording of command buffer");
     }
 
+    // color attachment writes of one frame
+    const double frameBytes =
+        4.0 * lveSwapChain.width() * lveSwapChain.height();
+    gpuProfiler.beginFrame(commandBuffers[i], i);
+    gpuProfiler.beginScope(commandBuffers[i], i, 0, "render pass", frameBytes);
+
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = lveSwapChain.getRenderPass();
@@ -92,6 +120,7 @@ void FirstApp::createCommandBuffers() {
     vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
 
     vkCmdEndRenderPass(commandBuffers[i]);
+    gpuProfiler.endScope(commandBuffers[i], i, 0);
     if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
       throw std::runtime_error("failed to record command buffer");
     }
@@ -111,6 +140,8 @@ void FirstApp::drawFrame() {
   if (result != VK_SUCCESS) {
     throw std::runtime_error("failed to present swap chain image");
   }
+
+  gpuProfiler.collect();
 }
 
 }  // namespace lve
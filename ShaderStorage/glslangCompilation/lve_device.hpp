@@ -40,6 +40,7 @@ class LveDevice {
   LveDevice &operator=(LveDevice &&) = delete;
 
   VkCommandPool getCommandPool() { return commandPool; }
+  VkPhysicalDevice getPhysicalDevice() { return physicalDevice; }
   VkDevice device() { return device_; }
   VkSurfaceKHR surface() { return surface_; }
   VkQueue graphicsQueue() { return graphicsQueue_; }
@@ -72,6 +73,7 @@ class LveDevice {
                            VkDeviceMemory &imageMemory);
 
   VkPhysicalDeviceProperties properties{};
+  VkPhysicalDeviceFeatures enabledFeatures{};
 
  private:
   void createInstance();